@@ -0,0 +1,96 @@
+// Main page without reloads: the buttons send /api/command and the page is updated in place
+// from its reply, and from /api/state every 10 s. Taps of + and - within half a second go as
+// one command. Each command carries a seq, so a retry after a lost reply changes nothing twice.
+// Without this file the links still work.
+(function () {
+  var zone = (location.search.match(/zone=(\d+)/) || [0, 0])[1];
+  var seq = Math.floor(Math.random() * 1e9);
+  var taps = 0;
+  var tapTimer = 0;
+  var actions = {
+    addDegree: 0.1,
+    minusDegree: -0.1,
+    powerOn: 'power=1',
+    powerOff: 'power=0',
+    modeHeat: 'mode=heat',
+    modeCold: 'mode=cool'
+  };
+
+  function $(id) {
+    return document.getElementById(id);
+  }
+
+  function button(a, path, label) {
+    a.setAttribute('href', '/' + path + location.search);
+    a.firstChild.textContent = label;
+  }
+
+  function show(s) {
+    if (!s || s.error) {
+      return;
+    }
+    if ('avgTemp' in s) {
+      $('temp').textContent = s.avgTemp.toFixed(2);
+    }
+    if ('device' in s) {
+      $('device').textContent = s.device ? 'on' : 'off';
+    }
+    if (!taps) {
+      $('setpoint').textContent = s.setPoint.toFixed(2);
+    }
+    if ('alarms' in s) {
+      $('alarms').textContent = s.alarms.join(', ');
+      $('alarm').hidden = !s.alarms.length;
+    }
+    button($('power'), s.powerSet ? 'powerOff' : 'powerOn', s.powerSet ? 'On' : 'Off');
+    button($('mode'), s.heatMode ? 'modeHeat' : 'modeCold', s.heatMode ? 'Cool' : 'Heat');
+  }
+
+  function call(url, method, retries) {
+    fetch(url, {method: method, cache: 'no-cache'}).then(function (r) {
+      return r.json();
+    }).then(show, function () {
+      if (retries) {
+        setTimeout(function () {
+          call(url, method, retries - 1);
+        }, 1000);
+      }
+    });
+  }
+
+  function command(args) {
+    seq += 1;
+    call('/api/command?zone=' + zone + '&seq=' + seq + '&' + args, 'POST', 2);
+  }
+
+  function tap(delta) {
+    var sp = $('setpoint');
+    taps += delta;
+    sp.textContent = (parseFloat(sp.textContent) + delta).toFixed(2);
+    clearTimeout(tapTimer);
+    tapTimer = setTimeout(function () {
+      var d = taps.toFixed(1);
+      taps = 0;
+      command('delta=' + d);
+    }, 500);
+  }
+
+  if (!$('temp') || !window.fetch) {
+    return;
+  }
+  document.addEventListener('click', function (e) {
+    var a = e.target.closest && e.target.closest('a');
+    var act = a && actions[a.pathname.slice(1)];
+    if (act) {
+      e.preventDefault();
+      if (typeof act === 'number') {
+        tap(act);
+      } else {
+        command(act);
+      }
+    }
+  });
+  setInterval(function () {
+    call('/api/state?zone=' + zone, 'GET', 0);
+  }, 10000);
+})();
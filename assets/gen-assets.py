@@ -0,0 +1,49 @@
+#!/usr/bin/env python3
+"""
+Compresses the files in assets/ into web-therm-assets.h, gzipped byte arrays in flash that
+the sketch serves under /static/ with Content-Encoding: gzip.
+Run it after editing anything in assets/ and commit the header with the change:
+
+  python3 assets/gen-assets.py
+
+Each file gets an ETag from a hash of its text, also defined as NAME_TAG so pages can link
+to /static/name?v=TAG. A changed file gets a new link, so browsers can cache for a year.
+"""
+
+import gzip
+import hashlib
+import os
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+OUT = os.path.join(HERE, '..', 'web-therm-assets.h')
+TYPES = {'.css': 'text/css', '.js': 'application/javascript', '.html': 'text/html', '.svg': 'image/svg+xml'}
+
+
+def main():
+    names = sorted(n for n in os.listdir(HERE) if os.path.splitext(n)[1] in TYPES)
+    lines = ['// Generated by assets/gen-assets.py from the files in assets/. Edit those and rerun it.', '']
+    table = []
+    for name in names:
+        with open(os.path.join(HERE, name), 'rb') as f:
+            text = f.read()
+        packed = gzip.compress(text, compresslevel=9, mtime=0)
+        ident = 'ASSET_' + name.upper().replace('.', '_').replace('-', '_')
+        tag = hashlib.sha1(text).hexdigest()[:8]
+        lines.append('#define %s_TAG "%s"  // %d bytes, %d gzipped' % (ident, tag, len(text), len(packed)))
+        lines.append('const uint8_t %s[] PROGMEM = {' % ident)
+        for i in range(0, len(packed), 16):
+            lines.append('  ' + ' '.join('0x%02x,' % b for b in packed[i:i + 16]))
+        lines.append('};')
+        lines.append('')
+        table.append('  {"/static/%s", "%s", %s, sizeof(%s), "\\"%s\\""},'
+                     % (name, TYPES[os.path.splitext(name)[1]], ident, ident, tag))
+    lines.append('const StaticAsset staticAssets[] = {')
+    lines.extend(table)
+    lines.append('};')
+    lines.append('')
+    with open(OUT, 'w') as f:
+        f.write('\n'.join(lines))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,236 @@
+/*
+Host simulation shim for the Arduino/ESP8266 core.
+Only what web-therm.c uses is provided. Time is virtual: millis() reads the sim clock and
+delay() advances it, which also steps the plant model (see web-therm-sim.cpp).
+*/
+
+#ifndef SIM_ARDUINO_H
+#define SIM_ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define INPUT 0
+#define OUTPUT 1
+#define LOW 0
+#define HIGH 1
+
+#define A0 17
+#define D0 16
+#define D1 5
+#define D2 4
+#define D4 2
+#define D5 14
+#define D6 12
+#define D7 13
+
+#define highByte(w) ((uint8_t) ((w) >> 8))
+#define lowByte(w) ((uint8_t) ((w) & 0xff))
+
+#define constrain(v, lo, hi) ((v) < (lo) ? (lo) : ((v) > (hi) ? (hi) : (v)))
+
+inline uint16_t word(uint8_t h, uint8_t l) { return (h << 8) | l; }
+
+// FLASH STRINGS -------------------------------------------------
+// The host has one address space, so flash data is ordinary const data
+
+#define PROGMEM
+#define PGM_P const char *
+#define PSTR(s) (s)
+#define F(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define memcpy_P memcpy
+#define strlen_P strlen
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+
+inline char *dtostrf(double v, signed char width, unsigned char prec, char *buf) {
+  sprintf(buf, "%*.*f", width, prec, v);
+  return buf;
+}
+
+inline char *ltoa(long v, char *buf, int) {
+  snprintf(buf, 12, "%ld", (long)(int32_t)v);          // long is 32 bits on the ESP8266
+  return buf;
+}
+
+// HARDWARE HOOKS (implemented by the simulator) ----------------
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+void simAdvance(unsigned long long us);
+inline void configTime(long, int, const char *) {}   // No SNTP in the simulator
+
+// STRING --------------------------------------------------------
+// Grows its buffer to the exact length on each concat, as the ESP8266 core String does
+// (after a short inline buffer), so allocation counts in benchmarks match the device
+
+class String {
+public:
+  String() {}
+  String(const char *s) { concat(s ? s : "", s ? strlen(s) : 0); }
+  String(const std::string &s) { concat(s.data(), s.size()); }
+  String(const String &o) { concat(o.c_str(), o.len_); }
+  String(int v) { concatNum("%d", v); }
+  String(unsigned int v) { concatNum("%u", v); }
+  String(long v) { concatNum("%ld", v); }
+  String(unsigned long v) { concatNum("%lu", v); }
+  String(float v, int decimals = 2) { char b[32]; snprintf(b, sizeof(b), "%.*f", decimals, v); concat(b, strlen(b)); }
+  String(double v, int decimals = 2) { char b[32]; snprintf(b, sizeof(b), "%.*f", decimals, v); concat(b, strlen(b)); }
+  ~String() { if (heap_) delete[] heap_; }
+
+  String &operator=(const String &o) { if (this != &o) { len_ = 0; concat(o.c_str(), o.len_); } return *this; }
+  String &operator+=(const String &o) { return concat(o.c_str(), o.len_); }
+  String &operator+=(const char *o) { return concat(o, strlen(o)); }
+  String &operator+=(char c) { return concat(&c, 1); }
+  String &operator+=(int v) { return *this += String(v); }
+  String &operator+=(unsigned long v) { return *this += String(v); }
+  String &operator+=(float v) { return *this += String(v); }
+  String &operator+=(double v) { return *this += String(v); }
+  bool operator==(const char *o) const { return strcmp(c_str(), o) == 0; }
+  bool operator==(const String &o) const { return strcmp(c_str(), o.c_str()) == 0; }
+  bool operator!=(const char *o) const { return !(*this == o); }
+
+  const char *c_str() const { return heap_ ? heap_ : sso_; }
+  unsigned int length() const { return len_; }
+  int toInt() const { return atoi(c_str()); }
+  float toFloat() const { return atof(c_str()); }
+
+private:
+  String &concat(const char *s, size_t n) {
+    size_t need = len_ + n;
+    if (need >= sizeof(sso_) && need + 1 > cap_) {
+      char *b = new char[need + 1];
+      memcpy(b, c_str(), len_);
+      if (heap_) delete[] heap_;
+      heap_ = b;
+      cap_ = need + 1;
+    }
+    char *d = heap_ ? heap_ : sso_;
+    memmove(d + len_, s, n);
+    len_ = need;
+    d[len_] = 0;
+    return *this;
+  }
+  template <typename T> void concatNum(const char *fmt, T v) {
+    char b[24];
+    snprintf(b, sizeof(b), fmt, v);
+    concat(b, strlen(b));
+  }
+
+  char sso_[12] = {0};
+  char *heap_ = nullptr;
+  size_t len_ = 0;
+  size_t cap_ = 0;
+};
+
+// SERIAL --------------------------------------------------------
+// Discarded unless the simulator is run verbose
+
+extern bool simVerbose;
+
+class SimSerial {
+public:
+  void begin(unsigned long) {}
+  template <typename T> void print(const T &v) { if (simVerbose) emit(String(v).c_str(), false); }
+  template <typename T> void println(const T &v) { if (simVerbose) emit(String(v).c_str(), true); }
+  void println() { if (simVerbose) emit("", true); }
+private:
+  void emit(const char *s, bool nl) { fprintf(stderr, "%s%s", s, nl ? "\n" : ""); }
+};
+
+extern SimSerial Serial;
+
+// CHIP ----------------------------------------------------------
+// The cycle counter runs off the virtual clock, so timings are what the sim charges for
+// ADC reads, 1-Wire transfers, socket calls and flash. Heap figures are fixed, set by the simulator.
+// Only the filesystem region of flash is there (flash_hal.h). It behaves as NOR flash: an
+// erase sets a sector to 0xFF and a write can only clear bits. Every erase and write is a
+// step; from step flashCutAt on nothing more reaches flash, as if power had gone, except
+// that with flashCutHalf that step gets half way.
+
+#define SIM_FLASH_SECTOR 0x1000
+#define SIM_FS_ADDR 0x300000            // Filesystem region, 8 sectors
+#define SIM_FS_SIZE 0x8000
+#define SIM_FLASH_ERASE_US 45000        // Sector erase, typical for the board's SPI flash
+#define SIM_FLASH_WRITE_US 700          // Page program, typical
+
+class SimESP {
+public:
+  bool flashEraseSector(uint32_t sector) {
+    uint32_t at = sector * SIM_FLASH_SECTOR - SIM_FS_ADDR;
+    if (sector * SIM_FLASH_SECTOR < SIM_FS_ADDR || at >= SIM_FS_SIZE) {
+      return false;
+    }
+    memset(flash + at, 0xFF, flashPart(SIM_FLASH_SECTOR));
+    flashErases[at / SIM_FLASH_SECTOR]++;
+    simAdvance(SIM_FLASH_ERASE_US);
+    return true;
+  }
+  bool flashWrite(uint32_t address, uint32_t *data, size_t size) {
+    if (!flashInside(address, size)) {
+      return false;
+    }
+    size_t n = flashPart(size);
+    for (size_t i = 0; i < n; i++) {
+      flash[address - SIM_FS_ADDR + i] &= ((uint8_t *)data)[i];
+    }
+    flashWrites++;
+    simAdvance(SIM_FLASH_WRITE_US);
+    return true;
+  }
+  bool flashRead(uint32_t address, uint32_t *data, size_t size) {
+    if (!flashInside(address, size)) {
+      return false;
+    }
+    memcpy(data, flash + address - SIM_FS_ADDR, size);
+    return true;
+  }
+
+  uint32_t getChipId() { return 0xa1b2c3; }
+  uint32_t getCycleCount() { return (uint32_t)((unsigned long long)micros() * 80); }
+  uint8_t getCpuFreqMHz() { return 80; }
+  uint32_t getFreeHeap() { return freeHeap; }
+  uint32_t getMaxFreeBlockSize() { return maxFreeBlock; }
+  uint8_t getHeapFragmentation() { return 100 - maxFreeBlock * 100 / freeHeap; }
+  uint32_t freeHeap = 24000;
+  uint32_t maxFreeBlock = 20000;
+
+  uint8_t flash[SIM_FS_SIZE];
+  unsigned long flashErases[SIM_FS_SIZE / SIM_FLASH_SECTOR] = {};
+  unsigned long flashWrites = 0;
+  unsigned long flashSteps = 0;
+  long flashCutAt = -1;                 // Step power goes at, -1 never
+  bool flashCutHalf = false;            // That step gets half way, else not started
+
+  SimESP() { memset(flash, 0xFF, sizeof(flash)); }
+
+private:
+  bool flashInside(uint32_t address, size_t size) {
+    return address % 4 == 0 && size % 4 == 0 && address >= SIM_FS_ADDR && address + size <= SIM_FS_ADDR + SIM_FS_SIZE;
+  }
+  size_t flashPart(size_t n) {
+    long step = flashSteps++;
+    if (flashCutAt < 0 || step < flashCutAt) {
+      return n;
+    }
+    return step == flashCutAt && flashCutHalf ? n / 2 : 0;
+  }
+};
+
+extern SimESP ESP;
+
+#endif
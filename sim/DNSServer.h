@@ -0,0 +1,8 @@
+// Host simulation shim: captive portal DNS is not simulated.
+
+#ifndef SIM_DNSSERVER_H
+#define SIM_DNSSERVER_H
+
+#include "Arduino.h"
+
+#endif
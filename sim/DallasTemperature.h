@@ -0,0 +1,42 @@
+/*
+Host simulation shim for DS18B20 sensors.
+The simulator provides the sensors (see web-therm-sim.cpp): a conversion latches every
+sensor's reading, and each read charges the virtual time a real bus transaction takes.
+*/
+
+#ifndef SIM_DALLASTEMPERATURE_H
+#define SIM_DALLASTEMPERATURE_H
+
+#include "OneWire.h"
+
+#define DEVICE_DISCONNECTED_RAW -7040
+
+typedef uint8_t DeviceAddress[8];
+
+// Implemented by the simulator
+int simOneWireCount();
+void simOneWireConvert();
+int32_t simOneWireRead(int index);       // Raw reading, 1/128 C
+
+class DallasTemperature {
+public:
+  DallasTemperature(OneWire *) {}
+  void begin() {}
+  void setWaitForConversion(bool) {}
+  uint8_t getDeviceCount() { return simOneWireCount(); }
+  bool getAddress(uint8_t *addr, uint8_t index) {
+    memset(addr, 0, 8);
+    if (index >= simOneWireCount()) {
+      return false;
+    }
+    addr[0] = 0x28;                     // DS18B20 family code
+    addr[1] = index + 1;
+    return true;
+  }
+  void requestTemperatures() { simOneWireConvert(); }
+  int32_t getTemp(const uint8_t *addr) {
+    return addr[0] == 0x28 ? simOneWireRead(addr[1] - 1) : DEVICE_DISCONNECTED_RAW;
+  }
+};
+
+#endif
@@ -0,0 +1,26 @@
+// Host simulation shim: RAM-backed EEPROM. The sketch only reads it, once at boot, for settings
+// saved in the old fixed layout.
+
+#ifndef SIM_EEPROM_H
+#define SIM_EEPROM_H
+
+#include "Arduino.h"
+
+class SimEEPROM {
+public:
+  SimEEPROM() { memset(data, 0xFF, sizeof(data)); }
+  void begin(size_t size) { this->size = size; }
+  void end() { size = 0; }
+  uint8_t read(int addr) const { return data[addr]; }
+  void write(int addr, uint8_t val) { if (data[addr] != val) { data[addr] = val; dirty = true; } }
+  bool commit() { if (dirty) { commits++; dirty = false; } return true; }
+
+  uint8_t data[4096];
+  size_t size = 0;
+  bool dirty = false;
+  unsigned long commits = 0;
+};
+
+extern SimEEPROM EEPROM;
+
+#endif
@@ -0,0 +1,18 @@
+/*
+Host simulation shim for ESP8266WebServer.
+The sketch serves HTTP itself (HttpServer) and only borrows the method enum and the
+CONTENT_LENGTH_ values from this header, which WiFiManager includes for its portal.
+*/
+
+#ifndef SIM_ESP8266WEBSERVER_H
+#define SIM_ESP8266WEBSERVER_H
+
+#include "Arduino.h"
+#include "ESP8266WiFi.h"
+
+#define CONTENT_LENGTH_UNKNOWN ((size_t) -1)
+#define CONTENT_LENGTH_NOT_SET ((size_t) -2)
+
+enum HTTPMethod { HTTP_ANY, HTTP_GET, HTTP_HEAD, HTTP_POST, HTTP_PUT, HTTP_PATCH, HTTP_DELETE, HTTP_OPTIONS };
+
+#endif
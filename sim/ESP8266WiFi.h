@@ -0,0 +1,154 @@
+// Host simulation shim: joins take the time the simulator's access point model gives them.
+
+#ifndef SIM_ESP8266WIFI_H
+#define SIM_ESP8266WIFI_H
+
+#include "Arduino.h"
+#include <deque>
+#include <memory>
+
+// VIRTUAL SOCKETS ------------------------------------------------
+// One SimConn per TCP connection. The peer appends requests to rx and drains tx; window is
+// the send buffer, so availableForWrite() shows back-pressure from slow peers.
+
+struct SimConn {
+  std::string rx;                       // Bytes from peer not yet read by the sketch
+  std::string tx;                       // Bytes written by the sketch not yet taken by peer
+  size_t window = 2920;                 // Bytes tx can hold (two full TCP segments)
+  bool open = true;                     // Sketch hasn't stopped it
+  bool hangup = false;                  // Peer has closed its end
+  unsigned long long txTotal = 0;       // Bytes ever written by the sketch
+};
+
+void simTcpCost(size_t bytes);          // Charges virtual time for a socket read or write (simulator)
+
+class IPAddress {
+public:
+  IPAddress() {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : addr((uint32_t)a << 24 | b << 16 | c << 8 | d) {}
+  uint8_t operator[](int i) const { return addr >> (24 - 8 * i); }
+  bool fromString(const char *s) {
+    unsigned a, b, c, d;
+    char tail;
+    if (sscanf(s, "%u.%u.%u.%u%c", &a, &b, &c, &d, &tail) != 4 || a > 255 || b > 255 || c > 255 || d > 255) {
+      return false;
+    }
+    addr = a << 24 | b << 16 | c << 8 | d;
+    return true;
+  }
+  uint32_t addr = 0;
+};
+
+// Opens an outgoing connection, null if nothing answers within timeoutMs (simulator)
+std::shared_ptr<SimConn> simDial(uint32_t addr, uint16_t port, unsigned long timeoutMs);
+
+enum WiFiSleepType { WIFI_NONE_SLEEP, WIFI_LIGHT_SLEEP, WIFI_MODEM_SLEEP };
+enum WiFiMode_t { WIFI_OFF, WIFI_STA, WIFI_AP, WIFI_AP_STA };
+enum wl_status_t { WL_IDLE_STATUS = 0, WL_NO_SSID_AVAIL = 1, WL_CONNECTED = 3, WL_CONNECT_FAILED = 4, WL_DISCONNECTED = 7 };
+
+// Implemented by the simulator: starts a join, and says whether the station is joined now
+void simJoin(int32_t channel, const uint8_t *bssid, bool staticIp);
+bool simJoined();
+
+class SimWiFi {
+public:
+  bool mode(WiFiMode_t m) { wifiMode = m; return true; }
+  bool setSleepMode(WiFiSleepType type) { sleepMode = type; return true; }
+  bool config(IPAddress ip, IPAddress gateway, IPAddress subnet, IPAddress dns = IPAddress()) {
+    staticIp = ip.addr != 0;
+    if (staticIp) {
+      addr[0] = ip; addr[1] = gateway; addr[2] = subnet; addr[3] = dns;
+    }
+    return true;
+  }
+  wl_status_t begin(const char *, const char *, int32_t channel = 0, const uint8_t *bssid = nullptr) {
+    simJoin(channel, bssid, staticIp);
+    return WL_DISCONNECTED;
+  }
+  wl_status_t status() { return simJoined() ? WL_CONNECTED : WL_DISCONNECTED; }
+  String SSID() { return ssid; }
+  String psk() { return pass; }
+  uint8_t *BSSID() { return bssid; }
+  int32_t channel() { return chan; }
+  IPAddress localIP() { return addr[0]; }
+  IPAddress gatewayIP() { return addr[1]; }
+  IPAddress subnetMask() { return addr[2]; }
+  IPAddress dnsIP() { return addr[3]; }
+  int32_t RSSI() { return -62; }
+  void simTx() { lastTxUs = micros(); }   // Radio transmitted, analogRead() is noisier for a while
+  WiFiMode_t wifiMode = WIFI_STA;
+  WiFiSleepType sleepMode = WIFI_MODEM_SLEEP;
+  unsigned long lastTxUs = 0;
+  const char *ssid = "home";            // Credentials the SDK kept from a portal save
+  const char *pass = "secret";
+  uint8_t bssid[6] = {0};               // Access point joined, set by the simulator
+  int32_t chan = 0;
+  bool staticIp = false;
+  IPAddress addr[4];                    // Address, gateway, subnet, DNS: static, or from DHCP
+};
+
+extern SimWiFi WiFi;
+
+class WiFiClient {
+public:
+  WiFiClient() {}
+  explicit WiFiClient(std::shared_ptr<SimConn> c) : conn(c) {}
+
+  int connect(IPAddress ip, uint16_t port) {
+    stop();
+    conn = simDial(ip.addr, port, timeout);
+    return conn ? 1 : 0;
+  }
+  void setTimeout(unsigned long ms) { timeout = ms; }
+
+  // Like the real client, still connected after the peer hangs up while unread bytes remain
+  uint8_t connected() const { return conn && conn->open && (!conn->hangup || !conn->rx.empty()); }
+  explicit operator bool() const { return connected(); }
+  int available() const { return conn && conn->open ? conn->rx.size() : 0; }
+  int read(uint8_t *buf, size_t n) {
+    if (n > (size_t)available()) {
+      n = available();
+    }
+    memcpy(buf, conn->rx.data(), n);
+    conn->rx.erase(0, n);
+    simTcpCost(n);
+    return n;
+  }
+  size_t availableForWrite() const {
+    return connected() && conn->tx.size() < conn->window ? conn->window - conn->tx.size() : 0;
+  }
+  size_t write(const uint8_t *buf, size_t n) {
+    if (!connected()) {
+      return 0;
+    }
+    conn->tx.append((const char *)buf, n);
+    conn->txTotal += n;
+    simTcpCost(n);
+    WiFi.simTx();
+    return n;
+  }
+  size_t write_P(PGM_P buf, size_t n) { return write((const uint8_t *)buf, n); }
+  bool stop(unsigned int = 0) { if (conn) conn->open = false; return true; }
+  void setNoDelay(bool) {}
+
+  std::shared_ptr<SimConn> conn;
+  unsigned long timeout = 5000;         // connect() wait, as the core's default
+};
+
+extern std::deque<std::shared_ptr<SimConn> > simBacklog;   // Connections waiting for accept()
+
+class WiFiServer {
+public:
+  explicit WiFiServer(uint16_t) {}
+  void begin() {}
+  WiFiClient accept() {
+    if (simBacklog.empty()) {
+      return WiFiClient();
+    }
+    WiFiClient client(simBacklog.front());
+    simBacklog.pop_front();
+    return client;
+  }
+};
+
+#endif
@@ -0,0 +1,14 @@
+// Host simulation shim: the 1-Wire bus itself is not simulated, DallasTemperature.h talks
+// to the simulator's sensors directly.
+
+#ifndef SIM_ONEWIRE_H
+#define SIM_ONEWIRE_H
+
+#include "Arduino.h"
+
+class OneWire {
+public:
+  OneWire(uint8_t) {}
+};
+
+#endif
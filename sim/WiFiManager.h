@@ -0,0 +1,30 @@
+// Host simulation shim: a non-blocking portal that nobody saves credentials in, so it runs
+// until its timeout.
+
+#ifndef SIM_WIFIMANAGER_H
+#define SIM_WIFIMANAGER_H
+
+#include "Arduino.h"
+
+class WiFiManager {
+public:
+  void setConfigPortalBlocking(bool) {}
+  void setConfigPortalTimeout(unsigned long seconds) { timeout = seconds; }
+  void setConnectTimeout(unsigned long) {}
+  bool startConfigPortal() { active = true; openedAt = millis(); opened++; return false; }
+  bool process() {
+    if (active && millis() - openedAt >= timeout * 1000) {
+      active = false;
+    }
+    return false;
+  }
+  bool getConfigPortalActive() { return active; }
+  bool stopConfigPortal() { active = false; return true; }
+
+  bool active = false;
+  unsigned long openedAt = 0;
+  unsigned long timeout = 0;
+  unsigned long opened = 0;             // Times the portal was opened
+};
+
+#endif
@@ -0,0 +1,9 @@
+// Host simulation shim: there is no SNTP, so the callback is kept but never called.
+// The simulator sets the clock through /api/time instead.
+
+#ifndef SIM_COREDECLS_H
+#define SIM_COREDECLS_H
+
+inline void settimeofday_cb(void (*)()) {}
+
+#endif
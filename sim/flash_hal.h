@@ -0,0 +1,13 @@
+// Host simulation shim: the filesystem region of flash. Its sectors are held, erased and
+// written by SimESP in Arduino.h.
+
+#ifndef SIM_FLASH_HAL_H
+#define SIM_FLASH_HAL_H
+
+#include "Arduino.h"
+
+#define FLASH_SECTOR_SIZE SIM_FLASH_SECTOR
+#define FS_PHYS_ADDR SIM_FS_ADDR
+#define FS_PHYS_SIZE SIM_FS_SIZE
+
+#endif
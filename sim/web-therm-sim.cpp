@@ -0,0 +1,2551 @@
+/*
+Host simulation of web-therm.c.
+Builds the sketch unchanged against the shims in this directory and runs it on a virtual
+clock. A thermal plant model turns the relay output into room temperature and the room
+temperature back into ADC counts, so a day of control replays in well under a second.
+
+  g++ -std=gnu++11 -O2 -Isim -o web-therm-sim sim/web-therm-sim.cpp
+  ./web-therm-sim --mode cool --hours 24 --setpoint 72
+
+Add -DZONES=4 to build the sketch with four zones, each with its own room and relay.
+*/
+
+#include "Arduino.h"
+
+const char *simMqttHost = "";           // --mqtt points the sketch at the stand-in broker
+#define MQTT_HOST simMqttHost
+
+#include "../web-therm.c"
+
+#include <algorithm>
+#include <chrono>
+#include <dirent.h>
+#include <map>
+#include <new>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// ALLOCATION COUNTING -------------------------------------------
+// Every heap allocation in the process goes through here, so benchmarks can count what
+// the sketch allocates per request
+
+unsigned long long allocCalls = 0;
+unsigned long long allocBytes = 0;
+
+__attribute__((noinline)) void *simAlloc(size_t n) {
+  allocCalls++;
+  allocBytes += n;
+  void *p = malloc(n ? n : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+__attribute__((noinline)) void simFree(void *p) { free(p); }
+
+void *operator new(size_t n) { return simAlloc(n); }
+void *operator new[](size_t n) { return simAlloc(n); }
+void operator delete(void *p) noexcept { simFree(p); }
+void operator delete(void *p, size_t) noexcept { simFree(p); }
+void operator delete[](void *p) noexcept { simFree(p); }
+void operator delete[](void *p, size_t) noexcept { simFree(p); }
+
+// SIMULATOR STATE ----------------------------------------------
+
+bool simVerbose = false;
+SimSerial Serial;
+SimEEPROM EEPROM;
+SimWiFi WiFi;
+SimESP ESP;
+std::deque<std::shared_ptr<SimConn> > simBacklog;
+
+unsigned long long simClockUs = 0;      // Virtual time since boot
+const unsigned long SIM_LOOP_COST_US = 50;  // Virtual time charged per loop() pass
+const unsigned long SIM_ADC_US = 90;        // Virtual time charged per analogRead()
+const unsigned long SIM_ONEWIRE_READ_US = 11000;    // Per DS18B20 read: reset, match ROM, 9 byte scratchpad
+const unsigned long SIM_ONEWIRE_CONVERT_US = 1000;  // Per conversion request: reset, skip ROM, convert
+const unsigned long SIM_REMOTE_MS = 30000;          // How often a remote sensor board POSTs its reading
+const unsigned long SIM_TCP_US = 40;                // Per socket read or write: lwIP call and pbuf handling
+const unsigned long SIM_TCP_NS_PER_BYTE = 50;       // Per byte copied to or from a socket
+
+// THERMAL PLANT ------------------------------------------------
+// Room loses heat to a daily outside temperature cycle. The device output does not reach
+// full strength at once, it ramps with tauOutput, which is what causes overshoot.
+
+struct Plant {
+  double room = 70;                     // Room air temp F
+  double output = 0;                    // F per second the device is adding (heat) or removing (cool)
+  double outsideMean = 40;              // Mean outside temp F
+  double outsideSwing = 10;             // Daily swing either side of mean, coldest at 4am
+  double tauRoom = 4 * 3600.0;          // Seconds for room to lose 63% of its difference to outside
+  double tauOutput = 180;               // Seconds for heater/coil to reach 63% of full output
+  double capacity = 15.0 / 3600;        // F per second at full output
+  bool cooling = false;
+  bool relay = false;
+  bool dead = false;                    // Relay switches nothing, a failed heater or cooler (--fault dead)
+
+  double outside(double t) const {
+    return outsideMean - outsideSwing * cos(2 * M_PI * (t / 3600 - 4) / 24);
+  }
+
+  void step(double t, double dt) {
+    double target = relay && !dead ? (cooling ? -capacity : capacity) : 0;
+    output += (target - output) * (1 - exp(-dt / tauOutput));
+    room += (output + (outside(t) - room) / tauRoom) * dt;
+  }
+};
+
+Plant plants[ZONES];                    // One room per zone
+
+double simF(double degrees) {
+// RETURNS DEGREES IN THE SKETCH'S TEMP_UNIT AS F, THE PLANT'S UNIT ---
+  return TEMP_UNIT == UNIT_F ? degrees : degrees * 9 / 5 + 32;
+}
+
+double simUnit(double f) {
+// RETURNS F IN THE SKETCH'S TEMP_UNIT ---
+  return TEMP_UNIT == UNIT_F ? f : (f - 32) * 5 / 9;
+}
+
+// SENSOR NOISE -------------------------------------------------
+
+uint32_t rngState = 1;
+
+double simRandom() {
+// RETURNS UNIFORM 0-1 FROM XORSHIFT, SO RUNS REPEAT FOR A GIVEN SEED ---
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState / 4294967296.0;
+}
+
+double simGauss() {
+  double u = simRandom() + 1e-12, v = simRandom();
+  return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+double adcNoise = 1.0;                  // Gaussian noise in ADC counts
+double adcSpikeRate = 0.02;             // Fraction of reads hit by Wi-Fi burst noise
+double adcTxSpikeRate = 0.5;            // Fraction hit while the radio is transmitting
+double adcTxBias = 3;                   // Counts every read is pulled up by supply droop during TX
+unsigned long adcTxUs = 5000;           // How long after a send the radio is still transmitting or acking
+double adcSpike = 8;                    // Size of burst noise in ADC counts
+
+// SENSOR AND EQUIPMENT FAULTS -----------------------------------
+// --fault KIND@M breaks zone 0 at the first moment from minute M on that its relay is on, so
+// there is a running device for the sketch to stop: open and short pin its ADC at full scale
+// and at 0, stuck holds the last count, loose reads 60% in odd seconds as a bad contact
+// would, and dead leaves the relay driving nothing.
+
+enum { SIM_FAULT_NONE, SIM_FAULT_OPEN, SIM_FAULT_SHORT, SIM_FAULT_STUCK, SIM_FAULT_LOOSE, SIM_FAULT_DEAD, SIM_FAULTS };
+const char *simFaultNames[SIM_FAULTS] = {"none", "open", "short", "stuck", "loose", "dead"};
+int simFault = SIM_FAULT_NONE;
+double simFaultFrom = 0;                // Minute the fault is armed from
+unsigned long long simFaultUs = ~0ULL;  // When it struck
+long adcStuck = -1;                     // Count a stuck ADC holds, -1 until it sticks
+long adcLastCount = 0;                  // Last count returned
+unsigned long startsAtFault = 0;        // Zone 0's relay starts when it struck
+
+// RELAY STATS ---------------------------------------------------
+
+struct RelayStats {
+  unsigned long switches = 0;           // Output pin transitions
+  unsigned long starts = 0;             // Off to on transitions
+  unsigned long quickRestarts = 0;      // Starts less than powerWait after a stop
+  unsigned long long onUs = 0;          // Total time on
+  unsigned long long lastChangeUs = 0;
+  unsigned long long minOnUs = ~0ULL;
+  unsigned long long minOffUs = ~0ULL;
+  bool everStopped = false;
+};
+
+RelayStats relayStats[ZONES];
+bool originalHyst = false;              // --control original, the sim switches relays as the first sketch did
+
+// HTTP CLIENTS --------------------------------------------------
+// Requests reach the sketch over virtual sockets, as a browser's would. simCall() answers
+// one at once; simSend() leaves it to the loop and throws the response away.
+
+struct SimResponse {
+  int status = 0;
+  std::map<std::string, std::string> headers;   // Names lower case
+  std::string body;                             // Chunks joined
+};
+
+SimResponse simLast;                    // Response to the last simCall()
+unsigned long long simCallBytes = 0;    // Response bytes simCall() has taken
+std::vector<std::shared_ptr<SimConn> > oneShots;   // simSend() connections not yet closed
+
+std::shared_ptr<SimConn> simConnect(size_t window = 2920) {
+  std::shared_ptr<SimConn> c = std::make_shared<SimConn>();
+  c->window = window;
+  simBacklog.push_back(c);
+  return c;
+}
+
+std::string simRequestText(const char *target, HTTPMethod method, bool keepAlive, const std::string &headers = "") {
+  return std::string(method == HTTP_POST ? "POST " : "GET ") + target + " HTTP/1.1\r\nHost: therm\r\n" +
+         headers + (keepAlive ? "" : "Connection: close\r\n") + "\r\n";
+}
+
+size_t simParse(const std::string &s, SimResponse *r) {
+// RETURNS LENGTH OF THE WHOLE RESPONSE AT THE FRONT OF s, 0 IF IT HASN'T ALL ARRIVED ---
+  size_t head = s.find("\r\n\r\n");
+  if (head == std::string::npos) return 0;
+  SimResponse res;
+  res.status = atoi(s.c_str() + 9);
+  for (size_t at = s.find("\r\n") + 2; at < head + 2; ) {
+    size_t eol = s.find("\r\n", at);
+    size_t colon = s.find(':', at);
+    if (colon < eol) {
+      std::string name = s.substr(at, colon - at);
+      std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+      res.headers[name] = s.substr(colon + 2, eol - colon - 2);
+    }
+    at = eol + 2;
+  }
+  size_t at = head + 4;
+  if (res.headers["transfer-encoding"] == "chunked") {
+    for (;;) {
+      size_t eol = s.find("\r\n", at);
+      if (eol == std::string::npos) return 0;
+      size_t n = strtoul(s.c_str() + at, nullptr, 16);
+      if (s.size() < eol + 2 + n + 2) return 0;
+      res.body.append(s, eol + 2, n);
+      at = eol + 2 + n + 2;
+      if (n == 0) break;
+    }
+  } else {
+    size_t n = res.headers.count("content-length") ? strtoul(res.headers["content-length"].c_str(), nullptr, 10) : 0;
+    if (s.size() < at + n) return 0;
+    res.body = s.substr(at, n);
+    at += n;
+  }
+  if (r) *r = res;
+  return at;
+}
+
+int simCall(const char *target, HTTPMethod method = HTTP_GET, const std::string &headers = "") {
+// SENDS A REQUEST ON A NEW CONNECTION AND SERVES IT AT ONCE, RETURNS THE STATUS (0 IF NONE) ---
+  std::shared_ptr<SimConn> c = simConnect(1 << 20);
+  std::string got;
+  c->rx = simRequestText(target, method, false, headers);
+  simLast = SimResponse();
+  for (int pass = 0; pass < 1000 && c->open; pass++) {
+    server.handleClient();
+    got += c->tx;
+    simCallBytes += c->tx.size();
+    c->tx.clear();
+    if (simParse(got, &simLast)) break;
+  }
+  c->hangup = true;
+  return simLast.status;
+}
+
+void simSend(const char *target, HTTPMethod method = HTTP_GET) {
+// QUEUES A REQUEST FOR THE LOOP TO SERVE, RESPONSE DISCARDED ---
+  std::shared_ptr<SimConn> c = simConnect();
+  c->rx = simRequestText(target, method, false);
+  oneShots.push_back(c);
+}
+
+// POLLING CLIENTS -----------------------------------------------
+// --poll MS sends a GET /api/state every MS millis, as a dashboard would, so responses
+// go out at times unrelated to the sketch's own schedule
+
+unsigned long pollMs = 0;
+unsigned long long nextPollUs = 0;
+unsigned long polls = 0;
+
+void pollState() {
+  if (pollMs == 0 || simClockUs < nextPollUs) {
+    return;
+  }
+  simSend("/api/state");
+  polls++;
+  nextPollUs = simClockUs + (unsigned long long)(pollMs * 1000 * (0.5 + simRandom()));
+}
+
+// EVENT STREAM PEERS --------------------------------------------
+// Subscribers attached with --subscribers, drained every loop pass like a fast client
+
+std::vector<std::shared_ptr<SimConn> > peers;
+unsigned long long peerBytes = 0;
+unsigned long peerEvents = 0;
+
+void drainPeers() {
+  for (size_t i = 0; i < peers.size(); i++) {
+    std::string &tx = peers[i]->tx;
+    for (size_t at = tx.find("event:"); at != std::string::npos; at = tx.find("event:", at + 1)) {
+      peerEvents++;
+    }
+    peerBytes += tx.size();
+    tx.clear();
+  }
+  for (size_t i = 0; i < oneShots.size(); ) {
+    oneShots[i]->tx.clear();
+    if (!oneShots[i]->open) {
+      oneShots[i] = oneShots.back();
+      oneShots.pop_back();
+    } else {
+      i++;
+    }
+  }
+}
+
+// LOAD CLIENTS --------------------------------------------------
+// --load N runs N clients against the server alongside the plant. Most are dashboards and
+// browsers on keep-alive connections; some open a new connection per request, some read
+// their responses a little at a time, and some send half a request and go quiet.
+
+enum LoadKind { LOAD_FAST, LOAD_CLOSE, LOAD_SLOW, LOAD_STALL };
+
+struct LoadClient {
+  LoadKind kind;
+  std::shared_ptr<SimConn> conn;
+  std::string got;                      // Response bytes taken so far
+  unsigned long long nextUs = 0;        // Next request when idle, next read when slow
+  unsigned long long sentUs = 0;        // When the request in flight went, 0 if none
+  unsigned seq = 0;                     // Requests sent
+  std::string etag;                     // Last /api/state ETag, sent back as a dashboard would
+};
+
+const size_t LOAD_SLOW_WINDOW = 256;    // Slow readers take this many bytes each LOAD_SLOW_MS
+const unsigned long LOAD_SLOW_MS = 100;
+const unsigned long LOAD_THINK_MS = 1000;   // Clients wait up to this long between requests
+
+std::vector<LoadClient> loadClients;
+std::map<int, unsigned long> loadStatus;    // Responses by status
+unsigned long loadSent = 0;
+unsigned long loadDropped = 0;          // Connection closed with no response
+std::vector<double> loadLatencyMs[2];   // Request to last byte of 200 and 304 responses, other clients and slow readers
+
+void loadStart(int n) {
+  for (int i = 0; i < n; i++) {
+    LoadClient c;
+    c.kind = i % 8 == 7 ? LOAD_STALL : i % 4 == 3 ? LOAD_SLOW : i % 4 == 1 ? LOAD_CLOSE : LOAD_FAST;
+    c.nextUs = simClockUs + (unsigned long long)(simRandom() * LOAD_THINK_MS * 1000);
+    loadClients.push_back(c);
+  }
+}
+
+void loadRequest(LoadClient &c) {
+// SENDS THE CLIENT'S NEXT REQUEST, ON A NEW CONNECTION IF IT HAS NONE ---
+  static const char *targets[] = {"/api/state", "/", "/api/state", "/api/zones", "/api/state",
+                                  "/settings", "/api/state", "/api/history?count=120"};
+  if (!c.conn || !c.conn->open || c.conn->hangup) {
+    c.conn = simConnect(c.kind == LOAD_SLOW ? LOAD_SLOW_WINDOW : 2920);
+  }
+  const char *target = targets[c.seq % 8];
+  std::string headers;
+  if (strcmp(target, "/api/state") == 0 && !c.etag.empty()) {
+    headers = "If-None-Match: " + c.etag + "\r\n";
+  }
+  std::string req = simRequestText(target, HTTP_GET, c.kind != LOAD_CLOSE, headers);
+  if (c.kind == LOAD_STALL) {
+    req.resize(req.size() / 2);                 // The rest never comes
+  }
+  c.conn->rx += req;
+  c.got.clear();
+  c.sentUs = simClockUs;
+  c.seq++;
+  loadSent++;
+}
+
+void loadStep() {
+// MOVES EACH LOAD CLIENT ON, CALLED EVERY LOOP PASS ---
+  for (size_t i = 0; i < loadClients.size(); i++) {
+    LoadClient &c = loadClients[i];
+    if (c.sentUs == 0) {
+      if (simClockUs >= c.nextUs) {
+        loadRequest(c);
+      }
+      continue;
+    }
+    if (c.kind != LOAD_SLOW || simClockUs >= c.nextUs) {
+      size_t take = c.kind == LOAD_SLOW ? std::min(c.conn->tx.size(), LOAD_SLOW_WINDOW) : c.conn->tx.size();
+      c.got.append(c.conn->tx, 0, take);
+      c.conn->tx.erase(0, take);
+      c.nextUs = simClockUs + LOAD_SLOW_MS * 1000;
+    }
+    SimResponse r;
+    if (simParse(c.got, &r)) {
+      loadStatus[r.status]++;
+      if (r.status == 200 || r.status == 304) {
+        loadLatencyMs[c.kind == LOAD_SLOW].push_back((simClockUs - c.sentUs) / 1000.0);
+      }
+      if (r.headers.count("etag")) {
+        c.etag = r.headers["etag"];
+      }
+      if (r.headers["connection"] == "close") {
+        c.conn->hangup = true;
+      }
+    } else if (c.conn->open || !c.conn->tx.empty()) {
+      continue;                                 // Still coming
+    } else {
+      loadDropped++;
+    }
+    c.sentUs = 0;
+    c.nextUs = simClockUs + (unsigned long long)(simRandom() * LOAD_THINK_MS * 1000);
+    if (c.kind == LOAD_STALL) {
+      c.nextUs += 5000000;                      // Stalled clients come back less often
+    }
+  }
+}
+
+// TRACE REPLAY HOOKS --------------------------------------------
+// While a trace replays, the sensors give the recorded raw values instead of the rooms', and
+// the clock is set to each record's time rather than charged for reads
+
+bool replaying = false;
+long replayRaw = 0;                     // Raw value the sensor hooks give for the sample being replayed
+int replayReads = 0;                    // analogRead()s of the burst so far
+std::vector<std::pair<unsigned long, bool> > replaySwitched[ZONES];   // Relay changes the replay made, millis and state
+
+int replayAdc() {
+// RETURNS THE NEXT OF A BURST OF READS WHOSE KEPT SUM, AS getCounts() TAKES IT, IS replayRaw ---
+// The trimmed reads are 0 and 1023; the kept ones are the sum's share, the remainder spread one each
+  int n = replayReads++ % Config::adcBurst;
+  if (n < Config::adcTrim) return 0;
+  if (n >= Config::adcBurst - Config::adcTrim) return 1023;
+  return replayRaw / Config::adcKept + (n - Config::adcTrim < replayRaw % Config::adcKept);
+}
+
+// HARDWARE HOOKS -----------------------------------------------
+
+const unsigned long long PLANT_STEP_US = 100000;   // Plant is integrated in steps of this size
+unsigned long long plantClockUs = 0;                 // Virtual time the plant has been stepped to
+
+void plantCatchUp() {
+// STEPS PLANTS UP TO THE VIRTUAL CLOCK, CALLED BEFORE THE SKETCH READS OR DRIVES THEM ---
+  if (replaying) {
+    plantClockUs = simClockUs;          // Rooms play no part in a replay
+    return;
+  }
+  while (plantClockUs < simClockUs) {
+    unsigned long long step = simClockUs - plantClockUs;
+    if (step > PLANT_STEP_US) step = PLANT_STEP_US;
+    for (int i = 0; i < ZONES; i++) {
+      if (plants[i].relay) {
+        relayStats[i].onUs += step;
+      }
+      plants[i].step(plantClockUs / 1e6, step / 1e6);
+    }
+    plantClockUs += step;
+  }
+}
+
+void simAdvance(unsigned long long us) {
+// MOVES VIRTUAL CLOCK FORWARD, PLANTS FOLLOW ONCE A WHOLE STEP HAS PASSED ---
+  simClockUs += us;
+  if (simClockUs - plantClockUs >= PLANT_STEP_US) {
+    plantCatchUp();
+  }
+}
+
+void simTcpCost(size_t bytes) {
+  simAdvance(SIM_TCP_US + bytes * SIM_TCP_NS_PER_BYTE / 1000);
+}
+
+int relayZone(uint8_t pin) {
+// RETURNS ZONE WHOSE RELAY IS ON pin, -1 IF NONE ---
+  for (int i = 0; i < ZONES; i++) {
+    if (zoneConfig[i].relayPin == pin) return i;
+  }
+  return -1;
+}
+
+unsigned long millis() { return simClockUs / 1000; }
+unsigned long micros() { return simClockUs; }
+void delay(unsigned long ms) { simAdvance(ms * 1000ULL); }
+void yield() {}
+void pinMode(uint8_t, uint8_t) {}
+int digitalRead(uint8_t pin) { int z = relayZone(pin); return z >= 0 ? plants[z].relay : 0; }
+
+void relayWrite(int z, bool on) {
+// SWITCHES ZONE z's RELAY, COUNTING IT, IF IT ISN'T ALREADY THAT WAY ---
+  if (on == plants[z].relay) {
+    return;
+  }
+  plantCatchUp();
+  RelayStats &rs = relayStats[z];
+  unsigned long long held = simClockUs - rs.lastChangeUs;
+  rs.switches++;
+  if (on) {
+    rs.starts++;
+    if (rs.everStopped) {
+      if (held < rs.minOffUs) rs.minOffUs = held;
+      if (held < Config::powerWait * 1000ULL) rs.quickRestarts++;
+    }
+  } else {
+    rs.everStopped = true;
+    if (held < rs.minOnUs) rs.minOnUs = held;
+  }
+  rs.lastChangeUs = simClockUs;
+  plants[z].relay = on;
+  if (replaying) {
+    replaySwitched[z].push_back(std::make_pair(millis(), on));
+  }
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+// RELAY PINS MOVE THE PLANT, UNLESS THE ORIGINAL HYSTERESIS HAS THEM ---
+  int z = relayZone(pin);
+  if (z >= 0 && !originalHyst) {
+    relayWrite(z, val != 0);
+  }
+}
+
+int analogRead(uint8_t pin) {
+// CONVERTS ROOM TEMP TO TMP36 VOLTAGE TO ADC COUNTS, WITH NOISE ---
+  if (replaying) {
+    return replayAdc();
+  }
+  simAdvance(SIM_ADC_US);
+  plantCatchUp();
+  int z = 0;
+  while (z < ZONES - 1 && !(zoneConfig[z].source == SRC_ADC && zoneConfig[z].sensor == pin)) z++;
+  double degreesC = (plants[z].room - 32) * 5 / 9;
+  double counts = (degreesC / 100 + 0.5) / 0.00302734375;
+  bool tx = micros() - WiFi.lastTxUs < adcTxUs;
+  counts += simGauss() * adcNoise + (tx ? adcTxBias : 0);
+  if (simRandom() < (tx ? adcTxSpikeRate : adcSpikeRate)) {
+    counts += (simRandom() < 0.5 ? -adcSpike : adcSpike);
+  }
+  long c = lround(counts);
+  c = c < 0 ? 0 : (c > 1023 ? 1023 : c);
+  if (z == 0 && simClockUs >= simFaultUs) {
+    if (simFault == SIM_FAULT_OPEN) c = 1023;
+    if (simFault == SIM_FAULT_SHORT) c = 0;
+    if (simFault == SIM_FAULT_STUCK) c = adcStuck < 0 ? (adcStuck = adcLastCount) : adcStuck;
+    if (simFault == SIM_FAULT_LOOSE && simClockUs / 1000000 % 2) c = lround(c * 0.6);
+  }
+  adcLastCount = c;
+  return c;
+}
+
+// DS18B20 SENSORS -----------------------------------------------
+// A conversion latches each sensor's room temp to the part's 1/16 C resolution, as the raw
+// 1/128 C value the library returns. Until the first conversion since power-on has had
+// SIM_ONEWIRE_CONVERT_MS, reads give the part's power-on 85 C.
+
+const unsigned long SIM_ONEWIRE_CONVERT_MS = 750;
+int32_t oneWireLatched[ZONES];
+unsigned long long oneWireFirstUs = ~0ULL;  // When the first conversion since power-on finishes
+
+int oneWireZone(int index) {
+// RETURNS ZONE READ FROM 1-WIRE SENSOR index, -1 IF NONE ---
+  for (int i = 0; i < ZONES; i++) {
+    if (zoneConfig[i].source == SRC_ONEWIRE && zoneConfig[i].sensor == index) return i;
+  }
+  return -1;
+}
+
+int simOneWireCount() {
+  int n = 0;
+  while (oneWireZone(n) >= 0) n++;
+  return n;
+}
+
+void simOneWireConvert() {
+  if (replaying) {
+    return;
+  }
+  if (oneWireFirstUs == ~0ULL) {
+    oneWireFirstUs = simClockUs + SIM_ONEWIRE_CONVERT_MS * 1000ULL;
+  }
+  simAdvance(SIM_ONEWIRE_CONVERT_US);
+  plantCatchUp();
+  for (int i = 0; i < ZONES; i++) {
+    double degreesC = (plants[i].room - 32) * 5 / 9 + simGauss() * 0.02;
+    oneWireLatched[i] = lround(degreesC * 16) * 8;
+  }
+}
+
+int32_t simOneWireRead(int index) {
+  if (replaying) {
+    return replayRaw;
+  }
+  simAdvance(SIM_ONEWIRE_READ_US);
+  int z = oneWireZone(index);
+  if (z < 0) {
+    return DEVICE_DISCONNECTED_RAW;
+  }
+  return simClockUs >= oneWireFirstUs ? oneWireLatched[z] : 85 * 128;
+}
+
+// REMOTE SENSORS ------------------------------------------------
+// Each SRC_REMOTE zone's room is POSTed to /api/sensor every SIM_REMOTE_MS, as a sensor
+// board elsewhere in the house would
+
+unsigned long long nextRemoteUs = 0;
+
+void postRemote() {
+  if (simClockUs < nextRemoteUs) {
+    return;
+  }
+  plantCatchUp();
+  for (int i = 0; i < ZONES; i++) {
+    if (zoneConfig[i].source == SRC_REMOTE) {
+      char uri[64];
+      snprintf(uri, sizeof(uri), "/api/sensor?zone=%d&temp=%.1f", i, simUnit(plants[i].room + simGauss() * 0.05));
+      simSend(uri, HTTP_POST);
+    }
+  }
+  nextRemoteUs = simClockUs + SIM_REMOTE_MS * 1000ULL;
+}
+
+// ACCESS POINT --------------------------------------------------
+// Told the access point's BSSID and channel, the station joins in SIM_ASSOC_MS; otherwise it
+// scans every channel first. DHCP adds SIM_DHCP_MS unless the sketch set a static address.
+// Told the wrong BSSID or channel it never joins. --ap-down A-B takes the access point off
+// air from minute A to B, dropping the station; --ap-moved puts it on another channel than
+// the one a warm boot has cached, as a router that picked a new channel would be.
+
+const unsigned long SIM_SCAN_MS = 2200;            // Scan of every channel for the SSID
+const unsigned long SIM_ASSOC_MS = 300;            // Authentication, association and WPA2 handshake
+const unsigned long SIM_DHCP_MS = 1000;            // Discover, offer, request, ack
+const uint8_t SIM_BSSID[2][6] = {{0x02, 0x11, 0x22, 0x33, 0x44, 0x55}, {0x02, 0x11, 0x22, 0x33, 0x44, 0x66}};
+const int32_t SIM_CHANNEL[2] = {6, 11};
+
+bool apMoved = false;
+double apDownFrom = -1, apDownTo = -1;             // Outage minutes
+unsigned long long joinUs = ~0ULL;                 // When the join under way finishes, ~0 if it never will
+unsigned long simJoins = 0;                        // Joins started
+
+bool apUp() {
+  double minute = simClockUs / 60e6;
+  return !(minute >= apDownFrom && minute < apDownTo);
+}
+
+void simJoin(int32_t channel, const uint8_t *bssid, bool staticIp) {
+// STARTS A JOIN, TIMED BY WHAT THE STATION WAS TOLD AND WHETHER THE ACCESS POINT IS THERE ---
+  simJoins++;
+  if (bssid && (channel != SIM_CHANNEL[apMoved] || memcmp(bssid, SIM_BSSID[apMoved], 6) != 0)) {
+    joinUs = ~0ULL;
+    return;
+  }
+  if (!apUp()) {
+    joinUs = ~0ULL;
+    return;
+  }
+  joinUs = simClockUs + ((bssid ? 0 : SIM_SCAN_MS) + SIM_ASSOC_MS + (staticIp ? 0 : SIM_DHCP_MS)) * 1000ULL;
+  memcpy(WiFi.bssid, SIM_BSSID[apMoved], 6);
+  WiFi.chan = SIM_CHANNEL[apMoved];
+  if (!staticIp) {
+    WiFi.addr[0] = IPAddress(192, 168, 1, 57);
+    WiFi.addr[1] = IPAddress(192, 168, 1, 1);
+    WiFi.addr[2] = IPAddress(255, 255, 255, 0);
+    WiFi.addr[3] = IPAddress(192, 168, 1, 1);
+  }
+}
+
+bool simJoined() {
+  if (!apUp()) {
+    joinUs = ~0ULL;                     // Dropped, the sketch has to join again
+  }
+  return simClockUs >= joinUs;
+}
+
+// MQTT BROKER ---------------------------------------------------
+// --mqtt points the sketch at a stand-in for a Mosquitto broker on the LAN. It speaks MQTT
+// 3.1.1 over virtual sockets: CONNECT with a will, SUBSCRIBE with + and # filters, retained
+// messages, PINGREQ and keepalive expiry. The fleet collector, subscribed to #, and the
+// commander, which sends setpoints, are in-process. --mqtt-down A-B refuses and resets
+// connections from minute A to B as a broker restart would; --mqtt-silent A-B answers nothing,
+// as a dead link would.
+
+const char *SIM_BROKER_IP = "192.168.1.2";
+const unsigned long SIM_CONNECT_US = 3000;         // TCP handshake with a LAN host, or its reset
+const unsigned long SIM_COMMAND_MS = 600000;       // How often the commander moves a setpoint
+
+struct BrokerSession {
+  std::shared_ptr<SimConn> conn;
+  std::string in;                       // Bytes from the client not yet parsed
+  bool connected = false;               // CONNECT accepted
+  bool clean = false;                   // Left with DISCONNECT, so no will
+  std::string willTopic, willMessage;
+  bool willRetain = false;
+  unsigned keepAlive = 0;               // Seconds, 0 for none
+  unsigned long long lastInUs = 0;
+  std::vector<std::string> filters;
+};
+
+struct BrokerMessage {
+  unsigned long long atUs;
+  std::string topic, payload;
+};
+
+bool brokerOn = false;
+double downFrom = -1, downTo = -1, silentFrom = -1, silentTo = -1;   // Outage minutes
+std::vector<BrokerSession> brokerSessions;
+std::map<std::string, std::string> brokerRetained;
+std::vector<BrokerMessage> collected;   // Every publish, as the collector sees it
+unsigned long brokerAccepts = 0;
+unsigned long brokerRefusals = 0;
+unsigned long long brokerBytes = 0;     // Bytes from the sketch
+
+struct SimCommand {
+  std::string topic;
+  double setPoint;
+  unsigned long long sentUs;
+};
+
+std::vector<SimCommand> commandsPending;
+size_t collectedSeen = 0;               // Messages already checked against commandsPending
+std::vector<double> commandLatencyMs;
+unsigned long commandsSent = 0;
+unsigned long commandsDelivered = 0;
+unsigned long long nextCommandUs = SIM_COMMAND_MS * 1000ULL;
+
+bool brokerOutage(double from, double to) {
+  double minute = simClockUs / 60e6;
+  return minute >= from && minute < to;
+}
+
+std::string mqttText(const std::string &s) {
+  return std::string(1, (char)(s.size() >> 8)) + (char)(s.size() & 0xFF) + s;
+}
+
+std::string mqttPacket(uint8_t type, const std::string &body) {
+  std::string p(1, (char)type);
+  size_t n = body.size();
+  do {
+    p += (char)((n & 0x7F) | (n > 0x7F ? 0x80 : 0));
+    n >>= 7;
+  } while (n);
+  return p + body;
+}
+
+bool topicMatch(const std::string &filter, const std::string &topic) {
+// TRUE IF topic IS COVERED BY filter, + MATCHING ONE LEVEL AND # THE REST ---
+  size_t f = 0, t = 0;
+  while (f < filter.size()) {
+    if (filter[f] == '#') return true;
+    size_t fe = filter.find('/', f), te = topic.find('/', t);
+    if (fe == std::string::npos) fe = filter.size();
+    if (te == std::string::npos) te = topic.size();
+    if (t > topic.size()) return false;
+    if (filter.compare(f, fe - f, "+") != 0 && filter.compare(f, fe - f, topic, t, te - t) != 0) return false;
+    f = fe + 1;
+    t = te + 1;
+  }
+  return t > topic.size();
+}
+
+int brokerPublish(const std::string &topic, const std::string &payload, bool retain) {
+// STORES A RETAINED MESSAGE AND DELIVERS TO EVERY MATCHING SUBSCRIPTION, RETURNS HOW MANY ---
+  if (retain) {
+    if (payload.empty()) brokerRetained.erase(topic);
+    else brokerRetained[topic] = payload;
+  }
+  collected.push_back({simClockUs, topic, payload});
+  std::string p = mqttPacket(0x30, mqttText(topic) + payload);
+  int delivered = 0;
+  for (size_t i = 0; i < brokerSessions.size(); i++) {
+    BrokerSession &s = brokerSessions[i];
+    for (size_t k = 0; s.connected && k < s.filters.size(); k++) {
+      if (topicMatch(s.filters[k], topic)) {
+        s.conn->rx += p;
+        delivered++;
+        break;
+      }
+    }
+  }
+  return delivered;
+}
+
+std::shared_ptr<SimConn> simDial(uint32_t addr, uint16_t port, unsigned long timeoutMs) {
+// CONNECTS TO THE BROKER, OR FAILS AS A DOWN BROKER (RESET) OR A DEAD LINK (TIMEOUT) WOULD ---
+  IPAddress broker;
+  broker.fromString(SIM_BROKER_IP);
+  if (brokerOutage(silentFrom, silentTo)) {
+    simAdvance(timeoutMs * 1000ULL);
+    brokerRefusals++;
+    return nullptr;
+  }
+  simAdvance(SIM_CONNECT_US);
+  if (!brokerOn || addr != broker.addr || port != 1883 || brokerOutage(downFrom, downTo)) {
+    brokerRefusals++;
+    return nullptr;
+  }
+  BrokerSession s;
+  s.conn = std::make_shared<SimConn>();
+  s.lastInUs = simClockUs;
+  brokerSessions.push_back(s);
+  return s.conn;
+}
+
+void brokerPacket(BrokerSession &s, uint8_t type, const std::string &body) {
+// ANSWERS ONE PACKET FROM A CLIENT ---
+  size_t at = 0;
+  auto text = [&]() {
+    size_t n = at + 2 <= body.size() ? ((uint8_t)body[at] << 8 | (uint8_t)body[at + 1]) : 0;
+    std::string v = body.substr(std::min(at + 2, body.size()), n);
+    at += 2 + n;
+    return v;
+  };
+  switch (type >> 4) {
+  case 1: {                                     // CONNECT
+    bool ok = text() == "MQTT" && at + 4 <= body.size() && body[at] == 4;
+    uint8_t flags = ok ? body[at + 1] : 0;
+    s.keepAlive = ok ? ((uint8_t)body[at + 2] << 8 | (uint8_t)body[at + 3]) : 0;
+    at += 4;
+    text();                                     // Client id
+    if (flags & 0x04) {
+      s.willTopic = text();
+      s.willMessage = text();
+      s.willRetain = flags & 0x20;
+    }
+    s.conn->rx += mqttPacket(0x20, std::string("\0", 1) + (char)(ok ? 0 : 1));
+    s.connected = ok;
+    brokerAccepts += ok;
+    break;
+  }
+  case 8: {                                     // SUBSCRIBE
+    std::string ack = body.substr(0, 2);
+    at = 2;
+    while (at < body.size()) {
+      std::string filter = text();
+      at++;                                     // Requested QoS, always granted 0
+      s.filters.push_back(filter);
+      ack += '\0';
+    }
+    s.conn->rx += mqttPacket(0x90, ack);
+    for (std::map<std::string, std::string>::iterator it = brokerRetained.begin(); it != brokerRetained.end(); ++it) {
+      for (size_t k = 0; k < s.filters.size(); k++) {
+        if (topicMatch(s.filters[k], it->first)) {
+          s.conn->rx += mqttPacket(0x31, mqttText(it->first) + it->second);
+          break;
+        }
+      }
+    }
+    break;
+  }
+  case 3: {                                     // PUBLISH
+    std::string topic = text();
+    if (type & 0x06) at += 2;
+    brokerPublish(topic, body.substr(std::min(at, body.size())), type & 1);
+    break;
+  }
+  case 12:                                      // PINGREQ
+    s.conn->rx += mqttPacket(0xD0, "");
+    break;
+  case 14:                                      // DISCONNECT
+    s.clean = true;
+    s.conn->hangup = true;
+    break;
+  }
+}
+
+void brokerStep() {
+// READS AND ANSWERS EACH CLIENT, CALLED EVERY LOOP PASS ---
+  if (!brokerOn || brokerOutage(silentFrom, silentTo)) {
+    return;
+  }
+  bool down = brokerOutage(downFrom, downTo);
+  for (size_t i = 0; i < brokerSessions.size(); ) {
+    BrokerSession &s = brokerSessions[i];
+    bool gone = !s.conn->open || s.conn->hangup || down;
+    if (!gone) {
+      brokerBytes += s.conn->tx.size();
+      if (!s.conn->tx.empty()) s.lastInUs = simClockUs;
+      s.in += s.conn->tx;
+      s.conn->tx.clear();
+      for (;;) {
+        size_t n = 0, head = 1, shift = 0;
+        while (head < s.in.size() && head < 5) {
+          n |= (size_t)((uint8_t)s.in[head] & 0x7F) << shift;
+          shift += 7;
+          if (!((uint8_t)s.in[head++] & 0x80)) break;
+        }
+        if (head < 2 || ((uint8_t)s.in[head - 1] & 0x80) || s.in.size() < head + n) break;
+        brokerPacket(s, s.in[0], s.in.substr(head, n));
+        s.in.erase(0, head + n);
+      }
+      if (s.keepAlive && simClockUs - s.lastInUs > s.keepAlive * 1500000ULL) {
+        gone = true;                            // Client went quiet past its keepalive
+      }
+    }
+    if (!gone) {
+      i++;
+      continue;
+    }
+    if (s.connected && !s.clean && !down && !s.willTopic.empty()) {
+      brokerPublish(s.willTopic, s.willMessage, s.willRetain);
+    }
+    s.conn->hangup = true;
+    brokerSessions.erase(brokerSessions.begin() + i);
+  }
+}
+
+void faultStep() {
+// STRIKES THE ARMED FAULT ONCE ZONE 0'S RELAY IS ON ---
+  if (simFault != SIM_FAULT_NONE && simFaultUs == ~0ULL && plants[0].relay && simClockUs >= simFaultFrom * 60e6) {
+    simFaultUs = simClockUs;
+    startsAtFault = relayStats[0].starts;
+    plantCatchUp();
+    plants[0].dead = simFault == SIM_FAULT_DEAD;
+  }
+}
+
+double faultOffSec() {
+// RETURNS SECONDS FROM THE FAULT STRIKING TO ZONE 0'S RELAY GOING OFF FOR GOOD, -1 IF IT IS ON ---
+  return plants[0].relay ? -1 : (relayStats[0].lastChangeUs - simFaultUs) / 1e6;
+}
+
+void commandStep() {
+// MOVES A ZONE'S SETPOINT BY MQTT EVERY SIM_COMMAND_MS, TIMING UNTIL ITS STATE SHOWS IT ---
+  if (!brokerOn) {
+    return;
+  }
+  for (size_t i = collectedSeen; i < collected.size(); i++) {
+    BrokerMessage &m = collected[i];
+    for (size_t k = 0; k < commandsPending.size(); k++) {
+      SimCommand &c = commandsPending[k];
+      size_t sp = m.payload.find("\"setPoint\":");
+      if (m.topic == c.topic && sp != std::string::npos && fabs(atof(m.payload.c_str() + sp + 11) - c.setPoint) < 0.005) {
+        commandLatencyMs.push_back((m.atUs - c.sentUs) / 1000.0);
+        commandsPending.erase(commandsPending.begin() + k);
+        break;
+      }
+    }
+  }
+  collectedSeen = collected.size();
+  if (simClockUs < nextCommandUs || brokerOutage(downFrom, downTo) || brokerOutage(silentFrom, silentTo)) {
+    return;
+  }
+  int zone = commandsSent % ZONES;
+  double setPoint = zones[zone].setPoint10 / 10.0 + ((commandsSent / ZONES) % 2 ? -0.5 : 0.5);
+  char value[16];
+  snprintf(value, sizeof(value), "%.1f", setPoint);
+  std::string base = std::string(mqtt.base) + "/" + std::to_string(zone);
+  if (brokerPublish(base + "/set/setpoint", value, false)) {
+    commandsPending.push_back({base + "/state", atof(value), simClockUs});
+    commandsDelivered++;                        // QoS 0, lost if the sketch isn't connected
+  }
+  if (commandsSent % 6 == 5) {
+    brokerPublish(base + "/set/setpoint", "warmer", false);   // Malformed, the sketch should ignore it
+  }
+  commandsSent++;
+  nextCommandUs += SIM_COMMAND_MS * 1000ULL;
+}
+
+// ORIGINAL HYSTERESIS ---------------------------------------------
+// The first sketch's thermoStat(), kept as the baseline the other control modes are compared
+// against: heat goes off anywhere above setpoint - hyst rather than holding inside the band,
+// cool is as now. It decides on the sketch's filtered avgTemp100 every thermoPeriod, and the
+// sketch runs in hyst with its relay writes ignored.
+
+struct OriginalState {
+  bool device = false;
+  bool lastSetting = false;
+  unsigned long shutDownTimer = 0;
+};
+
+OriginalState originalState[ZONES];
+unsigned long originalNext = 0;
+
+void originalStep() {
+// RUNS THE ORIGINAL THERMOSTAT ON EACH ZONE ONCE A thermoPeriod, THEN SETS ITS RELAY ---
+  if (millis() < originalNext) {
+    return;
+  }
+  originalNext = millis() + Config::thermoPeriod;
+  for (int i = 0; i < ZONES; i++) {
+    Zone &z = zones[i];
+    OriginalState &o = originalState[i];
+    int setPoint100 = z.setPoint10 * 10;
+    if (z.avgTemp100 >= Config::failSafe100) {
+      if (z.powerSet) {
+        if (z.heatMode == 0) {
+          o.device = z.avgTemp100 <= setPoint100 - z.hyst100;
+        } else if (z.avgTemp100 >= setPoint100 + z.hyst100 && millis() - o.shutDownTimer >= Config::powerWait) {
+          o.device = true;
+        } else if (z.avgTemp100 <= setPoint100) {
+          o.device = false;
+          if (o.lastSetting != o.device) {
+            o.shutDownTimer = millis();
+          }
+        }
+      } else {
+        o.device = false;
+        if (o.lastSetting != o.device) {
+          o.shutDownTimer = millis();
+        }
+      }
+      o.lastSetting = o.device;
+    } else {
+      o.device = false;
+    }
+    relayWrite(i, o.device);
+  }
+}
+
+// RUNNER --------------------------------------------------------
+
+struct ZoneResult {
+  double rmsError = 0;
+  double sensorRms = 0;                 // avgTemp against true room temp, noise and lag together
+  double minRoom = 1e9, maxRoom = -1e9;
+};
+
+struct RunResult {
+  unsigned long long loops = 0;
+  double wallSec = 0;
+  ZoneResult zone[ZONES];
+};
+
+RunResult simRun(double hours) {
+// CALLS loop() UNTIL VIRTUAL CLOCK PASSES hours, SAMPLING EACH ROOM'S ERROR EACH SECOND ---
+  RunResult r;
+  unsigned long long endUs = simClockUs + (unsigned long long)(hours * 3600e6);
+  unsigned long long nextSampleUs = simClockUs;
+  double sumSq[ZONES] = {0}, sensorSq[ZONES] = {0};
+  unsigned long samples = 0, sensorSamples = 0;
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+
+  while (simClockUs < endUs) {
+    pollState();
+    postRemote();
+    loop();
+    if (originalHyst) {
+      originalStep();
+    }
+    drainPeers();
+    loadStep();
+    brokerStep();
+    commandStep();
+    faultStep();
+    simAdvance(SIM_LOOP_COST_US);
+    r.loops++;
+    while (nextSampleUs <= simClockUs) {
+      plantCatchUp();
+      for (int i = 0; i < ZONES; i++) {
+        double room = plants[i].room;
+        ZoneResult &zr = r.zone[i];
+        double setPoint = simF(zones[i].setPoint10 / 10.0);
+        sumSq[i] += (room - setPoint) * (room - setPoint);
+        if (room < zr.minRoom) zr.minRoom = room;
+        if (room > zr.maxRoom) zr.maxRoom = room;
+        if (millis() >= 60000) {              // Filter has filled
+          double avgTemp = simF(zones[i].avgTemp100 / 100.0);
+          sensorSq[i] += (avgTemp - room) * (avgTemp - room);
+        }
+      }
+      samples++;
+      if (millis() >= 60000) {
+        sensorSamples++;
+      }
+      nextSampleUs += 1000000;
+    }
+  }
+  r.wallSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  for (int i = 0; i < ZONES; i++) {
+    r.zone[i].rmsError = samples ? sqrt(sumSq[i] / samples) : 0;
+    r.zone[i].sensorRms = sensorSamples ? sqrt(sensorSq[i] / sensorSamples) : 0;
+  }
+  return r;
+}
+
+void mqttSummary(double hours) {
+// SUMS UP WHAT THE COLLECTOR RECEIVED AND WHETHER REPORTS AND COMMANDS GOT THROUGH ---
+  unsigned long states = 0, reports = 0, late = 0, statuses = 0, commands = 0;
+  std::map<long, int> uptimes;
+  for (size_t i = 0; i < collected.size(); i++) {
+    const BrokerMessage &m = collected[i];
+    const std::string &t = m.topic;
+    if (t.size() > 6 && t.compare(t.size() - 6, 6, "/state") == 0) {
+      states++;
+    } else if (t.size() > 7 && t.compare(t.size() - 7, 7, "/report") == 0) {
+      long uptime = atol(m.payload.c_str() + m.payload.find(':') + 1);
+      reports += uptimes[uptime]++ == 0;
+      late += m.atUs / 1000000 > (unsigned long long)uptime + 2;
+    } else if (t.size() > 7 && t.compare(t.size() - 7, 7, "/status") == 0) {
+      statuses++;
+    } else {
+      commands++;
+    }
+  }
+  std::sort(commandLatencyMs.begin(), commandLatencyMs.end());
+  printf("mqtt session     %lu connects, %lu refused or timed out, %lu published, %lu dropped from queue\n",
+         mqtt.connects, brokerRefusals, mqtt.published, mqtt.dropped);
+  printf("mqtt broker      %zu messages (%lu state, %lu report, %lu status, %lu command), %llu bytes from sketch\n",
+         collected.size(), states, reports, statuses, commands, brokerBytes);
+  printf("mqtt reports     %lu of %lu periods arrived, %lu late from the offline queue\n",
+         reports, (unsigned long)((hours * 3600000 - 1) / MQTT_REPORT), late);
+  printf("mqtt commands    %lu sent, %lu delivered, %zu shown in state", commandsSent, commandsDelivered,
+         commandLatencyMs.size());
+  if (!commandLatencyMs.empty()) {
+    printf(" (p50 %.0f ms, max %.0f ms)", commandLatencyMs[commandLatencyMs.size() / 2], commandLatencyMs.back());
+  }
+  printf(", sketch applied %lu and rejected %lu\n", mqtt.commands, mqtt.rejected);
+}
+
+std::string alarmText(const Zone &z, unsigned long long fromUs) {
+// RETURNS EACH ALARM RAISED SINCE fromUs WITH WHEN, IN MINUTES OR SECONDS AFTER fromUs ---
+  std::string s;
+  char part[48];
+  for (int k = 0; k < FAULT_KINDS; k++) {
+    if (z.alarmCount[k] && z.alarmAt[k] * 1000ULL >= fromUs) {
+      if (fromUs) {
+        snprintf(part, sizeof(part), "%s%s +%.1f s", s.empty() ? "" : ", ", faultNames[k], z.alarmAt[k] / 1e3 - fromUs / 1e6);
+      } else {
+        snprintf(part, sizeof(part), "%s%s at %.1f min", s.empty() ? "" : ", ", faultNames[k], z.alarmAt[k] / 60e3);
+      }
+      s += part;
+    }
+  }
+  return s.empty() ? "none" : s;
+}
+
+unsigned long flashErases() {
+// SECTOR ERASES SO FAR, OVER EVERY SECTOR ---
+  unsigned long n = 0;
+  for (size_t i = 0; i < sizeof(ESP.flashErases) / sizeof(ESP.flashErases[0]); i++) {
+    n += ESP.flashErases[i];
+  }
+  return n;
+}
+
+void simReport(const RunResult &r, double hours) {
+  printf("simulated        %.1f h in %.3f s (%.0fx real time, %llu loop passes)\n",
+         hours, r.wallSec, hours * 3600 / r.wallSec, r.loops);
+  for (int i = 0; i < ZONES; i++) {
+    const RelayStats &rs = relayStats[i];
+    const ZoneResult &zr = r.zone[i];
+    if (ZONES > 1) {
+      printf("zone %d           %s, %s sensor\n", i, zoneConfig[i].name,
+             zoneConfig[i].source == SRC_ADC ? "adc" : zoneConfig[i].source == SRC_ONEWIRE ? "onewire" : "remote");
+    }
+    printf("duty cycle       %.1f %%\n", 100.0 * rs.onUs / (hours * 3600e6));
+    printf("relay switches   %lu (%lu starts)\n", rs.switches, rs.starts);
+    if (rs.minOnUs != ~0ULL) printf("shortest on      %.1f s\n", rs.minOnUs / 1e6);
+    if (rs.minOffUs != ~0ULL) printf("shortest off     %.1f s\n", rs.minOffUs / 1e6);
+    printf("quick restarts   %lu (off < powerWait before start)\n", rs.quickRestarts);
+    printf("room error rms   %.2f F (range %.2f - %.2f F, setpoint %.2f F)\n",
+           zr.rmsError, zr.minRoom, zr.maxRoom, simF(zones[i].setPoint10 / 10.0));
+    printf("sensor error rms %.3f F (avgTemp against room)\n", zr.sensorRms);
+    printf("alarms           %s\n", alarmText(zones[i], 0).c_str());
+  }
+  if (simFaultUs != ~0ULL && faultOffSec() >= 0) {
+    printf("fault            %s struck zone 0 at %.1f min, relay off for good %.1f s later, %lu starts before that\n",
+           simFaultNames[simFault], simFaultUs / 60e6, faultOffSec(), relayStats[0].starts - startsAtFault);
+  } else if (simFaultUs != ~0ULL) {
+    printf("fault            %s struck zone 0 at %.1f min, relay still on\n", simFaultNames[simFault], simFaultUs / 60e6);
+  }
+  printf("flash            %lu writes, %lu erases\n", ESP.flashWrites, flashErases());
+  printf("task budget      ");
+  for (int i = 0; i < TASK_COUNT; i++) {
+    printf("%s%s %.2f ms max", i ? ", " : "", tasks[i].name, tasks[i].maxMicros / 1000.0);
+  }
+  printf("\n");
+  if (polls) {
+    printf("state polls      %lu\n", polls);
+  }
+  if (!peers.empty()) {
+    printf("event stream     %lu events, %llu bytes to %zu subscribers\n", peerEvents, peerBytes, peers.size());
+  }
+  if (!loadClients.empty()) {
+    printf("http load        %zu clients, %lu requests:", loadClients.size(), loadSent);
+    for (std::map<int, unsigned long>::iterator it = loadStatus.begin(); it != loadStatus.end(); ++it) {
+      printf(" %lu x %d,", it->second, it->first);
+    }
+    printf(" %lu dropped\n", loadDropped);
+    for (int k = 0; k < 2; k++) {
+      std::vector<double> &lat = loadLatencyMs[k];
+      std::sort(lat.begin(), lat.end());
+      if (!lat.empty()) {
+        printf("http latency     p50 %.1f ms, p99 %.1f ms, max %.1f ms (%s)\n", lat[lat.size() / 2],
+               lat[lat.size() * 99 / 100], lat.back(), k ? "slow readers" : "other clients");
+      }
+    }
+    printf("http server      %lu requests, %lu busy, %lu timed out, %lu overruns\n",
+           server.requests, server.busy, server.timeouts, server.overruns);
+    printf("late task runs   ");
+    for (int i = 0; i < TASK_COUNT; i++) {
+      printf("%s%s %lu", i ? ", " : "", tasks[i].name, tasks[i].late);
+    }
+    printf("\n");
+  }
+  if (brokerOn) {
+    mqttSummary(hours);
+  }
+}
+
+void benchRender(unsigned long n) {
+// TIMES REQUESTS FOR EACH PAGE ON ONE KEEP-ALIVE CONNECTION AND COUNTS HEAP ALLOCATIONS PER REQUEST ---
+  const char *pages[] = {"/", "/settings", "/writeEEPROM", "/static/style.css", "/static/app.js"};
+  std::shared_ptr<SimConn> c = simConnect(1 << 20);
+
+  printf("%-18s %10s %10s %12s %10s\n", "page", "bytes", "allocs", "alloc bytes", "us/render");
+  for (size_t p = 0; p < sizeof(pages) / sizeof(pages[0]); p++) {
+    std::string req = simRequestText(pages[p], HTTP_GET, true);
+    c->rx = req;
+    server.handleClient();                      // First request sizes the buffers
+    c->tx.clear();
+    unsigned long long bytes = 0, calls0 = allocCalls, abytes0 = allocBytes;
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; i < n; i++) {
+      c->rx.append(req);
+      server.handleClient();
+      bytes += c->tx.size();
+      c->tx.clear();
+    }
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+    printf("%-18s %10llu %10.1f %12.1f %10.3f\n", pages[p], bytes / n,
+           (double)(allocCalls - calls0) / n, (double)(allocBytes - abytes0) / n, us / n);
+  }
+}
+
+// SAMPLE PATH BENCHMARK -----------------------------------------
+// --bench-sample N times the sketch's sample, filter and compare path (TMP36 counts to
+// hundredths, mean filter, calibration, hysteresis) against the float code it replaced, on
+// the same burst sums. The host has an FPU and a divide instruction, so its timings say
+// nothing about the ESP8266, where each float operation and each integer divide is a libgcc
+// call. For the board, the calls each path makes are counted and priced with the costs
+// below. Those are assumed, not measured: ESP.getCycleCount() around each path on a board is
+// what would settle it.
+
+#define CALL_FADD 50                    // Cycles assumed for a float add or subtract
+#define CALL_FMUL 70                    // Float multiply
+#define CALL_FDIV 200                   // Float divide
+#define CALL_FCMP 20                    // Float compare
+#define CALL_FCONV 30                   // Integer to float
+#define CALL_IDIV 50                    // Integer divide
+
+enum { OP_ADD, OP_MUL, OP_DIV, OP_CMP, OP_CONV, OP_IDIV, OP_KINDS };
+const int opCycles[OP_KINDS] = {CALL_FADD, CALL_FMUL, CALL_FDIV, CALL_FCMP, CALL_FCONV, CALL_IDIV};
+
+struct CountedFloat {                   // float that counts its arithmetic, compares and conversions by kind
+  float v;
+  static unsigned long long ops[OP_KINDS];
+  CountedFloat(float x = 0) : v(x) {}
+  explicit CountedFloat(long x) : v(x) { ops[OP_CONV]++; }
+  friend CountedFloat operator+(CountedFloat a, CountedFloat b) { ops[OP_ADD]++; return a.v + b.v; }
+  friend CountedFloat operator-(CountedFloat a, CountedFloat b) { ops[OP_ADD]++; return a.v - b.v; }
+  friend CountedFloat operator*(CountedFloat a, CountedFloat b) { ops[OP_MUL]++; return a.v * b.v; }
+  friend CountedFloat operator/(CountedFloat a, CountedFloat b) { ops[OP_DIV]++; return a.v / b.v; }
+  friend bool operator<=(CountedFloat a, CountedFloat b) { ops[OP_CMP]++; return a.v <= b.v; }
+  friend bool operator>=(CountedFloat a, CountedFloat b) { ops[OP_CMP]++; return a.v >= b.v; }
+  CountedFloat &operator+=(CountedFloat b) { ops[OP_ADD]++; v += b.v; return *this; }
+  CountedFloat &operator-=(CountedFloat b) { ops[OP_ADD]++; v -= b.v; return *this; }
+};
+
+unsigned long long CountedFloat::ops[OP_KINDS] = {};
+
+void sampleCallsRow(const char *name, const double *perSample) {
+// PRINTS LIBGCC CALLS PER SAMPLE BY KIND AND THE CYCLES THEY ARE ASSUMED TO COST ---
+  double cycles = 0;
+  printf("%-16s", name);
+  for (int k = 0; k < OP_KINDS; k++) {
+    printf(" %7.1f", perSample[k]);
+    cycles += perSample[k] * opCycles[k];
+  }
+  printf(" %12.0f\n", cycles);
+}
+
+template <typename T> struct FloatPath {
+  T ring[Config::windowMax];
+  T sum = T(0.0f);
+  int ctr = 0, count = 0;
+  bool device = 0;
+  T avg;
+
+  bool sample(long counts, T setPoint, T hyst, T gain, T offset) {
+  // getVoltage(), readZone(), filterTemp() (mean) and thermoZone() (heat) as they were ---
+    T volts = T(counts) * T(0.00302734375f) / T((float)Config::adcKept);
+    T degrees = (volts - T(0.5f)) * T(100.0f);
+    if (TEMP_UNIT == UNIT_F) {
+      degrees = degrees * T(1.8f) + T(32.0f);
+    }
+    bool full = count == Config::window;
+    if (full) {
+      sum -= ring[ctr];
+    } else {
+      count++;
+    }
+    ring[ctr] = degrees;
+    sum += degrees;
+    if (++ctr >= Config::window) {
+      ctr = 0;
+      sum = T(0.0f);                    // Resum once per lap so float rounding can't build up
+      for (int i = 0; i < count; i++) sum += ring[i];
+    }
+    avg = sum / T((long)count) * gain + offset;
+    if (avg <= setPoint - hyst) {
+      device = 1;
+    } else if (avg >= setPoint) {
+      device = 0;
+    }
+    return device;
+  }
+};
+
+unsigned long long benchTicks() {
+// RETURNS HOST CYCLE COUNTER (TSC), 0 WHERE THERE IS NONE ---
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+void benchSample(unsigned long n, double sp) {
+// RUNS n BURSTS THROUGH BOTH PATHS, REPORTING HOST TIME, CALLS ON THE BOARD AND AGREEMENT ---
+  std::vector<long> sums(n);
+  std::vector<int> fixedAvg(n);
+  std::vector<float> floatAvg(n);
+  std::vector<char> fixedOn(n), floatOn(n);
+  double room = sp - 0.3;
+
+  for (unsigned long i = 0; i < n; i++) {
+    room += simGauss() * 0.004 + (room < sp - 0.3 ? 0.002 : room > sp + 0.3 ? -0.002 : 0);
+    double counts = ((room - 32) * 5 / 9 / 100 + 0.5) / 0.00302734375;
+    sums[i] = lround(counts * Config::adcKept + simGauss() * 4);
+  }
+
+  static Zone z;
+  z.setPoint10 = lround(simUnit(sp) * 10);
+  z.calOffset100 = 12;
+  z.calGain10000 = 10050;
+  z.powerSet = 1;
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  unsigned long long c0 = benchTicks();
+  for (unsigned long i = 0; i < n; i++) {
+    z.rawTemp100 = filterTemp(z, Config::adcHundredths(sums[i]));
+    z.avgTemp100 = calibrated(z);
+    z.device = hystDecide(z);
+    fixedAvg[i] = z.avgTemp100;
+    fixedOn[i] = z.device;
+  }
+  unsigned long long fixedCycles = benchTicks() - c0;
+  double fixedNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+
+  float setPoint = z.setPoint10 / 10.0f, hyst = z.hyst100 / 100.0f;
+  float gain = z.calGain10000 / 10000.0f, offset = z.calOffset100 / 100.0f;
+  static FloatPath<float> fp;
+  t0 = std::chrono::steady_clock::now();
+  c0 = benchTicks();
+  for (unsigned long i = 0; i < n; i++) {
+    floatOn[i] = fp.sample(sums[i], setPoint, hyst, gain, offset);
+    floatAvg[i] = fp.avg;
+  }
+  unsigned long long floatCycles = benchTicks() - c0;
+  double floatNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+
+  static FloatPath<CountedFloat> cp;
+  for (unsigned long i = 0; i < n; i++) {
+    cp.sample(sums[i], setPoint, hyst, gain, offset);
+  }
+
+  double worst = 0;
+  unsigned long differ = 0;
+  for (unsigned long i = 0; i < n; i++) {
+    worst = std::max(worst, fabs(fixedAvg[i] / 100.0 - floatAvg[i]));
+    differ += fixedOn[i] != floatOn[i];
+  }
+  double floatCalls[OP_KINDS];
+  double fixedCalls[OP_KINDS] = {0, 0, 0, 0, 0, 3};   // adcHundredths(), filterTemp() and calibrated() divide once each
+  for (int k = 0; k < OP_KINDS; k++) {
+    floatCalls[k] = (double)CountedFloat::ops[k] / n;
+  }
+  printf("sample path      %lu samples, mean of %d, heat at %.2f %c\n", n, Config::window, setPoint, Config::symbol);
+  printf("measured on this host, which has an FPU and a divider:\n");
+  printf("%-16s %10s %14s\n", "", "ns/sample", "cycles/sample");
+  printf("%-16s %10.2f %14.1f\n", "float (before)", floatNs / n, (double)floatCycles / n);
+  printf("%-16s %10.2f %14.1f\n", "fixed (now)", fixedNs / n, (double)fixedCycles / n);
+  printf("libgcc calls per sample on the ESP8266, and their cost at the assumed cycles per call:\n");
+  printf("%-16s %7s %7s %7s %7s %7s %7s %12s\n", "", "fadd", "fmul", "fdiv", "fcmp", "fconv", "idiv", "model cycles");
+  sampleCallsRow("float (before)", floatCalls);
+  sampleCallsRow("fixed (now)", fixedCalls);
+  printf("assumed cycles   fadd %d, fmul %d, fdiv %d, fcmp %d, fconv %d, idiv %d; not measured on a board\n",
+         CALL_FADD, CALL_FMUL, CALL_FDIV, CALL_FCMP, CALL_FCONV, CALL_IDIV);
+  printf("agreement        avgTemp within %.3f %c of the float path, %lu of %lu decisions differ\n",
+         worst, Config::symbol, differ, n);
+}
+
+void bootRow(const char *name) {
+// RUNS FROM POWER-ON UNTIL EVERY ZONE HAS BEEN DECIDED AND WI-FI HAS JOINED, OR 10 MINUTES ---
+  int on = -1;
+
+  setup();
+  while (simClockUs < 600000000ULL && !(bootDecided && net.upAt)) {
+    loop();
+    simAdvance(SIM_LOOP_COST_US);
+    if (bootDecided && on < 0) {
+      on = 0;
+      for (int i = 0; i < ZONES; i++) on += zones[i].device;
+    }
+  }
+  const char *paths[] = {"fast", "full", "portal"};
+  printf("%-14s %10.3f %7d/%d %9.3f %-7s %6lu %8lu\n", name, bootDecisionMs / 1000.0, on, ZONES,
+         net.upAt / 1000.0, net.upAt ? paths[net.upPath] : "-", simJoins, portal.opened);
+  fflush(stdout);
+}
+
+void benchBoot(bool cool) {
+// BOOTS THE SKETCH FOUR WAYS, EACH IN ITS OWN PROCESS, TIMING FIRST CONTROL AND FIRST JOIN ---
+// The first boot is from blank flash. Its settings are then set and saved as a user would,
+// and the flash it leaves, with its join cached, is what the other three boot from.
+  static uint8_t image[sizeof(ESP.flash)];
+  int fds[2];
+
+  printf("%-14s %10s %9s %9s %-7s %6s %8s\n", "boot", "control s", "relays", "wifi s", "joined", "joins", "portals");
+  fflush(stdout);
+  if (pipe(fds) != 0) {
+    return;
+  }
+  if (fork() == 0) {
+    bootRow("first boot");
+    for (int i = 0; i < ZONES; i++) {
+      std::string zq = "?zone=" + std::to_string(i);
+      simCall(("/powerOn" + zq).c_str());
+      simCall(((cool ? "/modeCold" : "/modeHeat") + zq).c_str());
+    }
+    simCall("/writeEEPROM");
+    for (int i = 0; i < 100; i++) {
+      loop();
+      simAdvance(SIM_LOOP_COST_US);
+    }
+    if (write(fds[1], ESP.flash, sizeof(ESP.flash)) != (ssize_t)sizeof(ESP.flash)) _exit(1);
+    _exit(0);
+  }
+  size_t got = 0;
+  ssize_t n;
+  while (got < sizeof(image) && (n = read(fds[0], image + got, sizeof(image) - got)) > 0) {
+    got += n;
+  }
+  int status;
+  wait(&status);
+  if (got < sizeof(image)) {
+    return;
+  }
+
+  struct { const char *name; bool moved; double down; } warm[] = {
+    {"warm boot", false, -1}, {"ap moved", true, -1}, {"ap down 1 min", false, 1},
+  };
+  for (int k = 0; k < 3; k++) {
+    if (fork() == 0) {
+      memcpy(ESP.flash, image, sizeof(image));
+      apMoved = warm[k].moved;
+      apDownFrom = 0;
+      apDownTo = warm[k].down;
+      bootRow(warm[k].name);
+      _exit(0);
+    }
+    wait(&status);
+  }
+}
+
+void commandRow(const char *name, int n, const char *target, unsigned long gapMs, bool redirect) {
+// SENDS target n TIMES gapMs APART (%d IS THE REQUEST'S INDEX), THEN PRINTS WHAT IT COST AND CHANGED ---
+// A redirect is followed as a browser would, with a GET of the main page
+  std::map<int, int> statuses;
+  char uri[128];
+
+  setup();
+  simCall("/powerOn");
+  simCall("/modeHeat");
+  simCall("/api/setpoint?value=72", HTTP_POST);
+  for (unsigned long long end = simClockUs + 60000000ULL; simClockUs < end; ) {
+    loop();
+    drainPeers();
+    simAdvance(SIM_LOOP_COST_US);
+  }
+
+  unsigned long versions = stateVersion, writes = ESP.flashWrites;
+  unsigned long long bytes = simCallBytes;
+  for (int i = 0; i < n; i++) {
+    snprintf(uri, sizeof(uri), target, i);
+    statuses[simCall(uri, redirect ? HTTP_GET : HTTP_POST)]++;
+    if (redirect) {
+      simCall("/");
+    }
+    for (unsigned long long end = simClockUs + gapMs * 1000ULL; simClockUs < end; ) {
+      loop();
+      drainPeers();
+      simAdvance(SIM_LOOP_COST_US);
+    }
+  }
+  for (unsigned long long end = simClockUs + 60000000ULL; simClockUs < end; ) {
+    loop();
+    drainPeers();
+    simAdvance(SIM_LOOP_COST_US);
+  }
+  std::string codes;
+  for (std::map<int, int>::iterator it = statuses.begin(); it != statuses.end(); ++it) {
+    codes += (codes.empty() ? "" : " ") + std::to_string(it->second) + "x" + std::to_string(it->first);
+  }
+  printf("%-34s %9d %7llu %-13s %8lu %8lu %9.1f\n", name, n * (redirect ? 2 : 1), simCallBytes - bytes, codes.c_str(),
+         stateVersion - versions, ESP.flashWrites - writes, simF(zones[0].setPoint10 / 10.0));
+  fflush(stdout);
+}
+
+void benchCommand() {
+// MOVES THE SETPOINT FROM 72 TO 75 F EACH WAY THERE IS, EACH IN ITS OWN PROCESS ---
+// Counts requests, response bytes, state versions and flash writes over the following minute.
+  struct { const char *name; int n; const char *target; unsigned long gapMs; bool redirect; } rows[] = {
+    {"30 taps of /addDegree, 150 ms", 30, "/addDegree", 150, true},
+    {"30 x /api/setpoint delta, 150 ms", 30, "/api/setpoint?delta=0.1", 150, false},
+    {"30 x /api/command delta, 150 ms", 30, "/api/command?delta=0.1&seq=%d", 150, false},
+    {"1 x /api/command delta=3", 1, "/api/command?delta=3&seq=%d", 0, false},
+    {"same command sent 3 times", 3, "/api/command?delta=3&seq=7", 0, false},
+    {"30 x /api/command delta, 10 ms", 30, "/api/command?delta=0.1&seq=%d", 10, false},
+  };
+
+  printf("%-34s %9s %7s %-13s %8s %8s %9s\n", "setpoint 72 to 75", "requests", "bytes", "status",
+         "versions", "flash wr", "final F");
+  fflush(stdout);
+  for (size_t k = 0; k < sizeof(rows) / sizeof(rows[0]); k++) {
+    if (fork() == 0) {
+      commandRow(rows[k].name, rows[k].n, rows[k].target, rows[k].gapMs, rows[k].redirect);
+      _exit(0);
+    }
+    int status;
+    wait(&status);
+  }
+}
+
+void benchControl(int argc, char **argv) {
+// RUNS EACH CONTROL MODE HEATING AND COOLING IN ITS OWN PROCESS, ONE SUMMARY ROW EACH ---
+// Forking keeps every run starting from the sketch's power-on state; --hours and the other
+// options go through to each run with the rest of the command line.
+  const char *modes[] = {"original", "hyst", "pid", "predict"};
+  const char *plants[] = {"heat", "cool"};
+
+  printf("%-8s %-5s %9s %7s %9s %9s %9s %8s\n",
+         "control", "mode", "switches", "duty %", "rms F", "min F", "max F", "wall s");
+  fflush(stdout);
+  for (int p = 0; p < 2; p++) {
+    for (int m = 0; m < 4; m++) {
+      if (fork() == 0) {
+        std::vector<char *> args(argv, argv + argc);
+        std::vector<std::string> extra = {"--mode", plants[p], "--control", modes[m], "--row"};
+        for (size_t i = 0; i < extra.size(); i++) args.push_back((char *)extra[i].c_str());
+        args.push_back(nullptr);
+        execv("/proc/self/exe", args.data());
+        _exit(127);
+      }
+      int status;
+      wait(&status);
+    }
+  }
+}
+
+void benchFaults(int argc, char **argv) {
+// BREAKS ZONE 0 EACH WAY --fault CAN, HEATING AND COOLING, IN ITS OWN PROCESS, ONE ROW EACH ---
+// Each runs 3 hours with the fault armed from minute 60, and says what was raised, how soon
+// the relay went off for good after the fault struck and how often it started before that
+  const char *plants[] = {"heat", "cool"};
+
+  printf("%-6s %-5s %9s %-30s %11s %7s %9s\n", "fault", "mode", "struck m", "alarms after fault", "relay off s",
+         "starts", "room F");
+  fflush(stdout);
+  for (int p = 0; p < 2; p++) {
+    for (int f = 0; f < SIM_FAULTS; f++) {
+      if (fork() == 0) {
+        std::vector<char *> args(argv, argv + argc);
+        std::string fault = std::string(simFaultNames[f]) + "@60";
+        std::vector<std::string> extra = {"--mode", plants[p], "--hours", "3", "--fault", fault, "--fault-row"};
+        for (size_t i = 0; i < extra.size(); i++) args.push_back((char *)extra[i].c_str());
+        args.push_back(nullptr);
+        execv("/proc/self/exe", args.data());
+        _exit(127);
+      }
+      int status;
+      wait(&status);
+    }
+  }
+}
+
+void faultRow(bool cool) {
+  bool struck = simFaultUs != ~0ULL;
+  char off[16] = "-", starts[16] = "-";
+  if (struck && faultOffSec() >= 0) {
+    snprintf(off, sizeof(off), "%.1f", faultOffSec());
+  }
+  if (struck) {
+    snprintf(starts, sizeof(starts), "%lu", relayStats[0].starts - startsAtFault);
+  }
+  printf("%-6s %-5s %9s %-30s %11s %7s %9.2f\n", simFaultNames[simFault], cool ? "cool" : "heat",
+         struck ? std::to_string(lround(simFaultUs / 60e6)).c_str() : "-",
+         struck ? alarmText(zones[0], simFaultUs).c_str() : alarmText(zones[0], 0).c_str(), off, starts, plants[0].room);
+  fflush(stdout);
+}
+
+void simRow(const RunResult &r, double hours, const char *control, bool cool) {
+  printf("%-8s %-5s %9lu %7.1f %9.3f %9.2f %9.2f %8.3f\n", control, cool ? "cool" : "heat",
+         relayStats[0].switches, 100.0 * relayStats[0].onUs / (hours * 3600e6), r.zone[0].rmsError,
+         r.zone[0].minRoom, r.zone[0].maxRoom, r.wallSec);
+}
+
+// TRACE REPLAY --------------------------------------------------
+// A trace from /api/trace is replayed through the sketch's own sample, thermostat and output
+// code. Its first keyframe sets every zone's state and the clock; from there each sample is
+// given to the sensor hooks at the time it was taken, and each thermostat run and setting
+// change is made when it was. The relay changes the replay makes are set against the ones
+// recorded, and each later keyframe against the state the replay has reached by then.
+
+struct TraceReader {
+  const std::string &d;
+  size_t at;
+  bool ok = true;                       // Nothing read past the end
+  TraceReader(const std::string &data, size_t from) : d(data), at(from) {}
+  uint8_t next() {
+    if (at >= d.size()) {
+      ok = false;
+      return 0;
+    }
+    return d[at++];
+  }
+  unsigned long get() {
+    unsigned long v = 0;
+    for (int shift = 0; ok && shift < 64; shift += 7) {
+      uint8_t b = next();
+      v |= (unsigned long)(b & 0x7F) << shift;
+      if (!(b & 0x80)) break;
+    }
+    return v;
+  }
+  long getSigned() {
+    unsigned long v = get();
+    return v & 1 ? ~(long)(v >> 1) : (long)(v >> 1);
+  }
+  uint32_t word() {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) v |= (uint32_t)next() << (8 * i);
+    return v;
+  }
+};
+
+struct ReplayResult {
+  std::string skipped;                  // Why the trace can't be replayed by this build, empty if it was
+  bool cut = false;                     // Trace ends part way through a record
+  unsigned long fromMs = 0, toMs = 0;   // Uptime of the first keyframe and the last record
+  unsigned long samples = 0, thermoRuns = 0, settings = 0;
+  unsigned long keys = 0, keysAlike = 0;   // Keyframes after the first, and those the replay agreed with
+  double wallSec = 0;
+  std::vector<std::pair<unsigned long, bool> > recorded[ZONES];   // Relay changes in the trace
+  unsigned long alike[ZONES] = {0};     // Recorded changes the replay made too, within outputPeriod
+  unsigned long differAt[ZONES] = {0};  // millis() of the first change one made and the other didn't, 0 if none
+  double errSq[ZONES] = {0};            // Sum of (avgTemp - setpoint)^2 in degrees, power on and in control
+  unsigned long errN[ZONES] = {0};
+  byte alarmsAtStart[ZONES] = {0};
+};
+
+void replayKeyZone(TraceReader &r, Zone &k, unsigned long now) {
+// READS ONE ZONE OF A KEYFRAME INTO k, IN THE ORDER traceKey() WRITES IT ---
+  k.setPoint10 = r.getSigned();
+  k.hyst100 = r.getSigned();
+  k.calOffset100 = r.getSigned();
+  k.calGain10000 = r.get();
+  unsigned long flags = r.get();
+  k.powerSet = flags & 1;
+  k.heatMode = flags >> 1 & 1;
+  k.device = flags >> 2 & 1;
+  k.lastDeviceState = flags >> 3 & 1;
+  k.deviceLastSetting = flags >> 4 & 1;
+  k.pidDone = flags >> 5 & 1;
+  k.effectRunning = flags >> 6 & 1;
+  k.ctrlMode = r.get();
+  k.alarms = r.get();
+  k.deviceChangedAt = now - r.get();
+  k.shutDownTimer = now - r.get();
+  int raw = r.getSigned();
+  int avg = r.getSigned();
+  setFilter(k, r.get());
+  int count = std::min(r.get(), (unsigned long)Config::windowMax);
+  long reading = 0;
+  for (int n = 0; n < count; n++) {
+    reading += r.getSigned();
+    filterTemp(k, reading);               // Rebuilds the sum and, for the median, the sorted copy
+  }
+  k.tempEma = r.getSigned();
+  k.rawTemp100 = raw;
+  k.avgTemp100 = avg;
+  k.remoteTemp100 = r.getSigned();
+  k.remoteAt = now - r.get();
+  uint32_t bits = r.word();
+  memcpy(&k.pidI, &bits, sizeof(bits));
+  k.pidLastTemp100 = r.getSigned();
+  unsigned long age = r.get();
+  k.pidLast = age ? now - age + 1 : 0;
+  k.pidWindowStart = now - r.get();
+  bits = r.word();
+  memcpy(&k.predictRate, &bits, sizeof(bits));
+  k.predictPrevTemp10 = r.getSigned();
+  k.predictPrevDuty = r.get();
+  k.histMinute = now / 60000 - r.get();
+  k.histTempSum = r.getSigned();
+  k.histSetPointSum = r.getSigned();
+  k.histOn = r.get();
+  k.histSamples = r.get();
+  k.faultLast100 = r.getSigned();
+  k.faultLastAt = now - r.get();
+  k.faultBad = r.get();
+  k.faultSame = r.get();
+  k.faultJumps = r.get();
+  k.faultJumpAt = now - r.get();
+  k.effectRef100 = r.getSigned();
+  k.effectAt = now - r.get();
+  k.faultStartCount = std::min(r.get(), (unsigned long)FAULT_CYCLES + 1);
+  for (int n = 0; n < k.faultStartCount; n++) {
+    k.faultStarts[n] = now - r.get();
+  }
+  k.faultStartNext = k.faultStartCount % (FAULT_CYCLES + 1);
+}
+
+bool replayAgrees(const Zone &k, const Zone &z) {
+// TRUE IF A LATER KEYFRAME'S ZONE k HOLDS WHAT THE REPLAY'S ZONE z DOES FOR CONTROL ---
+  return k.avgTemp100 == z.avgTemp100 && k.tempEma == z.tempEma && k.device == z.device &&
+         k.lastDeviceState == z.lastDeviceState && k.alarms == z.alarms && k.shutDownTimer == z.shutDownTimer &&
+         k.deviceChangedAt == z.deviceChangedAt && memcmp(&k.pidI, &z.pidI, sizeof(float)) == 0 &&
+         memcmp(&k.predictRate, &z.predictRate, sizeof(float)) == 0 && k.faultStartCount == z.faultStartCount;
+}
+
+void replayOutputs(unsigned long &due, unsigned long until) {
+// RUNS THE OUTPUT TASK AT EACH OF ITS DUE TIMES BEFORE until ---
+  while ((long)(until - due) > 0) {
+    simClockUs = due * 1000ULL;
+    sendOutput();
+    due += Config::outputPeriod;
+  }
+}
+
+void replayMatch(ReplayResult &r, int i) {
+// PAIRS RECORDED RELAY CHANGES WITH THE REPLAY'S IN ORDER, NOTING THE FIRST THAT HAS NO PARTNER ---
+  const std::vector<std::pair<unsigned long, bool> > &a = r.recorded[i], &b = replaySwitched[i];
+  size_t x = 0, y = 0;
+
+  while (x < a.size() && y < b.size()) {
+    unsigned long apart = a[x].first > b[y].first ? a[x].first - b[y].first : b[y].first - a[x].first;
+    if (a[x].second != b[y].second || apart > Config::outputPeriod) {
+      break;
+    }
+    r.alike[i]++;
+    x++;
+    y++;
+  }
+  if (x < a.size() || y < b.size()) {
+    r.differAt[i] = std::min(x < a.size() ? a[x].first : ~0UL, y < b.size() ? b[y].first : ~0UL);
+  }
+}
+
+ReplayResult replayTrace(const std::string &d) {
+// REPLAYS A TRACE FROM ITS FIRST KEYFRAME TO ITS END ---
+  ReplayResult r;
+  char why[64] = "";
+  const char *filters[] = {"mean", "median", "ema"};
+
+  if (d.size() < 6 + ZONES || d[0] != 'W' || d[1] != 'T' || d[2] != TRACE_VERSION) {
+    snprintf(why, sizeof(why), "not a version %d trace", TRACE_VERSION);
+  } else if (d[3] != ZONES) {
+    snprintf(why, sizeof(why), "recorded with %d zones, built with %d", d[3], ZONES);
+  } else if (d[4] != TEMP_UNIT) {
+    snprintf(why, sizeof(why), "recorded in %c", d[4] == UNIT_C ? 'C' : 'F');
+  } else if (d[5] != Config::filter) {
+    snprintf(why, sizeof(why), "recorded with the %s filter", d[5] < 3 ? filters[(int)d[5]] : "unknown");
+  } else if ((uint8_t)d[6 + ZONES] >> 5 != TRACE_KEY) {
+    snprintf(why, sizeof(why), "doesn't start with a keyframe");
+  }
+  for (int i = 0; i < ZONES && !why[0]; i++) {
+    if (d[6 + i] != zoneConfig[i].source) {
+      snprintf(why, sizeof(why), "zone %d read another kind of sensor", i);
+    }
+  }
+  if (why[0]) {
+    r.skipped = why;
+    return r;
+  }
+
+  setup();
+  replaying = true;
+  TraceReader rd(d, 6 + ZONES);
+  long prev[ZONES] = {0};
+  unsigned long sampleAt[ZONES] = {0};
+  unsigned long at = 0, outputDue = 0;
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+
+  while (rd.at < d.size()) {
+    uint8_t head = rd.next();
+    int kind = head >> 5, arg = head >> 3 & 3, i = head & 7;
+    unsigned long t;
+
+    if (kind == TRACE_KEY) {
+      size_t len = rd.next();
+      len |= rd.next() << 8;
+      size_t end = rd.at + len;
+      if (end > d.size()) {
+        r.cut = true;
+        break;
+      }
+      t = rd.word();
+      long phase = rd.getSigned();
+      if (r.fromMs) {
+        replayOutputs(outputDue, t);
+      }
+      simClockUs = t * 1000ULL;
+      bool alike = true;
+      for (int z = 0; z < ZONES; z++) {
+        Zone k = zones[z];
+        replayKeyZone(rd, k, t);
+        if (!r.fromMs) {
+          zones[z] = k;                         // The replay starts from here
+          plants[z].relay = k.lastDeviceState;
+          r.alarmsAtStart[z] = k.alarms;
+        } else {
+          alike = alike && replayAgrees(k, zones[z]);
+        }
+        prev[z] = 0;
+        sampleAt[z] = t;
+      }
+      if (!r.fromMs) {
+        r.fromMs = t;
+        outputDue = t + phase;
+        sampledAll = 1;
+      } else {
+        r.keys++;
+        r.keysAlike += alike;
+      }
+      rd.at = end;
+      at = t;
+      continue;
+    }
+    if (i >= ZONES) {
+      r.cut = true;
+      break;
+    }
+    long v = 0, w = 0;
+    if (kind == TRACE_SAMPLE) {
+      t = sampleAt[i] + Config::samplePeriod + rd.getSigned();
+      v = prev[i] + rd.getSigned();
+    } else {
+      t = at + rd.get();
+      if (traceFields[kind] > 1) v = kind == TRACE_MODES ? (long)rd.get() : rd.getSigned();
+      if (traceFields[kind] > 2) w = rd.get();
+    }
+    if (!rd.ok) {
+      r.cut = true;
+      break;
+    }
+    replayOutputs(outputDue, t);
+    simClockUs = t * 1000ULL;
+    at = t;
+    Zone &z = zones[i];
+
+    if (kind == TRACE_SAMPLE) {
+      prev[i] = v;
+      sampleAt[i] = t;
+      replayRaw = v;
+      sampleZone = i;
+      radioAt = t - ADC_QUIET;                  // The sketch waited out anything in the way before reading
+      oneWireAt = t - Config::oneWireConvert;
+      if (zoneConfig[i].source == SRC_REMOTE) {
+        z.remoteTemp100 = v == NO_READING ? z.remoteTemp100 : v;
+        z.remoteAt = v == NO_READING ? t - REMOTE_STALE - 1 : t;
+      }
+      getTemp();
+      r.samples++;
+      if (z.powerSet && !(z.alarms & FAULT_OFF) && z.avgTemp100 >= Config::faultMin100 && z.avgTemp100 <= Config::faultMax100) {
+        double err = (z.avgTemp100 - z.setPoint10 * 10) / 100.0;
+        r.errSq[i] += err * err;
+        r.errN[i]++;
+      }
+    } else if (kind == TRACE_THERMO) {
+      thermoStat();
+      r.thermoRuns++;
+    } else if (kind == TRACE_OUTPUT) {
+      r.recorded[i].push_back(std::make_pair(t, arg != 0));
+    } else if (kind == TRACE_SETPOINT) {
+      z.setPoint10 = v;
+      r.settings++;
+    } else if (kind == TRACE_MODES) {
+      z.powerSet = arg & 1;
+      z.heatMode = arg >> 1 & 1;
+      if (z.ctrlMode != v) {
+        changeControl(z, v);
+      }
+      r.settings++;
+    } else if (kind == TRACE_CALIB) {
+      z.calOffset100 = v;
+      z.calGain10000 = w;
+      r.settings++;
+    } else if (kind == TRACE_CLEAR) {
+      faultClear(i);
+    }
+  }
+  replayOutputs(outputDue, at + 1);
+  r.wallSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  r.toMs = at;
+  replaying = false;
+  for (int i = 0; i < ZONES; i++) {
+    replayMatch(r, i);
+  }
+  return r;
+}
+
+bool replayFaithful(const ReplayResult &r) {
+// TRUE IF THE REPLAY MADE EVERY RELAY CHANGE RECORDED, NO OTHERS, AND AGREED WITH EVERY KEYFRAME ---
+  bool same = r.skipped.empty() && r.keysAlike == r.keys;
+  for (int i = 0; i < ZONES; i++) {
+    same = same && r.differAt[i] == 0;
+  }
+  return same;
+}
+
+bool readFile(const char *path, std::string *d) {
+  FILE *f = fopen(path, "rb");
+  char buf[4096];
+  size_t n;
+
+  if (!f) {
+    return false;
+  }
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    d->append(buf, n);
+  }
+  fclose(f);
+  return true;
+}
+
+void replayReport(const char *path, const ReplayResult &r) {
+  if (!r.skipped.empty()) {
+    printf("trace            %s: %s, not replayed\n", path, r.skipped.c_str());
+    return;
+  }
+  printf("trace            %s, %.1f min from uptime %.1f min%s\n", path, (r.toMs - r.fromMs) / 60e3,
+         r.fromMs / 60e3, r.cut ? ", last record cut short" : "");
+  printf("replayed         %lu samples, %lu thermostat runs, %lu setting changes in %.2f ms (%.0f samples/s)\n",
+         r.samples, r.thermoRuns, r.settings, r.wallSec * 1e3, r.samples / r.wallSec);
+  for (int i = 0; i < ZONES; i++) {
+    if (ZONES > 1) {
+      printf("zone %d           %s\n", i, zoneConfig[i].name);
+    }
+    printf("relay changes    %zu recorded, %zu replayed, %lu alike within %lu ms", r.recorded[i].size(),
+           replaySwitched[i].size(), r.alike[i], Config::outputPeriod);
+    if (r.differAt[i]) {
+      printf(", first differs at %.1f min", r.differAt[i] / 60e3);
+    }
+    printf("\n");
+    printf("setpoint error   rms %.2f %c over %lu samples in control\n",
+           r.errN[i] ? sqrt(r.errSq[i] / r.errN[i]) : 0.0, Config::symbol, r.errN[i]);
+    std::string latched;
+    for (int k = 0; k < FAULT_KINDS; k++) {
+      if (r.alarmsAtStart[i] & 1 << k) {
+        latched += (latched.empty() ? "" : ", ") + std::string(faultNames[k]);
+      }
+    }
+    printf("alarms           %s raised in replay, %s latched at start\n", alarmText(zones[i], 0).c_str(),
+           latched.empty() ? "none" : latched.c_str());
+  }
+  printf("keyframes        %lu of %lu after the first agree with the replay\n", r.keysAlike, r.keys);
+  printf("verdict          %s\n", replayFaithful(r) ? "replays as recorded" : "replay differs from the recording");
+}
+
+void replayRow(const char *path) {
+  std::string d;
+  const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+
+  if (!readFile(path, &d)) {
+    printf("%-18s can't be read\n", name);
+    fflush(stdout);
+    _exit(1);
+  }
+  ReplayResult r = replayTrace(d);
+  if (!r.skipped.empty()) {
+    printf("%-18s %s\n", name, r.skipped.c_str());
+    fflush(stdout);
+    _exit(2);
+  }
+  size_t recorded = 0, replayed = 0;
+  unsigned long alike = 0;
+  std::string alarms;
+  for (int i = 0; i < ZONES; i++) {
+    recorded += r.recorded[i].size();
+    replayed += replaySwitched[i].size();
+    alike += r.alike[i];
+    for (int k = 0; k < FAULT_KINDS; k++) {
+      if (zones[i].alarmCount[k] && alarms.find(faultNames[k]) == std::string::npos) {
+        alarms += (alarms.empty() ? "" : ",") + std::string(faultNames[k]);
+      }
+    }
+  }
+  char changes[32], keys[16];
+  snprintf(changes, sizeof(changes), "%zu/%zu/%lu", recorded, replayed, alike);
+  snprintf(keys, sizeof(keys), "%lu/%lu", r.keysAlike, r.keys);
+  printf("%-18s %6zu %7.1f %8lu %11.0f %-14s %6s %-10s %s\n", name, d.size(), (r.toMs - r.fromMs) / 60e3,
+         r.samples, r.samples / r.wallSec, changes, keys, alarms.empty() ? "none" : alarms.c_str(),
+         replayFaithful(r) ? "yes" : "no");
+  fflush(stdout);
+  _exit(replayFaithful(r) ? 0 : 1);
+}
+
+void benchReplay(const char *dir) {
+// REPLAYS EACH .wtt TRACE IN dir IN ITS OWN PROCESS, ONE ROW EACH, AND COUNTS THOSE THAT MATCH ---
+// Traces built for another zone count or unit are listed but left out of the count
+  std::vector<std::string> paths;
+  DIR *dp = opendir(dir);
+  int replayed = 0, same = 0;
+
+  if (!dp) {
+    fprintf(stderr, "%s: can't open\n", dir);
+    exit(2);
+  }
+  while (struct dirent *e = readdir(dp)) {
+    std::string n = e->d_name;
+    if (n.size() > 4 && n.compare(n.size() - 4, 4, ".wtt") == 0) {
+      paths.push_back(std::string(dir) + "/" + n);
+    }
+  }
+  closedir(dp);
+  std::sort(paths.begin(), paths.end());
+
+  printf("%-18s %6s %7s %8s %11s %-14s %6s %-10s %s\n", "trace", "bytes", "min", "samples", "samples/s",
+         "rec/rep/alike", "keys", "alarms", "same");
+  fflush(stdout);
+  for (size_t i = 0; i < paths.size(); i++) {
+    if (fork() == 0) {
+      replayRow(paths[i].c_str());
+    }
+    int status;
+    wait(&status);
+    if (WIFEXITED(status) && WEXITSTATUS(status) != 2) {
+      replayed++;
+      same += WEXITSTATUS(status) == 0;
+    }
+  }
+  printf("%d of %d traces replay as recorded\n", same, replayed);
+}
+
+// CHECKS --------------------------------------------------------
+// --check runs each case in its own process from power-on and prints one row each: what it
+// should give and what it gave. It exits non-zero if any case fails.
+
+Zone checkBefore;                       // Zone 0 as it was before the case's request
+int checkTz = 0;                        // clockTz before it
+unsigned long checkWrites = 0;          // Flash writes before it
+
+bool calibrationKept() {
+// TRUE IF ZONE 0'S CALIBRATION IS WHAT IT WAS AND NOTHING WAS SAVED ---
+  return zones[0].calGain10000 == checkBefore.calGain10000 && zones[0].calOffset100 == checkBefore.calOffset100 &&
+         ESP.flashWrites == checkWrites;
+}
+
+bool tzKept() {
+// TRUE IF THE TIME ZONE IS WHAT IT WAS AND NOTHING WAS SAVED ---
+  return clockTz == checkTz && ESP.flashWrites == checkWrites;
+}
+
+struct CheckRequest {
+  HTTPMethod method;
+  const char *target;
+  int status;                           // Status it should get
+  bool (*kept)();                       // What must be left alone, nullptr for nothing
+};
+
+const CheckRequest checkRequests[] = {
+  {HTTP_POST, "/api/calibrate?zone=0&gain=nan&offset=0", 422, calibrationKept},
+  {HTTP_POST, "/api/calibrate?zone=0&gain=inf", 422, calibrationKept},
+  {HTTP_POST, "/api/calibrate?zone=0&gain=-inf", 422, calibrationKept},
+  {HTTP_POST, "/api/calibrate?zone=0&offset=nan", 422, calibrationKept},
+  {HTTP_POST, "/api/calibrate?zone=0&offset=inf", 422, calibrationKept},
+  {HTTP_POST, "/api/calibrate?zone=0&gain=2.5", 422, calibrationKept},
+  {HTTP_POST, "/api/calibrate?zone=0&gain=abc", 400, calibrationKept},
+  {HTTP_POST, "/api/calibrate?zone=0&actual=nan", 400, calibrationKept},
+  {HTTP_POST, "/api/calibrate?zone=0&gain=1.01&offset=-0.5", 200, nullptr},
+  {HTTP_POST, "/api/time?epoch=1704067200&tz=nan", 400, tzKept},
+  {HTTP_POST, "/api/time?epoch=1704067200&tz=inf", 400, tzKept},
+  {HTTP_POST, "/api/time?epoch=1704067200&tz=-inf", 400, tzKept},
+  {HTTP_POST, "/api/time?epoch=1704067200&tz=60", 200, nullptr},
+};
+
+std::string checkWeeklyOverride() {
+// ONE RULE A WEEK: IT APPLIES, A CHANGE BY HAND HOLDS ALL WEEK, THEN IT APPLIES AGAIN ---
+// Gives the setpoint after the first event, just before the next one and just after it.
+  char got[64];
+  char uri[64];
+  simCall("/powerOn");
+  simCall("/api/time?epoch=1704067200&tz=0", HTTP_POST);   // Monday 1 Jan 2024, midnight
+  snprintf(uri, sizeof(uri), "/api/schedule?rules=-M-----,06:00,%.1f,heat", simUnit(68));
+  simCall(uri, HTTP_POST);
+  simRun(7.0);
+  double first = simF(zones[0].setPoint10 / 10.0);
+  snprintf(uri, sizeof(uri), "/api/setpoint?value=%.1f", simUnit(75));
+  simCall(uri, HTTP_POST);
+  simRun(7 * 24 - 2.0);                         // To 05:00 the next Monday
+  double held = simF(zones[0].setPoint10 / 10.0);
+  simRun(2.0);
+  snprintf(got, sizeof(got), "%.1f %.1f %.1f", first, held, simF(zones[0].setPoint10 / 10.0));
+  return got;
+}
+
+void checkSetPoint(double f) {
+// SETS ZONE 0'S SETPOINT AND PRESSES SAVE ---
+  char uri[64];
+  snprintf(uri, sizeof(uri), "/api/setpoint?value=%.1f", simUnit(f));
+  simCall(uri, HTTP_POST);
+  simCall("/writeEEPROM");
+}
+
+std::string checkWear() {
+// SAVES SETTINGS 2000 TIMES, THEN GIVES THE ERASES OF EACH LOG SECTOR IF THEY ARE UNEVEN ---
+  for (int i = 0; i < 2000; i++) {
+    checkSetPoint(i % 2 ? 72 : 71);
+  }
+  unsigned long lo = ~0UL, hi = 0;
+  std::string each;
+  for (int i = 0; i < LOG_SECTORS; i++) {
+    unsigned long n = ESP.flashErases[(logAddr(i) - SIM_FS_ADDR) / SIM_FLASH_SECTOR];
+    lo = std::min(lo, n);
+    hi = std::max(hi, n);
+    each += (i ? " " : "") + std::to_string(n);
+  }
+  return lo > 0 && hi - lo <= 1 ? "all within 1" : each;
+}
+
+struct CheckBoot {
+  uint8_t flash[SIM_FS_SIZE];           // Flash to boot from, then as the boot left it
+  bool fill;                            // Fill the log's sector, so the next save moves to another
+  long cutAt;                           // Step of the save power goes at
+  bool cutHalf;                         // That step gets half way
+  bool cut;                             // Power did go
+  int found10;                          // Zone 0's setpoint as boot found it
+  unsigned int foundGain;               // And its calibration gain
+  int foundTz;                          // Time zone
+  int foundRules;                       // Schedule rules
+  bool foundJoin;                       // A join cached
+  int setPoint10;                       // Zone 0's setpoint once done
+  unsigned int gain;                    // And its calibration gain
+};
+
+bool checkBoot(CheckBoot &b, void (*run)(CheckBoot &)) {
+// BOOTS THE SKETCH FROM b.flash IN A PROCESS OF ITS OWN AND RUNS run, WHICH FILLS IN b ---
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return false;
+  }
+  if (fork() == 0) {
+    memcpy(ESP.flash, b.flash, sizeof(b.flash));
+    setup();
+    b.found10 = zones[0].setPoint10;
+    b.foundGain = zones[0].calGain10000;
+    b.foundTz = clockTz;
+    b.foundRules = schedRuleCount;
+    b.foundJoin = net.cached;
+    run(b);
+    b.setPoint10 = zones[0].setPoint10;
+    b.gain = zones[0].calGain10000;
+    memcpy(b.flash, ESP.flash, sizeof(b.flash));
+    if (write(fds[1], &b, sizeof(b)) != (ssize_t)sizeof(b)) _exit(1);
+    _exit(0);
+  }
+  close(fds[1]);
+  size_t got = 0;
+  ssize_t n;
+  while (got < sizeof(b) && (n = read(fds[0], (char *)&b + got, sizeof(b) - got)) > 0) {
+    got += n;
+  }
+  close(fds[0]);
+  int status;
+  wait(&status);
+  return got == sizeof(b);
+}
+
+void checkPrepare(CheckBoot &b) {
+// CALIBRATES AND SAVES 72, THEN FILLS THE SECTOR IF ASKED ---
+  simCall("/api/calibrate?zone=0&gain=1.01", HTTP_POST);
+  checkSetPoint(72);
+  for (int i = 0; b.fill && logEnd + logSize(5 * ZONES) <= LOG_SECTOR; i++) {
+    checkSetPoint(i % 2 ? 72 : 71);
+  }
+}
+
+void checkCutSave(CheckBoot &b) {
+// SAVES 75 WITH POWER GOING AT STEP b.cutAt OF THE SAVE ---
+  ESP.flashCutAt = ESP.flashSteps + b.cutAt;
+  ESP.flashCutHalf = b.cutHalf;
+  checkSetPoint(75);
+  b.cut = ESP.flashSteps > (unsigned long)ESP.flashCutAt;
+}
+
+void checkSave70(CheckBoot &) {
+  checkSetPoint(70);
+}
+
+void checkNothing(CheckBoot &) {
+}
+
+std::string checkPowerCut(bool move) {
+// SAVES 75 OVER 72 WITH POWER GOING BEFORE, THEN HALF WAY THROUGH, EACH STEP OF THE SAVE IN TURN ---
+// Each boot after must find 72 or 75 and the calibration, and a save of 70 from there must stick.
+// Gives how many of the cuts came through that way.
+  static CheckBoot prep, cut, after, last;
+  int cuts = 0, good = 0;
+  char got[32];
+
+  memset(prep.flash, 0xFF, sizeof(prep.flash));
+  prep.fill = move;
+  if (!checkBoot(prep, checkPrepare)) {
+    return "no boot";
+  }
+  for (long step = 0; ; step++) {
+    for (int half = 0; half < 2; half++) {
+      cut = prep;
+      cut.cutAt = step;
+      cut.cutHalf = half;
+      if (!checkBoot(cut, checkCutSave) || !cut.cut) {
+        snprintf(got, sizeof(got), "%d of %d", good, cuts);
+        return got;
+      }
+      cuts++;
+      after = cut;
+      if (!checkBoot(after, checkSave70) || (after.found10 != prep.setPoint10 && after.found10 != cut.setPoint10) ||
+          after.foundGain != prep.gain) {
+        continue;
+      }
+      last = after;
+      good += checkBoot(last, checkNothing) && last.found10 == after.setPoint10;
+    }
+  }
+}
+
+void checkEraseAfterAll(CheckBoot &) {
+// SAVES A CALIBRATION, TIME ZONE, SCHEDULE, JOIN AND SETPOINT, THEN PRESSES ERASE ---
+  char uri[64];
+  simCall("/api/calibrate?zone=0&gain=1.01", HTTP_POST);
+  simCall("/api/time?epoch=1704067200&tz=60", HTTP_POST);
+  snprintf(uri, sizeof(uri), "/api/schedule?rules=-M-----,06:00,%.1f,heat", simUnit(68));
+  simCall(uri, HTTP_POST);
+  simRun(0.1);
+  checkSetPoint(72);
+  simCall("/eraseEEPROM");
+}
+
+std::string checkErase() {
+// GIVES WHAT THE BOOT AFTER AN ERASE FINDS ---
+  static CheckBoot b;
+  char got[64];
+
+  memset(b.flash, 0xFF, sizeof(b.flash));
+  if (!checkBoot(b, checkEraseAfterAll) || !checkBoot(b, checkNothing)) {
+    return "no boot";
+  }
+  snprintf(got, sizeof(got), "%s %.2f %d %d %s", b.found10 == Config::startSetPoint10 ? "default" : "saved",
+           b.foundGain / 10000.0, b.foundTz, b.foundRules, b.foundJoin ? "cached" : "lost");
+  return got;
+}
+
+int checkStoredTenths = 0;              // Setpoint checkStoreSetPoint() saves
+
+void checkStoreSetPoint(CheckBoot &) {
+// APPENDS A SETTINGS RECORD HOLDING checkStoredTenths, WHATEVER IT IS ---
+  byte rec[5 * ZONES] = {};
+  rec[0] = highByte(checkStoredTenths);
+  rec[1] = lowByte(checkStoredTenths);
+  logWrite(REC_SETTINGS, rec, sizeof(rec));
+}
+
+std::string checkRangeName(int tenths) {
+// max OR min IF tenths IS THE API'S LIMIT, ELSE tenths ---
+  return tenths == Config::spMax10 ? "max" : tenths == Config::spMin10 ? "min" : std::to_string(tenths);
+}
+
+std::string checkStoredRange() {
+// BOOTS FROM THE OLD LAYOUT HOLDING 1200 TENTHS, THEN FROM LOG RECORDS HOLDING 2000 AND -100 ---
+// Gives each setpoint the boot found
+  static CheckBoot b;
+  std::string got;
+
+  memset(b.flash, 0xFF, sizeof(b.flash));
+  EEPROM.data[ID_ADDR] = EEPROM_ID;
+  EEPROM.data[setPointAddr] = highByte(1200);
+  EEPROM.data[setPointAddr + 1] = lowByte(1200);
+  if (!checkBoot(b, checkNothing)) {
+    return "no boot";
+  }
+  got = checkRangeName(b.found10);
+  EEPROM.data[ID_ADDR] = 0;
+  checkStoredTenths = 2000;
+  if (!checkBoot(b, checkStoreSetPoint) || !checkBoot(b, checkNothing)) {
+    return "no boot";
+  }
+  got += " " + checkRangeName(b.found10);
+  checkStoredTenths = -100;
+  if (!checkBoot(b, checkStoreSetPoint) || !checkBoot(b, checkNothing)) {
+    return "no boot";
+  }
+  return got + " " + checkRangeName(b.found10);
+}
+
+std::string checkCutAppend() {
+  return checkPowerCut(false);
+}
+
+std::string checkCutMove() {
+  return checkPowerCut(true);
+}
+
+struct CheckScenario {
+  const char *name;
+  const char *want;
+  std::string (*run)();                 // Says what happened
+  bool boots;                           // Boots the sketch itself, else it runs from power-on
+};
+
+const CheckScenario checkScenarios[] = {
+  {"weekly rule at Mon 06:00 68 F, set to 75 by hand", "68.0 75.0 68.0", checkWeeklyOverride, false},
+  {"2000 saves, erases of each log sector", "all within 1", checkWear, false},
+  {"Erase, then boot: setpoint, gain, tz, rules, join", "default 1.01 60 1 cached", checkErase, true},
+  {"setpoint saved out of range: old layout, high, low", "max max min", checkStoredRange, true},
+  {"power cut at each step of a save", "6 of 6", checkCutAppend, true},
+  {"power cut at each step of a save to a new sector", "8 of 8", checkCutMove, true},
+};
+
+bool checkRow(const std::string &name, const std::string &want, const std::string &got) {
+// PRINTS ONE CASE, TRUE IF IT GAVE WHAT IT SHOULD ---
+  bool ok = want == got;
+  printf("%-52s %-24s %-24s %s\n", name.c_str(), want.c_str(), got.c_str(), ok ? "ok" : "FAIL");
+  fflush(stdout);
+  return ok;
+}
+
+bool checkRequest(const CheckRequest &c) {
+// SENDS ONE REQUEST FROM POWER-ON AND CHECKS ITS STATUS AND WHAT IT MUST LEAVE ALONE ---
+  setup();
+  checkBefore = zones[0];
+  checkTz = clockTz;
+  checkWrites = ESP.flashWrites;
+  std::string got = std::to_string(simCall(c.target, c.method));
+  std::string want = std::to_string(c.status);
+  if (c.kept) {
+    want += ", kept";
+    got += c.kept() ? ", kept" : ", changed";
+  }
+  return checkRow(std::string(c.method == HTTP_POST ? "POST " : "GET ") + c.target, want, got);
+}
+
+int checkAll() {
+// RUNS EVERY CASE IN ITS OWN PROCESS, RETURNS HOW MANY FAILED ---
+  int failed = 0;
+  int status;
+
+  printf("%-52s %-24s %-24s %s\n", "case", "want", "got", "");
+  fflush(stdout);
+  for (size_t k = 0; k < sizeof(checkRequests) / sizeof(checkRequests[0]); k++) {
+    if (fork() == 0) {
+      _exit(checkRequest(checkRequests[k]) ? 0 : 1);
+    }
+    wait(&status);
+    failed += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+  }
+  for (size_t k = 0; k < sizeof(checkScenarios) / sizeof(checkScenarios[0]); k++) {
+    if (fork() == 0) {
+      if (!checkScenarios[k].boots) {
+        setup();
+      }
+      _exit(checkRow(checkScenarios[k].name, checkScenarios[k].want, checkScenarios[k].run()) ? 0 : 1);
+    }
+    wait(&status);
+    failed += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+  }
+  printf("%d failed\n", failed);
+  return failed;
+}
+
+void usage() {
+  fprintf(stderr,
+    "usage: web-therm-sim [options]\n"
+    "  --mode heat|cool   device mode (default heat)\n"
+    "  --hours N          simulated run length (default 24)\n"
+    "  --setpoint F       setpoint in F (default 72)\n"
+    "  --outside F        mean outside temp (default 40 heat, 88 cool)\n"
+    "  --swing F          daily outside swing either side of mean (default 10)\n"
+    "  --noise N          ADC noise in counts (default 1)\n"
+    "  --seed N           noise seed (default 1)\n"
+    "  --verbose          echo Serial output to stderr\n"
+    "  --control C        hyst, pid, predict or original, the first sketch's hysteresis (default hyst)\n"
+    "  --bench-control    run every control mode heating and cooling, one row each\n"
+    "  --subscribers N    attach N event stream subscribers (delta 0.2 F)\n"
+    "  --poll MS          GET /api/state about every MS millis\n"
+    "  --load N           run N concurrent HTTP clients, some slow or stalled\n"
+    "  --mqtt             publish to and take commands from a stand-in MQTT broker\n"
+    "  --mqtt-down A-B    broker down (connections reset) from minute A to minute B\n"
+    "  --mqtt-silent A-B  broker unreachable (nothing answers) from minute A to minute B\n"
+    "  --schedule RULES   weekly schedule as /api/schedule takes it, run starts Monday 00:00\n"
+    "  --metrics          print /metrics after the run\n"
+    "  --bench-render N   time N renders of each page and count heap use, then exit\n"
+    "  --bench-sample N   time N samples through the fixed point and float paths, then exit\n"
+    "  --ap-down A-B      access point off air from minute A to minute B\n"
+    "  --ap-moved         access point on another channel than the one cached\n"
+    "  --bench-boot       boot from blank and saved flash, timing first control and Wi-Fi join\n"
+    "  --bench-command    move the setpoint 3 F by buttons, /api/setpoint and /api/command, one row each\n"
+    "  --fault KIND@M     break zone 0 once its relay is on from minute M: open, short, stuck, loose or dead\n"
+    "  --bench-faults     run each fault heating and cooling, one row each\n"
+    "  --record FILE      save /api/trace to FILE after the run\n"
+    "  --replay FILE      replay a trace from /api/trace through the sketch and compare, then exit\n"
+    "  --bench-replay DIR replay each .wtt trace in DIR, one row each\n"
+    "  --check            run the API and scenario checks, one row each, non-zero exit if any fail\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  bool cool = false;
+  double hours = 24, sp = 72, outside = NAN, swing = 10;
+  unsigned long benchRenders = 0;
+  unsigned long benchSamples = 0;
+  int subscribers = 0;
+  int load = 0;
+  const char *control = "hyst";
+  const char *schedule = nullptr;
+  bool row = false;
+  bool metrics = false;
+  bool bootBench = false;
+  bool commandBench = false;
+  bool faultRowOut = false;
+  const char *record = nullptr;
+
+  for (int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    const char *v = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (a == "--verbose") { simVerbose = true; continue; }
+    if (a == "--row") { row = true; continue; }
+    if (a == "--metrics") { metrics = true; continue; }
+    if (a == "--ap-moved") { apMoved = true; continue; }
+    if (a == "--bench-boot") { bootBench = true; continue; }
+    if (a == "--bench-command") { commandBench = true; continue; }
+    if (a == "--fault-row") { faultRowOut = true; continue; }
+    if (a == "--mqtt") { brokerOn = true; simMqttHost = SIM_BROKER_IP; continue; }
+    if (a == "--bench-control") {
+      std::vector<char *> rest(argv, argv + i);
+      rest.insert(rest.end(), argv + i + 1, argv + argc);
+      benchControl(rest.size(), rest.data());
+      return 0;
+    }
+    if (a == "--check") {
+      return checkAll() ? 1 : 0;
+    }
+    if (a == "--bench-faults") {
+      std::vector<char *> rest(argv, argv + i);
+      rest.insert(rest.end(), argv + i + 1, argv + argc);
+      benchFaults(rest.size(), rest.data());
+      return 0;
+    }
+    if (!v) usage();
+    if (a == "--replay") {
+      std::string d;
+      if (!readFile(v, &d)) usage();
+      ReplayResult r = replayTrace(d);
+      replayReport(v, r);
+      return replayFaithful(r) ? 0 : 1;
+    }
+    if (a == "--bench-replay") {
+      benchReplay(v);
+      return 0;
+    }
+    if (a == "--mode") cool = std::string(v) == "cool";
+    else if (a == "--hours") hours = atof(v);
+    else if (a == "--setpoint") sp = atof(v);
+    else if (a == "--outside") outside = atof(v);
+    else if (a == "--swing") swing = atof(v);
+    else if (a == "--noise") adcNoise = atof(v);
+    else if (a == "--seed") rngState = strtoul(v, nullptr, 0) | 1;
+    else if (a == "--control") { control = v; originalHyst = std::string(v) == "original"; }
+    else if (a == "--subscribers") subscribers = atoi(v);
+    else if (a == "--poll") pollMs = strtoul(v, nullptr, 0);
+    else if (a == "--load") load = atoi(v);
+    else if (a == "--mqtt-down") { if (sscanf(v, "%lf-%lf", &downFrom, &downTo) != 2) usage(); }
+    else if (a == "--mqtt-silent") { if (sscanf(v, "%lf-%lf", &silentFrom, &silentTo) != 2) usage(); }
+    else if (a == "--ap-down") { if (sscanf(v, "%lf-%lf", &apDownFrom, &apDownTo) != 2) usage(); }
+    else if (a == "--schedule") schedule = v;
+    else if (a == "--record") record = v;
+    else if (a == "--fault") {
+      char kind[16];
+      if (sscanf(v, "%15[a-z]@%lf", kind, &simFaultFrom) != 2) usage();
+      simFault = std::find(simFaultNames, simFaultNames + SIM_FAULTS, std::string(kind)) - simFaultNames;
+      if (simFault == SIM_FAULTS) usage();
+    }
+    else if (a == "--bench-render") benchRenders = strtoul(v, nullptr, 0);
+    else if (a == "--bench-sample") benchSamples = strtoul(v, nullptr, 0);
+    else usage();
+    i++;
+  }
+
+  const double tauHours[] = {4, 5, 3, 6, 3.5, 4.5};     // Zones differ in how well they hold heat
+  for (int i = 0; i < ZONES; i++) {
+    plants[i].cooling = cool;
+    plants[i].outsideMean = std::isnan(outside) ? (cool ? 88 : 40) : outside;
+    plants[i].outsideSwing = swing;
+    plants[i].tauRoom = tauHours[i] * 3600;
+    plants[i].room = cool ? sp + 2 : sp - 2;
+  }
+
+  if (bootBench) {
+    benchBoot(cool);
+    return 0;
+  }
+  if (commandBench) {
+    benchCommand();
+    return 0;
+  }
+
+  setup();
+  for (int i = 0; i < ZONES; i++) {
+    std::string zq = "?zone=" + std::to_string(i);
+    zones[i].setPoint10 = lround(simUnit(sp) * 10);
+    simCall(("/powerOn" + zq).c_str());
+    simCall(((cool ? "/modeCold" : "/modeHeat") + zq).c_str());
+    std::string mode = originalHyst ? "hyst" : control;
+    if (simCall(("/api/control?mode=" + mode + "&zone=" + std::to_string(i)).c_str(), HTTP_POST) != 200) usage();
+  }
+  if (schedule) {
+    simCall("/api/time?epoch=1704067200&tz=0", HTTP_POST);   // Monday 1 Jan 2024, midnight as the plant's day
+    if (simCall((std::string("/api/schedule?rules=") + schedule).c_str(), HTTP_POST) != 200) {
+      fprintf(stderr, "%s", simLast.body.c_str());
+      usage();
+    }
+  }
+  for (int i = 0; i < subscribers; i++) {
+    std::shared_ptr<SimConn> c = simConnect();
+    c->rx = simRequestText("/api/events?delta=0.2", HTTP_GET, true);
+    server.handleClient();
+    if (c->open && c->tx.compare(0, 12, "HTTP/1.1 200") == 0) {
+      peers.push_back(c);                       // Held by the sketch as a subscriber
+    }
+  }
+  loadStart(load);
+
+  if (benchRenders) {
+    benchRender(benchRenders);
+    return 0;
+  }
+  if (benchSamples) {
+    benchSample(benchSamples, sp);
+    return 0;
+  }
+
+  RunResult r = simRun(hours);
+  if (faultRowOut) {
+    faultRow(cool);
+  } else if (row) {
+    simRow(r, hours, control, cool);
+  } else {
+    simReport(r, hours);
+  }
+  if (metrics) {
+    simCall("/metrics");
+    printf("\n%s", simLast.body.c_str());
+  }
+  if (record) {
+    simCall("/api/trace");
+    FILE *f = fopen(record, "wb");
+    if (!f || fwrite(simLast.body.data(), 1, simLast.body.size(), f) != simLast.body.size()) {
+      fprintf(stderr, "%s: can't write\n", record);
+      return 1;
+    }
+    fclose(f);
+  }
+  return 0;
+}
@@ -0,0 +1,101 @@
+// Generated by assets/gen-assets.py from the files in assets/. Edit those and rerun it.
+
+#define ASSET_APP_JS_TAG "06022bb9"  // 2674 bytes, 1150 gzipped
+const uint8_t ASSET_APP_JS[] PROGMEM = {
+  0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x85, 0x56, 0x5b, 0x6f, 0xdb, 0x36,
+  0x14, 0x7e, 0xcf, 0xaf, 0x38, 0x01, 0x8a, 0x50, 0x5e, 0x14, 0xda, 0x2e, 0xb0, 0x87, 0x25, 0x30,
+  0x8a, 0x2d, 0x4d, 0xb7, 0x02, 0x0b, 0x52, 0xa0, 0x01, 0xf6, 0x90, 0xe5, 0x81, 0x91, 0x8e, 0x2c,
+  0x36, 0x94, 0xa8, 0x91, 0xb4, 0xdd, 0xac, 0xcd, 0x7f, 0xdf, 0x39, 0xd4, 0xc5, 0xf2, 0x65, 0x5b,
+  0x80, 0x24, 0xe4, 0xb9, 0x7e, 0x3c, 0x57, 0x4d, 0xa7, 0x70, 0xab, 0x74, 0x0d, 0x8d, 0x5a, 0x22,
+  0x6c, 0x74, 0x28, 0xed, 0x2a, 0x80, 0x43, 0x63, 0x55, 0xee, 0x2f, 0x21, 0x94, 0x08, 0x4f, 0xab,
+  0x10, 0x6c, 0xed, 0xc1, 0x63, 0x9d, 0xc3, 0x54, 0x35, 0x7a, 0x9a, 0xd9, 0xaa, 0x52, 0x74, 0xe1,
+  0x5f, 0x96, 0x88, 0xba, 0xda, 0xc3, 0xaa, 0xc9, 0x55, 0xc0, 0x1c, 0xd8, 0x9c, 0x51, 0x19, 0x9e,
+  0x4c, 0xa7, 0x50, 0x38, 0x5b, 0x81, 0x0e, 0x9e, 0x6c, 0x36, 0xe6, 0x25, 0x8d, 0x3a, 0x91, 0x16,
+  0x2d, 0xf9, 0x40, 0x0a, 0x80, 0x6b, 0x74, 0x2f, 0x30, 0x9f, 0x81, 0x97, 0x70, 0xaf, 0x1a, 0x0f,
+  0xb6, 0x80, 0xf3, 0x28, 0x79, 0x11, 0x21, 0x91, 0xbd, 0x52, 0x99, 0x02, 0x14, 0x61, 0xc8, 0x2c,
+  0x91, 0x97, 0x16, 0x94, 0x67, 0xeb, 0xb6, 0x46, 0xe8, 0xd0, 0x48, 0xb8, 0x51, 0x59, 0xd9, 0xdf,
+  0x20, 0x53, 0xce, 0x69, 0xf4, 0x51, 0xe7, 0xaf, 0x14, 0x3c, 0x69, 0x10, 0x84, 0x40, 0x7e, 0x54,
+  0x11, 0xd0, 0xd1, 0xcd, 0x58, 0x1f, 0x5a, 0x54, 0x90, 0x95, 0xaa, 0x5e, 0x92, 0x70, 0x6d, 0xd9,
+  0xd9, 0x12, 0xc2, 0x46, 0x67, 0x28, 0xd9, 0xc1, 0x1f, 0x5d, 0x44, 0x88, 0xee, 0xa1, 0xd0, 0x06,
+  0xe3, 0x83, 0x8d, 0xae, 0x9f, 0x29, 0x20, 0x41, 0x1b, 0x03, 0x1b, 0xeb, 0x9e, 0xe5, 0x49, 0x52,
+  0xac, 0xea, 0x2c, 0x68, 0x5b, 0x43, 0x32, 0x81, 0x6f, 0x27, 0x00, 0x6b, 0xe5, 0xe0, 0x6f, 0x86,
+  0xb7, 0x80, 0xc4, 0xd8, 0x4c, 0x31, 0x4f, 0x7a, 0x54, 0x2e, 0x2b, 0x65, 0xa5, 0x42, 0x56, 0x26,
+  0x53, 0x66, 0x2f, 0x92, 0x3f, 0xf3, 0xf3, 0xc9, 0x74, 0x02, 0xdf, 0xbf, 0xc3, 0xc3, 0x2c, 0x85,
+  0xd9, 0xe3, 0xe4, 0x61, 0xfe, 0x78, 0xd5, 0x19, 0x20, 0xe8, 0xa4, 0x7f, 0xab, 0x42, 0x29, 0x0b,
+  0x63, 0xad, 0x4b, 0xe2, 0xd1, 0xd1, 0xfb, 0x6c, 0x45, 0x7e, 0x7e, 0x80, 0x39, 0xfe, 0x34, 0xe9,
+  0x85, 0x03, 0x47, 0x6e, 0x01, 0xb3, 0xd1, 0xfd, 0x5e, 0x57, 0xf4, 0xd4, 0x11, 0x4d, 0x45, 0x8c,
+  0x2c, 0xc6, 0x18, 0x01, 0x54, 0x9e, 0xbf, 0xc7, 0xa5, 0x43, 0xbc, 0x84, 0x99, 0x9c, 0xa7, 0x91,
+  0x56, 0xe9, 0x7a, 0xe5, 0x7b, 0xea, 0xc5, 0x40, 0x6e, 0xec, 0x06, 0xdd, 0x5d, 0x7d, 0x09, 0x22,
+  0x9e, 0x16, 0x73, 0x31, 0xa6, 0x17, 0xc5, 0xc0, 0x98, 0x75, 0x8c, 0xca, 0xe6, 0xf8, 0x1b, 0xaa,
+  0x40, 0x0c, 0x3e, 0x2e, 0x4a, 0x3a, 0x8f, 0x58, 0xd7, 0xd6, 0xe4, 0x3d, 0x2b, 0xb3, 0xd6, 0x08,
+  0xe2, 0xbc, 0x5e, 0x9d, 0xd0, 0xdf, 0x21, 0x94, 0x6f, 0x12, 0x9d, 0x4f, 0x3a, 0xa4, 0x94, 0xbb,
+  0x95, 0xab, 0x21, 0xb7, 0xd9, 0xaa, 0xc2, 0x3a, 0xc8, 0x25, 0x86, 0x1b, 0x83, 0x7c, 0xfc, 0xe5,
+  0xe5, 0x63, 0xce, 0x82, 0xfc, 0xc6, 0xd7, 0x1d, 0xfd, 0xb6, 0x72, 0x13, 0x95, 0x52, 0x85, 0x86,
+  0x32, 0x05, 0xa3, 0x9e, 0xd0, 0xf4, 0x06, 0x15, 0x65, 0x23, 0xfc, 0x1c, 0x82, 0xd3, 0x24, 0x86,
+  0x89, 0x28, 0x1d, 0x16, 0x22, 0x05, 0x31, 0x15, 0x54, 0x7b, 0x2c, 0x4f, 0xff, 0xf6, 0x12, 0x17,
+  0x5d, 0xb0, 0x66, 0xa1, 0x9d, 0x0f, 0xd7, 0xa5, 0x36, 0xb9, 0x0c, 0xf8, 0x35, 0x5c, 0xdb, 0x3a,
+  0x10, 0x10, 0x8a, 0x6a, 0xf4, 0x70, 0x08, 0xc4, 0x97, 0x76, 0x93, 0xf8, 0xde, 0xb3, 0x2e, 0x20,
+  0x39, 0xf5, 0x9c, 0x71, 0x2f, 0xd1, 0x39, 0xeb, 0x7a, 0x46, 0xff, 0xca, 0xd6, 0xcd, 0xeb, 0x20,
+  0x2c, 0xd4, 0x7a, 0x79, 0x8f, 0x55, 0x23, 0xb8, 0xb3, 0xfc, 0x56, 0xfa, 0x4d, 0x22, 0x02, 0x93,
+  0x27, 0x7b, 0x28, 0xbc, 0xec, 0x14, 0x64, 0xb0, 0x1f, 0xf4, 0x57, 0xcc, 0x93, 0xb7, 0x93, 0x03,
+  0x9b, 0x39, 0xae, 0xa9, 0xc8, 0x8f, 0x98, 0xec, 0x18, 0x87, 0x46, 0x5b, 0x06, 0xbc, 0x03, 0x61,
+  0x6b, 0x01, 0x94, 0x3b, 0x5b, 0x14, 0x62, 0xdf, 0xee, 0x29, 0x97, 0xe1, 0x8e, 0x3d, 0x0a, 0x73,
+  0x63, 0x75, 0x1d, 0x8e, 0x58, 0x24, 0xd6, 0x27, 0x66, 0xfd, 0x17, 0x4e, 0x65, 0x94, 0xab, 0xfc,
+  0x11, 0x9c, 0x1d, 0xe3, 0xc8, 0xe3, 0x23, 0x43, 0x7e, 0x21, 0xcb, 0x09, 0x67, 0xb4, 0xb3, 0xb9,
+  0x55, 0x22, 0x9d, 0x52, 0xe7, 0x39, 0xd6, 0x24, 0x7e, 0x3a, 0xc8, 0x1b, 0xac, 0x97, 0xa1, 0x1c,
+  0xfb, 0xef, 0xea, 0x87, 0xd4, 0x62, 0x65, 0x8b, 0x09, 0xcd, 0x11, 0x19, 0x8f, 0x9f, 0x31, 0x70,
+  0x1c, 0xfa, 0xda, 0x8f, 0xd1, 0xe8, 0x1a, 0x44, 0xec, 0x0b, 0xdd, 0xb5, 0xc1, 0x62, 0xb1, 0x0e,
+  0xc9, 0xd6, 0x2e, 0x57, 0x7f, 0x6b, 0x96, 0xbb, 0xe3, 0x96, 0x6e, 0xac, 0xd1, 0x77, 0x4e, 0xd4,
+  0xeb, 0x7b, 0x45, 0xec, 0x4b, 0x5d, 0x73, 0xd3, 0xb0, 0x44, 0x14, 0x3d, 0x52, 0xfe, 0x99, 0x32,
+  0x26, 0x59, 0x39, 0x93, 0x42, 0x85, 0x34, 0xc5, 0xf2, 0x34, 0x0e, 0x40, 0x1a, 0x8a, 0x7d, 0x18,
+  0x0b, 0xe4, 0x39, 0x14, 0x25, 0xbe, 0xb5, 0x22, 0x97, 0x83, 0x68, 0x46, 0xc3, 0x94, 0xfa, 0x5f,
+  0xd4, 0xf6, 0x22, 0x1e, 0xc5, 0x2b, 0x05, 0xba, 0xc4, 0x7a, 0x34, 0xe8, 0x0e, 0xea, 0x16, 0x9c,
+  0xfc, 0xe2, 0xe9, 0x61, 0x7d, 0x12, 0x3b, 0x0d, 0xae, 0xfe, 0x14, 0xf6, 0x07, 0x64, 0x9f, 0xe0,
+  0x3d, 0x4c, 0xfc, 0x43, 0x65, 0xc1, 0x93, 0x8b, 0xe6, 0x6e, 0x72, 0x4c, 0x8b, 0x7f, 0xfe, 0xf5,
+  0x6d, 0xb4, 0x32, 0xe6, 0x43, 0xc2, 0x09, 0x43, 0x4a, 0x7b, 0x65, 0x36, 0x1b, 0x28, 0xaf, 0x1d,
+  0xb2, 0x23, 0xd1, 0x6a, 0x17, 0x47, 0xa2, 0xdc, 0x72, 0x00, 0xc3, 0xf3, 0xf7, 0x7c, 0x01, 0xf3,
+  0x56, 0x3b, 0xfa, 0x14, 0xe3, 0x0d, 0xf8, 0x2e, 0x8e, 0x70, 0x1e, 0x18, 0x71, 0xd4, 0x9f, 0x83,
+  0x38, 0x23, 0x95, 0x48, 0x88, 0xaa, 0x74, 0xe7, 0x33, 0x9b, 0xa4, 0x3a, 0xfc, 0x74, 0xf7, 0xf9,
+  0x9e, 0xb2, 0xf8, 0xf6, 0x88, 0x73, 0x6a, 0x9a, 0x24, 0x47, 0x13, 0x54, 0xef, 0x39, 0x4e, 0xff,
+  0x86, 0xea, 0x73, 0xa7, 0x81, 0x5a, 0x1c, 0x71, 0xd0, 0x13, 0xac, 0xa8, 0xd0, 0x92, 0x7c, 0xb3,
+  0xd7, 0x05, 0x49, 0xa3, 0x9c, 0xc7, 0x0f, 0xb4, 0xc6, 0x43, 0xb2, 0xcb, 0x9c, 0x10, 0xa0, 0xd6,
+  0xd5, 0x41, 0xd7, 0x65, 0x86, 0xc6, 0x5c, 0x1f, 0xf9, 0x7e, 0x7d, 0x6c, 0x9d, 0xf6, 0xdb, 0xe4,
+  0x7f, 0xd2, 0xc3, 0xd0, 0x73, 0x12, 0x63, 0x98, 0x83, 0x8b, 0x6d, 0x4e, 0xc6, 0x6b, 0x2a, 0x3a,
+  0xed, 0xe2, 0x2e, 0x22, 0xa8, 0x18, 0xbb, 0xbc, 0x2f, 0xa0, 0x14, 0x7e, 0xec, 0x72, 0x17, 0xc3,
+  0x15, 0xe7, 0xcb, 0x30, 0xf4, 0x78, 0x80, 0x9e, 0x6e, 0x34, 0xed, 0xc2, 0x8d, 0x8c, 0x95, 0xbc,
+  0xbb, 0x2a, 0x5a, 0x2d, 0xd8, 0x6e, 0x0c, 0xda, 0x75, 0x37, 0x6b, 0x3a, 0xfc, 0xae, 0x3d, 0xc5,
+  0x01, 0x5d, 0x22, 0x32, 0xa3, 0xb3, 0x67, 0x31, 0x2e, 0x4d, 0x1c, 0xc7, 0x5f, 0x11, 0x4c, 0x94,
+  0x81, 0xb2, 0x87, 0x41, 0x66, 0xf4, 0xb9, 0x80, 0xf4, 0xc1, 0x70, 0x76, 0x76, 0x40, 0xa3, 0xa9,
+  0xd2, 0xa7, 0xa6, 0xdb, 0xb1, 0xa4, 0xa8, 0x58, 0xb2, 0x5b, 0xb7, 0x0f, 0x4a, 0xf2, 0x42, 0xa9,
+  0x55, 0x85, 0xd2, 0x93, 0x4f, 0xa4, 0x70, 0x3c, 0x5e, 0x0d, 0x23, 0x8e, 0xa4, 0xb6, 0xd1, 0x43,
+  0xd9, 0x38, 0x64, 0x98, 0xef, 0xb1, 0x50, 0x2b, 0x13, 0x92, 0x21, 0x70, 0x2c, 0x1a, 0x5e, 0x1a,
+  0xa4, 0x8f, 0xa3, 0xe8, 0x62, 0xb1, 0xa0, 0xee, 0x5c, 0x55, 0x4f, 0x3c, 0x98, 0x46, 0xbd, 0xc1,
+  0xa5, 0xc4, 0x16, 0x87, 0x8a, 0x07, 0x34, 0x1e, 0x47, 0x02, 0x43, 0xa1, 0x8f, 0x85, 0x86, 0xa9,
+  0xd7, 0xb6, 0x06, 0xa5, 0xf8, 0x23, 0x55, 0x8b, 0x5b, 0x2b, 0x73, 0x24, 0xc7, 0xa3, 0x46, 0x88,
+  0x1f, 0x70, 0xbb, 0x6d, 0x40, 0x95, 0xfe, 0xeb, 0x0d, 0x17, 0x7a, 0x97, 0xb9, 0xb6, 0x03, 0xf9,
+  0xf2, 0x3a, 0xe1, 0xd7, 0xfc, 0x03, 0x28, 0x5d, 0x36, 0xc5, 0x72, 0x0a, 0x00, 0x00,
+};
+
+#define ASSET_STYLE_CSS_TAG "138bf215"  // 327 bytes, 230 gzipped
+const uint8_t ASSET_STYLE_CSS[] PROGMEM = {
+  0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x6d, 0x8f, 0xbd, 0x6e, 0xc3, 0x30,
+  0x0c, 0x84, 0xf7, 0x3e, 0x05, 0x81, 0xcc, 0x02, 0xe4, 0xd4, 0x0e, 0x50, 0x69, 0x6a, 0xa6, 0xbe,
+  0x86, 0xfe, 0x62, 0x0b, 0x91, 0x44, 0x41, 0xa1, 0xdb, 0xa4, 0x46, 0xdf, 0xbd, 0xac, 0x5d, 0xa3,
+  0x4b, 0xb9, 0xf1, 0x3b, 0xf0, 0xee, 0x38, 0x51, 0x4e, 0xb0, 0xc0, 0x05, 0x0b, 0x89, 0x8b, 0xc9,
+  0x31, 0x3d, 0x14, 0xbc, 0x85, 0xf4, 0x1e, 0x28, 0x3a, 0xa3, 0xc1, 0xc7, 0x5b, 0x4d, 0x86, 0x59,
+  0x2c, 0x29, 0x96, 0x20, 0x6c, 0x42, 0x77, 0xd5, 0x90, 0x4d, 0x1b, 0x63, 0x51, 0x20, 0xeb, 0x1d,
+  0xcc, 0x4c, 0xa8, 0x81, 0xc2, 0x9d, 0x84, 0x49, 0x71, 0x64, 0xea, 0x42, 0xa1, 0xd0, 0xf4, 0xd7,
+  0x93, 0x9d, 0x89, 0xb0, 0xb0, 0xbd, 0x35, 0xee, 0x3a, 0x36, 0x9c, 0x8b, 0x17, 0x0e, 0x13, 0x36,
+  0x05, 0x87, 0xee, 0x65, 0x38, 0x9f, 0x5e, 0x35, 0x58, 0x6c, 0x3e, 0x30, 0x28, 0x58, 0x82, 0x86,
+  0x5f, 0xf5, 0x63, 0x8a, 0xc4, 0x5b, 0x35, 0xde, 0xc7, 0x32, 0x2a, 0xe8, 0x4e, 0x1c, 0xd4, 0x73,
+  0xda, 0x8f, 0x29, 0xfa, 0xc7, 0xb2, 0x15, 0x10, 0x84, 0x55, 0xc1, 0xb0, 0x72, 0x98, 0x3a, 0x58,
+  0x76, 0xf3, 0x7e, 0x1d, 0xbd, 0xd7, 0x1c, 0xf6, 0x9e, 0xf0, 0xbc, 0x79, 0x54, 0x58, 0xd6, 0x8f,
+  0x6f, 0xf1, 0x33, 0x28, 0x38, 0xf6, 0x0c, 0xff, 0x3d, 0x15, 0x16, 0xf9, 0x83, 0xcc, 0x05, 0xb6,
+  0xbb, 0x83, 0x49, 0xa6, 0xe5, 0xbf, 0x9c, 0xb3, 0x94, 0xf2, 0x28, 0x59, 0xf8, 0x06, 0xe8, 0x0c,
+  0xbe, 0xf2, 0x47, 0x01, 0x00, 0x00,
+};
+
+const StaticAsset staticAssets[] = {
+  {"/static/app.js", "application/javascript", ASSET_APP_JS, sizeof(ASSET_APP_JS), "\"06022bb9\""},
+  {"/static/style.css", "text/css", ASSET_STYLE_CSS, sizeof(ASSET_STYLE_CSS), "\"138bf215\""},
+};
@@ -8,10 +8,139 @@ Written for Wemos D1 development board. With minor changes will run on wifi ardu
 
 // DEFINES ---------------------------
 
-#define TEMPFRQ 1000                  // Freq of temperature reading
-#define THERMFRQ 5000                 // Freq of thermo on off descision
-#define TEMPARRAYSIZE 60              // Size of avg array for temp calc
-#define POWER_WAIT 300000             // Time to wait to restart cooler (5 mins)
+#define HTTPFRQ 0                     // Freq of web server servicing (0 = every pass)
+#define SAVEFRQ 1000                  // Freq of check for setting changes waiting to be saved
+#define IDLE_MAX 5                    // Longest light sleep between passes, bounds web response time
+
+#define LOCKOUT_STEP 10               // Seconds the reported cooler restart wait is rounded up to
+
+#define CTRL_HYST 0                   // On/off at setpoint with hyst, as always
+#define CTRL_PID 1                    // Time proportional PID
+#define CTRL_PREDICT 2                // On/off, turning off early by the learned rate of change
+#define CTRL_MIN_ON 120000            // Least time device stays on (PID and predictive)
+#define CTRL_MIN_OFF 120000           // Least time device stays off (PID and predictive)
+#define PID_KP 0.5                    // Output fraction per degree of error
+#define PID_TI 900                    // Integral time, seconds
+#define PID_TD 0                      // Derivative time, seconds; sensor noise over one thermoPeriod step swamps it
+#define PID_WINDOW 600000             // Time proportioning window, output fraction is on time within it
+#define PREDICT_LAG 3                 // Minutes of heating/cooling still to come when device turns off
+#define PREDICT_BAND 60               // Predictive mode cycles the room over this span centred on setpoint, hundredths
+#define PREDICT_RATE 0.1              // Degrees per minute assumed until a rate has been learned
+
+#define HIST_MIN_SIZE 1440            // Per-minute history records (24 hours)
+#define HIST_QTR_SIZE 672             // Per-15-minute history records (7 days)
+#define HIST_HOUR_SIZE 720            // Hourly history records (30 days)
+#define HIST_TIERS 3
+
+#define HTTP_PORT 80
+#define HTTP_CONNS 4                  // Connections served at once; the longest idle one makes way for a new one
+#define HTTP_IN_MAX 1024              // Longest request, head and body together
+#define HTTP_OUT_MAX 1536             // Response bytes held for a connection beyond what its socket takes
+#define HTTP_ARGS 12                  // Most query and form args in one request
+#define HTTP_ROUTES 32                // Most handlers registered with server.on()
+#define HTTP_HDR_MAX 128              // Bytes of headers a handler can add with sendHeader()
+#define HTTP_CURSOR 5                 // Values a long response keeps its place with between passes
+#define HTTP_HEAD_TIMEOUT 2000        // Whole request must arrive within this long of its first byte
+#define HTTP_IDLE_TIMEOUT 10000       // Keep-alive connection closed after this long without a request
+#define HTTP_SEND_TIMEOUT 10000       // Connection dropped once its client has taken nothing for this long
+#define HTTP_CLOSE_WAIT 1             // Millis stop() waits for acks, it would otherwise wait up to 300
+
+#define TIMING_BUCKETS 17             // Histogram buckets per timing, doubling from 2^TIMING_FIRST cycles, last is the rest
+#define TIMING_FIRST 8                // First bucket is up to 256 cycles, 3.2 us at 80 MHz
+#define SSE_MAX 4                     // Most event stream subscribers at once
+#define SSE_FRQ 250                   // Freq of check for events to push
+#define SSE_DELTA 20                  // avgTemp change in hundredths that pushes an event, unless subscriber asks otherwise
+#define SSE_KEEPALIVE 15000           // Comment sent after this long without an event so the stream stays open
+#define SSE_STALL 10000               // Drop subscriber whose socket has had no room for this long
+#ifndef MQTT_HOST
+#define MQTT_HOST ""                  // Broker IP address, empty leaves MQTT off
+#endif
+#define MQTT_PORT 1883
+#define MQTT_PREFIX "web-therm"       // Topics are MQTT_PREFIX/<chip id>/...
+#define MQTT_FRQ 250                  // Freq of MQTT servicing: commands read, state changes published
+#define MQTT_DELTA 20                 // avgTemp change in hundredths that publishes a zone's state
+#define MQTT_REPORT 300000            // Freq of the report of every zone, queued while offline
+#define MQTT_KEEPALIVE 60             // Seconds; pinged after half this idle, dropped after 1.5 times it silent
+#define MQTT_CONNECT_WAIT 25          // Longest connect() waits for the TCP handshake, broker on the LAN
+#define MQTT_CONNACK_WAIT 5000        // Broker must accept CONNECT within this long
+#define MQTT_BACKOFF_MIN 1000         // Wait before first reconnect, doubled after each failure
+#define MQTT_BACKOFF_MAX 300000       // Longest wait between reconnects
+#define MQTT_IN_MAX 256               // Longest packet taken from the broker, longer ones are skipped
+#define MQTT_QUEUE 4096               // Bytes of publishes held for the broker, oldest dropped when full
+#define CMD_WINDOW 300                // Commands for a zone within this long of its first are applied as one change
+#define CMD_IDLE 60000                // Freq of the command task with nothing queued; a command makes it due sooner
+#define CMD_RATE 5                    // Commands /api/command accepts per second on average, from every client together
+#define CMD_BURST 10                  // Commands it accepts at once before CMD_RATE holds
+#define CMD_SEEN 8                    // Recent seq= values remembered; a repeat gets the first reply again
+#define CMD_DELTA_MAX 100             // Largest relative setpoint change in one command, tenths
+#define WIFI_FRQ 100                  // Freq of Wi-Fi join checks
+#define WIFI_FAST_WAIT 2000           // Join to the cached access point and address must finish within this long
+#define WIFI_JOIN_WAIT 20000          // Full join (scan and DHCP) must finish within this long before the portal opens
+#define WIFI_PORTAL_TIME 300          // Seconds the portal stays up without a save before joining is tried again
+#define WIFI_PORTAL_FRQ 10            // Freq of portal servicing (its web server and DNS) while it is up
+#define WIFI_PORTAL_RETRY 15000       // Freq of joins to the cached access point while the portal is up
+#define WIFI_SAVE_WAIT 10             // Seconds the portal waits for a join with newly saved credentials
+#ifndef WIFI_CACHE_IP
+#define WIFI_CACHE_IP 1               // Rejoin with the last DHCP address as static, skipping DHCP; 0 always asks
+#endif
+
+#define FILTER_MEAN 0                 // Rolling average of last tempWindow readings
+#define FILTER_EMA 1                  // Exponential moving average, time constant of tempWindow readings
+#define FILTER_MEDIAN 2               // Rolling median of last tempWindow readings
+#define EMA_SHIFT 8                   // Fraction bits the EMA carries below a hundredth
+
+#define ADC_QUIET 10                  // Millis after sending before a burst, radio TX spikes the ADC
+#define ADC_DEFER_MAX 250             // Longest a reading waits for the radio to go quiet
+#define CAL_OFFSET_MAX 20.0           // Largest calibration offset accepted, degrees
+#define CAL_GAIN_MIN 0.5              // Calibration gain range accepted
+#define CAL_GAIN_MAX 1.5
+
+#define FAULT_SENSOR 1                // Alarm: no reading, or one no room gives (sensor open, shorted or gone)
+#define FAULT_STUCK 2                 // Alarm: ADC reading unchanged for FAULT_STUCK_READS readings
+#define FAULT_JUMP 4                  // Alarm: reading moved faster than a room can FAULT_JUMPS times in FAULT_JUMP_SPAN
+#define FAULT_NO_EFFECT 8             // Alarm: device on FAULT_EFFECT_TIME without moving the room its way
+#define FAULT_CYCLING 16              // Alarm: more than FAULT_CYCLES starts in FAULT_CYCLE_SPAN
+#define FAULT_KINDS 5
+#define FAULT_OFF (FAULT_SENSOR | FAULT_STUCK | FAULT_JUMP)   // Alarms that hold the device off
+#define FAULT_BAD_READS 3             // Bad readings in a row before FAULT_SENSOR
+#define FAULT_STUCK_READS 300         // Identical ADC readings in a row before FAULT_STUCK, 5 minutes
+#define FAULT_JUMPS 3
+#define FAULT_JUMP_SPAN 60000
+#define FAULT_EFFECT_TIME 1200000     // Longest the device may run without moving the room effectMin100
+#define FAULT_CYCLES 12               // Starts allowed in FAULT_CYCLE_SPAN, as many as the cooler restart wait lets through
+#define FAULT_CYCLE_SPAN 3600000
+
+#ifndef TRACE_BYTES
+#define TRACE_BYTES 4096              // Trace ring, a power of 2; about 17 minutes of one ADC zone
+#endif
+#define TRACE_KEY_EVERY (TRACE_BYTES / 4)  // Bytes between keyframes, so the most dropped at once when full
+#define TRACE_HOLD (TRACE_BYTES / 2)  // Bytes recorded after the first alarm before the trace stops
+#define TRACE_VERSION 1               // Format of /api/trace, second byte after "WT"
+
+#define SCHED_RULES 16                // Most schedule rules, each is some weekdays at one time of day
+#define SCHED_EVENTS (SCHED_RULES * 7) // Transition table size, one entry per rule per weekday
+#define SCHED_RECHECK 3600000         // Longest the schedule task sleeps, so clock changes are picked up
+#define SCHED_TZ 0                    // Local time in minutes east of UTC until /api/time sets it
+#define WEEK_MINUTES 10080
+#define NTP_SERVER "pool.ntp.org"
+#define CLOCK_NONE 0                  // Time of day unknown, schedule idle
+#define CLOCK_API 1                   // Set through /api/time
+#define CLOCK_NTP 2                   // Set by SNTP
+
+#ifndef ZONES
+#define ZONES 1                       // Zones in use, the first ZONES entries of zoneConfig
+#endif
+#define SRC_ADC 0                     // TMP36 on the ADC pin. The ESP8266 has one ADC, so one zone at most
+#define SRC_ONEWIRE 1                 // DS18B20 on the 1-Wire bus, by index in bus search order
+#define SRC_REMOTE 2                  // Reading POSTed to /api/sensor by another board
+#define REMOTE_STALE 300000           // Remote reading older than this counts as a sensor failure
+#define NO_READING -32768             // readZone() result for a failed or silent sensor
+
+#define UNIT_F 0                      // Readings, setpoints and the API in Fahrenheit
+#define UNIT_C 1                      // Or in Celsius
+#ifndef TEMP_UNIT
+#define TEMP_UNIT UNIT_F
+#endif
 
 // INCLUDES ---------------------------
 
@@ -19,527 +148,5271 @@ Written for Wemos D1 development board. With minor changes will run on wifi ardu
 #include <DNSServer.h>                // Local DNS Server used for redirecting all requests to the configuration portal
 #include <ESP8266WebServer.h>         // Local WebServer used to serve the configuration portal
 #include <WiFiManager.h>              // WiFi Configuration Magic
-#include <EEPROM.h>                   // Enables reading and writing EEPROM
+#include <EEPROM.h>                   // Old fixed settings layout, read once at boot
+#include <flash_hal.h>                // FS_PHYS_ADDR, the flash region the settings log lives in
+#include <time.h>                     // time() for SNTP
+#include <coredecls.h>                // settimeofday_cb(), called when SNTP sets the time
+#include <OneWire.h>                  // 1-Wire bus for DS18B20 zone sensors
+#include <DallasTemperature.h>        // DS18B20 conversions, used without waiting
+
+// CONFIGURATION ----------------------
+// What the board is built for: unit, sensors and pins, filter and task periods. All are
+// compile-time constants, so code for a sensor no zone uses drops out and each conversion
+// folds to one integer multiply and divide. From the sensor read to the thermostat compare,
+// temperatures are whole hundredths of a degree in TEMP_UNIT (tenths would be coarser than
+// the 0.05 hysteresis); the ESP8266 has no FPU, and every float operation is a library call.
+
+constexpr long divRound(long n, long d) {
+// RETURNS n / d ROUNDED TO NEAREST, HALVES AWAY FROM ZERO (d > 0) ------------------------------
+  return n >= 0 ? (n + d / 2) / d : -((-n + d / 2) / d);
+}
+
+constexpr long gcd(long a, long b) {
+// RETURNS GREATEST COMMON DIVISOR, TO KEEP CONVERSION FACTORS SMALL ENOUGH FOR 32 BITS ----------
+  return b == 0 ? a : gcd(b, a % b);
+}
+
+template <int unit> struct Units;
+
+template <> struct Units<UNIT_F> {
+  static constexpr char symbol = 'F';
+  static constexpr long perC = 9;                 // Degrees per perCDiv degrees C
+  static constexpr long perCDiv = 5;
+  static constexpr long at0C = 3200;              // Hundredths at 0 C
+  static constexpr int spMin10 = 400;             // Lowest setpoint accepted from the API, tenths
+  static constexpr int spMax10 = 950;             // Highest setpoint accepted from the API, tenths
+  static constexpr int startSetPoint10 = 735;     // Startup setpoint if nothing saved, tenths
+  static constexpr int failSafe100 = 100;         // Shut down if temp lower than this (sensor failure)
+  static constexpr int failed100 = 0;             // avgTemp of a failed sensor, below failSafe100
+  static constexpr int remoteMin100 = -4000;      // Range of readings taken from /api/sensor
+  static constexpr int remoteMax100 = 15000;
+  static constexpr int faultMin100 = -2200;       // Readings outside this are a sensor fault, not a room
+  static constexpr int faultMax100 = 14000;
+  static constexpr int jumpRate100 = 500;         // Change per second no room makes, FAULT_JUMP
+  static constexpr int effectMin100 = 30;         // Least move a running device makes in FAULT_EFFECT_TIME
+};
+
+template <> struct Units<UNIT_C> {
+  static constexpr char symbol = 'C';
+  static constexpr long perC = 1;
+  static constexpr long perCDiv = 1;
+  static constexpr long at0C = 0;
+  static constexpr int spMin10 = 45;
+  static constexpr int spMax10 = 350;
+  static constexpr int startSetPoint10 = 230;
+  static constexpr int failSafe100 = -1722;
+  static constexpr int failed100 = -1778;
+  static constexpr int remoteMin100 = -4000;
+  static constexpr int remoteMax100 = 6500;
+  static constexpr int faultMin100 = -3000;
+  static constexpr int faultMax100 = 6000;
+  static constexpr int jumpRate100 = 280;
+  static constexpr int effectMin100 = 17;
+};
+
+struct Config : Units<TEMP_UNIT> {
+  static constexpr unsigned long samplePeriod = 1000;   // Freq of temperature reading
+  static constexpr unsigned long thermoPeriod = 5000;   // Freq of thermo on off descision
+  static constexpr unsigned long outputPeriod = 100;    // Freq of output pin update
+  static constexpr unsigned long powerWait = 300000;    // Time to wait to restart cooler (5 mins)
+
+  // Mean and EMA take constant time at any window. The median shifts its sorted copy, up to a
+  // window of readings per sample for each zone, so raising window or windowMax with it slows
+  // the sample task in step.
+  static constexpr byte filter = FILTER_MEAN;           // Filter used to smooth readings
+  static constexpr int window = 60;                     // Readings in filter window at startup (1 - windowMax)
+  static constexpr int windowMax = 60;                  // Max readings the filter holds
+
+  static constexpr byte oneWirePin = D4;                // 1-Wire bus for DS18B20 zones
+  static constexpr unsigned long oneWireConvert = 750;  // DS18B20 12 bit conversion; sooner reads get the power-on 85 C
+  static constexpr int adcBurst = 32;                   // analogRead()s per temperature reading
+  static constexpr int adcTrim = 8;                     // Lowest and highest reads dropped from each burst
+  static constexpr int adcKept = adcBurst - 2 * adcTrim;
+  static constexpr long adcFullScale = 3100;            // Millivolts at 1024 counts. Used 3.1 - seems more accurate on ESP8266
+  static constexpr long tmp36Zero = 500;                // TMP36 millivolts at 0 C, 10 mV per degree C above
+
+  // Hundredths = sum of kept counts * adcMul / adcDiv + adcAdd, and raw DS18B20 * owMul / owDiv + at0C
+  static constexpr long adcMul = adcFullScale * 10 * perC / gcd(adcFullScale * 10 * perC, 1024L * adcKept * perCDiv);
+  static constexpr long adcDiv = 1024L * adcKept * perCDiv / gcd(adcFullScale * 10 * perC, 1024L * adcKept * perCDiv);
+  static constexpr long adcAdd = at0C - tmp36Zero * 10 * perC / perCDiv;
+  static constexpr long owMul = 100 * perC / gcd(100 * perC, 128 * perCDiv);   // Raw is 1/128 C
+  static constexpr long owDiv = 128 * perCDiv / gcd(100 * perC, 128 * perCDiv);
+
+  static constexpr long adcHundredths(long sum) {
+  // RETURNS HUNDREDTHS FROM THE SUM OF A BURST'S KEPT READS (TMP36) ----------------------------
+    return divRound(sum * adcMul, adcDiv) + adcAdd;
+  }
+  static constexpr long oneWireHundredths(long raw) {
+  // RETURNS HUNDREDTHS FROM A DS18B20'S RAW READING ------------------------------------------
+    return divRound(raw * owMul, owDiv) + at0C;
+  }
+};
+
+struct ZoneConfig {
+  const char *name;                 // Shown on the main page and in the API
+  byte source;                      // SRC_ADC, SRC_ONEWIRE or SRC_REMOTE
+  byte sensor;                      // Pin (ADC) or index on the bus (1-Wire)
+  byte relayPin;                    // Pin controlling device
+};
+
+constexpr ZoneConfig zoneConfig[] = {
+  {"Zone 1", SRC_ADC, A0, D2},
+  {"Zone 2", SRC_ONEWIRE, 0, D5},
+  {"Zone 3", SRC_ONEWIRE, 1, D6},
+  {"Zone 4", SRC_REMOTE, 0, D7},
+  {"Zone 5", SRC_ONEWIRE, 2, D1},
+  {"Zone 6", SRC_REMOTE, 0, D0},
+};
+
+static_assert(ZONES >= 1 && ZONES <= sizeof(zoneConfig) / sizeof(zoneConfig[0]), "ZONES must be 1 to the entries in zoneConfig");
+static_assert(Config::window >= 1 && Config::window <= Config::windowMax, "window must be 1 to windowMax");
+static_assert(FAULT_CYCLES >= FAULT_CYCLE_SPAN / Config::powerWait, "FAULT_CYCLES must allow what the cooler restart wait does");
+static_assert(1023L * Config::adcKept * Config::adcMul < 0x7FFFFFFFL, "ADC conversion must fit in 32 bits");
+static_assert((TRACE_BYTES & (TRACE_BYTES - 1)) == 0 && TRACE_BYTES >= 2048, "TRACE_BYTES must be a power of 2, 2048 or more");
+static_assert(ZONES <= 8, "trace records have 3 bits for the zone");
+
+constexpr bool zonesUse(byte source, int i = 0) {
+// TRUE IF ANY ZONE IN USE READS THIS SOURCE, SO CODE FOR THE OTHERS FOLDS AWAY ---------------
+  return i < ZONES && (zoneConfig[i].source == source || zonesUse(source, i + 1));
+}
+
+// FUNCTION PROTOTYPES ----------------
+// The Arduino IDE generates these for .ino sketches, declared here so the file also builds
+// as plain C++ (see sim/ for the host simulation build)
+
+struct Zone;
+
+void runTask(int i, unsigned long now);
+void kickTask(int i);
+void deferTask(int i, unsigned long ms);
+void getTemp();
+int readZone(int i);
+void faultSample(int i, int reading);
+void faultEffect(Zone &z, unsigned long now);
+void faultStart(int i);
+void faultRaise(int i, byte alarm);
+byte faultActive(Zone &z);
+void faultClear(int i);
+void apiAlarms();
+void renderAlarms(byte alarms, bool json);
+void thermoStat();
+void thermoZone(Zone &z);
+void controlDevice(Zone &z, bool want);
+bool hystDecide(Zone &z);
+bool pidDecide(Zone &z);
+bool predictDecide(Zone &z);
+void predictLearn(Zone &z, int temp10, byte duty);
+void changeControl(Zone &z, byte mode);
+void apiControl();
+void sendOutput();
+void serviceHttp();
+void persistSettings();
+void pushEvents();
+void serviceMqtt();
+void serviceWifi();
+void apiCommand();
+void commandReject(int code, PGM_P message);
+bool commandTake();
+int commandSetPoint(int zone);
+void commandQueue(int zone, byte set, int setPoint10, bool powerSet, bool heatMode);
+void commandDrop(Zone &z, byte set);
+void applyCommands();
+void netBegin(bool fast);
+void netJoin(bool fast);
+void netPortal(unsigned long now);
+void netUp(unsigned long now);
+bool loadNetCache();
+void timingAdd(struct Timing &t, uint32_t cycles);
+uint32_t timingQuantile(struct Timing &t, float q);
+void apiMetrics();
+void metricsMore();
+bool metricsNext(long *at);
+void metricsHelp(PGM_P name, PGM_P type, PGM_P help);
+void metricsName(PGM_P name, PGM_P suffix, const char *labels, PGM_P extra, const char *extraValue);
+void metricsLe(char *le, int bucket);
+void metricsSeconds(uint64_t cycles, int decimals);
+void metricsReset();
+long getCounts(int pin);
+void apiCalibrate();
+void apiSensor();
+void apiZones();
+bool pickZone();
+void setClock(unsigned long epoch, byte source);
+void clockSynced();
+unsigned long clockNow();
+void runSchedule();
+void applyRule(byte rule);
+bool parseSchedule(const char *s);
+void compileSchedule();
+void apiTime();
+void apiSchedule();
+void renderSchedule();
+bool loadSchedule();
+void saveSchedule();
+bool loadCalibration();
+void saveCalibration();
+void setFilter(Zone &z, int window);
+int filterTemp(Zone &z, int reading);
+void sortedReplace(Zone &z, bool full, int oldest, int reading);
+int calibrated(Zone &z);
+void handle_OnConnect();
+void addDegree();
+void minusDegree();
+void powerOn();
+void powerOff();
+void modeHeat();
+void modeCold();
+void clearAlarms();
+void eraseEEPROM();
+void writeEEPROM();
+void resetPage();
+void resetSetting();
+void handle_NotFound();
+void serveStatic();
+void settingsChanged();
+bool loadSettings();
+byte saveSettings();
+byte crc8(byte crc, byte data);
+uint32_t logAddr(int sector);
+int logSize(int len);
+bool logHeaderValid(int sector, uint32_t *seq);
+int logFetch(int sector, int at, uint32_t *rec);
+bool logOpen();
+int logRead(byte type, byte *buf, int max);
+void logWrite(byte type, const byte *buf, int len);
+void logAppend(byte type, const byte *buf, int len, bool live);
+void logMove(byte type, const byte *buf, int len);
+void changeSetPoint(Zone &z, int value10);
+void changePower(Zone &z, bool on);
+void changeMode(Zone &z, bool cool);
+unsigned long lockoutRemaining(Zone &z);
+void checkState();
+void apiState();
+bool stateNotModified();
+void apiSetPoint();
+void apiPower();
+void apiMode();
+bool argFloat(const char *name, float *value);
+bool argUnsigned(const char *name, unsigned long *value);
+void apiError(int code, PGM_P message);
+void apiEvents();
+int renderEvent(int zone);
+void mqttConnect(unsigned long now);
+void mqttLost(unsigned long now);
+void mqttRead(unsigned long now);
+void mqttPacket(byte type, const byte *body, int len, unsigned long now);
+void mqttCommand(const char *topic, const char *payload);
+void mqttState(int zone);
+void mqttReport();
+void mqttBegin(const char *topic, bool retain);
+void mqttPut(const char *s, size_t n);
+void mqttEnd();
+void mqttSend(const byte *p, int len, unsigned long now);
+void mqttFlush(unsigned long now);
+int mqttPacketLen(const byte *p, int len, int *head);
+int mqttString(byte *p, const char *s);
+void histSample(int i);
+void histClose(int temp10, int setPoint10, int duty);
+void apiHistory();
+void histMore();
+void traceSample(int i, long raw);
+void traceThermo();
+void traceSettings(int i);
+void traceKey(unsigned long now);
+bool traceEvent(byte kind, int zone, byte arg);
+bool traceRecord(byte kind, int zone, byte arg);
+bool traceRoom(unsigned int n);
+unsigned int traceLength(unsigned long pos);
+void traceHold();
+void tracePut(unsigned long v);
+void traceSigned(long v);
+void traceWord(uint32_t v);
+void apiTrace();
+void traceMore();
+int tenths(float v);
+int hundredths(float v);
+void settingsPage();
+void sendRedirect();
+void settingsRedirect();
+void renderPage(int code, PGM_P tpl);
+void renderBegin(int code, const char *type);
+void renderTemplate(PGM_P tpl);
+void renderValue(const char *key);
+void renderZoneNav();
+void renderOut(const char *s, size_t n);
+void renderOut_P(PGM_P s);
+void renderOutN_P(PGM_P s, size_t n);
+void renderFixed(float v, int decimals);
+void renderInt(long v);
+void renderTenths(long v);
+void renderDecimals(long v, int decimals);
+void renderFlush();
+void renderEnd();
+PGM_P httpReason(int code);
+int urlDecode(char *s);
+
+// TIMING ---------------------------
+// Durations are taken with the CPU cycle counter, which costs a register read, and go into
+// doubling buckets found with one count-leading-zeros. /metrics gives them as Prometheus
+// histograms, with min, max and percentiles estimated from the buckets.
+
+struct Timing {
+  uint32_t count;                   // Runs timed
+  uint32_t minCycles;
+  uint32_t maxCycles;
+  uint64_t sumCycles;
+  uint32_t buckets[TIMING_BUCKETS]; // Runs per bucket, bucket i up to 2^(TIMING_FIRST + i) cycles
+};
+
+Timing loopTiming;                  // One pass of loop(), not counting its sleep
+unsigned long timingSince = 0;      // millis() timings were last reset
 
 // SCHEDULING TASKS ----------------
 
-unsigned long prevTempMillis = 0;   // Init timer var for Temp readings
-unsigned long prevThermoMillis = 0; // Init timer var for Thermostat
+struct Task {
+  const char *name;                 // Name shown in stats
+  void (*run)();                    // Function called when due
+  unsigned long period;             // Millis between runs (0 = every pass)
+  unsigned long deadline;           // Millis after due time before a run counts as late
+  unsigned long due;                // millis() when next run is due
+  unsigned long lastRun;            // millis() when last run started
+  unsigned long lastMicros;         // Duration of last run
+  unsigned long maxMicros;          // Longest run since boot
+  unsigned long runs;               // Runs since boot
+  unsigned long late;               // Runs started after deadline since boot
+  Timing timing;                    // Run durations
+};
+
+#define TASK_SAMPLE 0
+#define TASK_THERMO 1
+#define TASK_OUTPUT 2
+#define TASK_HTTP 3
+#define TASK_PERSIST 4
+#define TASK_PUSH 5
+#define TASK_SCHEDULE 6
+#define TASK_MQTT 7
+#define TASK_WIFI 8
+#define TASK_COMMAND 9
+#define TASK_COUNT 10
+
+Task tasks[TASK_COUNT] = {            // Runtime fields from due on start at zero
+  {"sample", getTemp, Config::samplePeriod, 100, 0, 0, 0, 0, 0, 0, {}},
+  {"thermostat", thermoStat, Config::thermoPeriod, 1000, 0, 0, 0, 0, 0, 0, {}},
+  {"output", sendOutput, Config::outputPeriod, 100, 0, 0, 0, 0, 0, 0, {}},
+  {"http", serviceHttp, HTTPFRQ, 50, 0, 0, 0, 0, 0, 0, {}},
+  {"persist", persistSettings, SAVEFRQ, 5000, 0, 0, 0, 0, 0, 0, {}},
+  {"push", pushEvents, SSE_FRQ, 500, 0, 0, 0, 0, 0, 0, {}},
+  {"schedule", runSchedule, SCHED_RECHECK, 60000, 0, 0, 0, 0, 0, 0, {}},
+  {"mqtt", serviceMqtt, MQTT_FRQ, 500, 0, 0, 0, 0, 0, 0, {}},
+  {"wifi", serviceWifi, WIFI_FRQ, 500, 0, 0, 0, 0, 0, 0, {}},
+  {"command", applyCommands, CMD_IDLE, 100, 0, 0, 0, 0, 0, 0, {}},
+};
+
+bool bootDecided = 0;               // Thermostat has decided for every zone from a reading since boot
+unsigned long bootDecisionMs = 0;   // millis() it first did, how long control took to start
 
 // READING TEMP --------------------
 
-float tempArray[TEMPARRAYSIZE];     // Define constant array for temp avg
-int tempArrayCtr = 0;               // Counter for array
+unsigned long radioAt = 0;          // millis() the sketch last sent anything over Wi-Fi
+unsigned long adcLastBurst = 0;     // millis() of last ADC burst
+unsigned long adcDeferred = 0;      // Times a reading waited for the radio since boot
+int sampleZone = 0;                 // Zone the sample task reads next
+unsigned long sampleDue = 0;        // Sample task due time for the next cycle, kept while zones are read
+bool sampledAll = 0;                // Every zone has been read since boot
+unsigned long oneWireAt = 0;        // millis() of the last conversion request
+OneWire oneWire(Config::oneWirePin);
+DallasTemperature oneWireSensors(&oneWire);
 
-// THERMOSTAT ----------------------
+// SETTINGS LOG ---------------------------
+// Settings are a log of records in LOG_SECTORS raw flash sectors at the start of the
+// filesystem region, which the sketch has no other use for. A save appends a record: its
+// header word goes first with the commit byte still erased, then the payload, then the commit
+// byte is cleared. Boot takes committed records only; one that isn't (power went while it was
+// written) ends that sector's log, and the next save moves to a new sector. When a sector is
+// full, or closed that way, the next one in turn is erased, the latest record of each type and
+// the new one are copied in, and its header is written last under the next sequence number.
+// Until that header is whole the old sector is still the log, so a power cut at any step
+// leaves the settings from before the save or after it. Taking the sectors in turn spreads
+// erases over all of them. An append is a few flash writes of under a milli each; a move to
+// a new sector adds an erase of about 45 ms, once every few hundred saves.
+// Records are a header word (type, payload length, crc8 of type, length and payload, commit)
+// then the payload padded to whole words. Fields are only ever added to the end of a
+// payload, so a shorter (older) record loads with defaults for the fields it lacks.
 
-float setPoint = 73.50;                // Startup setpoint for heat if nothing in EEPROM
-float hyst = 0.05;                  // Hysterysis setting in degrees F
-float avgTemp = 0;                  // Initialise avg temp
-boolean device = 0;                 // Device on or off
-boolean heatMode = 0;                // Heat or cool mode
-boolean lastDeviceState = 0;        // Last device state (used so not writing to output pin unless necessary)
-boolean heatOut = 0;                // Connects device to output if power on
-boolean powerSet = 0;               // On off switch
-boolean deviceLastSetting = 0;    // used to tell if first time off
-int failSafeTemp = 1;             // Shut down if temp lower than this (sensor failure)
+#define LOG_SECTORS 4                 // Flash sectors the log takes in turn
+#define LOG_SECTOR FLASH_SECTOR_SIZE  // Bytes per sector, 4 KB
+#define LOG_HDR 8                     // Sector header: sequence (4 bytes), magic, crc8, 2 unused
+#define LOG_MAGIC 0x5A                // Marks a sector header
+#define LOG_COMMIT 0x00               // Commit byte of a whole record, erased flash reads 0xFF
+#define LOG_ERASED 0xFFFFFFFF         // Header word of erased flash, end of records
+#define LOG_PAYLOAD 255               // Longest record payload
+#define LOG_WORDS (1 + (LOG_PAYLOAD + 3) / 4) // Longest record in words, header included
+#define LOG_TYPES 8                   // Record types 1 to LOG_TYPES-1
+#define REC_SETTINGS 1                // setPoint tenths (2 bytes), powerSet, heatMode, ctrlMode; repeated per zone
+#define REC_CALIB 2                   // Offset hundredths F (2 bytes), gain ten-thousandths (2 bytes); repeated per zone
+#define REC_SCHEDULE 3                // Time zone quarter hours, then 5 bytes per rule (see saveSchedule)
+#define REC_WIFI 4                    // Last join: BSSID (6 bytes), channel, then address, gateway, subnet, DNS (4 bytes each)
+#define SAVE_SETTLE 5000              // Setting changes are saved once left alone this long
+#define SAVE_INTERVAL 30000           // Least time between saves of setting changes
+#define LOG_ROOM (FS_PHYS_SIZE >= LOG_SECTORS * LOG_SECTOR) // Flash layout leaves the log room, else nothing is saved
+#define EEPROM_SIZE 512               // Old fixed layout
 
-// PINS -----------------------------
+const int ID_ADDR = 0;              // Old fixed layout: address of ID showing data present
+const int setPointAddr = 5;         // Old fixed layout: address settings began at
+const byte EEPROM_ID = 0x99;        // Old fixed layout: ID for valid data
+bool settingsStored = 0;            // A settings record exists
+bool settingsDirty = 0;             // Settings changed since last save
+unsigned long settingsChangedAt = 0; // millis() of last setting change
+unsigned long lastSave = 0;         // millis() of last settings save
+int logSector = -1;                 // Sector in use, -1 if none has a whole header
+uint32_t logSeq = 0;                // Sequence number of sector in use
+int logEnd = 0;                     // Offset in sector where next record goes, LOG_SECTOR once closed
+int logLatest[LOG_TYPES];           // Offset in sector of latest record of each type, 0 if none
 
-int tempPin = A0;                   // Pin temp sensor is attached to
-int heatCtrlPin = D2;               // Pin controlling device
+// WI-FI ----------------------------
+// Control runs from boot whether or not there is a network. The wifi task joins in the
+// background: first straight to the access point, channel and address of the last join,
+// kept in the settings log, which skips the scan and DHCP; then a full join if that doesn't answer;
+// then, if nothing has joined since boot, WiFiManager's portal, serviced between tasks rather
+// than holding the loop, which closes after WIFI_PORTAL_TIME so joining is tried again. With
+// a join cached, the portal tries it every WIFI_PORTAL_RETRY while it is up, so an access
+// point that was only off for a while is rejoined soon after it is back.
 
-// EEPROM ---------------------------
+#define NET_FAST 0                    // Joining the cached access point with the cached address
+#define NET_JOIN 1                    // Full join, scanning for the SSID and asking DHCP
+#define NET_PORTAL 2                  // Portal up for new credentials
+#define NET_UP 3                      // Joined
+#define NET_CACHE 23                  // REC_WIFI payload bytes
 
-const int ID_ADDR = 0;              // the EEPROM address used to store the ID and show data present
-const int setPointAddr = 5;         // address to begin storing settings
-const byte EEPROM_ID = 0x99;        // used to identify if valid data in EEPROM
-const byte EEPROM_CLR = 0x98;       // used to identify invalid data
-int storedSetPoint = 0;             // var used to hold Temp setpoint from EEPROM
-bool storedPowerState = 0;          // var used to hold Power setting from EEPROM
-bool storedHeatMode = 0;            // var used to hold heat mode setting from EEPROM
+struct NetLink {
+  byte state = NET_JOIN;
+  unsigned long since = 0;          // millis() state was entered, or of the last join tried from the portal
+  byte cache[NET_CACHE];            // Last join as REC_WIFI holds it
+  bool cached = 0;                  // cache holds a join
+  unsigned long upAt = 0;           // millis() of the first join since boot, 0 until then
+  byte upPath = NET_JOIN;           // State the first join was made from
+  unsigned long joins[3] = {0};     // Joins made from NET_FAST, NET_JOIN and NET_PORTAL
+  unsigned long drops = 0;          // Times the link went down once joined
+};
 
-// COOLER RESTART TIMER -------------
-unsigned long shutDownTimer = 0;
+NetLink net;
+WiFiManager portal;
 
-ESP8266WebServer server(80);        // Start web server port 80
+// COMMANDS -------------------------
+// /api/command and the +/- buttons queue changes rather than making them. Changes to a zone
+// within CMD_WINDOW of the first are applied together by the command task, so a burst of
+// taps or a script's run of requests is one setting change: one save, one state version and
+// one event or MQTT publish. Each accepted command gets a number in its reply; a client that
+// sends seq= can retry without the change being made twice. A change made at once, through
+// /api/setpoint, /api/power, /api/mode, MQTT or the schedule, drops whatever is queued for the
+// same setting, so the last one made wins.
 
-void setup(){
+#define CMD_SETPOINT 1                // PendingCmd set bits, what a burst changes
+#define CMD_POWER 2
+#define CMD_MODE 4
 
-// CONNECT TO WIFI -------------------------------------
+struct PendingCmd {
+  byte set = 0;                     // CMD_ bits waiting to be applied
+  int setPoint10;                   // Setpoint the burst ends at, tenths
+  bool powerSet;
+  bool heatMode;
+  unsigned long since;              // millis() of the burst's first command
+};
 
-  WiFiManager wifiManager;          // Start WifiManager
-  wifiManager.autoConnect();        // Connect to Wifi
+struct CmdSeen {
+  unsigned long cmd = 0;            // Number the command was given, 0 for an empty slot
+  unsigned long seq;                // Client's seq=
+  bool hasSeq;                      // Client sent seq=
+  byte zone;
+  int setPoint10;                   // What the reply said the zone would be set to
+  bool powerSet;
+  bool heatMode;
+  bool clamped;                     // Relative change stopped at a setpoint limit
+};
 
-// BEGIN SERVICES --------------------------------------
+PendingCmd pending[ZONES];
+CmdSeen cmdSeen[CMD_SEEN];          // Recent commands that sent seq=, oldest overwritten
+int cmdSeenNext = 0;                // Slot the next one goes in
+CmdSeen cmdReply;                   // Command the COMMAND_JSON keys render
+bool cmdReplay = 0;                 // Reply is a repeat
+unsigned long cmdCount = 0;         // Commands accepted since boot, the last one's number
+unsigned long cmdReplays = 0;       // Repeated seq= answered without a change
+unsigned long cmdLimited = 0;       // Turned away by the rate limit
+unsigned long cmdRejected = 0;      // Invalid
+unsigned long cmdBursts = 0;        // Queued changes applied, one per zone per burst
+long cmdTokens = CMD_BURST * 1000L; // Rate limit bucket, thousandths of a command
+unsigned long cmdRefillAt = 0;      // millis() the bucket was last topped up
 
-  Serial.begin(9600);               // Start serial service. Only using when debugging
-  EEPROM.begin(512);                // Start EEPROM service
+// SCHEDULE -------------------------
+// Rules are what the user sets: weekdays, time of day and what to do. They are compiled into
+// events, one per rule per weekday, sorted by minute of the week. The schedule task sleeps
+// until the next event is due, so passes of loop() cost nothing but the usual due check.
 
-// SET PIN MODES --------------------------------------
-  
-  pinMode(tempPin, INPUT);          // Assign input pin for temp sensor
-  pinMode(heatCtrlPin, OUTPUT);     // Assign output pin for Relay controlling heat
+struct SchedRule {
+  byte days;                        // Bit 0 Sunday to bit 6 Saturday
+  byte mode;                        // 0 heat, 1 cool, 2 power off
+  uint16_t minute;                  // Minute of day
+  uint16_t setPoint10;              // Setpoint tenths
+  byte zone;                        // Zone the rule sets
+};
 
+struct SchedEvent {
+  uint16_t at;                      // Minute of week, 0 is Sunday midnight
+  byte rule;
+};
 
+SchedRule schedRules[SCHED_RULES];
+int schedRuleCount = 0;
+SchedEvent schedEvents[SCHED_EVENTS];
+int schedEventCount = 0;
+unsigned long schedNextAt = 0;      // millis() the next event is due
+unsigned long clockEpoch = 0;       // UTC seconds at clockMillis
+unsigned long clockMillis = 0;
+int clockTz = SCHED_TZ;             // Local time, minutes east of UTC
+byte clockSource = CLOCK_NONE;
 
-// ASSIGN WEBPAGES TO BUTTON PRESSES ----------------------
+// STATE API ------------------------
 
-  server.on("/", handle_OnConnect);             // If nothing in header
-  server.on("/settings", settings);             // Settings button clicked
-  server.on("/addDegree", addDegree);           // If + button clicked
-  server.on("/minusDegree", minusDegree);       // If - button clicked
-  server.on("/powerOn", powerOn);               // If power on button clicked
-  server.on("/powerOff", powerOff);             // If power off button clicked
-  server.on("/modeHeat", modeHeat);             // If heat mode button clicked
-  server.on("/modeCold", modeCold);             // If cold mode button clicked
-  server.on("/writeEEPROM", writeEEPROM);       // If save button clicked
-  server.on("/resetPage", resetPage);           // If back button pressed
-  server.on("/eraseEEPROM", eraseEEPROM);       // If erase eeprom pressed
-  server.onNotFound(handle_NotFound);           // If something else in header
-  server.begin();
+struct StateSnap {
+  int temp10;                       // avgTemp in tenths, the resolution /api/state reports
+  int setPoint10;
+  int hyst100;
+  byte flags;                       // device, powerSet, heatMode, ctrlMode
+  byte alarms;
+  unsigned long lockout;            // Cooler restart wait in LOCKOUT_STEP seconds
+};
 
+unsigned long stateVersion = 1;     // Bumped on any change to any zone's state, sent as the ETag
 
-// CHECK FOR SETTINGS IN EEPROM ------------------------
-  
-  byte id = EEPROM.read(ID_ADDR);   // read the first byte from the EEPROM
+// ZONES ----------------------------
+// A zone is one sensor driving one relay. Wiring is fixed at build time in zoneConfig; what
+// changes at run time is in the zone's entry of zones[]. The sample, thermostat and output
+// tasks each go through every zone in one run (sampling one zone per run, see getTemp).
 
-  if( id == EEPROM_ID) {            // EEPROM contains saved settings
-    
-    Serial.println("Data found in eeprom");
+struct Zone {
+  // Reading temp
+  int16_t tempArray[Config::windowMax];   // Ring buffer of readings for temp avg, hundredths
+  int16_t tempSorted[Config::windowMax];  // Same readings kept in order (median filter only)
+  int tempArrayCtr = 0;             // Next slot to load in ring buffer
+  int tempCount = 0;                // Number of readings actually in ring buffer
+  int tempWindow = Config::window;  // Number of readings filtered
+  long tempSum = 0;                 // Running sum of readings in ring buffer, exact so never drifts
+  long tempEma = 0;                 // Running value of exponential average, hundredths << EMA_SHIFT
+  int rawTemp100 = 0;               // Filtered temp before calibration
+  int calOffset100 = 0;             // Per-sensor calibration, avgTemp = rawTemp * calGain + calOffset
+  unsigned int calGain10000 = 10000;
+  byte sensorAddr[8];               // DS18B20 ROM code (SRC_ONEWIRE)
+  int remoteTemp100 = NO_READING;   // Last reading POSTed (SRC_REMOTE), NO_READING until one arrives
+  unsigned long remoteAt = 0;       // millis() remoteTemp arrived
 
-    byte hiByte =  EEPROM.read(setPointAddr);
-    byte lowByte =  EEPROM.read(setPointAddr+1);
-    storedSetPoint =  word(hiByte, lowByte);
+  // Thermostat, temperatures in hundredths of TEMP_UNIT and setpoint in tenths as it is saved
+  int setPoint10 = Config::startSetPoint10;
+  int hyst100 = 5;                  // Hysterysis setting
+  int avgTemp100 = 0;               // Initialise avg temp
+  boolean device = 0;               // Device on or off
+  boolean heatMode = 0;             // Heat or cool mode
+  boolean lastDeviceState = 0;      // Last device state (used so not writing to output pin unless necessary)
+  boolean powerSet = 0;             // On off switch
+  boolean deviceLastSetting = 0;    // used to tell if first time off
+  unsigned long switches = 0;       // Relay changes since boot
+  byte ctrlMode = CTRL_HYST;        // Control algorithm
+  unsigned long deviceChangedAt = 0; // millis() device last turned on or off
+  unsigned long shutDownTimer = 0;  // Cooler restart timer
 
+  // PID
+  float pidI = 0;                   // Integral term, output fraction
+  int pidLastTemp100 = 0;           // avgTemp at last PID update
+  unsigned long pidLast = 0;        // millis() of last PID update, 0 before first
+  unsigned long pidWindowStart = 0; // millis() current time proportioning window began
+  bool pidDone = 0;                 // Device has had its on time for this window
 
+  // Predictive
+  float predictRate = PREDICT_RATE; // Learned degrees per minute the device moves the room while running
+  int predictPrevTemp10 = 0;        // Previous minute, tenths F
+  byte predictPrevDuty = 0;         // Previous minute device on time, 63rds
 
+  // Minute being summed (history for zone 0, predictive learning for all)
+  unsigned long histMinute = 0;     // Uptime minute readings are being summed for
+  long histTempSum = 0;             // Sum of readings this minute, tenths F
+  long histSetPointSum = 0;         // Sum of setPoint this minute, tenths F
+  int histOn = 0;                   // Readings this minute with device on
+  int histSamples = 0;              // Readings this minute
 
-    // storedSetPoint = EEPROM.read(setPointAddr);     // Read first EEPROM addr and load var for EEPROM value with setpoint
-      setPoint = storedSetPoint;                    // Load stored setpoint value to working setpoint
-      setPoint /= 10;                               // Div by 10 to get correct float value back
-      
-    storedPowerState = EEPROM.read(setPointAddr+5); // Read second EEPROM addr and load var for EEPROM value with power setting
-      powerSet = storedPowerState;                  // Load stored power value to working power setting
+  // Saved settings
+  int storedSetPoint = 0;           // Setpoint tenths in latest settings record
+  bool storedPowerState = 0;        // Power setting in latest settings record
+  bool storedHeatMode = 0;          // Heat mode setting in latest settings record
+  byte storedCtrlMode = 0;          // Control algorithm in latest settings record
+  int storedCalOffset = 0;          // Offset hundredths in latest calibration record
+  unsigned int storedCalGain = 10000; // Gain ten-thousandths in latest calibration record
 
-    storedHeatMode = EEPROM.read(setPointAddr+6);   // Read third EEPROM addr and load var for EEPROM value with heat setting
-      heatMode = storedHeatMode;                  // Load stored heat value to working power setting
+  // Schedule and state API
+  int schedCurrent = -1;            // Event in effect, -1 until the first one is applied
+  unsigned long schedFrom = 0;      // Local minute since 1970 that occurrence of it began
+  bool schedOverride = 0;           // Setting changed by hand since the event in effect
+  StateSnap snap;                   // What /api/state last reported
 
+  // MQTT
+  int mqttTemp100 = 0;              // avgTemp in last state published
+  int mqttSetPoint10 = 0;           // setPoint in last state published
+  uint16_t mqttFlags = 0xFFFF;      // device, powerSet, heatMode, ctrlMode, alarms in last state published, 0xFFFF for none
 
-    Serial.println(storedSetPoint);
-    Serial.println(setPoint);
-  } else {
-    Serial.println("Data not found in eeprom");
-    
-  }
-}
+  // Faults, checked as each reading and relay start comes in
+  byte alarms = 0;                  // FAULT_ bits latched, cleared through /api/alarms
+  unsigned long alarmAt[FAULT_KINDS];   // millis() each was last raised
+  unsigned long alarmCount[FAULT_KINDS] = {0};  // Times each was raised since boot
+  int faultLast100 = NO_READING;    // Previous reading
+  unsigned long faultLastAt = 0;    // millis() of previous reading
+  byte faultBad = 0;                // Bad readings in a row
+  int faultSame = 0;                // ADC readings in a row equal to the previous one
+  byte faultJumps = 0;              // Jumps within FAULT_JUMP_SPAN of each other
+  unsigned long faultJumpAt = 0;    // millis() of the last jump
+  bool effectRunning = 0;           // Device has been on since effectAt
+  int effectRef100 = 0;             // Coldest (heat) or warmest (cool) avgTemp since effectAt
+  unsigned long effectAt = 0;       // millis() the device turned on or last moved the room effectMin100
+  unsigned long faultStarts[FAULT_CYCLES + 1];   // millis() of the latest relay starts, a ring
+  byte faultStartNext = 0;          // Slot the next start goes in
+  byte faultStartCount = 0;         // Slots filled, up to FAULT_CYCLES + 1
+};
 
-void loop(){
+Zone zones[ZONES];
+int zoneSel = 0;                    // Zone a request or event is about, set by pickZone()
 
-// SCHEDULE TEMPERATURE READINGS -----------------------------
-// Initiates temp reading every TEMPFRQ milliseconds
-  
-  if (millis() - prevTempMillis >= TEMPFRQ) {      
-    prevTempMillis = millis();                          // Reset timer
-    getTemp();                                          // Get temp from sensor (using function getTemp)
+// FAULTS ---------------------------
+// Each reading is checked as it comes in, in constant time: for a sensor that is open,
+// shorted or silent, an ADC that has stopped changing and readings that jump faster than a
+// room can. A running device must move its room within FAULT_EFFECT_TIME, which catches a
+// failed heater, cooler or relay and a sensor frozen on one value. Relay starts go in a ring
+// whose oldest entry says whether the zone is starting more often than FAULT_CYCLES an hour.
+// A fault latches an alarm, which stays until cleared through /api/alarms even if the fault
+// goes. Alarms in FAULT_OFF hold the device off from the next thermostat run, at once rather
+// than when the average has decayed below failSafe100. FAULT_NO_EFFECT and FAULT_CYCLING only
+// report: control goes on as before, so a detector set too keen can't change how a zone runs.
+// A heater flat out against a cold night looks the same as a dead one, and switching it off
+// would let the room go. Alarms are not saved, a reboot clears them.
 
-    // Serial.println("Pin Reading");
-    // Serial.println(analogRead(tempPin));
-  }
+const char *const faultNames[FAULT_KINDS] = {"sensor", "stuck", "jump", "no_effect", "cycling"};
 
-// SCHEDULE THERMOSTAT --------------------------------------
-// Initiates thermostat decision every THERMFRQ milliseconds if power setting is on
-  
-/*  if (millis() - prevThermoMillis >= THERMFRQ) {
-    Serial.println("Time until cooler start");
-    Serial.println(millis() - shutDownTimer);
-    Serial.println("Output Device");
-    Serial.println(device);
-   
-      prevThermoMillis = millis();                  // Reset timer
-    
-     } */
-    
-  
-  thermoStat();                                 // Run thermostat object
+// TRACE ----------------------------
+// Everything control acts on goes into a ring as it happens, so a field complaint can be
+// downloaded from /api/trace and replayed on the host (see sim/). Records are a byte of kind,
+// argument and zone, then varints: millis since the previous record (a sample counts from
+// its zone's last one, less samplePeriod, so a reading on time takes one byte) and any
+// values, signed ones zigzagged. Samples are what the sensor gave before any conversion:
+// the ADC burst's kept sum, the DS18B20 raw value or the remote zone's hundredths, each as
+// a change from the zone's last. Every TRACE_KEY_EVERY bytes the thermostat run writes a
+// keyframe of all the state control carries; a replay starts from one, and a full ring drops
+// its oldest keyframe and what follows. Setting changes are recorded by the next sample or
+// thermostat run that sees them, however they were made. The first alarm lets TRACE_HOLD
+// more bytes in and then stops the ring, keeping its lead-up until POST /api/trace.
 
-// CHECK CHANGES AND UPDATE OUTPUT PIN -----------------------
-  sendOutput();                                 // Update output pin
+#define TRACE_MASK (TRACE_BYTES - 1)
+#define TRACE_KEY 0                   // Keyframe: length (2 bytes), millis (4 bytes), output task phase, each zone (traceKey)
+#define TRACE_SAMPLE 1                // Sensor reading: time, change in raw value
+#define TRACE_THERMO 2                // Thermostat run
+#define TRACE_OUTPUT 3                // Relay switched, argument is its new state
+#define TRACE_SETPOINT 4              // Setpoint tenths
+#define TRACE_MODES 5                 // Argument is powerSet and heatMode << 1, then ctrlMode
+#define TRACE_CALIB 6                 // Calibration offset and gain
+#define TRACE_CLEAR 7                 // Alarms cleared
+#define TRACE_RECORD_MAX 16           // Longest record but a keyframe
+#define TRACE_KEY_ZONE 140            // Keyframe bytes per zone before its readings and starts
 
-// LISTEN FOR HTML CONNECTIONS ---------------------------------
-  server.handleClient();                        // Waiting for html connection
+const byte traceFields[8] = {0, 2, 1, 1, 2, 2, 3, 1};   // Varints after the kind byte, by kind
 
- delay(10);
-} 
+struct TraceZone {
+  long prev;                        // Raw value of the last sample recorded
+  unsigned long sampleAt;           // millis() of the last sample recorded
+  int setPoint10;                   // Settings as last recorded
+  byte modes;
+  byte ctrlMode;
+  int calOffset100;
+  unsigned int calGain10000;
+};
 
-// -------------------------------------------------------------------------------------------------------
+byte traceBuf[TRACE_BYTES];
+unsigned long traceFirst = 0;       // Bytes ever written when the oldest record kept was, ring offset & TRACE_MASK
+unsigned long traceEnd = 0;         // Bytes ever written
+unsigned long traceKeyAt = 0;       // Offset of the latest keyframe
+unsigned long traceAt = 0;          // millis() of the latest record
+bool traceKeyed = 0;                // Ring starts with a keyframe, so records may follow
+bool traceHeld = 0;                 // An alarm has been raised, recording stops at traceStopAt
+unsigned long traceStopAt = 0;
+TraceZone traceZones[ZONES];
 
+// EVENT STREAM ---------------------
 
+struct Subscriber {
+  WiFiClient client;                // Held open after the request, events written straight to it
+  byte zone;                        // Zone whose state is streamed
+  int delta100;                     // avgTemp change that pushes an event
+  int lastTemp100;                  // avgTemp in last event sent
+  uint16_t lastFlags;               // device, powerSet, heatMode, alarms in last event sent
+  unsigned long lastSend;           // millis() of last event or keepalive
+  unsigned long stalledSince;       // millis() socket first had no room for pending event
+  bool stalled;                     // Socket has had no room since stalledSince
+};
 
-void getTemp() {                               
-// READS TEMP SENSOR, CONVERTS TO F, LOADS ARRAY AND TAKES AVERAGE -----------------
-// Array is on infinite loop, restarts loading readings at 0 once full
-// Used to reduce noise in temperature reading
+Subscriber subscribers[SSE_MAX];    // Free when client not connected
 
-  float voltage, degreesC, degreesF;            // Define floats for temp sensor
-  
-    voltage = getVoltage(tempPin);              // Calls getVoltage function to return voltage read from sensor
-    degreesC = (voltage - 0.5) * 100.0;         // Convert voltage to degrees C
-    
-    degreesF = degreesC * (9.0/5.0) + 32.0;     // Convert from F to C
-    
-    tempArray[tempArrayCtr] = degreesF;         // Load array with temp
-    
-    avgTemp = averageArrayItem(tempArray, TEMPARRAYSIZE); // Take average of temps in array (uses averageArrayItem function)
-    
-    tempArrayCtr = tempArrayCtr + 1;            // Increment counter
-    
-    if (tempArrayCtr >= TEMPARRAYSIZE) {
-      tempArrayCtr = 0;                         // Reset counter and array
-    }
-  }
-
-void thermoStat() { 
-// COMPARES TEMP TO SETPOINT AND CONTROLS DEVICE TAKING HYSTERISYS INTO ACCOUNT --------------
-  if (avgTemp >= failSafeTemp) {                          // If warmer than 1 degree ie sensor working
-    if (powerSet == 1) {                                  // If power is on
-     if (heatMode == 0) {                                  // If heatMode set to 0 (heat)
-       if (avgTemp <= setPoint - hyst) {                  // If colder than current setpoint - hysterysis
-         device = 1;                                       // Request device on
-       } else if (avgTemp >= setPoint) {                  // If hotter than current setpoint
-          device = 0;                                       // Request device off
-       } else {                                           // Anything else
-          device = 0;                                       // Request device off
-       }
-       
-   
-    } else {                                              // If heatMode set to 1 (cool)
-      if ((avgTemp >= setPoint + hyst) && ((millis() - shutDownTimer) >= POWER_WAIT))  {                  // If hotter than current setpoint + hysterysis and more than 5 mins
-         device = 1;                                      // Request device on
-       // deviceLastSetting = device;                      // Remember last setting
-       
-      } else if (avgTemp <= setPoint) {                  // If cooler than current setpoint
-         device = 0;                                      // Request device off
-         if (deviceLastSetting != device) {               // First iteration since shutdown - start timer
-           shutDownTimer = millis();
-       }
-       }
-    }
-  } else {                                                // Power setting is off
-        device = 0;
-        if (deviceLastSetting != device) {               // First iteration since shutdown - start timer
-           shutDownTimer = millis();
-  }
-  }
-deviceLastSetting = device;                // Update state for next time
-  
-}
-  else {
-    Serial.println("Shut down heater, sensor failure.");
-    if (device == 1) {
-        device = 0;                                    // Shut off heater
-  }
- }
-}
+// MQTT -----------------------------
+// Each zone's state is published, retained, when it changes, and every zone's state together
+// every MQTT_REPORT; setpoint, power, mode and control commands come back from the broker.
+// Packets are MQTT 3.1.1 at QoS 0, built in place on a queue and written only when the socket
+// has room for a whole one, so the task never waits on the broker. The one wait is connect(),
+// held to MQTT_CONNECT_WAIT. While the broker can't be reached, reports stay queued (oldest
+// dropped first) and reconnects back off.
 
-void sendOutput() {
-// COMPARES CURRENT DEVICE SETTING TO LAST SETTING AND UPDATES PIN IF CHANGED ---------------------
-     
-     if (device != lastDeviceState) {          // Compares current heat request to last known state of output
-    digitalWrite(heatCtrlPin, device);      // Write output state to output pin
-  
-  }
-   lastDeviceState = device;                // Update state for next time
- 
-}
-   
-float getVoltage(int pin) {
-// READS PIN AND RETURNS VOLTAGE FOR TEMP SENSOR -------------------------
-// Converts pin read (0-1024) to actual voltage returned from sensor in range 0-3.3v
-   return (analogRead(pin) * 0.00302734375); // Used 3.1 div 1024 - seems more accutate on ESP8266
-}
+#define MQTT_DOWN 0                   // No connection, next attempt at retryAt
+#define MQTT_WAIT 1                   // CONNECT sent, waiting for CONNACK
+#define MQTT_UP 2                     // Accepted and subscribed
 
-float averageArrayItem(float arr[], int n) {  
-// RETURNS AVERAGE OF GIVEN ARRAY ---------------------------------------------
-  int i;
-  float sum = 0;
-  
-  for (int i=0; i<n; i++)
-    sum += arr[i];
-  
-  return sum/n;
-  
-}
+struct Mqtt {
+  WiFiClient client;
+  byte state = MQTT_DOWN;
+  char base[32];                    // Topic prefix, MQTT_PREFIX/chip id
+  byte in[MQTT_IN_MAX];             // Packet arriving from the broker
+  int inLen = 0;
+  unsigned long skip = 0;           // Bytes of an oversized packet still to throw away
+  byte queue[MQTT_QUEUE];           // Whole PUBLISH packets waiting for the socket, oldest first
+  int queueLen = 0;
+  int msgStart = -1;                // Offset in queue of the packet being built
+  bool msgLost = 0;                 // Packet being built doesn't fit
+  unsigned long since = 0;          // millis() of connect, CONNACK wait runs from here
+  unsigned long lastIn = 0;         // millis() of last bytes from broker
+  unsigned long lastOut = 0;        // millis() of last packet to broker
+  unsigned long pingAt = 0;         // millis() of last PINGREQ
+  unsigned long retryAt = 0;        // millis() of next connect attempt
+  unsigned long backoff = MQTT_BACKOFF_MIN;
+  unsigned long reportAt = 0;       // millis() of last report
+  unsigned long connects = 0;       // Sessions the broker accepted since boot
+  unsigned long published = 0;      // Publishes written to the socket since boot
+  unsigned long dropped = 0;        // Publishes lost to a full queue since boot
+  unsigned long commands = 0;       // Commands applied since boot
+  unsigned long rejected = 0;       // Commands ignored as malformed or out of range
+};
 
-void handle_OnConnect() {
-// CALLS MAIN WEBPAGE ------------------------------------------------------------                   
-   server.send(200, "text/html", SendHTML(avgTemp, setPoint));  // Calls SendHTML to generate dynamic webpage
-}
+Mqtt mqtt;
 
-void addDegree() {
-// ADDS .1 DEGREE TO SETPOINT AND CALLS REDIRECT TO MAIN WEBPAGE --------------------                              
-  setPoint += 0.1;                                  // Increment temp setpoint
-  server.send(200, "text/html", sendRedirect());  // Once increment done, resets webpage to root
-  
-}
+// HISTORY --------------------------
+// Readings are averaged into one record per minute, and minute records into 15 minute and
+// hourly records, each tier kept in its own ring. Records are 4 bytes, so all three tiers
+// take about 11 KB of static RAM; with the HTTP connections, MQTT queue and trace ring that
+// comes to about 30 KB, leaving the rest of the board's 80 KB to the SDK, lwIP and the
+// WiFiManager portal. That is why only zone 0 keeps history, and why longer tiers don't fit.
 
-void powerOn() {
-// SETS POWER VAR TO ON AND CALLS REDIRECT TO MAIN WEBPAGE ------------------------                              
-  powerSet = 1;                                   // Sets var for thermostat to turn on
-  server.send(200, "text/html", sendRedirect());  // Resets webpage to root
-  }
+struct HistRec {
+  int16_t temp10;                   // avgTemp in tenths
+  uint16_t packed;                  // setPoint tenths above spMin10 (top 10 bits), device on time in 63rds (low 6 bits)
+};
 
-void powerOff() {
-// SETS POWER VAR TO OFF AND CALLS REDIRECT TO MAIN WEBPAGE ------------------------                               
-  powerSet = 0;                                  // Sets var for thermostat to turn off
-  server.send(200, "text/html", sendRedirect());  // Resets webpage to root
-}
+struct HistTier {
+  HistRec *recs;                    // Ring of records
+  int size;                         // Records ring holds
+  int minutes;                      // Minutes each record covers
+  int head;                         // Slot for next record
+  int count;                        // Records held
+  unsigned long newest;             // Uptime minute the newest record ends at
+  long tempSum;                     // Sums of minute values for record being built
+  long setPointSum;
+  long dutySum;
+  int n;                            // Minutes in record being built
+};
 
-void minusDegree() {  
-// SUBTRACTS DEGREE AND CALLS REDIRECT TO MAIN WEBPAGE ------------------------------                            
-  setPoint -= 0.1;                                  // Decrement temp setpoint
-  server.send(200, "text/html", sendRedirect());  // Once decrement done, resets webpage to root
-  
-}
-void modeHeat() {
-// SETS SYSTEM TO HEATER MODE (heatMode false) ----------------------------------------
-  heatMode = 0;                                    // Set var to heat mode
-  server.send(200, "text/html", sendRedirect());  // Once mode changed, resets webpage to root
-  
-}
+HistRec histMin[HIST_MIN_SIZE];
+HistRec histQtr[HIST_QTR_SIZE];
+HistRec histHour[HIST_HOUR_SIZE];
 
-void modeCold() {
-// SETS SYSTEM TO HEATER MODE (heatMode false) ----------------------------------------
-  heatMode = 1;                                    // Set var to cold mode
-  server.send(200, "text/html", sendRedirect());  // Once mode changed, resets webpage to root
-  
-}
+HistTier histTiers[HIST_TIERS] = {
+  {histMin, HIST_MIN_SIZE, 1, 0, 0, 0, 0, 0, 0, 0},
+  {histQtr, HIST_QTR_SIZE, 15, 0, 0, 0, 0, 0, 0, 0},
+  {histHour, HIST_HOUR_SIZE, 60, 0, 0, 0, 0, 0, 0, 0},
+};
 
-void eraseEEPROM () {
+// PAGE RENDERING -------------------
 
-  EEPROM.write(ID_ADDR,EEPROM_CLR);                  // write the ID to indicate invalid data
-   
-   EEPROM.commit();                                   // Commit changes to EEPROM
+#define RENDER_BUF 512              // Bytes gathered before each chunk is sent
+#define RENDER_KEY 16               // Longest %KEY% name in a template
+
+#define SAVED_SETPOINT 1            // pageSaved bits, which settings writeEEPROM() updated
+#define SAVED_POWER 2
+#define SAVED_MODE 4
+#define SAVED_CONTROL 8
+
+char renderBuf[RENDER_BUF];         // Chunk being assembled (static so pages never touch the heap)
+int renderLen = 0;                  // Bytes waiting in renderBuf
+bool renderCapture = 0;             // Keep output in renderBuf instead of sending it (event text)
+void (*renderTo)(const char *s, size_t n) = 0;  // Takes each chunk instead of the web response (MQTT payloads)
+byte pageSaved = 0;                 // Settings updated by last save, shown on EEPROM page
+
+// STATIC ASSETS --------------------
+// Stylesheet and script shared by the pages, gzipped into flash by assets/gen-assets.py. Pages
+// link them with the file's hash in the URL, so browsers keep them for a year and only fetch
+// them again after a firmware update changes them.
+
+#define ASSET_MAX_AGE "31536000"      // Seconds browsers may cache a static asset
+
+struct StaticAsset {
+  const char *path;                 // Served at this path
+  const char *type;                 // Content-Type
+  const uint8_t *data;              // Gzipped file in flash
+  size_t len;
+  const char *etag;                 // Quoted hash of the file
+};
 
-  server.send(200, "text/html", sendRedirect());  // Once mode changed, resets webpage to root
+#include "web-therm-assets.h"
+
+// PAGE TEMPLATES -------------------
+// Kept in flash and streamed by renderTemplate(), which replaces each %KEY% with its value
+// from renderValue(). %% gives a literal %.
+
+const char PAGE_HEAD[] PROGMEM =
+  "<!DOCTYPE html> <html>\n"
+  "<head><meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0, user-scalable=no\">\n";
+
+const char PAGE_STYLE[] PROGMEM =
+  "<link rel=\"stylesheet\" href=\"/static/style.css?v=" ASSET_STYLE_CSS_TAG "\">\n"
+  "<script src=\"/static/app.js?v=" ASSET_APP_JS_TAG "\" defer></script>\n"
+  "</head>\n"
+  "<body>\n"
+  "<div id=\"webpage\">\n";
+
+const char PAGE_FOOT[] PROGMEM =
+  "</div>\n"
+  "</body>\n"
+  "</html>\n";
+
+const char MAIN_PAGE[] PROGMEM =
+  "%HEAD%<title>Web Enabled Thermostat</title>\n%STYLE%"
+  "%ZONENAV%"
+  "<h1>Room Temperature</h1>\n"
+  "<p><span id=\"temp\">%TEMP%</span> %UNIT%</p>\n"
+  "<h1>Setpoint</h1>\n"
+  "<p><a href=\"/addDegree%ZQ%\"><button>+</button></a></p>\n"
+  "<p><span id=\"setpoint\">%SETTARGET%</span> %UNIT%</p>\n"
+  "<p><a href=\"/minusDegree%ZQ%\"><button>-</button></a></p>\n"
+  "<p>Device is <span id=\"device\">%DEVICE%</span>.</p>\n"
+  "<p id=\"alarm\"%ALARMHIDE%>Alarm: <span id=\"alarms\">%ALARMTEXT%</span> "
+  "<a href=\"/clearAlarms%ZQ%\"><button>Clear</button></a></p>\n"
+  "<h1>Power</h1>\n"
+  "%POWERBTN%"
+  "<p><a href=\"/settings%ZQ%\"><button>Settings</button></a></p>\n"
+  "<h1>Mode</h1>\n"
+  "%MODEBTN%"
+  "%FOOT%";
+
+const char SETTINGS_PAGE[] PROGMEM =
+  "%HEAD%<title>Settings</title>\n%STYLE%"
+  "<h1>Save Settings</h1>\n"
+  "<p><a href=\"/writeEEPROM%ZQ%\"><button>Save</button></a></p>\n"
+  "<p><a href=\"/eraseEEPROM%ZQ%\"><button>Erase</button></a></p>\n"
+  "<p><a href=\"/resetPage%ZQ%\"><button>Back</button></a></p>\n"
+  "%FOOT%";
+
+const char EEPROM_PAGE[] PROGMEM =
+  "%HEAD%<title>Settings</title>\n%STYLE%"
+  "<p><a href=\"/resetPage%ZQ%\"><button>Back</button></a></p>\n"
+  "<p>%SAVEDSETPOINT%</p>\n"
+  "<p>%SAVEDPOWER%</p>\n"
+  "<p>%SAVEDMODE%</p>\n"
+  "%FOOT%";
+
+const char POWER_OFF_BTN[] PROGMEM = "<p><a id=\"power\" href=\"/powerOn%ZQ%\"><button>Off</button></a></p>\n";
+const char POWER_ON_BTN[] PROGMEM = "<p><a id=\"power\" href=\"/powerOff%ZQ%\"><button>On</button></a></p>\n";
+const char MODE_HEAT_BTN[] PROGMEM = "<p><a id=\"mode\" href=\"/modeCold%ZQ%\"><button>Heat</button></a></p>\n";
+const char MODE_COOL_BTN[] PROGMEM = "<p><a id=\"mode\" href=\"/modeHeat%ZQ%\"><button>Cool</button></a></p>\n";
+
+const char STATE_JSON[] PROGMEM =
+  "{\"version\":%VERSION%,\"avgTemp\":%TEMP1%,\"setPoint\":%SETPOINT%,\"hyst\":%HYST%,"
+  "\"device\":%DEVICEBIT%,\"powerSet\":%POWERBIT%,\"heatMode\":%MODEBIT%,"
+  "\"shutDownRemaining\":%LOCKOUT%,\"control\":\"%CONTROL%\","
+  "\"zone\":%ZONE%,\"name\":\"%ZONENAME%\",\"sensor\":\"%SENSOR%\",\"alarms\":[%ALARMS%]}\n";
+
+const char ALARMS_JSON[] PROGMEM =
+  "{\"zone\":%ZONE%,\"alarms\":[%ALARMS%],\"active\":[%ALARMSACTIVE%],\"since\":%ALARMSINCE%,"
+  "\"raised\":{%ALARMRAISED%}}";
+
+const char COMMAND_JSON[] PROGMEM =
+  "{\"cmd\":%CMD%,\"seq\":%CMDSEQ%,\"zone\":%ZONE%,\"setPoint\":%CMDSETPOINT%,\"powerSet\":%CMDPOWER%,"
+  "\"heatMode\":%CMDMODE%,\"clamped\":%CMDCLAMPED%,\"applyIn\":%CMDAPPLYIN%,\"replay\":%CMDREPLAY%}\n";
+
+const char REPORT_ZONE_JSON[] PROGMEM =
+  "{\"zone\":%ZONE%,\"avgTemp\":%TEMP1%,\"setPoint\":%SETPOINT%,\"device\":%DEVICEBIT%,"
+  "\"powerSet\":%POWERBIT%,\"heatMode\":%MODEBIT%}";
+
+const char CALIB_JSON[] PROGMEM =
+  "{\"offset\":%CALOFFSET%,\"gain\":%CALGAIN%,\"rawTemp\":%RAWTEMP%,\"avgTemp\":%TEMP%,"
+  "\"deferred\":%ADCDEFERRED%}\n";
+
+const char TIME_JSON[] PROGMEM =
+  "{\"epoch\":%CLOCK%,\"tz\":%CLOCKTZ%,\"source\":\"%CLOCKSOURCE%\"}\n";
+
+const char SCHED_JSON[] PROGMEM =
+  "{\"rules\":\"%SCHEDRULES%\",\"transitions\":%SCHEDEVENTS%,\"current\":%SCHEDCURRENT%,"
+  "\"override\":%SCHEDOVERRIDE%,\"nextIn\":%SCHEDNEXT%}\n";
+
+const char SSE_HEADERS[] PROGMEM =
+  "HTTP/1.1 200 OK\r\n"
+  "Content-Type: text/event-stream\r\n"
+  "Cache-Control: no-cache\r\n"
+  "Connection: keep-alive\r\n"
+  "Access-Control-Allow-Origin: *\r\n"
+  "\r\n";
+
+const char SSE_KEEPALIVE_TEXT[] PROGMEM = ": keepalive\n\n";
+
+const char HTTP_BUSY[] PROGMEM =
+  "HTTP/1.1 503 Service Unavailable\r\n"
+  "Content-Length: 0\r\n"
+  "Connection: close\r\n"
+  "\r\n";
+
+const char REDIRECT_ROOT[] PROGMEM =
+  "<!DOCTYPE html> <html>\n"
+  "<meta http-equiv=\"Refresh\" content=\"0; url=/%ZQ%\" />\n"
+  "</html>\n";
+
+const char REDIRECT_SETTINGS[] PROGMEM =
+  "<!DOCTYPE html> <html>\n"
+  "<meta http-equiv=\"Refresh\" content=\"0; url=/settings%ZQ%\" />\n"
+  "</html>\n";
+
+// WEB SERVER -----------------------
+// Serves HTTP without ever waiting on a client. Each pass of the http task accepts new
+// connections, reads whatever request bytes have arrived, answers requests that are whole and
+// writes only as much as each socket has room for, holding the rest in the connection's out
+// buffer for later passes. A client that sends or reads slowly costs a pass nothing, so it
+// can't hold up the control tasks. Connections are kept alive between requests.
+// Handlers use the calls they used with ESP8266WebServer (arg, send, sendContent...).
+// lwIP allows 5 TCP connections in all by default, event stream subscribers included.
+
+struct HttpRoute {
+  const char *uri;
+  HTTPMethod method;                // HTTP_ANY matches every method
+  void (*fn)();
+  Timing timing;                    // Handler durations
+};
+
+struct HttpConn {
+  WiFiClient client;                // Slot is free when not connected
+  char in[HTTP_IN_MAX + 1];         // Request bytes as they arrive, parsed in place (+1 for a terminator)
+  int inLen;                        // Bytes in in
+  char out[HTTP_OUT_MAX];           // Response bytes waiting for room in the socket
+  int outLen;                       // Bytes in out
+  unsigned long since;              // millis() of last progress, timeouts run from here
+  bool keepAlive;                   // Connection stays open once the response has gone
+  bool chunked;                     // Response body is sent in chunks
+  size_t bodyLeft;                  // Body bytes still to send, CONTENT_LENGTH_UNKNOWN until an empty sendContent()
+  PGM_P flash;                      // Rest of a send_P() body, sent as out drains, 0 if none
+  bool broken;                      // Response overran out, connection is dropped
+  void (*more)();                   // Writes the next part of a long response as out drains, 0 if none
+  long cursor[HTTP_CURSOR];         // Where more() is up to
+};
+
+class HttpServer {
+public:
+  explicit HttpServer(int port) : listener(port) {}
+
+  void on(const char *uri, void (*fn)()) { on(uri, HTTP_ANY, fn); }
+  void on(const char *uri, HTTPMethod method, void (*fn)());
+  void onNotFound(void (*fn)()) { notFound = fn; }
+  void begin() { listener.begin(); }
+  void handleClient();
+
+  // Request being answered
+  String arg(const char *name);
+  bool hasArg(const char *name);
+  String header(const char *name);
+  HTTPMethod method() { return reqMethod; }
+  const char *uri() { return reqUri; }
+  WiFiClient &client();
+
+  // Response to it
+  void sendHeader(const char *name, const char *value);
+  void setContentLength(size_t len) { contentLength = len; }
+  void send(int code, const char *type, const char *body);
+  void send_P(int code, const char *type, PGM_P body, size_t len);
+  void sendContent(const char *data, size_t len);
+  void sendContent(const char *data) { sendContent(data, strlen(data)); }
+  void stream(void (*more)()) { cur->more = more; }
+  long *cursor() { return cur->cursor; }
+
+  HttpRoute *route(int i) { return i < routeCount ? &routes[i] : 0; }
+
+  unsigned long requests = 0;       // Requests answered since boot
+  unsigned long busy = 0;           // Connections turned away with 503, every slot in use
+  unsigned long timeouts = 0;       // Connections closed for a slow request or a client not reading
+  unsigned long overruns = 0;       // Responses dropped for outgrowing the out buffer
+  Timing notFoundTiming;            // Durations of the handler for unregistered paths
+
+private:
+  void accept(unsigned long now);
+  void service(HttpConn &c, unsigned long now);
+  int requestLength(HttpConn &c);
+  void dispatch(HttpConn &c, int len);
+  void parseArgs(char *s);
+  const char *findHeader(const char *name, int *len);
+  void reject(HttpConn &c, int code);
+  void put(const char *s, size_t n);
+  void putP(PGM_P s);
+  void putFlash(HttpConn &c);
+  void flush(HttpConn &c);
+  void close(HttpConn &c);
+
+  WiFiServer listener;
+  HttpRoute routes[HTTP_ROUTES];
+  int routeCount = 0;
+  void (*notFound)() = 0;
+  HttpConn conns[HTTP_CONNS];
+  HttpConn *cur = 0;                // Connection being answered
+
+  HTTPMethod reqMethod = HTTP_GET;  // Request being answered, strings point into cur->in
+  const char *reqUri = "";          // Path, without the query
+  char *argName[HTTP_ARGS];
+  char *argValue[HTTP_ARGS];
+  int argCount = 0;
+  const char *headStart = 0;        // Header lines, after the request line
+  const char *headEnd = 0;
+  char extra[HTTP_HDR_MAX];         // Headers from sendHeader() for the next send()
+  int extraLen = 0;
+  size_t contentLength = CONTENT_LENGTH_NOT_SET;  // From setContentLength() for the next send()
+  bool reqHttp10 = 0;               // Client speaks HTTP/1.0, so no chunks
+  bool sent = 0;                    // Handler has sent a response
+  bool taken = 0;                   // Handler has kept the connection (event streams)
+};
+
+HttpServer server(HTTP_PORT);
+
+void setup(){
+// Control starts on the first pass of loop(), from the saved settings. Nothing here waits
+// on the network, the wifi task joins once loop() is running.
+
+// BEGIN SERVICES --------------------------------------
+
+  Serial.begin(115200);             // Start serial service. Only using when debugging, /metrics has the timings
+
+// LOAD SAVED SETTINGS ------------------------
   
-}
+  if (loadSettings()) {
+    Serial.println("Saved settings found");
+    Serial.println(zones[0].setPoint10 / 10.0);
+  } else {
+    Serial.println("No saved settings");
+  }
+  loadCalibration();
+  loadSchedule();
+  loadNetCache();
 
-void writeEEPROM () {
-// WRITES CURRENT SETPOINT AND POWER SETTING TO EEPROM -------------------------------
-// Will not update if value being stored matches value known to be in EEPROM (saves write cycles)
-  bool setPointUpdated = 0;
-  bool powerUpdated = 0;
-  bool heatModeUpdated = 0;
-  int checkval = 0;
+// SET PIN MODES --------------------------------------
   
-  if (storedSetPoint != setPoint * 10) {          // If stored setpoint value is different from working setpoint
-    setPointUpdated = 1;                          // Set flag for update done
-    storedSetPoint = setPoint * 10;                // Update stored setpoint to setpoint
-    
-    byte hiByte = highByte(storedSetPoint);
-          byte loByte = lowByte(storedSetPoint);
-          EEPROM.write(setPointAddr, hiByte);
-          EEPROM.write(setPointAddr+1, loByte); 
-    
-    
-    
-    // EEPROM.write(setPointAddr, storedSetPoint);     // Write changes to EEPROM (not actually done until commit)
-    Serial.println("Stored Setpoint");
-    Serial.println(storedSetPoint);
-    Serial.println("Set Point");
-    Serial.println(setPoint);
+  if (zonesUse(SRC_ONEWIRE)) {
+    oneWireSensors.begin();                     // Finds DS18B20s on the bus
+    oneWireSensors.setWaitForConversion(false); // Conversions run while the loop does other work
+  }
+  for (int i = 0; i < ZONES; i++) {
+    if (zoneConfig[i].source == SRC_ADC) {
+      pinMode(zoneConfig[i].sensor, INPUT);       // Assign input pin for temp sensor
+    } else if (zoneConfig[i].source == SRC_ONEWIRE) {
+      oneWireSensors.getAddress(zones[i].sensorAddr, zoneConfig[i].sensor);
+    }
+    pinMode(zoneConfig[i].relayPin, OUTPUT);      // Assign output pin for Relay controlling heat
+  }
+  if (zonesUse(SRC_ONEWIRE) && oneWireSensors.getDeviceCount() > 0) {
+    oneWireSensors.requestTemperatures();       // First readings ready oneWireConvert from now
+    oneWireAt = millis();
+  }
 
+// START WIFI -------------------------------------------
+
+  WiFi.mode(WIFI_STA);
+  WiFi.setSleepMode(WIFI_LIGHT_SLEEP); // Let delay() in loop sleep the CPU and radio between DTIM beacons
+  portal.setConfigPortalBlocking(false);
+  portal.setConfigPortalTimeout(WIFI_PORTAL_TIME);
+  portal.setConnectTimeout(WIFI_SAVE_WAIT);
+  if (WiFi.SSID().length() == 0) {
+    netPortal(millis());                        // Never been set up
   } else {
-    setPointUpdated = 0;                          // Set flag for no update done
+    netBegin(net.cached);
   }
 
-  if (storedPowerState != powerSet) {             // If stored power value is different from working value
-    powerUpdated = 1;                             // Set flag for update done
-    storedPowerState = powerSet;                  // Update stored power state to working power state
-    EEPROM.write(setPointAddr+5, storedPowerState); // Write changes to EEPROM (not done until commit)
-   
-   } else {
-    powerUpdated = 0;                             // Set flag for no update done
-   }
-   
-   if (storedHeatMode != heatMode) {              // If stored power value is different from working value
-    heatModeUpdated = 1;                          // Set flag for update done
-    storedHeatMode = heatMode;                    // Update stored mode state to working mode state
-    EEPROM.write(setPointAddr+6, storedHeatMode); // Write changes to EEPROM (not done until commit)
-   
-   } else {
-    heatModeUpdated = 0;                           // Set flag for no update done
-   }
-   
-   
-   
-   if ((powerUpdated == 1) || (setPointUpdated == 1) || heatModeUpdated == 1)  {   // If any setpoint or power state updated
 
-   EEPROM.write(ID_ADDR,EEPROM_ID);                  // write the ID to indicate valid data
-   
-   EEPROM.commit();                                   // Commit changes to EEPROM
+// ASSIGN WEBPAGES TO BUTTON PRESSES ----------------------
 
-   Serial.println("Value in memory for setpoint");
-   Serial.println(EEPROM.read(setPointAddr));
-    
-   }
+  server.on("/", handle_OnConnect);             // If nothing in header
+  server.on("/settings", settingsPage);         // Settings button clicked
+  server.on("/addDegree", addDegree);           // If + button clicked
+  server.on("/minusDegree", minusDegree);       // If - button clicked
+  server.on("/powerOn", powerOn);               // If power on button clicked
+  server.on("/powerOff", powerOff);             // If power off button clicked
+  server.on("/modeHeat", modeHeat);             // If heat mode button clicked
+  server.on("/modeCold", modeCold);             // If cold mode button clicked
+  server.on("/clearAlarms", clearAlarms);       // If clear alarm button clicked
+  server.on("/writeEEPROM", writeEEPROM);       // If save button clicked
+  server.on("/resetPage", resetPage);           // If back button pressed
+  server.on("/eraseEEPROM", eraseEEPROM);       // If erase eeprom pressed
+  server.on("/api/state", HTTP_GET, apiState);             // Machine readable state
+  server.on("/api/setpoint", HTTP_POST, apiSetPoint);       // Set setpoint, value=F or delta=F
+  server.on("/api/power", HTTP_POST, apiPower);             // Set power, on=0 or 1
+  server.on("/api/mode", HTTP_POST, apiMode);               // Set mode, mode=heat or cool
+  server.on("/api/command", HTTP_POST, apiCommand);         // Queued setpoint, delta, power and mode, seq=
+  server.on("/api/control", HTTP_POST, apiControl);         // Set control, mode=hyst, pid or predict
+  server.on("/api/events", HTTP_GET, apiEvents);            // Event stream of state changes, delta=F
+  server.on("/api/history", HTTP_GET, apiHistory);          // History export, tier= from= count= format=
+  server.on("/api/calibrate", apiCalibrate);                // Sensor calibration, offset= gain= or actual=
+  server.on("/api/time", apiTime);                          // Clock, epoch= tz= when there is no NTP
+  server.on("/api/schedule", apiSchedule);                  // Weekly schedule, rules=
+  server.on("/api/zones", HTTP_GET, apiZones);              // State of every zone
+  server.on("/api/sensor", HTTP_POST, apiSensor);           // Reading for a remote sensor zone, temp=F
+  server.on("/api/alarms", apiAlarms);                      // Latched alarms, POST clears zone= or all
+  server.on("/api/trace", apiTrace);                        // Binary trace for replay, POST starts it again
+  server.on("/metrics", HTTP_GET, apiMetrics);              // Timings, heap and counters for Prometheus
+  server.on("/metrics/reset", HTTP_POST, metricsReset);     // Starts the timings again
+  for (size_t i = 0; i < sizeof(staticAssets) / sizeof(staticAssets[0]); i++) {
+    server.on(staticAssets[i].path, HTTP_GET, serveStatic);  // Stylesheet and script
+  }
+  server.onNotFound(handle_NotFound);           // If something else in header
+  server.begin();                               // Listens on every interface, so before joining is fine
 
- server.send(200, "text/html", EEPROMPage(setPointUpdated, powerUpdated, heatModeUpdated));    // Call EEPROM written webpage
-}
+// START CLOCK -------------------------------------------
 
-void resetPage() {
-// CALLS HTML REDIRECT STRING ----------------------------------------------
-    server.send(200, "text/html", sendRedirect());  // resets webpage to root
-}
+  configTime(0, 0, NTP_SERVER);     // UTC from SNTP, clockTz gives local time
+  settimeofday_cb(clockSynced);
 
-void resetSetting() {
-// CALLS HTML REDIRECT STRING ----------------------------------------------
-    server.send(200, "text/html", settingsRedirect());  // resets webpage to settings
-}
- 
+// NAME MQTT TOPICS --------------------------------------
 
-void handle_NotFound(){     
-// HANDLES BAD URL STRING ------------------------------------------------                      
-  server.send(404, "text/plain", "Not found");
+  snprintf(mqtt.base, sizeof(mqtt.base), "%s/%06lx", MQTT_PREFIX, (unsigned long)ESP.getChipId());
 }
 
-String EEPROMPage(bool setPointUpdated, bool powerUpdated, bool heatModeUpdated) {
-// ASSEMBLES HTML STRING FOR EEPROM UPDATE WEBPAGE ------------------------
-  String ptr = "<!DOCTYPE html> <html>\n";
-  ptr +="<head><meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0, user-scalable=no\">\n";
-  ptr +="<style>html { font-family: Helvetica; display: inline-block; margin: 0px auto; text-align: center;}\n";
+void loop(){
+// RUNS EACH TASK THAT IS DUE, THEN LIGHT SLEEPS UNTIL THE NEXT ONE ------------------
+// Sleep is capped at IDLE_MAX so web requests are still picked up promptly
+
+  uint32_t start = ESP.getCycleCount();
+  unsigned long now = millis();
+  unsigned long idle = IDLE_MAX;
 
-  ptr +=".button { background-color: #195B6A; border: none; color: white; padding: 16px 40px;\n";
-  
-  ptr +="body{margin-top: 50px;} h1 {color: #444444;margin: 50px auto 30px;}\n";
-  ptr +="p {font-size: 24px;color: #444444;margin-bottom: 10px;}\n";
-  ptr +="</style>\n";
-  ptr +="</head>\n";
-  ptr +="<body>\n";
-  ptr +="<div id=\"webpage\">\n";
+  for (int i = 0; i < TASK_COUNT; i++) {
+    if ((long)(now - tasks[i].due) >= 0) {
+      runTask(i, now);
+      now = millis();
+    }
+    if (tasks[i].period > 0) {
+      long wait = (long)(tasks[i].due - now);
+      if (wait < 0) {
+        idle = 0;                               // Another task became due while running this pass
+      } else if ((unsigned long)wait < idle) {
+        idle = wait;
+      }
+    }
+  }
 
-  ptr +="<p><a href=\"/resetPage\"><button class=\"button\">Back</button></a></p>\n";
+  checkState();                                 // Bump state version if anything reported changed
+  timingAdd(loopTiming, ESP.getCycleCount() - start);
 
-  
-  if (setPointUpdated == 1) {                                   // Displays message as to whether EEPROM updated for setpoint
-    ptr +="<p>Updated setpoint in EEPROM.</p>\n";
-  } else {
-    ptr +="<p>Did not update setpoint, same value in EEPROM.</p>\n";
+  delay(idle);                                  // Light sleep (set in setup) while idle
+} 
+
+void runTask(int i, unsigned long now) {
+// RUNS TASK, RECORDS TIMING AND SETS NEXT DUE TIME --------------------------------
+  Task &t = tasks[i];
+  uint32_t start = ESP.getCycleCount();
+
+  if (now - t.due > t.deadline) {
+    t.late = t.late + 1;
   }
-  if (powerUpdated == 1) {                                      // Displays message as to whether EEPROM updated for power state
-    ptr +="<p>Updated power setting in EEPROM.</p>\n";
-  } else {
-    ptr +="<p>Did not update power setting, same value in EEPROM.</p>\n";
+  t.lastRun = now;
+  t.due += t.period;                            // Keep to a fixed rate
+  if ((long)(now - t.due) >= 0) {
+    t.due = now + t.period;                     // Fell a whole period behind, don't try to catch up
   }
-  if (heatModeUpdated == 1) {                                      // Displays message as to whether EEPROM updated for heat state
-    ptr +="<p>Updated heat mode setting in EEPROM.</p>\n";
-  } else {
-    ptr +="<p>Did not update heat mode setting, same value in EEPROM.</p>\n";
+  t.run();                                      // Set next due first so the task can move it
+  uint32_t cycles = ESP.getCycleCount() - start;
+  timingAdd(t.timing, cycles);
+  t.lastMicros = cycles / ESP.getCpuFreqMHz();
+  if (t.lastMicros > t.maxMicros) {
+    t.maxMicros = t.lastMicros;
   }
-  
-  ptr +="</html>\n";
-  return ptr;                                                   // Return html string to calling argument
-  
+  t.runs = t.runs + 1;
 }
 
+void kickTask(int i) {
+// MAKES TASK DUE NOW, eg THERMOSTAT AFTER A SETTING CHANGE ---------------------------
+  tasks[i].due = millis();
+}
 
-String sendRedirect() { 
-// ASSEMBLES HTML FOR WEBPAGE REDIRECT TO MAIN PAGE ---------------------------                          
-  String ptr = "<!DOCTYPE html> <html>\n";
-  ptr +="<meta http-equiv=\"Refresh\" content=\"0\; url=/\" />\n";
-  ptr +="</html>\n";
-  return ptr;
-  
+void deferTask(int i, unsigned long ms) {
+// RUNS TASK AGAIN IN ms INSTEAD OF AT ITS NEXT PERIOD, CALLED FROM THE TASK ITSELF -------
+  tasks[i].due = millis() + ms;
 }
 
-String settingsRedirect() { 
-// ASSEMBLES HTML FOR WEBPAGE REDIRECT TO SETTINGS PAGE ---------------------------                          
-  String ptr = "<!DOCTYPE html> <html>\n";
-  ptr +="<meta http-equiv=\"Refresh\" content=\"0\; url=/settings\" />\n";
-  ptr +="</html>\n";
-  return ptr;
-  
+void serviceHttp() {
+// LISTEN FOR HTML CONNECTIONS ---------------------------------
+  server.handleClient();
 }
 
-String settings() {
-// ASSEMBLES HTML FOR SETTINGS WEBPAGE -------------------------------------------
-  String ptr = "<!DOCTYPE html> <html>\n";
-  ptr +="<head><meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0, user-scalable=no\">\n";
-  ptr +="<title>Settings</title>\n";
-  ptr +="<style>html { font-family: Helvetica; display: inline-block; margin: 0px auto; text-align: center;}\n";
+void serviceWifi() {
+// JOINS WI-FI IN THE BACKGROUND AND REJOINS WHEN THE LINK DROPS, NEVER WAITING ON IT --------
+// Fast join, then full join, then the portal if there hasn't been a join since boot. The portal
+// closes back to a join if nobody saves; after a drop the task just keeps joining.
+  unsigned long now = millis();
+  bool joined = WiFi.status() == WL_CONNECTED;
 
-  ptr +=".button { background-color: #195B6A; border: none; color: white; padding: 16px 40px;\n";
-  
-  ptr +="body{margin-top: 50px;} h1 {color: #444444;margin: 50px auto 30px;}\n";
-  ptr +="p {font-size: 24px;color: #444444;margin-bottom: 10px;}\n";
-  ptr +="</style>\n";
-  ptr +="</head>\n";
-  ptr +="<body>\n";
-  ptr +="<div id=\"webpage\">\n";
+  if (net.state == NET_PORTAL) {
+    portal.process();                             // Portal pages and DNS, joins on a save
+    deferTask(TASK_WIFI, WIFI_PORTAL_FRQ);
+  }
+  if (joined) {
+    if (net.state != NET_UP) {
+      netUp(now);
+    }
+  } else if (net.state == NET_UP) {
+    net.drops = net.drops + 1;
+    netBegin(net.cached);
+  } else if (net.state == NET_FAST && now - net.since >= WIFI_FAST_WAIT) {
+    netBegin(false);                              // Access point moved or address taken, join afresh
+  } else if (net.state == NET_JOIN && now - net.since >= WIFI_JOIN_WAIT && net.upAt == 0) {
+    netPortal(now);                               // Never joined since boot, credentials may be wrong
+  } else if (net.state == NET_JOIN && now - net.since >= WIFI_JOIN_WAIT) {
+    netBegin(net.cached);                         // Joined before, the access point should be back
+  } else if (net.state == NET_PORTAL && !portal.getConfigPortalActive()) {
+    netBegin(net.cached);                         // Portal timed out, the access point may be back
+  } else if (net.state == NET_PORTAL && net.cached && now - net.since >= WIFI_PORTAL_RETRY) {
+    netJoin(true);                                // Joined there before, it may just have been off
+    net.since = now;
+  }
+}
+
+void netBegin(bool fast) {
+// STARTS A JOIN, TO THE CACHED ACCESS POINT AND ADDRESS IF fast, OR A FULL ONE ----------------
+  netJoin(fast);
+  net.state = fast ? NET_FAST : NET_JOIN;
+  net.since = millis();
+}
 
-  ptr +="<h1>Save Settings</h1>\n";
-  ptr +="<p><a href=\"/writeEEPROM\"><button class=\"button\">Save</button></a></p>\n";
-  ptr +="<p><a href=\"/eraseEEPROM\"><button class=\"button\">Erase</button></a></p>\n";
+void netJoin(bool fast) {
+// ASKS THE SDK FOR A JOIN, TO THE CACHED ACCESS POINT AND ADDRESS IF fast, OR A FULL ONE -------
+// Returns at once. Credentials are the ones the SDK kept from the last portal save.
+  String ssid = WiFi.SSID();
+  String psk = WiFi.psk();
+  const byte *c = net.cache;
+  IPAddress addr[4];
 
-  
+  if (fast && WIFI_CACHE_IP) {
+    for (int i = 0; i < 4; i++) {
+      addr[i] = IPAddress(c[7 + i * 4], c[8 + i * 4], c[9 + i * 4], c[10 + i * 4]);
+    }
+  }
+  WiFi.config(addr[0], addr[1], addr[2], addr[3]);   // All zero asks DHCP
+  WiFi.begin(ssid.c_str(), psk.c_str(), fast ? c[6] : 0, fast ? c : nullptr);
 }
-String SendHTML(float Temperaturestat, float Setpoint){   
-// ASSEMBLES HTML FOR MAIN WEBPAGE -------------------------------------------
-  String ptr = "<!DOCTYPE html> <html>\n";
-  ptr +="<head><meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0, user-scalable=no\">\n";
-  ptr +="<title>Web Enabled Thermostat</title>\n";
-  ptr +="<style>html { font-family: Helvetica; display: inline-block; margin: 0px auto; text-align: center;}\n";
 
-  ptr +=".button { background-color: #195B6A; border: none; color: white; padding: 16px 40px;\n";
-  
-  ptr +="body{margin-top: 50px;} h1 {color: #444444;margin: 50px auto 30px;}\n";
-  ptr +="p {font-size: 24px;color: #444444;margin-bottom: 10px;}\n";
-  ptr +="</style>\n";
-  ptr +="</head>\n";
-  ptr +="<body>\n";
-  ptr +="<div id=\"webpage\">\n";
-  ptr +="<h1>Room Temperature</h1>\n";
-  
-  ptr +=(float)Temperaturestat;
-  ptr +=" F</p>";
+void netPortal(unsigned long now) {
+// OPENS THE CONFIGURATION PORTAL WITHOUT BLOCKING, THE WIFI TASK SERVICES IT --------------------
+// Saving new credentials joins with them, which holds the loop up to WIFI_SAVE_WAIT
+  portal.startConfigPortal();
+  net.state = NET_PORTAL;
+  net.since = now;
+  deferTask(TASK_WIFI, WIFI_PORTAL_FRQ);
+}
 
-  ptr +="<h1>Setpoint</h1>\n";
-  ptr +="<p><a href=\"/addDegree\"><button class=\"button\">+</button></a></p>\n";
-  ptr +=(float)Setpoint;
-  ptr +=" F</p>\n";
-  ptr +="<p><a href=\"/minusDegree\"><button class=\"button\">-</button></a></p>\n";
+void netUp(unsigned long now) {
+// COUNTS A JOIN AND CACHES WHERE IT WAS MADE FOR THE NEXT BOOT'S FAST JOIN ----------------------
+// Written only when something changed, so a fast join costs no flash write
+  byte rec[NET_CACHE];
+  IPAddress addr[4] = {WiFi.localIP(), WiFi.gatewayIP(), WiFi.subnetMask(), WiFi.dnsIP()};
 
-    if(device == 0) {                               // Displays whether device call is on or off
-        ptr +="<p>Device is off.</p>\n";
-    } else {
-        ptr +="<p>Device is on.</p>\n";
+  if (net.state == NET_PORTAL && portal.getConfigPortalActive()) {
+    portal.stopConfigPortal();                    // Joined from a save, or the access point came back
+  }
+  if (net.upAt == 0) {
+    net.upAt = now;
+    net.upPath = net.state;
+  }
+  net.joins[net.state] = net.joins[net.state] + 1;
+  net.state = NET_UP;
+  net.since = now;
+
+  memcpy(rec, WiFi.BSSID(), 6);
+  rec[6] = WiFi.channel();
+  for (int i = 0; i < 4; i++) {
+    for (int b = 0; b < 4; b++) {
+      rec[7 + i * 4 + b] = addr[i][b];
     }
+  }
+  if (!net.cached || memcmp(rec, net.cache, NET_CACHE) != 0) {
+    memcpy(net.cache, rec, NET_CACHE);
+    net.cached = 1;
+    logWrite(REC_WIFI, rec, NET_CACHE);
+  }
+}
 
-  ptr +="<h1>Power</h1>\n";                         // Shows OFF button if power call is off and vice versa
-     if (powerSet == 0) {
-        ptr +="<p><a href=\"/powerOn\"><button class=\"button\">Off</button></a></p>\n";
-     } else {
-        ptr +="<p><a href=\"/powerOff\"><button class=\"button\">On</button></a></p>\n";
-     }
+void persistSettings() {
+// SAVES SETTING CHANGES ONCE THEY SETTLE ------------------------------------------------
+// No more than once per SAVE_INTERVAL, so a burst of +/- presses costs one record. The Save
+// button, calibration and schedule save at once.
+  unsigned long now = millis();
 
-  
- 
+  if (settingsDirty == 1 && now - settingsChangedAt >= SAVE_SETTLE && now - lastSave >= SAVE_INTERVAL) {
+    saveSettings();
+  }
+}
 
-  ptr +="<p><a href=\"/settings\"><button class=\"button\">Settings</button></a></p>\n";
-  
-  ptr +="<h1>Mode</h1>\n";                         // Shows Heat button if heatMode is false
-     if (heatMode == 0) {
-        ptr +="<p><a href=\"/modeCold\"><button class=\"button\">Heat</button></a></p>\n";
+// -------------------------------------------------------------------------------------------------------
+
+
+
+void getTemp() {                               
+// READS ONE ZONE'S SENSOR IN HUNDREDTHS, LOADS FILTER AND TAKES AVERAGE --------------------
+// Used to reduce noise in temperature reading. Zones are read one per run, moving straight
+// on to the next, so a slow sensor (a DS18B20 read holds the CPU about 11 ms) does not hold
+// up web requests for every zone at once. Radio TX couples into the ADC, so an ADC reading
+// due just after the sketch sent something waits until the radio has gone quiet.
+
+  const ZoneConfig &c = zoneConfig[sampleZone];
+  Zone &z = zones[sampleZone];
+  int reading;
+  unsigned long now = millis();
+
+    if (zonesUse(SRC_ADC) && c.source == SRC_ADC) {
+      if (now - radioAt < ADC_QUIET && now - adcLastBurst < Config::samplePeriod + ADC_DEFER_MAX) {
+        adcDeferred = adcDeferred + 1;
+        deferTask(TASK_SAMPLE, ADC_QUIET - (now - radioAt));
+        return;
+      }
+      adcLastBurst = now;
+    }
+    if (zonesUse(SRC_ONEWIRE) && c.source == SRC_ONEWIRE && now - oneWireAt < Config::oneWireConvert) {
+      deferTask(TASK_SAMPLE, Config::oneWireConvert - (now - oneWireAt));   // Only at boot, conversion still running
+      return;
+    }
+    if (sampleZone == 0) {
+      sampleDue = tasks[TASK_SAMPLE].due;         // Next cycle keeps to the fixed rate
+    }
+
+    reading = readZone(sampleZone);
+    if (reading == NO_READING) {
+      setFilter(z, z.tempWindow);                 // Start afresh when the sensor is back
+      z.avgTemp100 = Config::failed100;           // Below failSafe100, thermostat shuts device off
+    } else {
+      z.rawTemp100 = filterTemp(z, reading);      // Load filter and take average (uses filterTemp function)
+      z.avgTemp100 = calibrated(z);               // Per-sensor calibration
+    }
+    faultSample(sampleZone, reading);             // Sensor and equipment checks, latch alarms
+
+    histSample(sampleZone);                       // Add to history
+
+    sampleZone = sampleZone + 1;
+    if (sampleZone < ZONES) {
+      deferTask(TASK_SAMPLE, 0);                  // Next zone on the next pass
+      return;
+    }
+    sampleZone = 0;
+    tasks[TASK_SAMPLE].due = sampleDue;
+    if (!sampledAll) {
+      sampledAll = 1;
+      kickTask(TASK_THERMO);                      // First decision as soon as every zone has a reading
+    }
+    if (zonesUse(SRC_ONEWIRE) && oneWireSensors.getDeviceCount() > 0) {
+      oneWireSensors.requestTemperatures();       // Converts while idle, read next cycle
+      oneWireAt = millis();
+    }
+  }
+
+int readZone(int i) {
+// RETURNS ZONE'S SENSOR READING IN HUNDREDTHS, NO_READING IF THE SENSOR HAS FAILED OR GONE QUIET -
+// Sources no zone uses are compiled out
+  const ZoneConfig &c = zoneConfig[i];
+  Zone &z = zones[i];
+
+  if (zonesUse(SRC_ADC) && c.source == SRC_ADC) {
+    long sum = getCounts(c.sensor);
+    traceSample(i, sum);
+    return Config::adcHundredths(sum);            // TMP36, converted in one multiply and divide
+  }
+  if (zonesUse(SRC_ONEWIRE) && c.source == SRC_ONEWIRE) {
+    int32_t raw = oneWireSensors.getTemp(z.sensorAddr);
+    traceSample(i, raw);
+    if (raw == DEVICE_DISCONNECTED_RAW) {
+      oneWireSensors.getAddress(z.sensorAddr, c.sensor);   // Look again in case it was replaced
+      return NO_READING;
+    }
+    return Config::oneWireHundredths(raw);
+  }
+  int reading = z.remoteTemp100;
+  if (!zonesUse(SRC_REMOTE) || millis() - z.remoteAt > REMOTE_STALE) {
+    reading = NO_READING;
+  }
+  traceSample(i, reading);
+  return reading;
+}
+
+void faultSample(int i, int reading) {
+// CHECKS A ZONE'S NEW READING FOR SENSOR FAULTS AND ITS DEVICE FOR EFFECT, LATCHING ALARMS ------
+// A remote zone that has never reported is waiting for its board, not failed
+  Zone &z = zones[i];
+  unsigned long now = millis();
+
+  if (reading == NO_READING || reading < Config::faultMin100 || reading > Config::faultMax100) {
+    if (zonesUse(SRC_REMOTE) && zoneConfig[i].source == SRC_REMOTE && z.remoteTemp100 == NO_READING) {
+      return;
+    }
+    if (z.faultBad < FAULT_BAD_READS) {
+      z.faultBad = z.faultBad + 1;
+    }
+    if (z.faultBad >= FAULT_BAD_READS) {
+      faultRaise(i, FAULT_SENSOR);
+    }
+    z.faultLast100 = NO_READING;                  // No rate across a gap
+    z.effectRunning = 0;
+    return;
+  }
+  z.faultBad = 0;
+
+  if (z.faultLast100 != NO_READING && now - z.faultLastAt < FAULT_JUMP_SPAN) {
+    if (zonesUse(SRC_ADC) && zoneConfig[i].source == SRC_ADC) {   // Others can sit on one value in a steady room
+      z.faultSame = reading == z.faultLast100 ? z.faultSame + 1 : 0;
+      if (z.faultSame >= FAULT_STUCK_READS) {
+        faultRaise(i, FAULT_STUCK);
+      }
+    }
+    if (labs(reading - z.faultLast100) * 1000L > (long)Config::jumpRate100 * (now - z.faultLastAt)) {
+      if (now - z.faultJumpAt >= FAULT_JUMP_SPAN) {
+        z.faultJumps = 0;
+      }
+      z.faultJumps = z.faultJumps + 1;
+      z.faultJumpAt = now;
+      if (z.faultJumps >= FAULT_JUMPS) {
+        faultRaise(i, FAULT_JUMP);
+      }
+    }
+  }
+  z.faultLast100 = reading;
+  z.faultLastAt = now;
+  faultEffect(z, now);
+  if (z.effectRunning && now - z.effectAt >= FAULT_EFFECT_TIME) {
+    faultRaise(i, FAULT_NO_EFFECT);
+  }
+}
+
+void faultEffect(Zone &z, unsigned long now) {
+// FOLLOWS THE ROOM WHILE THE RELAY IS ON, RESTARTING effectAt EACH TIME IT MOVES effectMin100 ---
+// Measured from the coldest (heat) or warmest (cool) point, so the lag before a device takes
+// hold counts as time but not as movement the wrong way
+  if (!z.lastDeviceState) {
+    z.effectRunning = 0;
+    return;
+  }
+  int moved = z.heatMode ? z.effectRef100 - z.avgTemp100 : z.avgTemp100 - z.effectRef100;
+  if (!z.effectRunning || moved >= Config::effectMin100) {
+    z.effectRunning = 1;
+    z.effectRef100 = z.avgTemp100;
+    z.effectAt = now;
+  } else if (moved < 0) {
+    z.effectRef100 = z.avgTemp100;                // Further the wrong way, measure from here
+  }
+}
+
+void faultStart(int i) {
+// RECORDS A RELAY START, RAISING FAULT_CYCLING IF FAULT_CYCLES EARLIER ONES ARE WITHIN THE SPAN --
+  Zone &z = zones[i];
+  unsigned long now = millis();
+  unsigned long oldest = z.faultStarts[z.faultStartNext];
+
+  z.faultStarts[z.faultStartNext] = now;
+  z.faultStartNext = (z.faultStartNext + 1) % (FAULT_CYCLES + 1);
+  if (z.faultStartCount <= FAULT_CYCLES) {
+    z.faultStartCount = z.faultStartCount + 1;
+  } else if (now - oldest < FAULT_CYCLE_SPAN) {
+    faultRaise(i, FAULT_CYCLING);
+  }
+}
+
+void faultRaise(int i, byte alarm) {
+// LATCHES AN ALARM, HAVING THE THERMOSTAT ACT ON IT NOW IF IT HOLDS THE DEVICE OFF -------------
+  Zone &z = zones[i];
+  int k = __builtin_ctz(alarm);
+
+  if (z.alarms & alarm) {
+    return;
+  }
+  z.alarms |= alarm;
+  z.alarmAt[k] = millis();
+  z.alarmCount[k]++;
+  traceHold();                                    // Keep what led up to it
+  Serial.print(zoneConfig[i].name);
+  Serial.print(" alarm: ");
+  Serial.println(faultNames[k]);
+  if (alarm & FAULT_OFF) {
+    kickTask(TASK_THERMO);
+  }
+}
+
+byte faultActive(Zone &z) {
+// RETURNS THE ALARMS WHOSE FAULT IS STILL THERE, WHICH CLEARING LEAVES LATCHED -----------------
+// No effect can't be seen with the device held off, so clearing it lets the device try again
+  byte active = 0;
+  unsigned long now = millis();
+
+  if (z.faultBad >= FAULT_BAD_READS) {
+    active |= FAULT_SENSOR;
+  }
+  if (z.faultSame >= FAULT_STUCK_READS) {
+    active |= FAULT_STUCK;
+  }
+  if (z.faultJumps >= FAULT_JUMPS && now - z.faultJumpAt < FAULT_JUMP_SPAN) {
+    active |= FAULT_JUMP;
+  }
+  if (z.faultStartCount > FAULT_CYCLES && now - z.faultStarts[z.faultStartNext] < FAULT_CYCLE_SPAN) {
+    active |= FAULT_CYCLING;
+  }
+  return active;
+}
+
+void faultClear(int i) {
+// CLEARS A ZONE'S LATCHED ALARMS WHOSE FAULT HAS GONE, AND HAS THE THERMOSTAT ACT ON IT NOW -----
+  Zone &z = zones[i];
+  byte keep = z.alarms & faultActive(z);
+
+  traceEvent(TRACE_CLEAR, i, 0);
+  if (keep != z.alarms) {
+    z.alarms = keep;
+    z.effectRunning = 0;
+    kickTask(TASK_THERMO);
+  }
+}
+
+void thermoStat() {
+// RUNS THERMOSTAT FOR EACH ZONE ------------------------------------------------------------
+  traceThermo();
+  for (int i = 0; i < ZONES; i++) {
+    thermoZone(zones[i]);
+  }
+  if (!bootDecided && sampledAll) {
+    bootDecided = 1;
+    bootDecisionMs = millis();
+  }
+}
+
+void thermoZone(Zone &z) { 
+// COMPARES TEMP TO SETPOINT AND CONTROLS DEVICE TAKING HYSTERISYS INTO ACCOUNT --------------
+  if (z.avgTemp100 >= Config::failSafe100 && !(z.alarms & FAULT_OFF)) {   // If warmer than 1 degree F ie sensor working, no alarm
+    if (z.powerSet == 1) {                                // If power is on
+     if (z.ctrlMode == CTRL_PID) {
+       controlDevice(z, pidDecide(z));
+     } else if (z.ctrlMode == CTRL_PREDICT) {
+       controlDevice(z, predictDecide(z));
+     } else if (hystDecide(z)) {                          // Past setpoint by hysterysis, or holding on
+       if (z.heatMode == 0 || millis() - z.shutDownTimer >= Config::powerWait) {   // Cooler only 5 mins after it stopped
+         z.device = 1;                                    // Request device on
+       }
      } else {
-        ptr +="<p><a href=\"/modeHeat\"><button class=\"button\">Cool</button></a></p>\n";
-     }
+       z.device = 0;                                      // Request device off
+       if (z.heatMode == 1 && z.deviceLastSetting != z.device) {   // First iteration since shutdown - start timer
+         z.shutDownTimer = millis();
+       }
+    }
+  } else {                                                // Power setting is off
+        z.device = 0;
+        if (z.deviceLastSetting != z.device) {           // First iteration since shutdown - start timer
+           z.shutDownTimer = millis();
+  }
+  }
+if (z.device != z.deviceLastSetting) {
+  z.deviceChangedAt = millis();
+}
+z.deviceLastSetting = z.device;            // Update state for next time
+  
+}
+  else {                                                  // Sensor failure or alarm, faultRaise() has said which
+    if (z.device == 1) {
+        z.device = 0;                                  // Shut off heater
+        z.shutDownTimer = millis();
+  }
+ }
+}
+
+void controlDevice(Zone &z, bool want) {
+// SETS DEVICE AS PID/PREDICTIVE WANT, HOLDING MIN ON/OFF TIMES AND COOLER RESTART WAIT -----
+  unsigned long held = millis() - z.deviceChangedAt;
+
+  if (want && !z.device) {
+    if (held < CTRL_MIN_OFF || (z.heatMode == 1 && millis() - z.shutDownTimer < Config::powerWait)) {
+      return;
+    }
+    z.device = 1;
+  } else if (!want && z.device) {
+    if (held < CTRL_MIN_ON) {
+      return;
+    }
+    z.device = 0;
+    z.shutDownTimer = millis();                   // Start cooler restart wait
+  }
+}
+
+bool hystDecide(Zone &z) {
+// ON/OFF AT SETPOINT WITH HYSTERISYS, RETURNS WHETHER DEVICE SHOULD BE ON ---------------------
+// Heat comes on at hyst below setpoint and goes off at setpoint, cool the other way round.
+// Anything between holds, the band is the hysteresis; with one threshold, sensor noise at it
+// would flip the relay every few seconds. Whole hundredths, so no float on this path.
+  int setPoint100 = z.setPoint10 * 10;
+
+  if (z.heatMode == 0) {
+    if (z.avgTemp100 <= setPoint100 - z.hyst100) {
+      return 1;
+    }
+    if (z.avgTemp100 >= setPoint100) {
+      return 0;
+    }
+  } else {
+    if (z.avgTemp100 >= setPoint100 + z.hyst100) {
+      return 1;
+    }
+    if (z.avgTemp100 <= setPoint100) {
+      return 0;
+    }
+  }
+  return z.device;
+}
+
+bool pidDecide(Zone &z) {
+// TIME PROPORTIONAL PID, RETURNS WHETHER DEVICE SHOULD BE ON NOW -----------------------------
+// Output fraction is the on time within each PID_WINDOW. The integral only grows while the
+// output is not pinned at 0 or 1 in the same direction (anti-windup). Derivative is taken on
+// temperature rather than error so setpoint steps do not kick the output.
+  unsigned long now = millis();
+  int setPoint100 = z.setPoint10 * 10;
+  float err = (z.heatMode ? z.avgTemp100 - setPoint100 : setPoint100 - z.avgTemp100) / 100.0;   // Positive when device needed
+  float deriv = 0;
+
+  if (z.pidLast != 0 && now != z.pidLast) {
+    float dt = (now - z.pidLast) / 1000.0;
+    deriv = (z.avgTemp100 - z.pidLastTemp100) / 100.0 / dt;
+    if (z.heatMode == 0) {
+      deriv = -deriv;                             // Rising temp means less heat needed
+    }
+    float u = PID_KP * err + z.pidI + PID_KP * PID_TD * deriv;
+    if ((u < 1 || err < 0) && (u > 0 || err > 0)) {
+      z.pidI += PID_KP * err * dt / PID_TI;
+      z.pidI = constrain(z.pidI, 0.0, 1.0);
+    }
+  }
+  z.pidLast = now;
+  z.pidLastTemp100 = z.avgTemp100;
+
+  float u = constrain(PID_KP * err + z.pidI + PID_KP * PID_TD * deriv, 0.0, 1.0);
+  unsigned long onTime = u * PID_WINDOW;
+  if (onTime < CTRL_MIN_ON) {
+    onTime = onTime < CTRL_MIN_ON / 2 ? 0 : CTRL_MIN_ON;      // Too short to be worth a start
+  } else if (PID_WINDOW - onTime < CTRL_MIN_OFF) {
+    onTime = PID_WINDOW - onTime < CTRL_MIN_OFF / 2 ? PID_WINDOW : PID_WINDOW - CTRL_MIN_OFF;
+  }
+
+  if (now - z.pidWindowStart >= PID_WINDOW) {
+    z.pidWindowStart = now;
+    z.pidDone = 0;
+  }
+  if (now - z.pidWindowStart >= onTime && z.device) {
+    z.pidDone = 1;                                // Once off, stay off until next window so noise can't toggle it
+  }
+  return !z.pidDone && now - z.pidWindowStart < onTime;
+}
+
+bool predictDecide(Zone &z) {
+// ON/OFF WITH BAND, TURNING OFF WHEN THE ROOM WILL REACH SETPOINT ON ITS OWN ------------------
+// Room keeps moving for about PREDICT_LAG minutes after the device stops (heater/coil still
+// warm or cold, sensor average catching up), so turn off once avgTemp is within that much
+// travel of the setpoint at the learned rate.
+  int coast = hundredths(z.predictRate * PREDICT_LAG);
+  int half = PREDICT_BAND / 2;
+  int setPoint100 = z.setPoint10 * 10;
+
+  if (z.heatMode == 0) {
+    if (z.avgTemp100 <= setPoint100 - half) {
+      return 1;
+    }
+    if (z.avgTemp100 + coast >= setPoint100 + half) {
+      return 0;
+    }
+  } else {
+    if (z.avgTemp100 >= setPoint100 + half) {
+      return 1;
+    }
+    if (z.avgTemp100 - coast <= setPoint100 - half) {
+      return 0;
+    }
+  }
+  return z.device;                                // Inside band, hold
+}
+
+void predictLearn(Zone &z, int temp10, byte duty) {
+// UPDATES LEARNED RATE FROM MINUTE AVERAGES WHEN DEVICE RAN ALL OF THIS AND LAST MINUTE --------
+  if (duty == 63 && z.predictPrevDuty == 63) {
+    float rate = (temp10 - z.predictPrevTemp10) / 10.0;
+    if (z.heatMode == 1) {
+      rate = -rate;
+    }
+    if (rate > 0) {
+      z.predictRate += (rate - z.predictRate) * 0.1;  // Smooth over about 10 minutes of running
+    }
+  }
+  z.predictPrevTemp10 = temp10;
+  z.predictPrevDuty = duty;
+}
+
+void sendOutput() {
+// COMPARES EACH ZONE'S DEVICE SETTING TO LAST SETTING AND UPDATES PIN IF CHANGED ------------------
+  for (int i = 0; i < ZONES; i++) {
+    Zone &z = zones[i];
+     if (z.device != z.lastDeviceState) {      // Compares current heat request to last known state of output
+    digitalWrite(zoneConfig[i].relayPin, z.device);  // Write output state to output pin
+    traceEvent(TRACE_OUTPUT, i, z.device);
+    z.switches = z.switches + 1;
+    if (z.device) {
+      faultStart(i);                           // Counts starts for short cycling
+    }
+  
+  }
+   z.lastDeviceState = z.device;            // Update state for next time
+  }
+}
+   
+long getCounts(int pin) {
+// READS PIN AND RETURNS SUM OF THE BURST'S KEPT ADC COUNTS FOR TEMP SENSOR -------------------
+// Takes a burst of adcBurst reads, sorting as it goes, and sums all but the adcTrim lowest
+// and highest, so reads hit by Wi-Fi noise are dropped rather than averaged in. The sum
+// keeps the burst's resolution below one count for Config::adcHundredths().
+  int reads[Config::adcBurst];
+  long sum = 0;
+  int i;
+
+  for (int n = 0; n < Config::adcBurst; n++) {
+    int v = analogRead(pin);
+    for (i = n; i > 0 && reads[i - 1] > v; i--) {
+      reads[i] = reads[i - 1];
+    }
+    reads[i] = v;
+  }
+  for (i = Config::adcTrim; i < Config::adcBurst - Config::adcTrim; i++) {
+    sum += reads[i];
+  }
+  return sum;
+}
+
+void setFilter(Zone &z, int window) {
+// SETS FILTER WINDOW, EMPTIES RING BUFFER -----------------------------------
+  if (window < 1) {
+    window = 1;
+  } else if (window > Config::windowMax) {
+    window = Config::windowMax;
+  }
+  z.tempWindow = window;
+  z.tempArrayCtr = 0;
+  z.tempCount = 0;
+  z.tempSum = 0;
+}
+
+int filterTemp(Zone &z, int reading) {
+// LOADS READING TO RING BUFFER AND RETURNS FILTERED TEMP ---------------------
+// Array is on infinite loop, restarts loading readings at 0 once full.
+// A running sum keeps each reading constant time, and only readings actually taken are
+// averaged so the result does not start near zero while the buffer fills after boot.
+// Readings and the result are hundredths; the sum is exact and the EMA carries EMA_SHIFT more
+// bits, so nothing builds up or rounds away. Config::filter picks the code built.
+  int oldest = z.tempArray[z.tempArrayCtr];
+  bool full = (z.tempCount == z.tempWindow);
+
+  if (full) {
+    z.tempSum -= oldest;                          // Oldest reading leaves the window
+  } else {
+    z.tempCount = z.tempCount + 1;
+  }
+  z.tempArray[z.tempArrayCtr] = reading;
+  z.tempSum += reading;
+
+  if (Config::filter == FILTER_MEDIAN) {
+    sortedReplace(z, full, oldest, reading);
+  }
+
+  z.tempArrayCtr = z.tempArrayCtr + 1;              // Increment counter
+  if (z.tempArrayCtr >= z.tempWindow) {
+    z.tempArrayCtr = 0;                           // Reset counter
+  }
+
+  if (Config::filter == FILTER_EMA) {
+    if (z.tempCount == 1) {
+      z.tempEma = (long)reading << EMA_SHIFT;     // First reading seeds the average
+    } else {
+      z.tempEma += (((long)reading << EMA_SHIFT) - z.tempEma) * 2 / (z.tempWindow + 1);
+    }
+    return divRound(z.tempEma, 1L << EMA_SHIFT);
+  }
+  if (Config::filter == FILTER_MEDIAN) {
+    if (z.tempCount % 2 == 1) {
+      return z.tempSorted[z.tempCount / 2];
+    }
+    return divRound(z.tempSorted[z.tempCount / 2 - 1] + z.tempSorted[z.tempCount / 2], 2);
+  }
+  return divRound(z.tempSum, z.tempCount);
+}
+
+void sortedReplace(Zone &z, bool full, int oldest, int reading) {
+// SWAPS OLDEST READING FOR NEW ONE IN ORDERED COPY OF RING BUFFER -------------------
+// Shifts at most one window of readings, so median costs a memmove rather than a sort per reading
+  int n = z.tempCount;
+  int i;
+
+  if (full) {
+    for (i = 0; i < n - 1 && z.tempSorted[i] != oldest; i++);    // Find oldest reading
+    memmove(&z.tempSorted[i], &z.tempSorted[i + 1], (n - 1 - i) * sizeof(z.tempSorted[0]));
+  }
+  for (i = n - 1; i > 0 && z.tempSorted[i - 1] > reading; i--) {  // Shift larger readings up
+    z.tempSorted[i] = z.tempSorted[i - 1];
+  }
+  z.tempSorted[i] = reading;
+}
+
+int calibrated(Zone &z) {
+// RETURNS rawTemp WITH ZONE'S CALIBRATION APPLIED, avgTemp = rawTemp * calGain + calOffset ---
+// Gain is in ten-thousandths and offset in hundredths as they are saved, so one multiply and
+// one divide in integers
+  return divRound((long)z.rawTemp100 * z.calGain10000 + z.calOffset100 * 10000L, 10000);
+}
 
+void handle_OnConnect() {
+// CALLS MAIN WEBPAGE ------------------------------------------------------------                   
+   if (!pickZone()) {
+     return;
+   }
+   renderPage(200, MAIN_PAGE);                     // Streams main page template with live values
+}
+
+void addDegree() {
+// QUEUES .1 DEGREE UP, UP TO spMax10, AND CALLS REDIRECT TO MAIN WEBPAGE ------------                              
+  if (!pickZone()) {
+    return;
+  }
+  int sp10 = commandSetPoint(zoneSel) + 1;
+  if (sp10 > Config::spMax10) {
+    sp10 = Config::spMax10;
+  }
+  commandQueue(zoneSel, CMD_SETPOINT, sp10, 0, 0);  // Applied with any other taps in CMD_WINDOW
+  sendRedirect();                                 // Once increment done, resets webpage to root
+  
+}
+
+void powerOn() {
+// SETS POWER VAR TO ON AND CALLS REDIRECT TO MAIN WEBPAGE ------------------------                              
+  if (!pickZone()) {
+    return;
+  }
+  changePower(zones[zoneSel], 1);                 // Sets var for thermostat to turn on
+  sendRedirect();                                 // Resets webpage to root
+  }
+
+void powerOff() {
+// SETS POWER VAR TO OFF AND CALLS REDIRECT TO MAIN WEBPAGE ------------------------                               
+  if (!pickZone()) {
+    return;
+  }
+  changePower(zones[zoneSel], 0);                 // Sets var for thermostat to turn off
+  sendRedirect();                                 // Resets webpage to root
+}
+
+void minusDegree() {  
+// QUEUES .1 DEGREE DOWN, DOWN TO spMin10, AND CALLS REDIRECT TO MAIN WEBPAGE ---------                            
+  if (!pickZone()) {
+    return;
+  }
+  int sp10 = commandSetPoint(zoneSel) - 1;
+  if (sp10 < Config::spMin10) {
+    sp10 = Config::spMin10;
+  }
+  commandQueue(zoneSel, CMD_SETPOINT, sp10, 0, 0);  // Applied with any other taps in CMD_WINDOW
+  sendRedirect();                                 // Once decrement done, resets webpage to root
   
-  ptr +="</div>\n";
-  ptr +="</body>\n";
+}
+void modeHeat() {
+// SETS SYSTEM TO HEATER MODE (heatMode false) ----------------------------------------
+  if (!pickZone()) {
+    return;
+  }
+  changeMode(zones[zoneSel], 0);                   // Set var to heat mode
+  sendRedirect();                                 // Once mode changed, resets webpage to root
   
-  ptr +="</html>\n";
+}
+
+void modeCold() {
+// SETS SYSTEM TO HEATER MODE (heatMode false) ----------------------------------------
+  if (!pickZone()) {
+    return;
+  }
+  changeMode(zones[zoneSel], 1);                   // Set var to cold mode
+  sendRedirect();                                 // Once mode changed, resets webpage to root
   
-  return ptr;                                       // Return string to calling argument
+}
+
+void clearAlarms() {
+// CLEARS THE ZONE'S ALARMS WHOSE FAULT HAS GONE AND CALLS REDIRECT TO MAIN WEBPAGE ---------
+  if (!pickZone()) {
+    return;
+  }
+  faultClear(zoneSel);
+  sendRedirect();
+}
+
+void changeSetPoint(Zone &z, int value10) {
+// SETS SETPOINT AND HAS THERMOSTAT ACT ON IT NOW RATHER THAN AT NEXT thermoPeriod ---------
+  z.setPoint10 = value10;
+  z.schedOverride = 1;                            // Cleared when the schedule next applies an event
+  commandDrop(z, CMD_SETPOINT);                   // Made after anything queued, so it wins
+  settingsChanged();
+}
+
+void changePower(Zone &z, bool on) {
+// SETS POWER AND HAS THERMOSTAT ACT ON IT NOW ------------------------------------------
+  z.powerSet = on;
+  z.schedOverride = 1;
+  commandDrop(z, CMD_POWER);
+  settingsChanged();
+}
+
+void changeMode(Zone &z, bool cool) {
+// SETS HEAT (0) OR COOL (1) MODE AND HAS THERMOSTAT ACT ON IT NOW -----------------------
+  z.heatMode = cool;
+  z.schedOverride = 1;
+  commandDrop(z, CMD_MODE);
+  settingsChanged();
+}
+
+void changeControl(Zone &z, byte mode) {
+// SELECTS CONTROL ALGORITHM, STARTING PID FROM A CLEAN STATE ----------------------------------
+  z.ctrlMode = mode;
+  z.pidI = 0;
+  z.pidLast = 0;
+  z.pidWindowStart = millis();
+  z.pidDone = 0;
+  settingsChanged();
+}
+
+void settingsChanged() {
+// RUNS THERMOSTAT NOW AND QUEUES SETTINGS FOR SAVING ------------------------------------
+  kickTask(TASK_THERMO);
+  settingsDirty = 1;
+  settingsChangedAt = millis();
+}
+
+unsigned long lockoutRemaining(Zone &z) {
+// RETURNS SECONDS UNTIL COOLER MAY RESTART, ROUNDED UP TO LOCKOUT_STEP ------------------
+  unsigned long since = millis() - z.shutDownTimer;
+  if (since >= Config::powerWait) {
+    return 0;
+  }
+  unsigned long secs = (Config::powerWait - since + 999) / 1000;
+  return (secs + LOCKOUT_STEP - 1) / LOCKOUT_STEP * LOCKOUT_STEP;
+}
+
+void checkState() {
+// BUMPS stateVersion IF ANYTHING /api/state REPORTS HAS CHANGED IN ANY ZONE --------------
+// Runs once per loop pass. avgTemp only changes at the tenth it is reported to, so polls
+// between real changes get 304 Not Modified.
+  bool changed = 0;
+
+  for (int i = 0; i < ZONES; i++) {
+    Zone &z = zones[i];
+    StateSnap now;
+    now.temp10 = divRound(z.avgTemp100, 10);
+    now.setPoint10 = z.setPoint10;
+    now.hyst100 = z.hyst100;
+    now.flags = z.device | (z.powerSet << 1) | (z.heatMode << 2) | (z.ctrlMode << 3);
+    now.alarms = z.alarms;
+    now.lockout = lockoutRemaining(z) / LOCKOUT_STEP;
+
+    if (now.temp10 != z.snap.temp10 || now.setPoint10 != z.snap.setPoint10 ||
+        now.hyst100 != z.snap.hyst100 || now.flags != z.snap.flags || now.alarms != z.snap.alarms || now.lockout != z.snap.lockout) {
+      z.snap = now;
+      changed = 1;
+    }
+  }
+  if (changed) {
+    stateVersion = stateVersion + 1;
+  }
+}
+
+bool pickZone() {
+// SETS zoneSel FROM zone= (DEFAULT 0), SENDS 404 AND RETURNS FALSE IF THERE IS NO SUCH ZONE ------
+  zoneSel = 0;
+  if (!server.hasArg("zone")) {
+    return true;
+  }
+  String arg = server.arg("zone");
+  char *end;
+  long n = strtol(arg.c_str(), &end, 10);
+  if (end == arg.c_str() || *end != 0 || n < 0 || n >= ZONES) {
+    apiError(404, PSTR("no such zone"));
+    return false;
+  }
+  zoneSel = n;
+  return true;
+}
+
+bool stateNotModified() {
+// SETS ETag FOR THE CURRENT STATE VERSION, SENDS 304 AND RETURNS TRUE IF CLIENT HAS IT ----------
+  char etag[16];
+  snprintf(etag, sizeof(etag), "\"%lu\"", stateVersion);
+
+  server.sendHeader("ETag", etag);
+  server.sendHeader("Cache-Control", "no-cache");
+  if (strcmp(server.header("If-None-Match").c_str(), etag) == 0) {
+    server.send(304, "application/json", "");
+    return true;
+  }
+  return false;
+}
+
+void apiState() {
+// SENDS ZONE'S STATE AS JSON, OR 304 IF CLIENT ALREADY HAS THIS VERSION -----------------
+  if (!pickZone() || stateNotModified()) {
+    return;
+  }
+  renderBegin(200, "application/json");
+  renderTemplate(STATE_JSON);
+  renderEnd();
+}
+
+void apiZones() {
+// SENDS EVERY ZONE'S STATE AS A JSON ARRAY, OR 304 IF CLIENT ALREADY HAS THIS VERSION -----
+  if (stateNotModified()) {
+    return;
+  }
+  renderBegin(200, "application/json");
+  renderOut("[", 1);
+  for (zoneSel = 0; zoneSel < ZONES; zoneSel++) {
+    if (zoneSel > 0) {
+      renderOut(",", 1);
+    }
+    renderTemplate(STATE_JSON);
+  }
+  renderOut("]\n", 2);
+  renderEnd();
+  zoneSel = 0;
+}
+
+void apiAlarms() {
+// SENDS EVERY ZONE'S ALARMS AS A JSON ARRAY, A POST FIRST CLEARING zone='S OR EVERY ZONE'S ------
+// Alarms whose fault is still there stay latched; active in the reply shows which
+  if (server.method() == HTTP_POST) {
+    if (server.hasArg("zone")) {
+      if (!pickZone()) {
+        return;
+      }
+      faultClear(zoneSel);
+    } else {
+      for (int i = 0; i < ZONES; i++) {
+        faultClear(i);
+      }
+    }
+  }
+  renderBegin(200, "application/json");
+  renderOut("[", 1);
+  for (zoneSel = 0; zoneSel < ZONES; zoneSel++) {
+    if (zoneSel > 0) {
+      renderOut(",", 1);
+    }
+    renderTemplate(ALARMS_JSON);
+  }
+  renderOut("]\n", 2);
+  renderEnd();
+  zoneSel = 0;
+}
+
+void apiSetPoint() {
+// SETS SETPOINT FROM value (ABSOLUTE) OR delta (RELATIVE), REPLIES WITH NEW STATE --------
+  float value;
+
+  if (!pickZone()) {
+    return;
+  }
+  if (!argFloat("value", &value)) {
+    if (!argFloat("delta", &value)) {
+      apiError(400, PSTR("value or delta required"));
+      return;
+    }
+    value += commandSetPoint(zoneSel) / 10.0;     // From where queued changes leave it
+  }
+  if (tenths(value) < Config::spMin10 || tenths(value) > Config::spMax10) {
+    apiError(422, PSTR("setpoint out of range"));
+    return;
+  }
+  changeSetPoint(zones[zoneSel], tenths(value));
+  checkState();
+  apiState();
+}
+
+void apiPower() {
+// SETS POWER FROM on=0 OR 1, REPLIES WITH NEW STATE --------------------------------------
+  String on = server.arg("on");
+
+  if (!pickZone()) {
+    return;
+  }
+  if (on != "0" && on != "1") {
+    apiError(400, PSTR("on must be 0 or 1"));
+    return;
+  }
+  changePower(zones[zoneSel], on == "1");
+  checkState();
+  apiState();
+}
+
+void apiMode() {
+// SETS MODE FROM mode=heat OR cool, REPLIES WITH NEW STATE --------------------------------
+  String mode = server.arg("mode");
+
+  if (!pickZone()) {
+    return;
+  }
+  if (mode != "heat" && mode != "cool") {
+    apiError(400, PSTR("mode must be heat or cool"));
+    return;
+  }
+  changeMode(zones[zoneSel], mode == "cool");
+  checkState();
+  apiState();
+}
+
+void apiCommand() {
+// QUEUES ANY OF setpoint= OR delta=, power= AND mode= FOR ONE ZONE, REPLIES WITH THE COMMAND'S NUMBER
+// AND WHAT THE ZONE WILL BE SET TO. A repeat of a recent seq= for the zone gets that command's
+// reply again, changing nothing, so a client can retry after a lost reply.
+  float value;
+  byte set = 0;
+  bool clamped = 0;
+  unsigned long seq = strtoul(server.arg("seq").c_str(), 0, 10);
+  bool hasSeq = server.hasArg("seq");
+
+  if (!pickZone()) {
+    return;
+  }
+  for (int i = 0; hasSeq && i < CMD_SEEN; i++) {
+    if (cmdSeen[i].cmd != 0 && cmdSeen[i].seq == seq && cmdSeen[i].zone == zoneSel) {
+      cmdReplays = cmdReplays + 1;
+      cmdReply = cmdSeen[i];
+      cmdReplay = 1;
+      renderBegin(200, "application/json");
+      renderTemplate(COMMAND_JSON);
+      renderEnd();
+      return;
+    }
+  }
+
+  Zone &z = zones[zoneSel];
+  PendingCmd &p = pending[zoneSel];
+  int sp10 = commandSetPoint(zoneSel);
+  bool powerSet = p.set & CMD_POWER ? p.powerSet : z.powerSet;
+  bool heatMode = p.set & CMD_MODE ? p.heatMode : z.heatMode;
+  String arg;
+
+  if (argFloat("setpoint", &value)) {
+    if (tenths(value) < Config::spMin10 || tenths(value) > Config::spMax10) {
+      commandReject(422, PSTR("setpoint out of range"));
+      return;
+    }
+    sp10 = tenths(value);
+    set |= CMD_SETPOINT;
+  } else if (argFloat("delta", &value)) {
+    if (abs(tenths(value)) > CMD_DELTA_MAX) {
+      commandReject(422, PSTR("delta too large"));
+      return;
+    }
+    sp10 += tenths(value);                        // From where queued changes leave it
+    if (sp10 < Config::spMin10 || sp10 > Config::spMax10) {
+      sp10 = sp10 < Config::spMin10 ? Config::spMin10 : Config::spMax10;
+      clamped = 1;
+    }
+    set |= CMD_SETPOINT;
+  } else if (server.hasArg("setpoint") || server.hasArg("delta")) {
+    commandReject(400, PSTR("setpoint and delta must be numbers"));
+    return;
+  }
+  if (server.hasArg("power")) {
+    arg = server.arg("power");
+    if (arg != "0" && arg != "1") {
+      commandReject(400, PSTR("power must be 0 or 1"));
+      return;
+    }
+    powerSet = arg == "1";
+    set |= CMD_POWER;
+  }
+  if (server.hasArg("mode")) {
+    arg = server.arg("mode");
+    if (arg != "heat" && arg != "cool") {
+      commandReject(400, PSTR("mode must be heat or cool"));
+      return;
+    }
+    heatMode = arg == "cool";
+    set |= CMD_MODE;
+  }
+  if (set == 0) {
+    commandReject(400, PSTR("setpoint, delta, power or mode required"));
+    return;
+  }
+  if (!commandTake()) {
+    cmdLimited = cmdLimited + 1;
+    server.sendHeader("Retry-After", "1");
+    apiError(429, PSTR("too many commands"));
+    return;
+  }
+
+  commandQueue(zoneSel, set, sp10, powerSet, heatMode);
+  cmdCount = cmdCount + 1;
+  cmdReply.cmd = cmdCount;
+  cmdReply.seq = seq;
+  cmdReply.hasSeq = hasSeq;
+  cmdReply.zone = zoneSel;
+  cmdReply.setPoint10 = sp10;
+  cmdReply.powerSet = powerSet;
+  cmdReply.heatMode = heatMode;
+  cmdReply.clamped = clamped;
+  cmdReplay = 0;
+  if (hasSeq) {
+    cmdSeen[cmdSeenNext] = cmdReply;
+    cmdSeenNext = (cmdSeenNext + 1) % CMD_SEEN;
+  }
+  renderBegin(200, "application/json");
+  renderTemplate(COMMAND_JSON);
+  renderEnd();
+}
+
+void commandReject(int code, PGM_P message) {
+// COUNTS AN INVALID COMMAND AND SENDS THE ERROR ----------------------------------------------
+  cmdRejected = cmdRejected + 1;
+  apiError(code, message);
+}
+
+bool commandTake() {
+// TAKES ONE COMMAND FROM THE RATE LIMIT BUCKET, FALSE IF IT IS EMPTY ---------------------------
+// The bucket holds CMD_BURST and refills at CMD_RATE a second
+  unsigned long now = millis();
+  unsigned long elapsed = now - cmdRefillAt;
+
+  cmdRefillAt = now;
+  if (elapsed > CMD_BURST * 1000UL / CMD_RATE) {
+    elapsed = CMD_BURST * 1000UL / CMD_RATE;      // Long enough to fill it, and no overflow below
+  }
+  cmdTokens += elapsed * CMD_RATE;
+  if (cmdTokens > CMD_BURST * 1000L) {
+    cmdTokens = CMD_BURST * 1000L;
+  }
+  if (cmdTokens < 1000) {
+    return false;
+  }
+  cmdTokens -= 1000;
+  return true;
+}
+
+int commandSetPoint(int zone) {
+// RETURNS THE SETPOINT THE ZONE'S QUEUED CHANGES LEAVE IT AT, TENTHS -----------------------------
+  return pending[zone].set & CMD_SETPOINT ? pending[zone].setPoint10 : zones[zone].setPoint10;
+}
+
+void commandQueue(int zone, byte set, int setPoint10, bool powerSet, bool heatMode) {
+// ADDS CHANGES TO THE ZONE'S BURST, STARTING ITS CMD_WINDOW IF IT IS THE FIRST -----------------
+  PendingCmd &p = pending[zone];
+  bool idle = 1;
+
+  for (int i = 0; i < ZONES; i++) {
+    if (pending[i].set) {
+      idle = 0;
+    }
+  }
+  if (p.set == 0) {
+    p.since = millis();
+  }
+  if (idle) {
+    deferTask(TASK_COMMAND, CMD_WINDOW);          // Otherwise already due for an earlier burst
+  }
+  p.set |= set;
+  if (set & CMD_SETPOINT) {
+    p.setPoint10 = setPoint10;
+  }
+  if (set & CMD_POWER) {
+    p.powerSet = powerSet;
+  }
+  if (set & CMD_MODE) {
+    p.heatMode = heatMode;
+  }
+}
+
+void commandDrop(Zone &z, byte set) {
+// DROPS QUEUED CHANGES TO WHAT A DIRECT CHANGE HAS JUST SET, SO A LATER BURST CAN'T UNDO IT -------
+  pending[&z - zones].set &= ~set;
+}
+
+void applyCommands() {
+// APPLIES EACH ZONE'S BURST ONCE ITS CMD_WINDOW HAS PASSED, AS ONE SETTING CHANGE -----------------
+// The settings save, the state version and so events and MQTT all see one change
+  unsigned long now = millis();
+  unsigned long wait = CMD_IDLE;
+  bool applied = 0;
+
+  for (int i = 0; i < ZONES; i++) {
+    PendingCmd &p = pending[i];
+    Zone &z = zones[i];
+    if (p.set == 0) {
+      continue;
+    }
+    if (now - p.since < CMD_WINDOW) {
+      if (CMD_WINDOW - (now - p.since) < wait) {
+        wait = CMD_WINDOW - (now - p.since);      // Burst started since the one that made this run due
+      }
+      continue;
+    }
+    if (p.set & CMD_SETPOINT) {
+      z.setPoint10 = p.setPoint10;
+    }
+    if (p.set & CMD_POWER) {
+      z.powerSet = p.powerSet;
+    }
+    if (p.set & CMD_MODE) {
+      z.heatMode = p.heatMode;
+    }
+    z.schedOverride = 1;                          // Cleared when the schedule next applies an event
+    p.set = 0;
+    cmdBursts = cmdBursts + 1;
+    applied = 1;
+  }
+  if (applied) {
+    settingsChanged();
+    checkState();
+  }
+  deferTask(TASK_COMMAND, wait);
+}
+
+void apiSensor() {
+// TAKES A READING FOR A REMOTE SENSOR ZONE FROM temp=DEGREES, REPLIES WITH THE ZONE'S STATE ---
+// The reading is used until the next one arrives. If none arrives for REMOTE_STALE the
+// zone is treated as a failed sensor and its device shut off.
+  float temp;
+
+  if (!pickZone()) {
+    return;
+  }
+  if (zoneConfig[zoneSel].source != SRC_REMOTE) {
+    apiError(409, PSTR("zone does not take remote readings"));
+    return;
+  }
+  if (!argFloat("temp", &temp) || hundredths(temp) < Config::remoteMin100 || hundredths(temp) > Config::remoteMax100) {
+    apiError(400, TEMP_UNIT == UNIT_F ? PSTR("temp must be F from -40 to 150") : PSTR("temp must be C from -40 to 65"));
+    return;
+  }
+  Zone &z = zones[zoneSel];
+  z.remoteTemp100 = hundredths(temp);
+  z.remoteAt = millis();
+  checkState();
+  apiState();
+}
+
+void apiEvents() {
+// KEEPS CLIENT AS EVENT STREAM SUBSCRIBER, delta=DEGREES SETS ITS avgTemp THRESHOLD --------
+// The connection is held after the handler returns, pushEvents() writes to it from then on
+  int slot = -1;
+  float delta;
+
+  if (!pickZone()) {
+    return;
+  }
+  for (int i = 0; i < SSE_MAX; i++) {
+    if (!subscribers[i].client.connected()) {
+      slot = i;
+      break;
+    }
+  }
+  if (slot < 0) {
+    apiError(503, PSTR("too many subscribers"));
+    return;
+  }
+  if (!argFloat("delta", &delta) || delta < 0) {
+    delta = SSE_DELTA / 100.0;
+  }
+
+  Subscriber &sub = subscribers[slot];
+  sub.client = server.client();
+  sub.client.setNoDelay(true);
+  sub.client.write_P(SSE_HEADERS, strlen_P(SSE_HEADERS));
+  radioAt = millis();
+  sub.zone = zoneSel;
+  sub.delta100 = hundredths(delta);
+  sub.lastFlags = 0xFFFF;                         // Nothing sent yet, so first check sends state
+  sub.lastSend = millis();
+  sub.stalled = 0;
+  kickTask(TASK_PUSH);
+}
+
+void pushEvents() {
+// SENDS STATE EVENT TO EACH SUBSCRIBER WHOSE THRESHOLD HAS BEEN MET ----------------------
+// Only writes what the socket can take without blocking. A subscriber with no room keeps
+// its event pending, and is dropped if the socket stays full for SSE_STALL.
+  unsigned long now = millis();
+  int eventLen = 0;                               // Event text rendered on first use, then shared
+  int eventZone = -1;                             // by subscribers to the same zone
+
+  for (int i = 0; i < SSE_MAX; i++) {
+    Subscriber &sub = subscribers[i];
+    if (!sub.client.connected()) {
+      continue;
+    }
+
+    Zone &z = zones[sub.zone];
+    uint16_t flags = z.device | (z.powerSet << 1) | (z.heatMode << 2) | (z.alarms << 3);
+    bool due = (flags != sub.lastFlags) || (abs(z.avgTemp100 - sub.lastTemp100) > sub.delta100);
+    if (!due && now - sub.lastSend < SSE_KEEPALIVE) {
+      continue;
+    }
+    if (due && eventZone != sub.zone) {
+      eventLen = renderEvent(sub.zone);
+      eventZone = sub.zone;
+    }
+    int len = due ? eventLen : strlen_P(SSE_KEEPALIVE_TEXT);
+
+    if ((int)sub.client.availableForWrite() < len) {
+      if (!sub.stalled) {
+        sub.stalled = 1;
+        sub.stalledSince = now;
+      } else if (now - sub.stalledSince >= SSE_STALL) {
+        sub.client.stop();                        // Slow client, free the slot
+      }
+      continue;
+    }
+    if (due) {
+      sub.client.write((const uint8_t *)renderBuf, len);
+      sub.lastTemp100 = z.avgTemp100;
+      sub.lastFlags = flags;
+    } else {
+      sub.client.write_P(SSE_KEEPALIVE_TEXT, len);
+    }
+    sub.lastSend = now;
+    sub.stalled = 0;
+    radioAt = now;
+  }
+}
+
+int renderEvent(int zone) {
+// RENDERS ZONE'S STATE EVENT INTO renderBuf AND RETURNS ITS LENGTH -------------------------
+  checkState();                                   // Version in event matches what it reports
+  zoneSel = zone;
+  renderLen = 0;
+  renderCapture = 1;
+  renderOut_P(PSTR("event: state\ndata: "));
+  renderTemplate(STATE_JSON);
+  renderOut_P(PSTR("\n"));
+  renderCapture = 0;
+  return renderLen;
+}
+
+void serviceMqtt() {
+// KEEPS THE BROKER CONNECTION UP, APPLIES COMMANDS, PUBLISHES STATE CHANGES AND REPORTS ---------
+  unsigned long now = millis();
+
+  if (MQTT_HOST[0] == 0) {
+    return;
+  }
+  if (now - mqtt.reportAt >= MQTT_REPORT) {
+    mqtt.reportAt = now;
+    mqttReport();                                 // Queued while offline, sent once back
+  }
+  if (!mqtt.client.connected()) {
+    if (mqtt.state != MQTT_DOWN) {
+      mqttLost(now);                              // Broker closed the connection
+    }
+    if (net.state == NET_UP && (long)(now - mqtt.retryAt) >= 0) {
+      mqttConnect(now);                           // Not before Wi-Fi has joined
+    }
+    return;
+  }
+
+  mqttRead(now);
+  if (mqtt.state == MQTT_WAIT && now - mqtt.since >= MQTT_CONNACK_WAIT) {
+    mqttLost(now);
+  }
+  if (mqtt.state != MQTT_UP) {
+    return;
+  }
+  if (now - mqtt.lastIn >= MQTT_KEEPALIVE * 1500UL) {
+    mqttLost(now);                                // Pings unanswered, the link is dead
+    return;
+  }
+
+  checkState();                                   // Version in each state matches what it reports
+  for (int i = 0; i < ZONES; i++) {
+    Zone &z = zones[i];
+    uint16_t flags = z.device | (z.powerSet << 1) | (z.heatMode << 2) | (z.ctrlMode << 3) | (z.alarms << 5);
+    if (flags != z.mqttFlags || z.setPoint10 != z.mqttSetPoint10 || abs(z.avgTemp100 - z.mqttTemp100) > MQTT_DELTA) {
+      mqttState(i);
+      z.mqttFlags = flags;
+      z.mqttSetPoint10 = z.setPoint10;
+      z.mqttTemp100 = z.avgTemp100;
+    }
+  }
+  unsigned long half = MQTT_KEEPALIVE * 500UL;
+  if ((now - mqtt.lastOut >= half || now - mqtt.lastIn >= half) && now - mqtt.pingAt >= half) {
+    const byte ping[2] = {0xC0, 0};               // Keeps the broker from timing us out, and shows it's there
+    mqtt.pingAt = now;
+    mqttSend(ping, 2, now);
+  }
+  if (mqtt.state == MQTT_UP) {
+    mqttFlush(now);                               // Unless the ping found no room and dropped it
+  }
+}
+
+void mqttConnect(unsigned long now) {
+// OPENS THE BROKER CONNECTION AND SENDS CONNECT, WITH A "offline" WILL ON THE STATUS TOPIC -------
+// The only call in the task that waits, for the TCP handshake, and no longer than MQTT_CONNECT_WAIT
+  IPAddress ip;
+  byte p[128];
+  char id[24];
+  char topic[48];
+
+  if (!ip.fromString(MQTT_HOST)) {
+    mqtt.retryAt = now + MQTT_BACKOFF_MAX;        // Not an address; names would need a DNS wait
+    return;
+  }
+  mqtt.client.setTimeout(MQTT_CONNECT_WAIT);
+  if (!mqtt.client.connect(ip, MQTT_PORT)) {
+    mqttLost(now);
+    return;
+  }
+  mqtt.client.setNoDelay(true);
+
+  snprintf(id, sizeof(id), "web-therm-%06lx", (unsigned long)ESP.getChipId());
+  snprintf(topic, sizeof(topic), "%s/status", mqtt.base);
+  int n = 2;
+  n += mqttString(p + n, "MQTT");
+  p[n++] = 4;                                     // Protocol level 3.1.1
+  p[n++] = 0x02 | 0x04 | 0x20;                    // Clean session, will, will retained
+  p[n++] = highByte(MQTT_KEEPALIVE);
+  p[n++] = lowByte(MQTT_KEEPALIVE);
+  n += mqttString(p + n, id);
+  n += mqttString(p + n, topic);
+  n += mqttString(p + n, "offline");
+  p[0] = 0x10;
+  p[1] = n - 2;
+  mqtt.state = MQTT_WAIT;
+  mqtt.since = now;
+  mqtt.lastIn = now;
+  mqtt.pingAt = now;
+  mqtt.inLen = 0;
+  mqtt.skip = 0;
+  mqttSend(p, n, now);
+}
+
+void mqttLost(unsigned long now) {
+// DROPS THE CONNECTION AND SETS WHEN TO TRY AGAIN, BACKING OFF AFTER EACH FAILURE ---------------
+// Up to a quarter more is added at random so a fleet doesn't reconnect in step after a broker restart
+  mqtt.client.stop();
+  mqtt.state = MQTT_DOWN;
+  mqtt.retryAt = now + mqtt.backoff + micros() % (mqtt.backoff / 4 + 1);
+  mqtt.backoff = mqtt.backoff * 2 < MQTT_BACKOFF_MAX ? mqtt.backoff * 2 : MQTT_BACKOFF_MAX;
+}
+
+void mqttRead(unsigned long now) {
+// READS WHAT HAS ARRIVED FROM THE BROKER, HANDLING EACH WHOLE PACKET ---------------------------
+  while (mqtt.state != MQTT_DOWN && mqtt.client.available() > 0) {
+    mqtt.lastIn = now;
+    if (mqtt.skip > 0) {
+      size_t take = mqtt.skip < MQTT_IN_MAX ? mqtt.skip : MQTT_IN_MAX;
+      mqtt.skip -= mqtt.client.read(mqtt.in, take);   // in is empty while skipping
+      continue;
+    }
+    mqtt.inLen += mqtt.client.read(mqtt.in + mqtt.inLen, MQTT_IN_MAX - mqtt.inLen);
+
+    while (mqtt.state != MQTT_DOWN) {
+      int head;
+      int len = mqttPacketLen(mqtt.in, mqtt.inLen, &head);
+      if (len < 0) {
+        mqttLost(now);                            // Not MQTT
+      } else if (len == 0 || len > mqtt.inLen) {
+        if (len > MQTT_IN_MAX) {
+          mqtt.skip = len - mqtt.inLen;           // Can never fit, throw it away as it arrives
+          mqtt.inLen = 0;
+        }
+        break;
+      } else {
+        mqttPacket(mqtt.in[0], mqtt.in + head, len - head, now);
+        mqtt.inLen -= len;
+        memmove(mqtt.in, mqtt.in + len, mqtt.inLen);
+      }
+    }
+  }
+}
+
+void mqttPacket(byte type, const byte *body, int len, unsigned long now) {
+// HANDLES ONE PACKET FROM THE BROKER ---------------------------------------------------------
+  if (type >> 4 == 2) {                           // CONNACK
+    if (len < 2 || body[1] != 0) {
+      mqttLost(now);                              // Refused
+      return;
+    }
+    byte p[64];
+    int n = 4;
+    char filter[48];
+    snprintf(filter, sizeof(filter), "%s/+/set/+", mqtt.base);
+    n += mqttString(p + n, filter);
+    p[n++] = 0;                                   // QoS 0
+    p[0] = 0x82;
+    p[1] = n - 2;
+    p[2] = 0;
+    p[3] = 1;                                     // Packet id
+    mqtt.state = MQTT_UP;
+    mqtt.backoff = MQTT_BACKOFF_MIN;
+    mqtt.connects++;
+    mqttSend(p, n, now);
+
+    snprintf(filter, sizeof(filter), "%s/status", mqtt.base);
+    mqttBegin(filter, 1);
+    renderOut_P(PSTR("online"));
+    mqttEnd();
+    for (int i = 0; i < ZONES; i++) {
+      zones[i].mqttFlags = 0xFFFF;                // Republish every zone's state
+    }
+  } else if (type >> 4 == 3 && len >= 2) {        // PUBLISH, a command
+    char topic[64];
+    char payload[16];
+    int tlen = (body[0] << 8) | body[1];
+    int at = 2 + tlen + ((type & 0x06) ? 2 : 0);  // Packet id follows the topic above QoS 0
+    if (at > len || tlen >= (int)sizeof(topic) || len - at >= (int)sizeof(payload)) {
+      mqtt.rejected++;
+      return;
+    }
+    memcpy(topic, body + 2, tlen);
+    topic[tlen] = 0;
+    memcpy(payload, body + at, len - at);
+    payload[len - at] = 0;
+    mqttCommand(topic, payload);
+  }
+}
+
+void mqttCommand(const char *topic, const char *payload) {
+// APPLIES <base>/<zone>/set/<setpoint|power|mode|control> AS THE MATCHING API CALL WOULD --------
+// setpoint takes degrees, or a signed change (+0.5) as delta= does; power on/off or 1/0;
+// mode heat/cool; control hyst/pid/predict
+  size_t n = strlen(mqtt.base);
+  char *end;
+
+  if (strncmp(topic, mqtt.base, n) != 0 || topic[n] != '/') {
+    mqtt.rejected++;
+    return;
+  }
+  long zone = strtol(topic + n + 1, &end, 10);
+  if (end == topic + n + 1 || zone < 0 || zone >= ZONES || strncmp_P(end, PSTR("/set/"), 5) != 0) {
+    mqtt.rejected++;
+    return;
+  }
+  const char *what = end + 5;
+  Zone &z = zones[zone];
+
+  if (strcmp_P(what, PSTR("setpoint")) == 0) {
+    float value = strtod(payload, &end);
+    if (end == payload || *end != 0) {
+      mqtt.rejected++;
+      return;
+    }
+    if (payload[0] == '+' || payload[0] == '-') {
+      value += commandSetPoint(zone) / 10.0;
+    }
+    if (tenths(value) < Config::spMin10 || tenths(value) > Config::spMax10) {
+      mqtt.rejected++;
+      return;
+    }
+    changeSetPoint(z, tenths(value));
+  } else if (strcmp_P(what, PSTR("power")) == 0 && (strcmp_P(payload, PSTR("on")) == 0 || strcmp_P(payload, PSTR("1")) == 0)) {
+    changePower(z, 1);
+  } else if (strcmp_P(what, PSTR("power")) == 0 && (strcmp_P(payload, PSTR("off")) == 0 || strcmp_P(payload, PSTR("0")) == 0)) {
+    changePower(z, 0);
+  } else if (strcmp_P(what, PSTR("mode")) == 0 && strcmp_P(payload, PSTR("heat")) == 0) {
+    changeMode(z, 0);
+  } else if (strcmp_P(what, PSTR("mode")) == 0 && strcmp_P(payload, PSTR("cool")) == 0) {
+    changeMode(z, 1);
+  } else if (strcmp_P(what, PSTR("control")) == 0 && strcmp_P(payload, PSTR("hyst")) == 0) {
+    changeControl(z, CTRL_HYST);
+  } else if (strcmp_P(what, PSTR("control")) == 0 && strcmp_P(payload, PSTR("pid")) == 0) {
+    changeControl(z, CTRL_PID);
+  } else if (strcmp_P(what, PSTR("control")) == 0 && strcmp_P(payload, PSTR("predict")) == 0) {
+    changeControl(z, CTRL_PREDICT);
+  } else {
+    mqtt.rejected++;
+    return;
+  }
+  mqtt.commands++;
+}
+
+void mqttState(int zone) {
+// QUEUES ZONE'S STATE, RETAINED, ON <base>/<zone>/state -----------------------------------------
+  char topic[48];
+  snprintf(topic, sizeof(topic), "%s/%d/state", mqtt.base, zone);
+  zoneSel = zone;
+  mqttBegin(topic, 1);
+  renderTemplate(STATE_JSON);
+  mqttEnd();
+  zoneSel = 0;
+}
+
+void mqttReport() {
+// QUEUES EVERY ZONE'S READING AND SETTINGS IN ONE MESSAGE ON <base>/report, STAMPED WITH WHEN ---
+// Kept short so the queue holds a long outage's worth
+  char topic[48];
+  snprintf(topic, sizeof(topic), "%s/report", mqtt.base);
+  mqttBegin(topic, 0);
+  renderOut_P(PSTR("{\"uptime\":"));
+  renderInt(millis() / 1000);
+  renderOut_P(PSTR(",\"epoch\":"));
+  renderInt(clockSource == CLOCK_NONE ? 0 : clockNow());
+  renderOut_P(PSTR(",\"zones\":["));
+  for (zoneSel = 0; zoneSel < ZONES; zoneSel++) {
+    if (zoneSel > 0) {
+      renderOut(",", 1);
+    }
+    renderTemplate(REPORT_ZONE_JSON);
+  }
+  renderOut_P(PSTR("]}\n"));
+  mqttEnd();
+  zoneSel = 0;
+}
+
+void mqttBegin(const char *topic, bool retain) {
+// STARTS A PUBLISH PACKET ON THE END OF THE QUEUE, PAYLOAD FOLLOWS THROUGH THE RENDER CALLS -----
+// Room is left for a 2 byte remaining length, mqttEnd() fills it in once the payload is known
+  byte head[5] = {(byte)(0x30 | retain), 0, 0};
+  int tlen = strlen(topic);
+
+  mqtt.msgStart = mqtt.queueLen;
+  mqtt.msgLost = 0;
+  head[3] = highByte(tlen);
+  head[4] = lowByte(tlen);
+  mqttPut((const char *)head, 5);
+  mqttPut(topic, tlen);
+  renderLen = 0;
+  renderTo = mqttPut;
+}
+
+void mqttPut(const char *s, size_t n) {
+// APPENDS TO THE PACKET BEING BUILT, DROPPING THE OLDEST QUEUED PACKETS TO MAKE ROOM -------------
+  while (mqtt.queueLen + (int)n > MQTT_QUEUE && mqtt.msgStart > 0) {
+    int head;
+    int len = mqttPacketLen(mqtt.queue, mqtt.queueLen, &head);
+    mqtt.queueLen -= len;
+    memmove(mqtt.queue, mqtt.queue + len, mqtt.queueLen);
+    mqtt.msgStart -= len;
+    mqtt.dropped++;
+  }
+  if (mqtt.msgLost || mqtt.queueLen + (int)n > MQTT_QUEUE) {
+    mqtt.msgLost = 1;                             // Bigger than the whole queue
+    return;
+  }
+  memcpy(mqtt.queue + mqtt.queueLen, s, n);
+  mqtt.queueLen += n;
+}
+
+void mqttEnd() {
+// FINISHES THE PACKET mqttBegin() STARTED, OR TAKES IT BACK OFF THE QUEUE IF IT DIDN'T FIT ------
+  renderFlush();
+  renderTo = 0;
+  byte *p = mqtt.queue + mqtt.msgStart;
+  int rem = mqtt.queueLen - mqtt.msgStart - 3;   // MQTT_QUEUE keeps this under 16384, 2 bytes
+
+  if (mqtt.msgLost) {
+    mqtt.queueLen = mqtt.msgStart;
+    mqtt.dropped++;
+  } else if (rem < 128) {
+    p[1] = rem;
+    memmove(p + 2, p + 3, rem);
+    mqtt.queueLen--;
+  } else {
+    p[1] = (rem & 0x7F) | 0x80;
+    p[2] = rem >> 7;
+  }
+  mqtt.msgStart = -1;
+}
+
+void mqttSend(const byte *p, int len, unsigned long now) {
+// WRITES A CONTROL PACKET, OR DROPS THE CONNECTION IF THE SOCKET HAS NO ROOM FOR IT --------------
+// A session missing its CONNECT, SUBSCRIBE or PINGREQ would sit up but deaf or be timed out,
+// so start a fresh one instead; queued publishes wait for it
+  if ((int)mqtt.client.availableForWrite() < len) {
+    mqttLost(now);
+    return;
+  }
+  mqtt.client.write(p, len);
+  mqtt.lastOut = now;
+  radioAt = now;
+}
+
+void mqttFlush(unsigned long now) {
+// WRITES QUEUED PUBLISHES, WHOLE ONES ONLY, AS FAR AS THE SOCKET HAS ROOM ------------------------
+  while (mqtt.queueLen > 0) {
+    int head;
+    int len = mqttPacketLen(mqtt.queue, mqtt.queueLen, &head);
+    if ((int)mqtt.client.availableForWrite() < len) {
+      break;
+    }
+    mqtt.client.write(mqtt.queue, len);
+    mqtt.queueLen -= len;
+    memmove(mqtt.queue, mqtt.queue + len, mqtt.queueLen);
+    mqtt.published++;
+    mqtt.lastOut = now;
+    radioAt = now;
+  }
+}
+
+int mqttPacketLen(const byte *p, int len, int *head) {
+// RETURNS WHOLE LENGTH OF THE PACKET AT p AND SETS ITS HEADER LENGTH, 0 IF HEADER INCOMPLETE, -1 IF BAD --
+  long rem = 0;
+  for (int i = 1; i < 5; i++) {
+    if (i >= len) {
+      return 0;
+    }
+    rem |= (long)(p[i] & 0x7F) << (7 * (i - 1));
+    if (!(p[i] & 0x80)) {
+      *head = i + 1;
+      return i + 1 + rem;
+    }
+  }
+  return -1;
+}
+
+int mqttString(byte *p, const char *s) {
+// WRITES s AS AN MQTT STRING, LENGTH FIRST, AND RETURNS BYTES WRITTEN ---------------------------
+  int n = strlen(s);
+  p[0] = highByte(n);
+  p[1] = lowByte(n);
+  memcpy(p + 2, s, n);
+  return n + 2;
+}
+
+void histSample(int i) {
+// ADDS ZONE'S READING TO ITS CURRENT MINUTE, CLOSING THE MINUTE ONCE IT HAS ENDED -----------
+// Every zone's minutes feed its predictive learning, zone 0's also go into the history tiers
+  Zone &z = zones[i];
+  unsigned long minute = millis() / 60000;
+
+  if (minute != z.histMinute && z.histSamples > 0) {
+    int temp10 = (z.histTempSum + z.histSamples / 2) / z.histSamples;
+    int duty = (z.histOn * 63 + z.histSamples / 2) / z.histSamples;
+    predictLearn(z, temp10, duty);
+    if (i == 0) {
+      histClose(temp10, (z.histSetPointSum + z.histSamples / 2) / z.histSamples, duty);
+    }
+    z.histTempSum = 0;
+    z.histSetPointSum = 0;
+    z.histOn = 0;
+    z.histSamples = 0;
+  }
+  z.histMinute = minute;
+  z.histTempSum += divRound(z.avgTemp100, 10);
+  z.histSetPointSum += z.setPoint10;
+  z.histOn += z.device;
+  z.histSamples = z.histSamples + 1;
+}
+
+void histClose(int temp10, int setPoint10, int duty) {
+// ADDS ZONE 0'S FINISHED MINUTE TO EACH TIER, STORING A RECORD IN ANY TIER WHOSE PERIOD IS UP ---
+  unsigned long end = zones[0].histMinute + 1;    // Uptime minute the finished minute ends at
+
+  for (int i = 0; i < HIST_TIERS; i++) {
+    HistTier &t = histTiers[i];
+    t.tempSum += temp10;
+    t.setPointSum += setPoint10;
+    t.dutySum += duty;
+    t.n = t.n + 1;
+    if (end % t.minutes != 0) {
+      continue;
+    }
+
+    long sp = (t.setPointSum + t.n / 2) / t.n - Config::spMin10;
+    if (sp < 0) {
+      sp = 0;
+    } else if (sp > 1023) {
+      sp = 1023;
+    }
+    HistRec &r = t.recs[t.head];
+    r.temp10 = (t.tempSum + t.n / 2) / t.n;
+    r.packed = (sp << 6) | ((t.dutySum + t.n / 2) / t.n);
+
+    t.head = (t.head + 1) % t.size;
+    if (t.count < t.size) {
+      t.count = t.count + 1;
+    }
+    t.newest = end;
+    t.tempSum = 0;
+    t.setPointSum = 0;
+    t.dutySum = 0;
+    t.n = 0;
+  }
+}
+
+void apiHistory() {
+// STREAMS HISTORY RECORDS OLDEST FIRST, AS CSV OR RAW 4 BYTE RECORDS ------------------------
+// tier=min|qtr|hour (default min), from=records back from newest (default 0),
+// count=records (default all), format=csv|bin (default csv). from and count are whole numbers,
+// anything else is a 400; past the records kept they stop at them. The records go out a chunk
+// at a time from histMore() as the socket drains, see the cursor values set here.
+  String tierArg = server.arg("tier");
+  int tier = 0;
+  unsigned long from = 0;
+  unsigned long count = 0;
+  char header[12];
+
+  if (tierArg == "qtr") {
+    tier = 1;
+  } else if (tierArg == "hour") {
+    tier = 2;
+  } else if (tierArg.length() > 0 && tierArg != "min") {
+    apiError(400, PSTR("tier must be min, qtr or hour"));
+    return;
+  }
+  HistTier &t = histTiers[tier];
+
+  if ((server.hasArg("from") && !argUnsigned("from", &from)) || (server.hasArg("count") && !argUnsigned("count", &count))) {
+    apiError(400, PSTR("from and count must be whole numbers"));
+    return;
+  }
+  if (from > (unsigned long)t.count) {
+    from = t.count;
+  }
+  if (!server.hasArg("count") || count > t.count - from) {
+    count = t.count - from;
+  }
+  int n = count;
+  unsigned long newestAgo = millis() / 60000 - t.newest + from * t.minutes;
+  bool bin = server.arg("format") == "bin";
+
+  long *at = server.cursor();
+  at[0] = tier;
+  at[1] = ((t.head - (int)from - n) % t.size + t.size) % t.size;  // Next record sent, oldest first
+  at[2] = n;                                      // Records still to send
+  at[3] = newestAgo;
+  at[4] = bin;
+
+  ltoa(t.minutes, header, 10);
+  server.sendHeader("X-History-Minutes", header);
+  ltoa(newestAgo, header, 10);
+  server.sendHeader("X-History-Newest-Ago", header);
+
+  if (bin) {
+    renderBegin(200, "application/octet-stream");
+  } else {
+    renderBegin(200, "text/csv");
+    renderOut_P(PSTR("ago,temp,setpoint,duty\n"));
+  }
+  server.stream(histMore);
+  histMore();
+}
+
+void histMore() {
+// SENDS THE NEXT CHUNK OF A HISTORY EXPORT, ENDING THE RESPONSE AFTER THE LAST RECORD ----------
+// Called by the server each time the connection's out buffer has drained to half
+  long *at = server.cursor();
+  HistTier &t = histTiers[at[0]];
+
+  while (at[2] > 0 && renderLen < RENDER_BUF - 32) {   // Room for one more CSV row
+    HistRec &r = t.recs[at[1]];
+    if (at[4]) {
+      renderOut((const char *)&r, sizeof(HistRec));
+    } else {
+      renderInt(at[3] + (at[2] - 1) * t.minutes);
+      renderOut(",", 1);
+      renderTenths(r.temp10);
+      renderOut(",", 1);
+      renderTenths(Config::spMin10 + (r.packed >> 6));
+      renderOut(",", 1);
+      renderInt(((r.packed & 63) * 100 + 31) / 63);
+      renderOut("\n", 1);
+    }
+    at[1] = (at[1] + 1) % t.size;
+    at[2]--;
+  }
+  if (at[2] == 0) {
+    renderEnd();
+  } else {
+    renderFlush();
+  }
+}
+
+void traceSample(int i, long raw) {
+// RECORDS A ZONE'S READING AS THE SENSOR GAVE IT, AFTER ANY SETTING CHANGE IT IS READ UNDER ------
+  TraceZone &t = traceZones[i];
+  unsigned long now = millis();
+
+  traceSettings(i);
+  if (!traceRecord(TRACE_SAMPLE, i, 0)) {
+    return;
+  }
+  traceSigned((long)(now - t.sampleAt) - (long)Config::samplePeriod);
+  traceSigned(raw - t.prev);
+  t.prev = raw;
+  t.sampleAt = now;
+  traceAt = now;
+}
+
+void traceThermo() {
+// RECORDS A THERMOSTAT RUN, WRITING A KEYFRAME FIRST IF ONE IS DUE -----------------------------
+// Settings go in before the keyframe: one would take a change in silently, and a replay only
+// checks later keyframes rather than loading them
+  for (int i = 0; i < ZONES; i++) {
+    traceSettings(i);
+  }
+  if (!traceKeyed || traceEnd - traceKeyAt >= TRACE_KEY_EVERY) {
+    traceKey(millis());
+  }
+  traceEvent(TRACE_THERMO, 0, 0);
+}
+
+void traceSettings(int i) {
+// RECORDS ANY OF A ZONE'S SETTINGS THAT HAVE CHANGED SINCE THEY WERE LAST RECORDED --------------
+// Compared here rather than at each place settings change, so the API, commands, MQTT and the
+// schedule are all caught
+  Zone &z = zones[i];
+  TraceZone &t = traceZones[i];
+  byte modes = z.powerSet | z.heatMode << 1;
+
+  if (z.setPoint10 != t.setPoint10 && traceEvent(TRACE_SETPOINT, i, 0)) {
+    traceSigned(z.setPoint10);
+    t.setPoint10 = z.setPoint10;
+  }
+  if ((modes != t.modes || z.ctrlMode != t.ctrlMode) && traceEvent(TRACE_MODES, i, modes)) {
+    tracePut(z.ctrlMode);
+    t.modes = modes;
+    t.ctrlMode = z.ctrlMode;
+  }
+  if ((z.calOffset100 != t.calOffset100 || z.calGain10000 != t.calGain10000) && traceEvent(TRACE_CALIB, i, 0)) {
+    traceSigned(z.calOffset100);
+    tracePut(z.calGain10000);
+    t.calOffset100 = z.calOffset100;
+    t.calGain10000 = z.calGain10000;
+  }
+}
+
+void traceKey(unsigned long now) {
+// WRITES A KEYFRAME: THE TIME, THE OUTPUT TASK'S PHASE AND ALL THE STATE EACH ZONE'S CONTROL CARRIES
+// Times are ages, millis back from now, which a replay's clock set to now turns back into the
+// same values. Readings in the filter go oldest first, starts in the cycling ring likewise.
+  unsigned int max = 8;
+  unsigned long at = traceEnd;
+
+  for (int i = 0; i < ZONES; i++) {
+    max += TRACE_KEY_ZONE + zones[i].tempCount * 3 + zones[i].faultStartCount * 5;
+  }
+  if (!traceRoom(max)) {
+    return;
+  }
+  traceBuf[traceEnd++ & TRACE_MASK] = TRACE_KEY << 5;
+  traceEnd += 2;                                  // Length, filled in once known
+  traceWord(now);
+  traceSigned((long)(tasks[TASK_OUTPUT].due - now));
+  for (int i = 0; i < ZONES; i++) {
+    Zone &z = zones[i];
+    TraceZone &t = traceZones[i];
+    uint32_t bits;
+    long prev = 0;
+
+    traceSigned(z.setPoint10);
+    traceSigned(z.hyst100);
+    traceSigned(z.calOffset100);
+    tracePut(z.calGain10000);
+    tracePut(z.powerSet | z.heatMode << 1 | z.device << 2 | z.lastDeviceState << 3 | z.deviceLastSetting << 4 |
+             z.pidDone << 5 | z.effectRunning << 6);
+    tracePut(z.ctrlMode);
+    tracePut(z.alarms);
+    tracePut(now - z.deviceChangedAt);
+    tracePut(now - z.shutDownTimer);
+    traceSigned(z.rawTemp100);
+    traceSigned(z.avgTemp100);
+    tracePut(z.tempWindow);
+    tracePut(z.tempCount);
+    for (int k = 0; k < z.tempCount; k++) {
+      int reading = z.tempArray[(z.tempArrayCtr - z.tempCount + k + z.tempWindow) % z.tempWindow];
+      traceSigned(reading - prev);
+      prev = reading;
+    }
+    traceSigned(z.tempEma);
+    traceSigned(z.remoteTemp100);
+    tracePut(now - z.remoteAt);
+    memcpy(&bits, &z.pidI, sizeof(bits));
+    traceWord(bits);
+    traceSigned(z.pidLastTemp100);
+    tracePut(z.pidLast ? now - z.pidLast + 1 : 0);
+    tracePut(now - z.pidWindowStart);
+    memcpy(&bits, &z.predictRate, sizeof(bits));
+    traceWord(bits);
+    traceSigned(z.predictPrevTemp10);
+    tracePut(z.predictPrevDuty);
+    tracePut(now / 60000 - z.histMinute);
+    traceSigned(z.histTempSum);
+    traceSigned(z.histSetPointSum);
+    tracePut(z.histOn);
+    tracePut(z.histSamples);
+    traceSigned(z.faultLast100);
+    tracePut(now - z.faultLastAt);
+    tracePut(z.faultBad);
+    tracePut(z.faultSame);
+    tracePut(z.faultJumps);
+    tracePut(now - z.faultJumpAt);
+    traceSigned(z.effectRef100);
+    tracePut(now - z.effectAt);
+    tracePut(z.faultStartCount);
+    for (int k = 0; k < z.faultStartCount; k++) {
+      tracePut(now - z.faultStarts[(z.faultStartNext - z.faultStartCount + k + FAULT_CYCLES + 1) % (FAULT_CYCLES + 1)]);
+    }
+
+    t.prev = 0;                                   // Samples start again from here
+    t.sampleAt = now;
+    t.setPoint10 = z.setPoint10;
+    t.modes = z.powerSet | z.heatMode << 1;
+    t.ctrlMode = z.ctrlMode;
+    t.calOffset100 = z.calOffset100;
+    t.calGain10000 = z.calGain10000;
+  }
+  unsigned int len = traceEnd - at - 3;
+  traceBuf[(at + 1) & TRACE_MASK] = len & 0xFF;
+  traceBuf[(at + 2) & TRACE_MASK] = len >> 8;
+  traceKeyAt = at;
+  traceKeyed = 1;
+  traceAt = now;
+}
+
+bool traceEvent(byte kind, int zone, byte arg) {
+// STARTS A RECORD TIMED FROM THE LAST ONE, FALSE IF THE TRACE ISN'T RECORDING, VALUES FOLLOW ----
+  unsigned long now = millis();
+
+  if (!traceRecord(kind, zone, arg)) {
+    return 0;
+  }
+  tracePut(now - traceAt);
+  traceAt = now;
+  return 1;
+}
+
+bool traceRecord(byte kind, int zone, byte arg) {
+// WRITES A RECORD'S KIND BYTE, FALSE IF THE TRACE ISN'T RECORDING --------------------------------
+  if (!traceRoom(TRACE_RECORD_MAX) || !traceKeyed) {
+    return 0;
+  }
+  traceBuf[traceEnd++ & TRACE_MASK] = kind << 5 | arg << 3 | zone;
+  return 1;
+}
+
+bool traceRoom(unsigned int n) {
+// MAKES ROOM FOR n BYTES, DROPPING THE OLDEST KEYFRAME AND WHAT FOLLOWS IT AS OFTEN AS NEEDED ----
+// False once an alarm's hold has run out, when the ring is kept as it is
+  if (n > TRACE_BYTES || (traceHeld && (long)(traceEnd - traceStopAt) >= 0)) {
+    return 0;
+  }
+  while (TRACE_BYTES - (traceEnd - traceFirst) < n) {
+    do {
+      traceFirst += traceLength(traceFirst);
+    } while (traceFirst != traceEnd && traceBuf[traceFirst & TRACE_MASK] >> 5 != TRACE_KEY);
+    if (traceFirst == traceEnd) {
+      traceKeyed = 0;                             // Nothing left to start a replay from until the next keyframe
+    }
+  }
+  return 1;
+}
+
+unsigned int traceLength(unsigned long pos) {
+// RETURNS THE LENGTH OF THE RECORD AT pos ------------------------------------------------------
+  byte kind = traceBuf[pos & TRACE_MASK] >> 5;
+  unsigned int n = 1;
+
+  if (kind == TRACE_KEY) {
+    return 3 + (traceBuf[(pos + 1) & TRACE_MASK] | traceBuf[(pos + 2) & TRACE_MASK] << 8);
+  }
+  for (int fields = traceFields[kind]; fields > 0; n++) {
+    if (!(traceBuf[(pos + n) & TRACE_MASK] & 0x80)) {
+      fields--;
+    }
+  }
+  return n;
+}
+
+void traceHold() {
+// LETS TRACE_HOLD MORE BYTES IN AFTER THE FIRST ALARM, THEN STOPS THE RING ---------------------
+  if (!traceHeld) {
+    traceHeld = 1;
+    traceStopAt = traceEnd + TRACE_HOLD;
+  }
+}
+
+void tracePut(unsigned long v) {
+// APPENDS v AS A VARINT, 7 BITS A BYTE, LOW FIRST ----------------------------------------------
+  while (v >= 0x80) {
+    traceBuf[traceEnd++ & TRACE_MASK] = v | 0x80;
+    v >>= 7;
+  }
+  traceBuf[traceEnd++ & TRACE_MASK] = v;
+}
+
+void traceSigned(long v) {
+// APPENDS v ZIGZAGGED, SO SMALL CHANGES EITHER WAY TAKE ONE BYTE -------------------------------
+  tracePut(v < 0 ? ~((unsigned long)v << 1) : (unsigned long)v << 1);
+}
+
+void traceWord(uint32_t v) {
+// APPENDS v AS 4 BYTES, LOW FIRST ------------------------------------------------------------
+  for (int i = 0; i < 4; i++) {
+    traceBuf[traceEnd++ & TRACE_MASK] = v >> (8 * i);
+  }
+}
+
+void apiTrace() {
+// STREAMS THE TRACE OLDEST FIRST AFTER A HEADER OF THE BUILD IT NEEDS, A POST STARTS IT AGAIN ----
+// The header is "WT", TRACE_VERSION, ZONES, TEMP_UNIT, Config::filter, then each zone's source.
+// A download the ring overtakes ends where it was, its last record cut short.
+  byte header[6 + ZONES] = {'W', 'T', TRACE_VERSION, ZONES, TEMP_UNIT, Config::filter};
+
+  if (server.method() == HTTP_POST) {
+    traceFirst = traceEnd;
+    traceKeyed = 0;                               // Starts at the next thermostat run
+    traceHeld = 0;
+  }
+  for (int i = 0; i < ZONES; i++) {
+    header[6 + i] = zoneConfig[i].source;
+  }
+  long *at = server.cursor();
+  at[0] = traceFirst;                             // Next byte sent
+  at[1] = traceEnd;                               // Sent up to here, what was recorded by now
+
+  server.sendHeader("X-Trace-Held", traceHeld ? "1" : "0");
+  renderBegin(200, "application/octet-stream");
+  renderOut((const char *)header, sizeof(header));
+  server.stream(traceMore);
+  traceMore();
+}
+
+void traceMore() {
+// SENDS THE NEXT CHUNK OF THE TRACE, ENDING THE RESPONSE AFTER THE LAST BYTE ----------------------
+  long *at = server.cursor();
+
+  if ((long)(traceFirst - (unsigned long)at[0]) > 0) {
+    at[0] = at[1];                                // Overwritten since the last chunk, stop here
+  }
+  while (at[0] != at[1] && renderLen < RENDER_BUF - 1) {   // Short of full, so renderOut() doesn't send it
+    unsigned long pos = at[0];
+    size_t n = RENDER_BUF - 1 - renderLen;
+    if (n > (unsigned long)at[1] - pos) {
+      n = (unsigned long)at[1] - pos;
+    }
+    if (n > TRACE_BYTES - (pos & TRACE_MASK)) {
+      n = TRACE_BYTES - (pos & TRACE_MASK);       // Up to the end of the ring, the rest from its start
+    }
+    renderOut((const char *)&traceBuf[pos & TRACE_MASK], n);
+    at[0] = pos + n;
+  }
+  if (at[0] == at[1]) {
+    renderEnd();
+  } else {
+    renderFlush();
+  }
+}
+
+void timingAdd(Timing &t, uint32_t cycles) {
+// ADDS ONE DURATION TO A TIMING ---------------------------------------------------------------
+  int b = 32 - __builtin_clz(cycles | 1) - TIMING_FIRST;   // Smallest b with cycles < 2^(TIMING_FIRST + b)
+  t.buckets[constrain(b, 0, TIMING_BUCKETS - 1)]++;
+  if (t.count == 0 || cycles < t.minCycles) {
+    t.minCycles = cycles;
+  }
+  if (cycles > t.maxCycles) {
+    t.maxCycles = cycles;
+  }
+  t.sumCycles += cycles;
+  t.count++;
+}
+
+uint32_t timingQuantile(Timing &t, float q) {
+// RETURNS CYCLES AT QUANTILE q: THE TOP OF THE BUCKET IT FALLS IN, NO MORE THAN THE MAX ----------
+  uint32_t rank = ceil(q * t.count);
+  uint32_t seen = 0;
+
+  if (q <= 0) {
+    return t.minCycles;
+  }
+  for (int b = 0; b < TIMING_BUCKETS - 1; b++) {
+    seen += t.buckets[b];
+    if (seen >= rank) {
+      uint32_t top = 1UL << (TIMING_FIRST + b);
+      return top < t.maxCycles ? top : t.maxCycles;
+    }
+  }
+  return t.maxCycles;
+}
+
+void apiMetrics() {
+// SENDS TIMINGS, HEAP, WI-FI AND COUNTERS IN PROMETHEUS TEXT FORMAT, STREAMED A FEW LINES AT A TIME --
+  long *at = server.cursor();
+  at[0] = 0;                                      // Family
+  at[1] = 0;                                      // Zone, task or route within it
+  at[2] = 0;                                      // Line within that
+  renderBegin(200, "text/plain; version=0.0.4");
+  server.stream(metricsMore);
+  metricsMore();
+}
+
+void metricsMore() {
+// SENDS THE NEXT CHUNK OF /metrics, ENDING THE RESPONSE AFTER THE LAST LINE --------------------
+  long *at = server.cursor();
+  bool more = 1;
+
+  while (more && renderLen < RENDER_BUF - 200) {  // Room for a family's HELP and TYPE lines
+    more = metricsNext(at);
+  }
+  if (more) {
+    renderFlush();
+  } else {
+    renderEnd();
+  }
+}
+
+bool metricsNext(long *at) {
+// RENDERS THE NEXT LINE OF /metrics, WITH ITS FAMILY'S HEADER IF FIRST, AND MOVES at ON ----------
+// Returns false once there are no more. Histograms and their quantiles are separate families,
+// loop, then task, then handler timings; routes that haven't run are left out.
+  char labels[48];
+  int items = 1;
+  int lines = 1;
+  Timing *t = &loopTiming;
+  bool first = at[1] == 0 && at[2] == 0;
+  long item = at[1];
+  bool wrote = 1;                                 // Timing lines clear this until they write
+
+  labels[0] = 0;
+  switch (at[0]) {
+  case 0:
+    if (first) metricsHelp(PSTR("uptime_seconds"), PSTR("counter"), PSTR("Seconds since boot"));
+    metricsName(PSTR("uptime_seconds"), PSTR(""), labels, 0, 0);
+    renderInt(millis() / 1000);
+    break;
+  case 1:
+    if (first) metricsHelp(PSTR("heap_free_bytes"), PSTR("gauge"), PSTR("Free heap"));
+    metricsName(PSTR("heap_free_bytes"), PSTR(""), labels, 0, 0);
+    renderInt(ESP.getFreeHeap());
+    break;
+  case 2:
+    if (first) metricsHelp(PSTR("heap_max_block_bytes"), PSTR("gauge"), PSTR("Largest free heap block"));
+    metricsName(PSTR("heap_max_block_bytes"), PSTR(""), labels, 0, 0);
+    renderInt(ESP.getMaxFreeBlockSize());
+    break;
+  case 3:
+    if (first) metricsHelp(PSTR("heap_fragmentation_percent"), PSTR("gauge"), PSTR("Heap fragmentation"));
+    metricsName(PSTR("heap_fragmentation_percent"), PSTR(""), labels, 0, 0);
+    renderInt(ESP.getHeapFragmentation());
+    break;
+  case 4:
+    if (first) metricsHelp(PSTR("wifi_rssi_dbm"), PSTR("gauge"), PSTR("Wi-Fi signal strength"));
+    metricsName(PSTR("wifi_rssi_dbm"), PSTR(""), labels, 0, 0);
+    renderInt(WiFi.RSSI());
+    break;
+  case 5:
+    items = ZONES;
+    if (first) metricsHelp(PSTR("relay_switches_total"), PSTR("counter"), PSTR("Relay changes since boot"));
+    snprintf(labels, sizeof(labels), "zone=\"%ld\"", item);
+    metricsName(PSTR("relay_switches_total"), PSTR(""), labels, 0, 0);
+    renderInt(zones[item].switches);
+    break;
+  case 6:
+  case 7:
+    items = TASK_COUNT;
+    if (first && at[0] == 6) metricsHelp(PSTR("task_runs_total"), PSTR("counter"), PSTR("Task runs since boot"));
+    if (first && at[0] == 7) metricsHelp(PSTR("task_late_total"), PSTR("counter"), PSTR("Task runs started after their deadline"));
+    snprintf(labels, sizeof(labels), "task=\"%s\"", tasks[item].name);
+    metricsName(at[0] == 6 ? PSTR("task_runs_total") : PSTR("task_late_total"), PSTR(""), labels, 0, 0);
+    renderInt(at[0] == 6 ? tasks[item].runs : tasks[item].late);
+    break;
+  case 8:
+    if (first) metricsHelp(PSTR("http_requests_total"), PSTR("counter"), PSTR("HTTP requests answered"));
+    metricsName(PSTR("http_requests_total"), PSTR(""), labels, 0, 0);
+    renderInt(server.requests);
+    break;
+  case 9:
+    items = 3;
+    if (first) metricsHelp(PSTR("http_dropped_total"), PSTR("counter"), PSTR("HTTP connections turned away or dropped"));
+    snprintf(labels, sizeof(labels), "reason=\"%s\"", item == 0 ? "busy" : item == 1 ? "timeout" : "overrun");
+    metricsName(PSTR("http_dropped_total"), PSTR(""), labels, 0, 0);
+    renderInt(item == 0 ? server.busy : item == 1 ? server.timeouts : server.overruns);
+    break;
+  case 10:
+    if (first) metricsHelp(PSTR("timing_age_seconds"), PSTR("gauge"), PSTR("Seconds timings have been gathered, since boot or POST /metrics/reset"));
+    metricsName(PSTR("timing_age_seconds"), PSTR(""), labels, 0, 0);
+    renderInt((millis() - timingSince) / 1000);
+    break;
+  case 11:
+    if (first) metricsHelp(PSTR("boot_decision_seconds"), PSTR("gauge"), PSTR("Boot to the first thermostat decision with every zone read"));
+    metricsName(PSTR("boot_decision_seconds"), PSTR(""), labels, 0, 0);
+    renderFixed(bootDecisionMs / 1000.0, 3);
+    break;
+  case 12:
+    if (first) metricsHelp(PSTR("wifi_join_seconds"), PSTR("gauge"), PSTR("Boot to the first Wi-Fi join, 0 until then"));
+    metricsName(PSTR("wifi_join_seconds"), PSTR(""), labels, 0, 0);
+    renderFixed(net.upAt / 1000.0, 3);
+    break;
+  case 13:
+    items = 4;
+    if (first) metricsHelp(PSTR("wifi_joins_total"), PSTR("counter"), PSTR("Wi-Fi joins by how they were made, and drops"));
+    snprintf(labels, sizeof(labels), "path=\"%s\"", item == 0 ? "fast" : item == 1 ? "full" : item == 2 ? "portal" : "dropped");
+    metricsName(PSTR("wifi_joins_total"), PSTR(""), labels, 0, 0);
+    renderInt(item < 3 ? net.joins[item] : net.drops);
+    break;
+  case 14:
+    items = 4;
+    if (first) metricsHelp(PSTR("commands_total"), PSTR("counter"), PSTR("/api/command requests by outcome"));
+    snprintf(labels, sizeof(labels), "result=\"%s\"", item == 0 ? "accepted" : item == 1 ? "replayed" : item == 2 ? "limited" : "rejected");
+    metricsName(PSTR("commands_total"), PSTR(""), labels, 0, 0);
+    renderInt(item == 0 ? cmdCount : item == 1 ? cmdReplays : item == 2 ? cmdLimited : cmdRejected);
+    break;
+  case 15:
+    if (first) metricsHelp(PSTR("command_bursts_total"), PSTR("counter"), PSTR("Queued changes applied, one per zone per burst"));
+    metricsName(PSTR("command_bursts_total"), PSTR(""), labels, 0, 0);
+    renderInt(cmdBursts);
+    break;
+  case 16:
+  case 17:
+    items = ZONES * FAULT_KINDS;
+    if (first && at[0] == 16) metricsHelp(PSTR("alarms_total"), PSTR("counter"), PSTR("Alarms raised since boot"));
+    if (first && at[0] == 17) metricsHelp(PSTR("alarm_latched"), PSTR("gauge"), PSTR("1 while the alarm is latched"));
+    snprintf(labels, sizeof(labels), "zone=\"%ld\",alarm=\"%s\"", item / FAULT_KINDS, faultNames[item % FAULT_KINDS]);
+    metricsName(at[0] == 16 ? PSTR("alarms_total") : PSTR("alarm_latched"), PSTR(""), labels, 0, 0);
+    renderInt(at[0] == 16 ? zones[item / FAULT_KINDS].alarmCount[item % FAULT_KINDS] :
+              (zones[item / FAULT_KINDS].alarms >> (item % FAULT_KINDS)) & 1);
+    break;
+  default:
+    int group = (at[0] - 18) / 2;                 // Loop, task or handler timings
+    bool quantiles = (at[0] - 18) % 2;
+    PGM_P name = group == 0 ? PSTR("loop_seconds") : group == 1 ? PSTR("task_seconds") : PSTR("handler_seconds");
+    PGM_P qname = group == 0 ? PSTR("loop_quantile_seconds") : group == 1 ? PSTR("task_quantile_seconds") : PSTR("handler_quantile_seconds");
+    if (group > 2) {
+      return false;
+    }
+    wrote = 0;
+    if (first && quantiles) {
+      metricsHelp(qname, PSTR("gauge"), PSTR("Duration at quantile (0 min, 1 max), estimated from the histogram"));
+    } else if (first) {
+      metricsHelp(name, PSTR("histogram"), group == 0 ? PSTR("Duration of a loop pass, not counting its sleep") :
+                  group == 1 ? PSTR("Duration of a task run") : PSTR("Duration of an HTTP handler"));
+    }
+    if (group == 1) {
+      items = TASK_COUNT;
+      t = &tasks[item].timing;
+      snprintf(labels, sizeof(labels), "task=\"%s\"", tasks[item].name);
+    } else if (group == 2) {
+      while (server.route(item) && server.route(item)->timing.count == 0) {
+        item++;                                   // Skip routes that haven't run
+      }
+      at[1] = item;
+      HttpRoute *r = server.route(item);
+      t = r ? &r->timing : &server.notFoundTiming;
+      snprintf(labels, sizeof(labels), "path=\"%s\"", r ? r->uri : "other");
+      items = item + 1 + (r != 0);                // Unregistered paths come after the last route
+    }
+    lines = quantiles ? 4 : TIMING_BUCKETS + 2;
+    if (t->count == 0 && (quantiles || group == 2)) {
+      lines = 1;                                  // Nothing timed yet
+      break;
+    }
+    if (quantiles) {
+      static const float qs[4] = {0, 0.5, 0.99, 1};
+      static const char *qlabels[4] = {"0", "0.5", "0.99", "1"};
+      metricsName(qname, PSTR(""), labels, PSTR("quantile"), qlabels[at[2]]);
+      metricsSeconds(timingQuantile(*t, qs[at[2]]), 7);
+    } else if (at[2] < TIMING_BUCKETS) {
+      char le[16];
+      uint32_t cumulative = 0;
+      for (int b = 0; b <= at[2]; b++) {
+        cumulative += t->buckets[b];
+      }
+      if (at[2] == TIMING_BUCKETS - 1) {
+        strcpy(le, "+Inf");
+      } else {
+        metricsLe(le, at[2]);
+      }
+      metricsName(name, PSTR("_bucket"), labels, PSTR("le"), le);
+      renderInt(cumulative);
+    } else if (at[2] == TIMING_BUCKETS) {
+      metricsName(name, PSTR("_sum"), labels, 0, 0);
+      metricsSeconds(t->sumCycles, 6);
+    } else {
+      metricsName(name, PSTR("_count"), labels, 0, 0);
+      renderInt(t->count);
+    }
+    wrote = 1;
+    break;
+  }
+  if (wrote) {
+    renderOut("\n", 1);
+  }
+  if (++at[2] >= lines) {
+    at[2] = 0;
+    if (++at[1] >= items) {
+      at[1] = 0;
+      at[0]++;
+    }
+  }
+  return true;
+}
+
+void metricsHelp(PGM_P name, PGM_P type, PGM_P help) {
+// WRITES A FAMILY'S HELP AND TYPE LINES ------------------------------------------------------
+  renderOut_P(PSTR("# HELP web_therm_"));
+  renderOut_P(name);
+  renderOut(" ", 1);
+  renderOut_P(help);
+  renderOut_P(PSTR("\n# TYPE web_therm_"));
+  renderOut_P(name);
+  renderOut(" ", 1);
+  renderOut_P(type);
+  renderOut("\n", 1);
+}
+
+void metricsName(PGM_P name, PGM_P suffix, const char *labels, PGM_P extra, const char *extraValue) {
+// WRITES A SAMPLE'S NAME AND LABELS AND THE SPACE BEFORE ITS VALUE -------------------------------
+  renderOut_P(PSTR("web_therm_"));
+  renderOut_P(name);
+  renderOut_P(suffix);
+  if (labels[0] || extra) {
+    renderOut("{", 1);
+    renderOut(labels, strlen(labels));
+    if (extra) {
+      if (labels[0]) {
+        renderOut(",", 1);
+      }
+      renderOut_P(extra);
+      renderOut("=\"", 2);
+      renderOut(extraValue, strlen(extraValue));
+      renderOut("\"", 1);
+    }
+    renderOut("}", 1);
+  }
+  renderOut(" ", 1);
+}
+
+void metricsLe(char *le, int bucket) {
+// WRITES THE TOP OF A BUCKET IN SECONDS ------------------------------------------------------
+  dtostrf((float)(1UL << (TIMING_FIRST + bucket)) / ESP.getCpuFreqMHz() / 1e6, 1, 7, le);
+}
+
+void metricsSeconds(uint64_t cycles, int decimals) {
+// WRITES CYCLES AS SECONDS -------------------------------------------------------------------
+  renderFixed((double)cycles / ESP.getCpuFreqMHz() / 1e6, decimals);
+}
+
+void metricsReset() {
+// STARTS EVERY TIMING AGAIN, COUNTERS CARRY ON ------------------------------------------------
+  memset(&loopTiming, 0, sizeof(loopTiming));
+  for (int i = 0; i < TASK_COUNT; i++) {
+    memset(&tasks[i].timing, 0, sizeof(Timing));
+    tasks[i].maxMicros = 0;
+  }
+  for (int i = 0; server.route(i); i++) {
+    memset(&server.route(i)->timing, 0, sizeof(Timing));
+  }
+  memset(&server.notFoundTiming, 0, sizeof(Timing));
+  timingSince = millis();
+  server.send(204, "text/plain", "");
+}
+
+int tenths(float v) {
+// RETURNS v IN WHOLE TENTHS, ROUNDED ------------------------------------------------------
+  return (int)floor(v * 10 + 0.5);
+}
+
+int hundredths(float v) {
+// RETURNS v IN WHOLE HUNDREDTHS, ROUNDED --------------------------------------------------
+  return (int)floor(v * 100 + 0.5);
+}
+
+void setClock(unsigned long epoch, byte source) {
+// SETS TIME OF DAY AND HAS THE SCHEDULE CATCH UP -------------------------------------------
+  clockEpoch = epoch;
+  clockMillis = millis();
+  clockSource = source;
+  kickTask(TASK_SCHEDULE);
+}
+
+void clockSynced() {
+// CALLED BY THE CORE EACH TIME SNTP SETS THE SYSTEM TIME ----------------------------------
+  setClock(time(nullptr), CLOCK_NTP);
+}
+
+unsigned long clockNow() {
+// RETURNS UTC SECONDS --------------------------------------------------------------------
+  return clockEpoch + (millis() - clockMillis) / 1000;
+}
+
+void runSchedule() {
+// APPLIES EACH ZONE'S EVENT IN EFFECT IF IT HAS CHANGED, THEN SLEEPS UNTIL THE NEXT EVENT ----
+// Settings only change here when an event comes due, so a change made by hand holds until
+// the zone's next event. An event is known by when that week's occurrence of it began, not
+// by its place in the table, so a zone with one event a week has it applied every week.
+// Sleeps at most SCHED_RECHECK, which also folds elapsed time into clockEpoch so millis()
+// wrapping does not lose time.
+  if (clockSource == CLOCK_NONE || schedEventCount == 0) {
+    return;
+  }
+  unsigned long elapsed = (millis() - clockMillis) / 1000;
+  clockEpoch += elapsed;
+  clockMillis += elapsed * 1000;
+
+  unsigned long local = clockEpoch + (long)clockTz * 60;
+  unsigned int mow = (local / 86400 + 4) % 7 * 1440 + local % 86400 / 60;   // 1 Jan 1970 was a Thursday
+  unsigned long week = local / 60 - mow;          // Local minute this week began
+
+  for (int n = 0; n < ZONES; n++) {
+    int i = -1;
+    int last = -1;                                // Before the zone's first event, last week's last is in effect
+    unsigned long from = week;
+    for (int e = 0; e < schedEventCount; e++) {
+      if (schedRules[schedEvents[e].rule].zone != n) {
+        continue;
+      }
+      last = e;
+      if (schedEvents[e].at <= mow) {
+        i = e;
+      }
+    }
+    if (i < 0) {
+      i = last;
+      from = week - WEEK_MINUTES;
+    }
+    if (i < 0) {
+      continue;
+    }
+    from += schedEvents[i].at;
+    if (i != zones[n].schedCurrent || from != zones[n].schedFrom) {
+      applyRule(schedEvents[i].rule);
+      zones[n].schedCurrent = i;
+      zones[n].schedFrom = from;
+      zones[n].schedOverride = 0;
+    }
+  }
+
+  int next = 0;                                   // After the week's last event, the first is next
+  while (next < schedEventCount && schedEvents[next].at <= mow) {
+    next++;
+  }
+  next = next % schedEventCount;
+  unsigned long wait = (schedEvents[next].at + WEEK_MINUTES - mow) % WEEK_MINUTES;
+  if (wait == 0) {
+    wait = WEEK_MINUTES;                          // Only one event time in the week
+  }
+  wait = wait * 60000 - (local % 60) * 1000 - (millis() - clockMillis);
+  schedNextAt = millis() + wait;
+  deferTask(TASK_SCHEDULE, wait < SCHED_RECHECK ? wait : SCHED_RECHECK);
+}
+
+void applyRule(byte rule) {
+// SETS POWER, MODE AND SETPOINT OF THE RULE'S ZONE, CHANGING ONLY WHAT DIFFERS ----------------
+  SchedRule &r = schedRules[rule];
+  Zone &z = zones[r.zone];
+
+  if (r.mode == 2) {
+    if (z.powerSet) {
+      changePower(z, 0);
+    }
+    return;
+  }
+  if (!z.powerSet) {
+    changePower(z, 1);
+  }
+  if (z.heatMode != r.mode) {
+    changeMode(z, r.mode);
+  }
+  if (z.setPoint10 != r.setPoint10) {
+    changeSetPoint(z, r.setPoint10);
+  }
+}
+
+bool parseSchedule(const char *s) {
+// READS RULES days,HH:MM,F,heat|cool|off[,zone] SEPARATED BY ; INTO schedRules, FALSE IF MALFORMED
+// days is 7 characters Sunday first, - for days the rule skips, eg -MTWTF- for weekdays.
+// zone defaults to 0. Setpoints are checked against Config::spMin10/spMax10 by the caller.
+  SchedRule rules[SCHED_RULES];
+  int n = 0;
+
+  while (*s) {
+    if (n == SCHED_RULES) {
+      return false;
+    }
+    SchedRule &r = rules[n];
+    r.days = 0;
+    for (int d = 0; d < 7; d++, s++) {
+      if (*s == 0 || *s == ',') {
+        return false;
+      }
+      if (*s != '-') {
+        r.days |= 1 << d;
+      }
+    }
+    char *end;
+    long hour = strtol(s + 1, &end, 10);
+    if (*s != ',' || *end != ':' || hour < 0 || hour > 23) {
+      return false;
+    }
+    long minute = strtol(end + 1, &end, 10);
+    if (*end != ',' || minute < 0 || minute > 59) {
+      return false;
+    }
+    r.minute = hour * 60 + minute;
+    float sp = strtod(end + 1, &end);
+    if (*end != ',') {
+      return false;
+    }
+    r.setPoint10 = tenths(sp);
+    s = end + 1;
+    if (strncmp(s, "heat", 4) == 0) {
+      r.mode = 0;
+    } else if (strncmp(s, "cool", 4) == 0) {
+      r.mode = 1;
+    } else if (strncmp(s, "off", 3) == 0) {
+      r.mode = 2;
+      r.setPoint10 = Config::spMin10;              // Not used, keep it in range
+    } else {
+      return false;
+    }
+    s += r.mode == 2 ? 3 : 4;
+    r.zone = 0;
+    if (*s == ',') {
+      long zone = strtol(s + 1, &end, 10);
+      if (end == s + 1 || zone < 0 || zone >= ZONES) {
+        return false;
+      }
+      r.zone = zone;
+      s = end;
+    }
+    if (*s == ';') {
+      s++;
+    } else if (*s != 0) {
+      return false;
+    }
+    n++;
+  }
+  memcpy(schedRules, rules, n * sizeof(SchedRule));
+  schedRuleCount = n;
+  return true;
+}
+
+void compileSchedule() {
+// BUILDS THE TRANSITION TABLE, ONE EVENT PER RULE PER DAY SORTED BY MINUTE OF WEEK ------------
+// Rules at the same minute keep their order, so the later rule is the one left in effect.
+  schedEventCount = 0;
+  for (int r = 0; r < schedRuleCount; r++) {
+    for (int d = 0; d < 7; d++) {
+      if ((schedRules[r].days & (1 << d)) == 0) {
+        continue;
+      }
+      SchedEvent ev = {(uint16_t)(d * 1440 + schedRules[r].minute), (byte)r};
+      int i;
+      for (i = schedEventCount; i > 0 && schedEvents[i - 1].at > ev.at; i--) {
+        schedEvents[i] = schedEvents[i - 1];
+      }
+      schedEvents[i] = ev;
+      schedEventCount++;
+    }
+  }
+  for (int n = 0; n < ZONES; n++) {
+    zones[n].schedCurrent = -1;                   // Apply whatever is in effect now
+  }
+  kickTask(TASK_SCHEDULE);
+}
+
+void apiTime() {
+// SETS CLOCK FROM epoch=UTC SECONDS AND/OR tz=MINUTES EAST OF UTC, REPLIES WITH CLOCK ---------
+// For when SNTP can't be reached. tz is saved with the schedule.
+  float tz;
+
+  if (server.method() == HTTP_POST) {
+    if (server.hasArg("tz")) {
+      if (!argFloat("tz", &tz) || tz < -720 || tz > 840) {
+        apiError(400, PSTR("tz must be minutes from -720 to 840"));
+        return;
+      }
+      clockTz = (int)tz / 15 * 15;
+      saveSchedule();
+      kickTask(TASK_SCHEDULE);
+    }
+    if (server.hasArg("epoch")) {
+      String arg = server.arg("epoch");
+      char *end;
+      unsigned long value = strtoul(arg.c_str(), &end, 10);
+      if (end == arg.c_str() || *end != 0) {
+        apiError(400, PSTR("epoch must be UTC seconds"));
+        return;
+      }
+      setClock(value, CLOCK_API);
+    }
+    runSchedule();                                // Apply now so the reply and state show it
+    checkState();
+  }
+  renderBegin(200, "application/json");
+  renderTemplate(TIME_JSON);
+  renderEnd();
+}
+
+void apiSchedule() {
+// SETS WEEKLY SCHEDULE FROM rules= (EMPTY CLEARS IT), REPLIES WITH SCHEDULE -------------------
+// zone= picks the zone whose event and override the reply shows
+  if (!pickZone()) {
+    return;
+  }
+  if (server.method() == HTTP_POST) {
+    if (!server.hasArg("rules")) {
+      apiError(400, PSTR("rules required"));
+      return;
+    }
+    SchedRule old[SCHED_RULES];
+    int oldCount = schedRuleCount;
+    memcpy(old, schedRules, sizeof(old));
+    if (!parseSchedule(server.arg("rules").c_str())) {
+      apiError(400, PSTR("rules must be days,HH:MM,F,heat|cool|off[,zone] separated by ;"));
+      return;
+    }
+    for (int r = 0; r < schedRuleCount; r++) {
+      if (schedRules[r].setPoint10 < Config::spMin10 || schedRules[r].setPoint10 > Config::spMax10) {
+        memcpy(schedRules, old, sizeof(old));
+        schedRuleCount = oldCount;
+        apiError(422, PSTR("setpoint out of range"));
+        return;
+      }
+    }
+    compileSchedule();
+    saveSchedule();
+    runSchedule();                                // Apply now so the reply shows it
+    checkState();
+  }
+  renderBegin(200, "application/json");
+  renderTemplate(SCHED_JSON);
+  renderEnd();
+}
+
+void renderSchedule() {
+// WRITES RULES IN THE FORM parseSchedule READS -------------------------------------------------
+  for (int r = 0; r < schedRuleCount; r++) {
+    SchedRule &rule = schedRules[r];
+    char text[20];
+    for (int d = 0; d < 7; d++) {
+      text[d] = (rule.days & (1 << d)) ? pgm_read_byte(PSTR("SMTWTFS") + d) : '-';
+    }
+    snprintf(text + 7, sizeof(text) - 7, ",%02u:%02u,", rule.minute / 60, rule.minute % 60);
+    if (r > 0) {
+      renderOut(";", 1);
+    }
+    renderOut(text, strlen(text));
+    renderTenths(rule.setPoint10);
+    renderOut_P(rule.mode == 0 ? PSTR(",heat") : rule.mode == 1 ? PSTR(",cool") : PSTR(",off"));
+    if (rule.zone != 0) {
+      renderOut(",", 1);
+      renderInt(rule.zone);
+    }
+  }
+}
+
+void apiControl() {
+// SETS CONTROL ALGORITHM FROM mode=hyst, pid OR predict, REPLIES WITH NEW STATE -----------------
+  String mode = server.arg("mode");
+
+  if (!pickZone()) {
+    return;
+  }
+  if (mode == "hyst") {
+    changeControl(zones[zoneSel], CTRL_HYST);
+  } else if (mode == "pid") {
+    changeControl(zones[zoneSel], CTRL_PID);
+  } else if (mode == "predict") {
+    changeControl(zones[zoneSel], CTRL_PREDICT);
+  } else {
+    apiError(400, PSTR("mode must be hyst, pid or predict"));
+    return;
+  }
+  checkState();
+  apiState();
+}
+
+void apiCalibrate() {
+// SETS SENSOR CALIBRATION FROM offset=DEGREES AND/OR gain=G, OR actual=DEGREES, REPLIES WITH IT
+// actual is the room temperature read from a reference thermometer now; the offset is moved
+// so avgTemp reads that. GET just replies. Saved straight away, it is not a user setting.
+  if (!pickZone()) {
+    return;
+  }
+  Zone &z = zones[zoneSel];
+  float offset = z.calOffset100 / 100.0;
+  float gain = z.calGain10000 / 10000.0;
+  float actual;
+
+  if (server.method() == HTTP_POST) {
+    // nan and inf are numbers argFloat() refuses; they go on to fail the range check, a 422
+    if (server.hasArg("gain") && !argFloat("gain", &gain) && isfinite(gain)) {
+      apiError(400, PSTR("gain must be a number"));
+      return;
+    }
+    if (server.hasArg("offset") && !argFloat("offset", &offset) && isfinite(offset)) {
+      apiError(400, PSTR("offset must be a number"));
+      return;
+    }
+    if (argFloat("actual", &actual)) {
+      offset = actual - z.rawTemp100 / 100.0 * gain;
+    } else if (server.hasArg("actual")) {
+      apiError(400, PSTR("actual must be a number"));
+      return;
+    }
+    if (!(gain >= CAL_GAIN_MIN && gain <= CAL_GAIN_MAX && offset >= -CAL_OFFSET_MAX && offset <= CAL_OFFSET_MAX)) {   // NaN fails it too
+      apiError(422, PSTR("calibration out of range"));
+      return;
+    }
+    z.calOffset100 = round(offset * 100);
+    z.calGain10000 = round(gain * 10000);
+    z.avgTemp100 = calibrated(z);
+    saveCalibration();
+    checkState();
+  }
+  renderBegin(200, "application/json");
+  renderTemplate(CALIB_JSON);
+  renderEnd();
+}
+
+bool argFloat(const char *name, float *value) {
+// PARSES REQUEST ARG AS A NUMBER, FALSE IF MISSING, NOT A NUMBER OR NOT FINITE -------------
+// strtod() takes "nan" and "inf", and NaN passes every range check written with < and >
+  if (!server.hasArg(name)) {
+    return false;
+  }
+  String arg = server.arg(name);
+  char *end;
+  *value = strtod(arg.c_str(), &end);
+  return end != arg.c_str() && *end == 0 && isfinite(*value);
+}
+
+bool argUnsigned(const char *name, unsigned long *value) {
+// PARSES REQUEST ARG AS A WHOLE NUMBER, FALSE IF MISSING OR ANYTHING BUT DIGITS -----------------
+  if (!server.hasArg(name)) {
+    return false;
+  }
+  String arg = server.arg(name);
+  char *end;
+  if (!isdigit((unsigned char)arg.c_str()[0])) {
+    return false;                                 // strtoul() would take a sign or spaces
+  }
+  *value = strtoul(arg.c_str(), &end, 10);
+  return *end == 0;
+}
+
+void apiError(int code, PGM_P message) {
+// SENDS {"error":"message"} WITH GIVEN STATUS ------------------------------------------
+  renderBegin(code, "application/json");
+  renderOut_P(PSTR("{\"error\":\""));
+  renderOut_P(message);
+  renderOut_P(PSTR("\"}\n"));
+  renderEnd();
+}
+
+void eraseEEPROM () {
+// CLEARS SAVED SETPOINT, POWER, MODE AND CONTROL, WORKING SETTINGS STAY AS THEY ARE -------------
+// An empty settings record, so the next boot starts from defaults. Calibration, the schedule
+// and the cached join belong to the device rather than the settings, and are kept.
+  byte none = 0;
+
+  if (!pickZone()) {
+    return;
+  }
+  logWrite(REC_SETTINGS, &none, 0);
+  settingsStored = 0;
+  sendRedirect();                                 // Once erased, resets webpage to root
+}
+
+void writeEEPROM () {
+// SAVES CURRENT SETPOINT, POWER AND MODE NOW AND SHOWS WHICH CHANGED -------------------------
+// Nothing is written if all match the latest settings record (saves write cycles)
+  if (!pickZone()) {
+    return;
+  }
+  pageSaved = saveSettings();
+  renderPage(200, EEPROM_PAGE);                   // Call EEPROM written webpage
+}
+
+bool loadSettings() {
+// LOADS LATEST SETTINGS RECORD, OR IMPORTS THE OLD FIXED LAYOUT ONCE -----------------------
+// Zones beyond what the record holds (saved with fewer zones) keep their startup settings.
+// A setpoint outside what the API takes, from an old image or a damaged record whose crc
+// still matched, is clamped into it.
+  byte rec[5 * ZONES];
+  int len;
+
+  if (logOpen()) {
+    len = logRead(REC_SETTINGS, rec, sizeof(rec));
+    if (len == 0) {
+      return false;
+    }
+    for (int i = 0; i < ZONES && (i + 1) * 5 <= len; i++) {
+      Zone &z = zones[i];
+      byte *r = rec + i * 5;
+      z.storedSetPoint = (int16_t)word(r[0], r[1]);
+      z.storedPowerState = r[2];
+      z.storedHeatMode = r[3];
+      z.storedCtrlMode = r[4] < 3 ? r[4] : CTRL_HYST;
+    }
+    settingsStored = 1;
+  } else {
+    EEPROM.begin(EEPROM_SIZE);                    // Only ever read here, and freed again after
+    bool old = EEPROM.read(ID_ADDR) == EEPROM_ID;
+    if (old) {
+      zones[0].storedSetPoint = word(EEPROM.read(setPointAddr), EEPROM.read(setPointAddr + 1));
+      zones[0].storedPowerState = EEPROM.read(setPointAddr + 5);
+      zones[0].storedHeatMode = EEPROM.read(setPointAddr + 6);
+      len = 5;
+      settingsDirty = 1;                          // Into the log at first save, which ends the import
+    }
+    EEPROM.end();
+    if (!old) {
+      return false;
+    }
+  }
+
+  for (int i = 0; i < ZONES && (i + 1) * 5 <= len; i++) {
+    Zone &z = zones[i];
+    z.setPoint10 = constrain(z.storedSetPoint, Config::spMin10, Config::spMax10);   // Stored in tenths
+    z.powerSet = z.storedPowerState;
+    z.heatMode = z.storedHeatMode;
+    z.ctrlMode = z.storedCtrlMode;
+  }
+  return true;
+}
+
+byte saveSettings() {
+// APPENDS SETTINGS RECORD IF ANY ZONE'S SETTING DIFFERS FROM LATEST ONE, RETURNS SAVED_ BITS CHANGED
+  byte rec[5 * ZONES];
+  byte changed = 0;
+
+  for (int i = 0; i < ZONES; i++) {
+    Zone &z = zones[i];
+    int sp10 = z.setPoint10;
+    if (!settingsStored || sp10 != z.storedSetPoint) {
+      changed |= SAVED_SETPOINT;
+    }
+    if (!settingsStored || z.powerSet != z.storedPowerState) {
+      changed |= SAVED_POWER;
+    }
+    if (!settingsStored || z.heatMode != z.storedHeatMode) {
+      changed |= SAVED_MODE;
+    }
+    if (!settingsStored || z.ctrlMode != z.storedCtrlMode) {
+      changed |= SAVED_CONTROL;
+    }
+    byte *r = rec + i * 5;
+    r[0] = highByte(sp10);
+    r[1] = lowByte(sp10);
+    r[2] = z.powerSet;
+    r[3] = z.heatMode;
+    r[4] = z.ctrlMode;
+  }
+  settingsDirty = 0;
+  if (changed == 0) {
+    return 0;
+  }
+
+  logWrite(REC_SETTINGS, rec, sizeof(rec));
+  lastSave = millis();
+  for (int i = 0; i < ZONES; i++) {
+    Zone &z = zones[i];
+    z.storedSetPoint = z.setPoint10;
+    z.storedPowerState = z.powerSet;
+    z.storedHeatMode = z.heatMode;
+    z.storedCtrlMode = z.ctrlMode;
+  }
+  settingsStored = 1;
+  return changed;
+}
+
+bool loadCalibration() {
+// LOADS LATEST CALIBRATION RECORD, IF ANY -------------------------------------------------
+  byte rec[4 * ZONES];
+  int len = logRead(REC_CALIB, rec, sizeof(rec));
+
+  if (len == 0) {
+    return false;
+  }
+  for (int i = 0; i < ZONES && (i + 1) * 4 <= len; i++) {
+    Zone &z = zones[i];
+    byte *r = rec + i * 4;
+    z.storedCalOffset = (int16_t)word(r[0], r[1]);
+    z.storedCalGain = word(r[2], r[3]);
+    z.calOffset100 = z.storedCalOffset;
+    z.calGain10000 = z.storedCalGain;
+  }
+  return true;
+}
+
+void saveCalibration() {
+// APPENDS CALIBRATION RECORD IF ANY ZONE'S DIFFERS FROM THE LATEST ONE -------------------------
+  byte rec[4 * ZONES];
+  bool stored = logSector >= 0 && logLatest[REC_CALIB] != 0;
+  bool same = 1;
+
+  for (int i = 0; i < ZONES; i++) {
+    Zone &z = zones[i];
+    int offset100 = z.calOffset100;
+    unsigned int gain10k = z.calGain10000;
+    if (stored ? offset100 != z.storedCalOffset || gain10k != z.storedCalGain : offset100 != 0 || gain10k != 10000) {
+      same = 0;
+    }
+    byte *r = rec + i * 4;
+    r[0] = highByte(offset100);
+    r[1] = lowByte(offset100);
+    r[2] = highByte(gain10k);
+    r[3] = lowByte(gain10k);
+  }
+  if (same) {
+    return;                                       // Same as saved, or default and nothing saved
+  }
+  logWrite(REC_CALIB, rec, sizeof(rec));
+  for (int i = 0; i < ZONES; i++) {
+    zones[i].storedCalOffset = (int16_t)word(rec[i * 4], rec[i * 4 + 1]);
+    zones[i].storedCalGain = word(rec[i * 4 + 2], rec[i * 4 + 3]);
+  }
+}
+
+bool loadNetCache() {
+// LOADS WHERE THE LAST JOIN WAS MADE, FOR A FAST JOIN --------------------------------------
+  net.cached = logRead(REC_WIFI, net.cache, NET_CACHE) >= NET_CACHE;
+  return net.cached;
+}
+
+bool loadSchedule() {
+// LOADS LATEST SCHEDULE RECORD AND COMPILES IT --------------------------------------------------
+// Rules for zones this build doesn't have are dropped
+  byte rec[1 + SCHED_RULES * 5];
+  int len = logRead(REC_SCHEDULE, rec, sizeof(rec));
+
+  if (len == 0) {
+    return false;
+  }
+  clockTz = (int8_t)rec[0] * 15;
+  schedRuleCount = 0;
+  for (int i = 1; i + 5 <= len && schedRuleCount < SCHED_RULES; i += 5) {
+    if (rec[i + 4] >= ZONES) {
+      continue;
+    }
+    SchedRule &r = schedRules[schedRuleCount++];
+    unsigned long packed = ((unsigned long)rec[i + 1] << 16) | ((unsigned int)rec[i + 2] << 8) | rec[i + 3];
+    r.days = rec[i];
+    r.minute = packed >> 12;
+    r.mode = (packed >> 10) & 3;
+    r.setPoint10 = (packed & 0x3FF) + Config::spMin10;
+    r.zone = rec[i + 4];
+  }
+  compileSchedule();
+  return true;
+}
+
+void saveSchedule() {
+// APPENDS SCHEDULE RECORD --------------------------------------------------------------------
+// Each rule is days, then 24 bits: minute of day (11), mode (2), setpoint tenths above spMin10 (10),
+// then zone
+  byte rec[1 + SCHED_RULES * 5];
+  int len = 1;
+
+  rec[0] = (int8_t)(clockTz / 15);
+  for (int r = 0; r < schedRuleCount; r++) {
+    SchedRule &rule = schedRules[r];
+    unsigned long packed = ((unsigned long)rule.minute << 12) | (rule.mode << 10) | (rule.setPoint10 - Config::spMin10);
+    rec[len++] = rule.days;
+    rec[len++] = packed >> 16;
+    rec[len++] = packed >> 8;
+    rec[len++] = packed;
+    rec[len++] = rule.zone;
+  }
+  logWrite(REC_SCHEDULE, rec, len);
+}
+
+byte crc8(byte crc, byte data) {
+// CRC-8 (POLYNOMIAL 0x07) OF ONE MORE BYTE -------------------------------------------------
+  crc ^= data;
+  for (int i = 0; i < 8; i++) {
+    crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+  }
+  return crc;
+}
+
+uint32_t logAddr(int sector) {
+// FLASH ADDRESS OF LOG SECTOR ----------------------------------------------------------------
+  return FS_PHYS_ADDR + sector * LOG_SECTOR;
+}
+
+int logSize(int len) {
+// FLASH BYTES A RECORD WITH len PAYLOAD BYTES TAKES ----------------------------------------------
+  return 4 + (len + 3) / 4 * 4;
+}
+
+bool logHeaderValid(int sector, uint32_t *seq) {
+// CHECKS SECTOR HEADER, RETURNING ITS SEQUENCE NUMBER -----------------------------------------
+  uint32_t hdr[LOG_HDR / 4];
+  byte *h = (byte *)hdr;
+  byte crc = 0;
+
+  ESP.flashRead(logAddr(sector), hdr, LOG_HDR);
+  for (int i = 0; i < 5; i++) {
+    crc = crc8(crc, h[i]);
+  }
+  *seq = hdr[0];
+  return h[4] == LOG_MAGIC && h[5] == crc;
+}
+
+int logFetch(int sector, int at, uint32_t *rec) {
+// READS RECORD AT at INTO rec, HEADER WORD THEN PAYLOAD, RETURNS PAYLOAD LENGTH ----------------
+// -1 if what is there isn't a whole, committed record
+  byte *h = (byte *)rec;
+
+  ESP.flashRead(logAddr(sector) + at, rec, 4);
+  if (h[3] != LOG_COMMIT || h[0] == 0 || h[0] >= LOG_TYPES || at + logSize(h[1]) > LOG_SECTOR) {
+    return -1;
+  }
+  ESP.flashRead(logAddr(sector) + at + 4, rec + 1, logSize(h[1]) - 4);
+  byte crc = crc8(crc8(0, h[0]), h[1]);
+  for (int i = 0; i < h[1]; i++) {
+    crc = crc8(crc, h[4 + i]);
+  }
+  return crc == h[2] ? h[1] : -1;
+}
+
+bool logOpen() {
+// PICKS SECTOR WITH THE HIGHEST SEQUENCE AND FINDS LATEST RECORD OF EACH TYPE AND END OF LOG ------
+// A record that isn't whole and committed closes the sector, so the next write moves on rather
+// than writing over it
+  uint32_t rec[LOG_WORDS];
+  uint32_t seq;
+
+  logSector = -1;
+  if (!LOG_ROOM) {
+    return false;
+  }
+  for (int i = 0; i < LOG_SECTORS; i++) {
+    if (logHeaderValid(i, &seq) && (logSector < 0 || (int32_t)(seq - logSeq) > 0)) {
+      logSector = i;
+      logSeq = seq;
+    }
+  }
+  if (logSector < 0) {
+    return false;
+  }
+
+  memset(logLatest, 0, sizeof(logLatest));
+  logEnd = LOG_HDR;
+  while (logEnd + 4 <= LOG_SECTOR) {
+    ESP.flashRead(logAddr(logSector) + logEnd, rec, 4);
+    if (rec[0] == LOG_ERASED) {
+      break;
+    }
+    int len = logFetch(logSector, logEnd, rec);
+    if (len < 0) {
+      logEnd = LOG_SECTOR;
+      break;
+    }
+    logLatest[((byte *)rec)[0]] = logEnd;
+    logEnd += logSize(len);
+  }
+  return true;
+}
+
+int logRead(byte type, byte *buf, int max) {
+// COPIES PAYLOAD OF LATEST RECORD OF type, RETURNS ITS FULL LENGTH (0 IF NONE) -----------------
+  uint32_t rec[LOG_WORDS];
+
+  if (logSector < 0 || logLatest[type] == 0) {
+    return 0;
+  }
+  int len = logFetch(logSector, logLatest[type], rec);
+
+  memset(buf, 0, max);                            // Fields missing from older records read as 0
+  if (len < 0) {
+    return 0;
+  }
+  memcpy(buf, (byte *)rec + 4, len < max ? len : max);
+  return len;
+}
+
+void logWrite(byte type, const byte *buf, int len) {
+// APPENDS RECORD, MOVING TO THE NEXT SECTOR WITH IT IF THIS ONE HAS NO ROOM -----------------------
+  if (!LOG_ROOM) {
+    return;
+  }
+  if (logSector < 0 || logEnd + logSize(len) > LOG_SECTOR) {
+    logMove(type, buf, len);
+  } else {
+    logAppend(type, buf, len, true);
+  }
+}
+
+void logAppend(byte type, const byte *buf, int len, bool live) {
+// WRITES RECORD AT END OF LOG IN SECTOR IN USE ---------------------------------------------------
+// In a live sector the header goes first with the commit byte erased and is committed last, so a
+// record cut short is never taken for one. In a sector not yet under a header it goes at once.
+  uint32_t rec[LOG_WORDS];
+  byte *h = (byte *)rec;
+  uint32_t at = logAddr(logSector) + logEnd;
+  int size = logSize(len);
+  byte crc = crc8(crc8(0, type), len);
+
+  memset(rec, 0xFF, size);
+  memcpy(h + 4, buf, len);
+  for (int i = 0; i < len; i++) {
+    crc = crc8(crc, buf[i]);
+  }
+  h[0] = type;
+  h[1] = len;
+  h[2] = crc;
+  if (live) {
+    ESP.flashWrite(at, rec, 4);
+    ESP.flashWrite(at + 4, rec + 1, size - 4);
+  }
+  h[3] = LOG_COMMIT;
+  ESP.flashWrite(at, rec, live ? 4 : size);
+  logLatest[type] = logEnd;
+  logEnd += size;
+}
+
+void logMove(byte type, const byte *buf, int len) {
+// ERASES NEXT SECTOR, COPIES IN LATEST RECORD OF EACH OTHER TYPE AND THIS ONE, THEN HEADS IT ----------
+  uint32_t rec[LOG_WORDS];
+  uint32_t hdr[LOG_HDR / 4];
+  byte *h = (byte *)hdr;
+  int from = logSector;
+  int latest[LOG_TYPES];
+
+  memcpy(latest, logLatest, sizeof(latest));
+  logSector = from < 0 ? 0 : (from + 1) % LOG_SECTORS;
+  logSeq = from < 0 ? 1 : logSeq + 1;
+  logEnd = LOG_HDR;
+  memset(logLatest, 0, sizeof(logLatest));
+  ESP.flashEraseSector(logAddr(logSector) / LOG_SECTOR);
+  for (byte t = 1; t < LOG_TYPES; t++) {
+    if (t == type || from < 0 || latest[t] == 0) {
+      continue;
+    }
+    int n = logFetch(from, latest[t], rec);
+    if (n >= 0) {
+      ESP.flashWrite(logAddr(logSector) + logEnd, rec, logSize(n));
+      logLatest[t] = logEnd;
+      logEnd += logSize(n);
+    }
+  }
+  logAppend(type, buf, len, false);
+
+  byte crc = 0;
+  hdr[0] = logSeq;
+  h[4] = LOG_MAGIC;
+  for (int i = 0; i < 5; i++) {
+    crc = crc8(crc, h[i]);
+  }
+  h[5] = crc;
+  h[6] = 0xFF;
+  h[7] = 0xFF;
+  ESP.flashWrite(logAddr(logSector), hdr, LOG_HDR);   // Last: from here on this sector is the log
+}
+
+void resetPage() {
+// CALLS HTML REDIRECT STRING ----------------------------------------------
+    if (!pickZone()) {
+      return;
+    }
+    sendRedirect();                                 // resets webpage to root
+}
+
+void resetSetting() {
+// CALLS HTML REDIRECT STRING ----------------------------------------------
+    if (!pickZone()) {
+      return;
+    }
+    settingsRedirect();                             // resets webpage to settings
+}
+ 
+
+void handle_NotFound(){     
+// HANDLES BAD URL STRING ------------------------------------------------                      
+  server.send(404, "text/plain", "Not found");
+}
+
+void serveStatic() {
+// SENDS A GZIPPED ASSET FROM FLASH, OR 304 IF THE CLIENT HAS IT ALREADY ----------------------
+  const StaticAsset *a = staticAssets;
+  while (strcmp(a->path, server.uri()) != 0) {
+    a++;                                          // Only registered for paths in the table
+  }
+  server.sendHeader("ETag", a->etag);
+  server.sendHeader("Cache-Control", "public, max-age=" ASSET_MAX_AGE);
+  if (strcmp(server.header("If-None-Match").c_str(), a->etag) == 0) {
+    server.send(304, a->type, "");
+    return;
+  }
+  server.sendHeader("Content-Encoding", "gzip");
+  server.send_P(200, a->type, (PGM_P)a->data, a->len);
+}
+
+void settingsPage() {
+// SENDS SETTINGS WEBPAGE -------------------------------------------
+  if (!pickZone()) {
+    return;
+  }
+  renderPage(200, SETTINGS_PAGE);
+}
+
+void sendRedirect() { 
+// SENDS HTML FOR WEBPAGE REDIRECT TO MAIN PAGE OF zoneSel ------------------                          
+  renderPage(200, REDIRECT_ROOT);
+}
+
+void settingsRedirect() { 
+// SENDS HTML FOR WEBPAGE REDIRECT TO SETTINGS PAGE OF zoneSel --------------                          
+  renderPage(200, REDIRECT_SETTINGS);
+}
+
+void renderPage(int code, PGM_P tpl) {
+// STREAMS A PAGE TEMPLATE AS ONE CHUNKED HTML RESPONSE ------------------------
+  renderBegin(code, "text/html");
+  renderTemplate(tpl);
+  renderEnd();
+}
+
+void renderBegin(int code, const char *type) {
+// SENDS HEADERS FOR A CHUNKED RESPONSE, BODY FOLLOWS IN RENDER_BUF SIZED CHUNKS ---------
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(code, type, "");
+  renderLen = 0;
+}
+
+void renderTemplate(PGM_P tpl) {
+// COPIES TEMPLATE FROM FLASH TO OUTPUT, SUBSTITUTING %KEY% VALUES -------------------
+  char key[RENDER_KEY];
+  char c;
+
+  while ((c = pgm_read_byte(tpl)) != 0) {
+    if (c != '%') {
+      size_t run = 1;                             // Copy literal text up to next key in one go
+      while ((c = pgm_read_byte(tpl + run)) != '%' && c != 0) {
+        run++;
+      }
+      renderOutN_P(tpl, run);
+      tpl += run;
+      continue;
+    }
+    tpl++;
+    int n = 0;
+    while ((c = pgm_read_byte(tpl++)) != '%' && c != 0) {
+      if (n < RENDER_KEY - 1) {
+        key[n++] = c;
+      }
+    }
+    key[n] = 0;
+    if (n == 0) {
+      renderOut("%", 1);                          // %% is a literal %
+    } else {
+      renderValue(key);
+    }
+    if (c == 0) {
+      break;                                      // Unterminated key at end of template
+    }
+  }
+}
+
+void renderValue(const char *key) {
+// WRITES THE LIVE VALUE OR FRAGMENT NAMED BY A TEMPLATE KEY, ZONE VALUES FROM zoneSel -------
+  Zone &z = zones[zoneSel];
+
+  if (strcmp_P(key, PSTR("HEAD")) == 0) {
+    renderOut_P(PAGE_HEAD);
+  } else if (strcmp_P(key, PSTR("STYLE")) == 0) {
+    renderOut_P(PAGE_STYLE);
+  } else if (strcmp_P(key, PSTR("FOOT")) == 0) {
+    renderOut_P(PAGE_FOOT);
+  } else if (strcmp_P(key, PSTR("TEMP")) == 0) {
+    renderDecimals(z.avgTemp100, 2);
+  } else if (strcmp_P(key, PSTR("SETPOINT")) == 0) {
+    renderDecimals(z.setPoint10 * 10, 2);
+  } else if (strcmp_P(key, PSTR("UNIT")) == 0) {
+    char unit = Config::symbol;
+    renderOut(&unit, 1);
+  } else if (strcmp_P(key, PSTR("DEVICE")) == 0) {
+    renderOut_P(z.device ? PSTR("on") : PSTR("off"));
+  } else if (strcmp_P(key, PSTR("POWERBTN")) == 0) {
+    renderTemplate(z.powerSet ? POWER_ON_BTN : POWER_OFF_BTN);
+  } else if (strcmp_P(key, PSTR("MODEBTN")) == 0) {
+    renderTemplate(z.heatMode ? MODE_COOL_BTN : MODE_HEAT_BTN);
+  } else if (strcmp_P(key, PSTR("ZQ")) == 0) {
+    if (zoneSel != 0) {
+      renderOut_P(PSTR("?zone="));
+      renderInt(zoneSel);
+    }
+  } else if (strcmp_P(key, PSTR("ZONENAV")) == 0) {
+    renderZoneNav();
+  } else if (strcmp_P(key, PSTR("ZONE")) == 0) {
+    renderInt(zoneSel);
+  } else if (strcmp_P(key, PSTR("ZONENAME")) == 0) {
+    renderOut(zoneConfig[zoneSel].name, strlen(zoneConfig[zoneSel].name));
+  } else if (strcmp_P(key, PSTR("SENSOR")) == 0) {
+    byte src = zoneConfig[zoneSel].source;
+    renderOut_P(src == SRC_ADC ? PSTR("adc") : src == SRC_ONEWIRE ? PSTR("onewire") : PSTR("remote"));
+  } else if (strcmp_P(key, PSTR("SETTARGET")) == 0) {
+    renderDecimals(commandSetPoint(zoneSel) * 10, 2);   // Setpoint a queued +/- will leave
+  } else if (strcmp_P(key, PSTR("CMD")) == 0) {
+    renderInt(cmdReply.cmd);
+  } else if (strcmp_P(key, PSTR("CMDSEQ")) == 0) {
+    if (cmdReply.hasSeq) {
+      renderInt(cmdReply.seq);
+    } else {
+      renderOut_P(PSTR("null"));
+    }
+  } else if (strcmp_P(key, PSTR("CMDSETPOINT")) == 0) {
+    renderDecimals(cmdReply.setPoint10 * 10, 2);
+  } else if (strcmp_P(key, PSTR("CMDPOWER")) == 0) {
+    renderInt(cmdReply.powerSet);
+  } else if (strcmp_P(key, PSTR("CMDMODE")) == 0) {
+    renderInt(cmdReply.heatMode);
+  } else if (strcmp_P(key, PSTR("CMDCLAMPED")) == 0) {
+    renderOut_P(cmdReply.clamped ? PSTR("true") : PSTR("false"));
+  } else if (strcmp_P(key, PSTR("CMDAPPLYIN")) == 0) {
+    PendingCmd &p = pending[cmdReply.zone];
+    unsigned long age = millis() - p.since;
+    renderInt(p.set && age < CMD_WINDOW ? CMD_WINDOW - age : 0);
+  } else if (strcmp_P(key, PSTR("CMDREPLAY")) == 0) {
+    renderOut_P(cmdReplay ? PSTR("true") : PSTR("false"));
+  } else if (strcmp_P(key, PSTR("ALARMS")) == 0) {
+    renderAlarms(z.alarms, 1);
+  } else if (strcmp_P(key, PSTR("ALARMSACTIVE")) == 0) {
+    renderAlarms(faultActive(z), 1);
+  } else if (strcmp_P(key, PSTR("ALARMTEXT")) == 0) {
+    renderAlarms(z.alarms, 0);
+  } else if (strcmp_P(key, PSTR("ALARMHIDE")) == 0) {
+    if (!z.alarms) {
+      renderOut_P(PSTR(" hidden"));
+    }
+  } else if (strcmp_P(key, PSTR("ALARMSINCE")) == 0) {
+    unsigned long age = 0;                        // Of the oldest alarm still latched
+    for (int k = 0; k < FAULT_KINDS; k++) {
+      if ((z.alarms & (1 << k)) && millis() - z.alarmAt[k] > age) {
+        age = millis() - z.alarmAt[k];
+      }
+    }
+    if (z.alarms) {
+      renderInt(age / 1000);
+    } else {
+      renderOut_P(PSTR("null"));
+    }
+  } else if (strcmp_P(key, PSTR("ALARMRAISED")) == 0) {
+    for (int k = 0; k < FAULT_KINDS; k++) {
+      renderOut_P(k ? PSTR(",\"") : PSTR("\""));
+      renderOut(faultNames[k], strlen(faultNames[k]));
+      renderOut_P(PSTR("\":"));
+      renderInt(z.alarmCount[k]);
+    }
+  } else if (strcmp_P(key, PSTR("VERSION")) == 0) {
+    renderInt(stateVersion);
+  } else if (strcmp_P(key, PSTR("TEMP1")) == 0) {
+    renderTenths(divRound(z.avgTemp100, 10));
+  } else if (strcmp_P(key, PSTR("HYST")) == 0) {
+    renderDecimals(z.hyst100, 2);
+  } else if (strcmp_P(key, PSTR("DEVICEBIT")) == 0) {
+    renderInt(z.device);
+  } else if (strcmp_P(key, PSTR("POWERBIT")) == 0) {
+    renderInt(z.powerSet);
+  } else if (strcmp_P(key, PSTR("MODEBIT")) == 0) {
+    renderInt(z.heatMode);
+  } else if (strcmp_P(key, PSTR("LOCKOUT")) == 0) {
+    renderInt(lockoutRemaining(z));
+  } else if (strcmp_P(key, PSTR("CONTROL")) == 0) {
+    renderOut_P(z.ctrlMode == CTRL_PID ? PSTR("pid") : z.ctrlMode == CTRL_PREDICT ? PSTR("predict") : PSTR("hyst"));
+  } else if (strcmp_P(key, PSTR("CALOFFSET")) == 0) {
+    renderDecimals(z.calOffset100, 2);
+  } else if (strcmp_P(key, PSTR("CALGAIN")) == 0) {
+    renderDecimals(z.calGain10000, 4);
+  } else if (strcmp_P(key, PSTR("RAWTEMP")) == 0) {
+    renderDecimals(z.rawTemp100, 2);
+  } else if (strcmp_P(key, PSTR("ADCDEFERRED")) == 0) {
+    renderInt(adcDeferred);
+  } else if (strcmp_P(key, PSTR("CLOCK")) == 0) {
+    renderInt(clockSource == CLOCK_NONE ? 0 : clockNow());
+  } else if (strcmp_P(key, PSTR("CLOCKTZ")) == 0) {
+    renderInt(clockTz);
+  } else if (strcmp_P(key, PSTR("CLOCKSOURCE")) == 0) {
+    renderOut_P(clockSource == CLOCK_NTP ? PSTR("ntp") : clockSource == CLOCK_API ? PSTR("api") : PSTR("none"));
+  } else if (strcmp_P(key, PSTR("SCHEDRULES")) == 0) {
+    renderSchedule();
+  } else if (strcmp_P(key, PSTR("SCHEDEVENTS")) == 0) {
+    renderInt(schedEventCount);
+  } else if (strcmp_P(key, PSTR("SCHEDCURRENT")) == 0) {
+    renderInt(z.schedCurrent);
+  } else if (strcmp_P(key, PSTR("SCHEDOVERRIDE")) == 0) {
+    renderInt(z.schedOverride);
+  } else if (strcmp_P(key, PSTR("SCHEDNEXT")) == 0) {
+    bool idle = clockSource == CLOCK_NONE || schedEventCount == 0;
+    renderInt(idle ? -1 : (long)(schedNextAt - millis()) / 1000);
+  } else if (strcmp_P(key, PSTR("SAVEDSETPOINT")) == 0) {
+    renderOut_P((pageSaved & SAVED_SETPOINT) ? PSTR("Updated setpoint in EEPROM.") : PSTR("Did not update setpoint, same value in EEPROM."));
+  } else if (strcmp_P(key, PSTR("SAVEDPOWER")) == 0) {
+    renderOut_P((pageSaved & SAVED_POWER) ? PSTR("Updated power setting in EEPROM.") : PSTR("Did not update power setting, same value in EEPROM."));
+  } else if (strcmp_P(key, PSTR("SAVEDMODE")) == 0) {
+    renderOut_P((pageSaved & SAVED_MODE) ? PSTR("Updated heat mode setting in EEPROM.") : PSTR("Did not update heat mode setting, same value in EEPROM."));
+  }
+}
+
+void renderZoneNav() {
+// WRITES A LINK TO EACH ZONE'S PAGE, THE ONE SHOWN IN BOLD, NOTHING WITH ONE ZONE -------------
+  if (ZONES == 1) {
+    return;
+  }
+  renderOut_P(PSTR("<p>"));
+  for (int i = 0; i < ZONES; i++) {
+    renderOut_P(i == zoneSel ? PSTR(" <b>") : PSTR(" <a href=\"/?zone="));
+    if (i != zoneSel) {
+      renderInt(i);
+      renderOut_P(PSTR("\">"));
+    }
+    renderOut(zoneConfig[i].name, strlen(zoneConfig[i].name));
+    renderOut_P(i == zoneSel ? PSTR("</b>") : PSTR("</a>"));
+  }
+  renderOut_P(PSTR("</p>\n"));
+}
+
+void renderAlarms(byte alarms, bool json) {
+// WRITES THE NAMES OF alarms, QUOTED AND COMMA SEPARATED FOR JSON OR AS A LIST FOR A PAGE ------
+  bool first = 1;
+
+  for (int k = 0; k < FAULT_KINDS; k++) {
+    if (!(alarms & (1 << k))) {
+      continue;
+    }
+    if (!first) {
+      renderOut_P(json ? PSTR(",") : PSTR(", "));
+    }
+    first = 0;
+    if (json) {
+      renderOut("\"", 1);
+    }
+    renderOut(faultNames[k], strlen(faultNames[k]));
+    if (json) {
+      renderOut("\"", 1);
+    }
+  }
+}
+
+void renderOut(const char *s, size_t n) {
+// APPENDS RAM BYTES TO OUTPUT, SENDING A CHUNK EACH TIME THE BUFFER FILLS -----------
+  while (n > 0) {
+    size_t room = RENDER_BUF - renderLen;
+    size_t take = n < room ? n : room;
+    memcpy(renderBuf + renderLen, s, take);
+    renderLen += take;
+    s += take;
+    n -= take;
+    if (renderLen == RENDER_BUF) {
+      if (renderCapture) {
+        return;                                   // Capturing, output beyond RENDER_BUF is dropped
+      }
+      renderFlush();
+    }
+  }
+}
+
+void renderOut_P(PGM_P s) {
+// APPENDS FLASH STRING TO OUTPUT ---------------------------------------------------
+  renderOutN_P(s, strlen_P(s));
+}
+
+void renderOutN_P(PGM_P s, size_t n) {
+// APPENDS n FLASH BYTES TO OUTPUT --------------------------------------------------
+  while (n > 0) {
+    size_t room = RENDER_BUF - renderLen;
+    size_t take = n < room ? n : room;
+    memcpy_P(renderBuf + renderLen, s, take);
+    renderLen += take;
+    s += take;
+    n -= take;
+    if (renderLen == RENDER_BUF) {
+      if (renderCapture) {
+        return;                                   // Capturing, output beyond RENDER_BUF is dropped
+      }
+      renderFlush();
+    }
+  }
+}
+
+void renderFixed(float v, int decimals) {
+// APPENDS NUMBER WITH GIVEN DECIMALS -----------------------------------------------
+  char num[16];
+  dtostrf(v, 1, decimals, num);
+  renderOut(num, strlen(num));
+}
+
+void renderInt(long v) {
+// APPENDS WHOLE NUMBER ------------------------------------------------------------
+  char num[12];
+  ltoa(v, num, 10);
+  renderOut(num, strlen(num));
+}
+
+void renderTenths(long v) {
+// APPENDS TENTHS AS A NUMBER WITH 1 DECIMAL ------------------------------------------------
+  renderDecimals(v, 1);
+}
+
+void renderDecimals(long v, int decimals) {
+// APPENDS FIXED POINT v WITH decimals PLACES AFTER THE POINT, eg 7205 AND 2 AS 72.05 ---------
+  char num[16];
+  long scale = 1;
+  for (int i = 0; i < decimals; i++) {
+    scale *= 10;
+  }
+  unsigned long a = v < 0 ? -v : v;
+  int n = snprintf(num, sizeof(num), "%s%lu.%0*lu", v < 0 ? "-" : "", a / scale, decimals, a % scale);
+  renderOut(num, n);
+}
+
+void renderFlush() {
+// SENDS BUFFERED BYTES AS ONE CHUNK ---------------------------------------------------
+  if (renderLen > 0) {
+    if (renderTo) {
+      renderTo(renderBuf, renderLen);
+    } else {
+      server.sendContent(renderBuf, renderLen);
+    }
+    renderLen = 0;
+  }
+}
+
+void renderEnd() {
+// SENDS LAST CHUNK AND THE EMPTY CHUNK THAT ENDS THE RESPONSE -------------------------
+  renderFlush();
+  server.sendContent("");
+}
+
+// WEB SERVER ---------------------------------------------------------------------------
+
+void HttpServer::on(const char *uri, HTTPMethod method, void (*fn)()) {
+// REGISTERS HANDLER FOR A PATH, DROPPED IF THE TABLE IS FULL ---------------------------
+  if (routeCount < HTTP_ROUTES) {
+    routes[routeCount++] = {uri, method, fn, {}};    // Timing starts at zero
+  }
+}
+
+void HttpServer::handleClient() {
+// ACCEPTS NEW CONNECTIONS, THEN MOVES EACH OPEN ONE ON AS FAR AS IT CAN WITHOUT WAITING ---------
+// At most one request per connection is answered per pass, so a pass is bounded by HTTP_CONNS
+  accept(millis());
+  for (int i = 0; i < HTTP_CONNS; i++) {
+    if (conns[i].client.connected()) {
+      service(conns[i], millis());
+    }
+  }
+  cur = 0;
+}
+
+void HttpServer::accept(unsigned long now) {
+// GIVES EACH NEW CONNECTION A SLOT, CLOSING THE LONGEST IDLE ONE IF NONE IS FREE, ELSE SENDS 503 ---
+  for (int n = 0; n < HTTP_CONNS; n++) {
+    WiFiClient client = listener.accept();
+    if (!client) {
+      return;
+    }
+    HttpConn *slot = 0;
+    HttpConn *idle = 0;
+    for (int i = 0; i < HTTP_CONNS && !slot; i++) {
+      HttpConn &c = conns[i];
+      if (!c.client.connected()) {
+        slot = &c;
+      } else if (c.inLen == 0 && c.outLen == 0 && !c.bodyLeft && c.client.available() == 0 &&
+                 (!idle || now - c.since > now - idle->since)) {
+        idle = &c;
+      }
+    }
+    if (!slot && idle) {
+      close(*idle);                               // Keep-alive is only a courtesy, the client reconnects
+      slot = idle;
+    }
+    if (!slot) {
+      busy = busy + 1;
+      client.write_P(HTTP_BUSY, strlen_P(HTTP_BUSY));
+      client.stop(HTTP_CLOSE_WAIT);
+      radioAt = now;
+      continue;
+    }
+    slot->client = client;
+    slot->client.setNoDelay(true);                // Responses go out in whole buffers already
+    slot->inLen = 0;
+    slot->outLen = 0;
+    slot->since = now;
+    slot->keepAlive = 1;
+    slot->chunked = 0;
+    slot->bodyLeft = 0;
+    slot->flash = 0;
+    slot->broken = 0;
+    slot->more = 0;
+  }
+}
+
+void HttpServer::service(HttpConn &c, unsigned long now) {
+// SENDS WHAT THE SOCKET WILL TAKE, THEN READS AND ANSWERS A REQUEST IF A WHOLE ONE HAS ARRIVED ---
+// The next request on a connection isn't read until the last response has all gone
+  cur = &c;
+  flush(c);
+  if (c.flash) {
+    putFlash(c);
+    flush(c);
+  }
+  if (c.more && c.outLen <= HTTP_OUT_MAX / 2) {
+    c.more();                                     // Next part of a long response
+    if (!c.bodyLeft) {
+      c.more = 0;
+    }
+    flush(c);
+  }
+  if (c.broken) {
+    close(c);
+    return;
+  }
+  now = millis();
+  if (c.outLen > 0 || c.bodyLeft) {
+    if (now - c.since >= HTTP_SEND_TIMEOUT) {
+      timeouts = timeouts + 1;                    // Client stopped reading
+      close(c);
+    }
+    return;
+  }
+  if (!c.keepAlive) {
+    close(c);
+    return;
+  }
+
+  int avail = c.client.available();
+  int room = HTTP_IN_MAX - c.inLen;
+  if (avail > 0 && room > 0) {
+    if (c.inLen == 0) {
+      c.since = now;                              // Head timeout runs from a request's first byte
+    }
+    c.inLen += c.client.read((uint8_t *)c.in + c.inLen, avail < room ? avail : room);
+  }
+
+  int len = requestLength(c);
+  if (len > 0) {
+    dispatch(c, len);
+  } else if (len < 0) {
+    reject(c, -len);
+  } else if (c.inLen > 0 && now - c.since >= HTTP_HEAD_TIMEOUT) {
+    timeouts = timeouts + 1;
+    reject(c, 408);
+  } else if (c.inLen == 0 && now - c.since >= HTTP_IDLE_TIMEOUT) {
+    close(c);
+  }
+}
+
+int HttpServer::requestLength(HttpConn &c) {
+// RETURNS LENGTH OF THE REQUEST AT THE FRONT OF in, 0 IF IT HASN'T ALL ARRIVED, -STATUS IF IT CAN'T BE READ --
+// Also points headStart and headEnd at its header lines
+  c.in[c.inLen] = 0;
+  char *end = strstr(c.in, "\r\n\r\n");
+  if (!end) {
+    return c.inLen == HTTP_IN_MAX ? -431 : 0;
+  }
+  int head = end + 4 - c.in;
+  int n;
+  headStart = strstr(c.in, "\r\n") + 2;
+  headEnd = end + 2;
+  const char *value = findHeader("Content-Length", &n);
+  long body = value ? strtol(value, 0, 10) : 0;
+  if (body < 0 || body > HTTP_IN_MAX - head) {
+    return -413;
+  }
+  return c.inLen < head + body ? 0 : head + body;
+}
+
+void HttpServer::dispatch(HttpConn &c, int len) {
+// SPLITS UP THE REQUEST AT THE FRONT OF in AND RUNS ITS HANDLER -------------------------------
+  char *body = (char *)headEnd + 2;
+  char saved = c.in[len];
+  c.in[len] = 0;                                  // Body ends here, a pipelined request may follow
+  char *lineEnd = strstr(c.in, "\r\n");
+  char *target = strchr(c.in, ' ');
+  char *version = target ? strchr(target + 1, ' ') : 0;
+  if (!version || version > lineEnd) {
+    reject(c, 400);
+    return;
+  }
+  *target++ = 0;
+  *version++ = 0;
+  *lineEnd = 0;
+
+  if (strcmp(c.in, "GET") == 0) {
+    reqMethod = HTTP_GET;
+  } else if (strcmp(c.in, "POST") == 0) {
+    reqMethod = HTTP_POST;
+  } else {
+    reject(c, 501);
+    return;
+  }
+  int n;
+  const char *value = findHeader("Connection", &n);
+  reqHttp10 = strcmp(version, "HTTP/1.0") == 0;
+  if (value && n == 5 && strncasecmp(value, "close", 5) == 0) {
+    c.keepAlive = 0;
+  } else {
+    c.keepAlive = !reqHttp10 || (value && n == 10 && strncasecmp(value, "keep-alive", 10) == 0);
+  }
+
+  argCount = 0;
+  reqUri = target;
+  char *query = strchr(target, '?');
+  if (query) {
+    *query++ = 0;
+    parseArgs(query);
+  }
+  value = findHeader("Content-Type", &n);
+  if (reqMethod == HTTP_POST && value && n >= 33 && strncasecmp(value, "application/x-www-form-urlencoded", 33) == 0) {
+    parseArgs(body);
+  }
+
+  void (*fn)() = notFound;
+  Timing *timing = &notFoundTiming;
+  for (int i = 0; i < routeCount; i++) {
+    if (strcmp(routes[i].uri, target) == 0 && (routes[i].method == HTTP_ANY || routes[i].method == reqMethod)) {
+      fn = routes[i].fn;
+      timing = &routes[i].timing;
+      break;
+    }
+  }
+  requests = requests + 1;
+  extraLen = 0;
+  contentLength = CONTENT_LENGTH_NOT_SET;
+  sent = 0;
+  taken = 0;
+  c.bodyLeft = 0;
+  c.chunked = 0;
+  c.more = 0;
+  c.flash = 0;
+  if (fn) {
+    uint32_t start = ESP.getCycleCount();
+    fn();
+    timingAdd(*timing, ESP.getCycleCount() - start);
+  }
+  if (!c.bodyLeft) {
+    c.more = 0;                                   // Long response ended in its first part
+  }
+  if (taken) {
+    c.client = WiFiClient();                      // Handler holds the connection now, slot is free
+    return;
+  }
+  if (!sent) {
+    close(c);
+    return;
+  }
+  c.in[len] = saved;
+  c.inLen -= len;
+  memmove(c.in, c.in + len, c.inLen);
+  c.since = millis();
+  flush(c);
+}
+
+void HttpServer::parseArgs(char *s) {
+// SPLITS name=value&... IN PLACE INTO argName AND argValue, DECODING EACH ----------------------
+  while (*s && argCount < HTTP_ARGS) {
+    char *next = strchr(s, '&');
+    if (next) {
+      *next++ = 0;
+    }
+    char *value = strchr(s, '=');
+    if (value) {
+      *value++ = 0;
+    } else {
+      value = s + strlen(s);                      // Name alone has an empty value
+    }
+    urlDecode(s);
+    urlDecode(value);
+    argName[argCount] = s;
+    argValue[argCount] = value;
+    argCount++;
+    if (!next) {
+      break;
+    }
+    s = next;
+  }
+}
+
+const char *HttpServer::findHeader(const char *name, int *len) {
+// RETURNS VALUE OF REQUEST HEADER name AND SETS ITS LENGTH, 0 IF NOT SENT ---------------------
+  int n = strlen(name);
+  const char *line = headStart;
+
+  while (line < headEnd) {
+    const char *eol = (const char *)memchr(line, '\n', headEnd - line);
+    if (!eol) {
+      break;
+    }
+    if (eol - line > n && strncasecmp(line, name, n) == 0 && line[n] == ':') {
+      const char *value = line + n + 1;
+      while (*value == ' ' || *value == '\t') {
+        value++;
+      }
+      const char *end = eol;
+      while (end > value && (end[-1] == '\r' || end[-1] == ' ')) {
+        end--;
+      }
+      *len = end - value;
+      return value;
+    }
+    line = eol + 1;
+  }
+  return 0;
+}
+
+String HttpServer::arg(const char *name) {
+// RETURNS QUERY OR FORM ARG name, EMPTY IF NOT SENT ---------------------------------------
+  for (int i = 0; i < argCount; i++) {
+    if (strcmp(argName[i], name) == 0) {
+      return String(argValue[i]);
+    }
+  }
+  return String();
+}
+
+bool HttpServer::hasArg(const char *name) {
+// TRUE IF QUERY OR FORM ARG name WAS SENT ---------------------------------------------------
+  for (int i = 0; i < argCount; i++) {
+    if (strcmp(argName[i], name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+String HttpServer::header(const char *name) {
+// RETURNS REQUEST HEADER name, EMPTY IF NOT SENT ----------------------------------------------
+  int n;
+  char *value = (char *)findHeader(name, &n);
+  if (!value) {
+    return String();
+  }
+  char saved = value[n];
+  value[n] = 0;                                   // Terminate in place for the copy
+  String s(value);
+  value[n] = saved;
+  return s;
+}
+
+WiFiClient &HttpServer::client() {
+// HANDS THE CONNECTION TO THE HANDLER, WHICH WRITES TO IT ITSELF FROM THEN ON (EVENT STREAMS) ----
+  taken = 1;
+  return cur->client;
+}
+
+void HttpServer::sendHeader(const char *name, const char *value) {
+// ADDS A HEADER TO THE NEXT send(), DROPPED IF IT DOESN'T FIT ----------------------------------
+  int n = snprintf(extra + extraLen, HTTP_HDR_MAX - extraLen, "%s: %s\r\n", name, value);
+  if (n > 0 && extraLen + n < HTTP_HDR_MAX) {
+    extraLen += n;
+  } else {
+    extra[extraLen] = 0;
+  }
+}
+
+void HttpServer::send(int code, const char *type, const char *body) {
+// STARTS THE RESPONSE WITH STATUS AND HEADERS, THEN body -------------------------------------
+// After setContentLength() the body (or the rest of it) follows in sendContent() calls. With
+// CONTENT_LENGTH_UNKNOWN it goes in chunks and an empty sendContent() ends it; HTTP/1.0
+// clients can't take chunks, so theirs ends with the connection.
+  char line[40];
+  size_t len = strlen(body);
+  size_t length = contentLength == CONTENT_LENGTH_NOT_SET ? len : contentLength;
+  bool unsized = length == CONTENT_LENGTH_UNKNOWN;
+  bool bodiless = code == 204 || code == 304;       // RFC 9110: no body, and 204 no Content-Length
+
+  sent = 1;
+  if (unsized && reqHttp10) {
+    cur->keepAlive = 0;
+  }
+  cur->chunked = unsized && !reqHttp10;
+  snprintf(line, sizeof(line), "HTTP/1.1 %d ", code);
+  put(line, strlen(line));
+  putP(httpReason(code));
+  putP(PSTR("\r\nContent-Type: "));
+  put(type, strlen(type));
+  if (cur->chunked) {
+    putP(PSTR("\r\nTransfer-Encoding: chunked"));
+  } else if (!unsized && !bodiless) {
+    snprintf(line, sizeof(line), "\r\nContent-Length: %u", (unsigned)length);
+    put(line, strlen(line));
+  }
+  putP(cur->keepAlive ? PSTR("\r\nConnection: keep-alive\r\n") : PSTR("\r\nConnection: close\r\n"));
+  put(extra, extraLen);
+  putP(PSTR("\r\n"));
+  extraLen = 0;
+  contentLength = CONTENT_LENGTH_NOT_SET;
+  cur->bodyLeft = bodiless ? 0 : length;
+  if (len > 0) {
+    sendContent(body, len);
+  }
+}
+
+void HttpServer::send_P(int code, const char *type, PGM_P body, size_t len) {
+// SENDS A RESPONSE WHOSE BODY IS len BYTES IN FLASH, COPIED OUT AS THE SOCKET DRAINS -------------
+  contentLength = len;
+  send(code, type, "");
+  cur->flash = len > 0 ? body : 0;
+  putFlash(*cur);
+}
+
+void HttpServer::sendContent(const char *data, size_t len) {
+// SENDS PART OF THE BODY, AS A CHUNK IF CHUNKED. EMPTY ENDS AN UNSIZED RESPONSE -----------------
+  if (cur->bodyLeft != CONTENT_LENGTH_UNKNOWN) {
+    if (len > cur->bodyLeft) {
+      len = cur->bodyLeft;                        // Never past the length sent
+    }
+    put(data, len);
+    cur->bodyLeft -= len;
+    return;
+  }
+  if (len == 0) {
+    if (cur->chunked) {
+      putP(PSTR("0\r\n\r\n"));
+    }
+    cur->bodyLeft = 0;
+    return;
+  }
+  if (cur->chunked) {
+    char size[12];
+    snprintf(size, sizeof(size), "%x\r\n", (unsigned)len);
+    put(size, strlen(size));
+    put(data, len);
+    put("\r\n", 2);
+  } else {
+    put(data, len);
+  }
+}
+
+void HttpServer::reject(HttpConn &c, int code) {
+// ANSWERS A REQUEST THAT CAN'T BE SERVED WITH ITS STATUS ALONE, CLOSING ONCE THAT HAS GONE -------
+  cur = &c;
+  c.inLen = 0;
+  c.keepAlive = 0;
+  extraLen = 0;
+  contentLength = CONTENT_LENGTH_NOT_SET;
+  send(code, "text/plain", "");
+  flush(c);
+}
+
+void HttpServer::put(const char *s, size_t n) {
+// QUEUES RESPONSE BYTES, SENDING WHAT THE SOCKET TAKES EACH TIME out FILLS ---------------------
+// A response outgrowing out and the socket together is dropped rather than waited on
+  HttpConn &c = *cur;
+
+  while (n > 0 && !c.broken) {
+    if (c.outLen == HTTP_OUT_MAX) {
+      flush(c);
+      if (c.outLen == HTTP_OUT_MAX) {
+        c.broken = 1;
+        overruns = overruns + 1;
+        return;
+      }
+    }
+    size_t room = HTTP_OUT_MAX - c.outLen;
+    size_t take = n < room ? n : room;
+    memcpy(c.out + c.outLen, s, take);
+    c.outLen += take;
+    s += take;
+    n -= take;
+  }
+}
+
+void HttpServer::putFlash(HttpConn &c) {
+// TOPS out UP FROM THE send_P() BODY ---------------------------------------------------------
+  size_t take = HTTP_OUT_MAX - c.outLen;
+  if (take > c.bodyLeft) {
+    take = c.bodyLeft;
+  }
+  memcpy_P(c.out + c.outLen, c.flash, take);
+  c.outLen += take;
+  c.flash += take;
+  c.bodyLeft -= take;
+  if (c.bodyLeft == 0) {
+    c.flash = 0;
+  }
+}
+
+void HttpServer::putP(PGM_P s) {
+// QUEUES FLASH STRING ------------------------------------------------------------------
+  char buf[32];
+  size_t n = strlen_P(s);
+
+  while (n > 0) {
+    size_t take = n < sizeof(buf) ? n : sizeof(buf);
+    memcpy_P(buf, s, take);
+    put(buf, take);
+    s += take;
+    n -= take;
+  }
+}
+
+void HttpServer::flush(HttpConn &c) {
+// WRITES AS MUCH OF out AS THE SOCKET HAS ROOM FOR, NEVER WAITING -----------------------------
+  size_t n = c.client.availableForWrite();
+  if (n > (size_t)c.outLen) {
+    n = c.outLen;
+  }
+  if (n == 0) {
+    return;
+  }
+  n = c.client.write((const uint8_t *)c.out, n);
+  c.outLen -= n;
+  memmove(c.out, c.out + n, c.outLen);
+  c.since = millis();
+  radioAt = c.since;
+}
+
+void HttpServer::close(HttpConn &c) {
+// CLOSES CONNECTION AND FREES ITS SLOT ----------------------------------------------------
+  c.client.stop(HTTP_CLOSE_WAIT);
+  c.inLen = 0;
+  c.outLen = 0;
+  c.bodyLeft = 0;
+  c.flash = 0;
+  c.more = 0;
+}
+
+PGM_P httpReason(int code) {
+// RETURNS REASON PHRASE FOR A STATUS THE SKETCH SENDS -----------------------------------------
+  switch (code) {
+    case 200: return PSTR("OK");
+    case 204: return PSTR("No Content");
+    case 304: return PSTR("Not Modified");
+    case 400: return PSTR("Bad Request");
+    case 404: return PSTR("Not Found");
+    case 408: return PSTR("Request Timeout");
+    case 409: return PSTR("Conflict");
+    case 413: return PSTR("Payload Too Large");
+    case 422: return PSTR("Unprocessable Entity");
+    case 429: return PSTR("Too Many Requests");
+    case 431: return PSTR("Request Header Fields Too Large");
+    case 501: return PSTR("Not Implemented");
+    case 503: return PSTR("Service Unavailable");
+  }
+  return PSTR("");
+}
+
+int urlDecode(char *s) {
+// DECODES %XX AND + IN PLACE, RETURNS NEW LENGTH ---------------------------------------------
+  char *out = s;
+
+  for (char *in = s; *in; in++) {
+    if (*in == '+') {
+      *out++ = ' ';
+    } else if (*in == '%' && isxdigit((unsigned char)in[1]) && isxdigit((unsigned char)in[2])) {
+      char hex[3] = {in[1], in[2], 0};
+      *out++ = (char)strtol(hex, 0, 16);
+      in += 2;
+    } else {
+      *out++ = *in;
+    }
+  }
+  *out = 0;
+  return out - s;
 }